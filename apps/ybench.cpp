@@ -0,0 +1,538 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2018 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#include "../yocto/ygl.h"
+#include "../yocto/json.hpp"
+#include "../yocto/yglio.h"
+#include "CLI11.hpp"
+#include <algorithm>
+#include <fstream>
+using namespace std::literals;
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
+
+void mkdir(const std::string& dir) {
+    if (dir == "" || dir == "." || dir == ".." || dir == "./" || dir == "../")
+        return;
+#ifndef _MSC_VER
+    system(("mkdir -p " + dir).c_str());
+#else
+    system(("mkdir " + dir).c_str());
+#endif
+}
+
+// List the scenes in a directory, sorted by name.
+std::vector<std::string> list_scenes(const std::string& dirname) {
+    auto names = std::vector<std::string>();
+#ifdef _WIN32
+    auto data = WIN32_FIND_DATAA();
+    auto handle = FindFirstFileA((dirname + "/*.json").c_str(), &data);
+    if (handle == INVALID_HANDLE_VALUE) return {};
+    do { names.push_back(data.cFileName); } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+#else
+    auto dir = opendir(dirname.c_str());
+    if (!dir) return {};
+    while (auto ent = readdir(dir)) {
+        auto name = std::string(ent->d_name);
+        if (ygl::get_extension(name) == "json") names.push_back(name);
+    }
+    closedir(dir);
+#endif
+    std::sort(names.begin(), names.end());
+    for (auto& name : names) name = dirname + "/" + name;
+    return names;
+}
+
+// Reset the peak resident memory, where the os supports it (Linux only).
+void reset_peak_memory() {
+#if defined(__linux__)
+    auto fs = fopen("/proc/self/clear_refs", "w");
+    if (!fs) return;
+    fputs("5", fs);
+    fclose(fs);
+#endif
+}
+
+// Peak resident memory of the process in bytes, or 0 if not available.
+uint64_t get_peak_memory() {
+#ifdef _WIN32
+    auto pmc = PROCESS_MEMORY_COUNTERS();
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize;
+#elif defined(__linux__)
+    // VmHWM honors the resets in reset_peak_memory(), ru_maxrss does not
+    auto fs = fopen("/proc/self/status", "r");
+    if (fs) {
+        char line[256];
+        auto kb = (uint64_t)0;
+        while (fgets(line, sizeof(line), fs)) {
+            if (sscanf(line, "VmHWM: %llu kB", (unsigned long long*)&kb) == 1)
+                break;
+        }
+        fclose(fs);
+        if (kb) return kb * 1024;
+    }
+    auto usage = rusage();
+    if (getrusage(RUSAGE_SELF, &usage)) return 0;
+    return (uint64_t)usage.ru_maxrss * 1024;
+#else
+    // ru_maxrss is in bytes on macOS
+    auto usage = rusage();
+    if (getrusage(RUSAGE_SELF, &usage)) return 0;
+    return (uint64_t)usage.ru_maxrss;
+#endif
+}
+
+// Median of a set of values.
+double median(std::vector<double> values) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    auto n = values.size();
+    return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Check the batched bvh queries against single and brute-force ones, with
+// queries near the vertices of each shape. Returns the number of mismatches.
+int check_bvh_queries(const std::shared_ptr<ygl::scene>& scn, int nthreads) {
+    auto mismatches = 0;
+    auto rng = ygl::make_rng(ygl::trace_default_seed);
+    for (auto shp : scn->shapes) {
+        if (shp->pos.empty() || !shp->bvh) continue;
+        auto size = ygl::max(shp->bbox.max - shp->bbox.min);
+        auto max_dist = size * 0.05f;
+        auto stride = std::max((int)shp->pos.size() / 256, 1);
+        auto queries = std::vector<ygl::vec3f>();
+        for (auto i = 0; i < shp->pos.size(); i += stride) {
+            auto offset = ygl::rand3f(rng) * 2 - ygl::vec3f{1, 1, 1};
+            queries.push_back(shp->pos[i] + offset * max_dist);
+        }
+
+        // closest elements, against one query at a time
+        auto overlaps = ygl::overlap_bvh_batch(
+            shp->bvh, queries, max_dist, false, nthreads);
+        for (auto i = 0; i < queries.size(); i++) {
+            auto overlap = ygl::bvh_overlap();
+            auto hit = ygl::overlap_bvh(shp->bvh, queries[i], max_dist, false,
+                overlap.dist, overlap.iid, overlap.eid, overlap.uv);
+            if (hit != (overlaps[i].eid >= 0) ||
+                (hit && (overlap.eid != overlaps[i].eid ||
+                            overlap.dist != overlaps[i].dist)))
+                mismatches++;
+        }
+
+        // nearest points are only defined for point bvhs
+        auto k = 8;
+        auto eids = std::vector<int>();
+        auto dists = std::vector<float>();
+        if (shp->points.empty()) {
+            try {
+                ygl::nearest_bvh_points_batch(
+                    shp->bvh, queries, k, max_dist, eids, dists, nthreads);
+                mismatches++;
+            } catch (const std::runtime_error&) {}
+        }
+
+        // nearest vertices, against brute force
+        auto vbvh = std::make_shared<ygl::bvh_tree>();
+        auto radius = std::vector<float>(shp->pos.size(), 0.0f);
+        vbvh->pos = shp->pos;
+        vbvh->radius = radius;
+        ygl::build_bvh(vbvh);
+        ygl::nearest_bvh_points_batch(
+            vbvh, queries, k, max_dist, eids, dists, nthreads);
+        for (auto i = 0; i < queries.size(); i++) {
+            auto all = std::vector<float>();
+            for (auto& p : shp->pos) {
+                auto dist = ygl::length(p - queries[i]);
+                if (dist <= max_dist) all.push_back(dist);
+            }
+            std::sort(all.begin(), all.end());
+            for (auto j = 0; j < k; j++) {
+                auto dist = (j < all.size()) ? all[j] : ygl::flt_max;
+                if (dists[i * k + j] != dist) mismatches++;
+            }
+        }
+    }
+    return mismatches;
+}
+
+// Check that shape bvhs rebuilt with different settings intersect rays
+// like freshly built ones, so no data of the previous build is reused.
+// Returns the number of mismatched rays.
+int check_bvh_rebuilds(const std::shared_ptr<ygl::scene>& scn) {
+    auto mismatches = 0;
+    auto rng = ygl::make_rng(ygl::trace_default_seed);
+    for (auto shp : scn->shapes) {
+        if (shp->pos.empty()) continue;
+        auto first = ygl::bvh_params();
+        first.build_type = ygl::bvh_build_type::sah;
+        first.max_prims = 2;
+        first.wide = true;
+        first.triangles = true;
+        auto rebuilt = std::make_shared<ygl::shape>(*shp);
+        rebuilt->bvh = nullptr;
+        ygl::update_bvh(rebuilt, first);
+        ygl::update_bvh(rebuilt, ygl::bvh_params());
+        auto fresh = std::make_shared<ygl::shape>(*shp);
+        fresh->bvh = nullptr;
+        ygl::update_bvh(fresh, ygl::bvh_params());
+
+        // rays from outside the bounds towards random points inside
+        auto center = (shp->bbox.min + shp->bbox.max) / 2;
+        auto size = ygl::max(shp->bbox.max - shp->bbox.min);
+        for (auto i = 0; i < 256; i++) {
+            auto target = shp->pos[ygl::rand1i(rng, (int)shp->pos.size())];
+            auto o = center + ygl::sample_sphere(ygl::rand2f(rng)) * size * 2;
+            auto ray = ygl::make_ray(o, ygl::normalize(target - o));
+            auto rd = 0.0f, fd = 0.0f;
+            auto riid = 0, reid = 0, fiid = 0, feid = 0;
+            auto ruv = ygl::zero2f, fuv = ygl::zero2f;
+            auto rhit = ygl::intersect_bvh(
+                rebuilt->bvh, ray, false, rd, riid, reid, ruv);
+            auto fhit = ygl::intersect_bvh(
+                fresh->bvh, ray, false, fd, fiid, feid, fuv);
+            if (rhit != fhit || (rhit && (reid != feid || rd != fd)))
+                mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+// Root mean square error of the colors of two images.
+double image_rmse(const ygl::image4f& a, const ygl::image4f& b) {
+    auto sum = 0.0;
+    for (auto i = 0; i < a.pxl.size(); i++) {
+        auto d = ygl::xyz(a.pxl[i]) - ygl::xyz(b.pxl[i]);
+        sum += ygl::dot(d, d);
+    }
+    return (a.pxl.empty()) ? 0 : std::sqrt(sum / (3 * a.pxl.size()));
+}
+
+// Check denoising against a reference render with `reference_ratio` times
+// the samples and a different seed. Returns the error of the render before
+// and after denoising.
+std::pair<double, double> check_denoise(const ygl::render_scene& rscn,
+    int resolution, int nsamples, ygl::trace_type tracer, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads,
+    int reference_ratio = 8) {
+    auto st = ygl::trace_state();
+    auto done = false;
+    while (!done) {
+        done = ygl::trace_samples(st, rscn, 0, resolution, nsamples, tracer,
+            nsamples, nbounces, pixel_clamp, noparallel, seed, nthreads, 0,
+            true);
+    }
+    auto denoised = ygl::denoise_trace_image(st);
+    auto reference = ygl::trace_image(rscn, 0, resolution,
+        nsamples * reference_ratio, tracer, nbounces, pixel_clamp, noparallel,
+        seed + 1, nthreads);
+    return {image_rmse(st.img, reference), image_rmse(denoised, reference)};
+}
+
+auto tracer_names = std::unordered_map<std::string, ygl::trace_type>{
+    {"pathtrace", ygl::trace_type::path},
+    {"direct", ygl::trace_type::direct},
+    {"environment", ygl::trace_type::environment},
+    {"eyelight", ygl::trace_type::eyelight},
+    {"pathtrace-nomis", ygl::trace_type::path_nomis},
+    {"pathtrace-naive", ygl::trace_type::path_naive},
+    {"direct-nomis", ygl::trace_type::direct_nomis},
+    {"debug_normal", ygl::trace_type::debug_normal},
+    {"debug_albedo", ygl::trace_type::debug_albedo},
+    {"debug_texcoord", ygl::trace_type::debug_texcoord},
+    {"debug_frontfacing", ygl::trace_type::debug_frontfacing},
+    {"debug_diffuse", ygl::trace_type::debug_diffuse},
+    {"debug_specular", ygl::trace_type::debug_specular},
+    {"debug_roughness", ygl::trace_type::debug_roughness}};
+
+auto bvh_names = std::unordered_map<std::string, ygl::bvh_build_type>{
+    {"median", ygl::bvh_build_type::median},
+    {"equalsize", ygl::bvh_build_type::equal_size},
+    {"sah", ygl::bvh_build_type::sah}};
+
+auto light_sampling_names =
+    std::unordered_map<std::string, ygl::light_sampling_type>{
+        {"uniform", ygl::light_sampling_type::uniform},
+        {"power", ygl::light_sampling_type::power},
+        {"tree", ygl::light_sampling_type::tree}};
+
+int main(int argc, char* argv[]) {
+    // command line parameters
+    auto filenames = std::vector<std::string>();  // scene filenames
+    auto testsdir = "tests"s;                     // tests scene directory
+    auto notests = false;                         // skip tests scenes
+    auto output = "bench.json"s;                  // results filename
+    auto imagedir = ""s;                          // image output directory
+    auto nruns = 3;                               // runs per scene
+    auto resolution = 256;                        // image vertical resolution
+    auto nsamples = 16;                           // image samples
+    auto tracer = "pathtrace"s;                   // tracer algorithm
+    auto nbounces = 4;                            // number of bounces
+    auto bvh_type = "median"s;                    // bvh build heuristic
+    auto bvh_prims = ygl::bvh_max_prims;          // bvh leaf size
+    auto bvh_wide = false;                        // wide bvh traversal
+    auto bvh_triangles = false;                   // precomputed bvh triangles
+    auto bvh_compressed = false;                  // compressed bvh nodes
+    auto light_sampling = "uniform"s;             // light sampling
+    auto pixel_clamp = 100.0f;                    // pixel clamping
+    auto noparallel = false;                      // disable parallel
+    auto nthreads = 0;                            // number of threads
+    auto seed = ygl::trace_default_seed;          // random seed
+    auto check_queries = false;                   // check bvh queries
+    auto check_denoising = false;                 // check the denoiser
+    auto quiet = false;                           // quiet mode
+
+    // parse command line
+    CLI::App parser("Scene loading, bvh and rendering benchmark", "ybench");
+    parser.add_option("--tests", testsdir, "Directory of test scenes.");
+    parser.add_flag("--notests", notests, "Skip the test scenes.");
+    parser.add_option("--output,-o", output, "Results filename");
+    parser.add_option("--image-dir", imagedir,
+        "Image output directory (defaults to the results one).");
+    parser.add_option("--nruns,-n", nruns, "Number of runs per scene.");
+    parser.add_option(
+        "--resolution,-r", resolution, "Image vertical resolution.");
+    parser.add_option("--nsamples,-s", nsamples, "Number of samples.");
+    parser.add_option("--tracer,-t", tracer, "Trace type.")
+        ->transform([](const std::string& s) -> std::string {
+            if (tracer_names.find(s) == tracer_names.end())
+                throw CLI::ValidationError("unknown tracer name");
+            return s;
+        });
+    parser.add_option("--nbounces", nbounces, "Maximum number of bounces.");
+    parser.add_option("--bvh", bvh_type, "Bvh build heuristic.")
+        ->transform([](const std::string& s) -> std::string {
+            if (bvh_names.find(s) == bvh_names.end())
+                throw CLI::ValidationError("unknown bvh build type");
+            return s;
+        });
+    parser.add_option(
+        "--bvh-prims", bvh_prims, "Maximum primitives per bvh leaf.");
+    parser.add_flag("--bvh-wide", bvh_wide, "Use wide bvh nodes for tracing.");
+    parser.add_flag("--bvh-triangles", bvh_triangles,
+        "Precompute triangles in bvh leaf order.");
+    parser.add_flag("--bvh-compressed", bvh_compressed,
+        "Use compressed bvh nodes to save memory.");
+    parser.add_option("--lights", light_sampling, "Light sampling type.")
+        ->transform([](const std::string& s) -> std::string {
+            if (light_sampling_names.find(s) == light_sampling_names.end())
+                throw CLI::ValidationError("unknown light sampling type");
+            return s;
+        });
+    parser.add_option("--pixel-clamp", pixel_clamp, "Final pixel clamping.");
+    parser.add_flag("--noparallel", noparallel, "Disable parallel execution.");
+    parser.add_option(
+        "--nthreads", nthreads, "Number of threads (0 for all hardware).");
+    parser.add_option("--seed", seed, "Seed for the random number generators.");
+    parser.add_flag("--check-queries", check_queries,
+        "Check batched bvh queries against brute force.");
+    parser.add_flag("--check-denoise", check_denoising,
+        "Check that denoising lowers the error against a reference.");
+    parser.add_flag("--quiet,-q", quiet, "Print only errors messages");
+    parser.add_option("scenes", filenames, "Additional scene filenames");
+    try {
+        parser.parse(argc, argv);
+    } catch (const CLI::ParseError& e) { return parser.exit(e); }
+
+    // scenes to run
+    auto scenes = std::vector<std::string>();
+    if (!notests) scenes = list_scenes(testsdir);
+    scenes.insert(scenes.end(), filenames.begin(), filenames.end());
+    if (scenes.empty()) {
+        std::cout << "no scenes to benchmark\n";
+        exit(1);
+    }
+    nruns = std::max(nruns, 1);
+    if (imagedir == "") imagedir = ygl::get_dirname(output);
+    if (imagedir == "") imagedir = ".";
+    mkdir(imagedir);
+
+    // settings
+    auto js = nlohmann::json::object();
+    js["settings"] = {{"runs", nruns}, {"resolution", resolution},
+        {"samples", nsamples}, {"tracer", tracer}, {"bounces", nbounces},
+        {"bvh", bvh_type}, {"bvh_prims", bvh_prims}, {"bvh_wide", bvh_wide},
+        {"bvh_triangles", bvh_triangles}, {"bvh_compressed", bvh_compressed},
+        {"lights", light_sampling}, {"seed", seed},
+        {"threads", (noparallel) ? 1 :
+                    (nthreads) ? nthreads :
+                                 (int)std::thread::hardware_concurrency()}};
+    js["scenes"] = nlohmann::json::array();
+
+    // run scenes
+    auto seconds = [](int64_t duration) { return duration / 1.0e9; };
+    for (auto& filename : scenes) {
+        if (!quiet) std::cout << "benchmarking " << filename << "\n";
+        auto imfilename = imagedir + "/" +
+                          ygl::replace_extension(
+                              ygl::get_filename(filename), "hdr");
+        auto load_times = std::vector<double>();
+        auto bvh_times = std::vector<double>();
+        auto lights_times = std::vector<double>();
+        auto render_times = std::vector<double>();
+        auto save_times = std::vector<double>();
+        auto rays_per_second = std::vector<double>();
+        auto trace_stats = ygl::trace_stats();
+        auto peak_memory = (uint64_t)0;
+        auto query_mismatches = 0;
+        auto denoise_rmse = std::pair<double, double>{0, 0};
+        auto error = ""s;
+        reset_peak_memory();
+        for (auto run = 0; run < nruns && error == ""; run++) {
+            // load, with the scene updates needed before building the bvh
+            auto start = ygl::get_time();
+            auto scn = std::shared_ptr<ygl::scene>();
+            try {
+                scn = ygl::load_scene(filename);
+            } catch (const std::exception& e) {
+                error = e.what();
+                break;
+            }
+            auto prebuilt = (bool)scn->bvh;
+            if (!prebuilt) ygl::update_tesselation(scn);
+            ygl::update_transforms(scn);
+            ygl::update_bbox(scn, !prebuilt);
+            if (scn->cameras.empty())
+                scn->cameras.push_back(
+                    ygl::make_bbox_camera("<view>", scn->bbox));
+            load_times.push_back(seconds(ygl::get_time() - start));
+
+            // bvh, always rebuilt so that build settings can be compared
+            start = ygl::get_time();
+            auto params = ygl::bvh_params();
+            params.build_type = bvh_names.at(bvh_type);
+            params.max_prims = bvh_prims;
+            params.noparallel = noparallel;
+            params.wide = bvh_wide;
+            params.triangles = bvh_triangles;
+            params.compressed = bvh_compressed;
+            ygl::update_bvh(scn, true, params);
+            bvh_times.push_back(seconds(ygl::get_time() - start));
+            if (check_queries && !run) {
+                query_mismatches = check_bvh_queries(scn, nthreads) +
+                                   check_bvh_rebuilds(scn);
+                if (query_mismatches) {
+                    error = std::to_string(query_mismatches) +
+                            " bvh query mismatches";
+                    break;
+                }
+            }
+
+            // lights
+            start = ygl::get_time();
+            ygl::update_lights(
+                scn, true, false, light_sampling_names.at(light_sampling));
+            lights_times.push_back(seconds(ygl::get_time() - start));
+
+            // render with a fixed seed
+            ygl::reset_trace_stats();
+            start = ygl::get_time();
+            auto rscn = ygl::make_render_scene(scn);
+            auto img = ygl::trace_image(rscn, 0, resolution, nsamples,
+                tracer_names.at(tracer), nbounces, pixel_clamp, noparallel,
+                seed, nthreads);
+            auto render_time = seconds(ygl::get_time() - start);
+            render_times.push_back(render_time);
+            trace_stats = ygl::get_trace_stats();
+            rays_per_second.push_back(
+                (render_time) ? trace_stats.nrays / render_time : 0.0);
+            if (check_denoising && !run) {
+                denoise_rmse = check_denoise(rscn, resolution, nsamples,
+                    tracer_names.at(tracer), nbounces, pixel_clamp,
+                    noparallel, seed, nthreads);
+                if (denoise_rmse.second > denoise_rmse.first) {
+                    error = "denoising raised the error from " +
+                            std::to_string(denoise_rmse.first) + " to " +
+                            std::to_string(denoise_rmse.second);
+                    break;
+                }
+            }
+
+            // save
+            start = ygl::get_time();
+            try {
+                ygl::save_image(imfilename, img);
+            } catch (const std::exception& e) {
+                error = e.what();
+                break;
+            }
+            save_times.push_back(seconds(ygl::get_time() - start));
+        }
+        peak_memory = get_peak_memory();
+
+        // record results
+        auto jscn = nlohmann::json::object();
+        jscn["scene"] = filename;
+        if (error != "") {
+            std::cout << "error benchmarking " << filename << ": " << error
+                      << "\n";
+            jscn["error"] = error;
+            js["scenes"].push_back(jscn);
+            continue;
+        }
+        jscn["image"] = imfilename;
+        jscn["timings"] = {{"load", median(load_times)},
+            {"bvh", median(bvh_times)}, {"lights", median(lights_times)},
+            {"render", median(render_times)}, {"save", median(save_times)}};
+        jscn["paths"] = trace_stats.npaths;
+        jscn["rays"] = trace_stats.nrays;
+        jscn["rays_per_second"] = median(rays_per_second);
+        jscn["peak_memory"] = peak_memory;
+        if (check_queries) jscn["query_mismatches"] = query_mismatches;
+        if (check_denoising)
+            jscn["denoise_rmse"] = {{"noisy", denoise_rmse.first},
+                {"denoised", denoise_rmse.second}};
+        js["scenes"].push_back(jscn);
+        if (!quiet)
+            std::cout << "load " << median(load_times) << "s, bvh "
+                      << median(bvh_times) << "s, render "
+                      << median(render_times) << "s, "
+                      << ygl::format_num((uint64_t)median(rays_per_second))
+                      << " rays/s, " << peak_memory / (1024.0 * 1024.0)
+                      << " MB peak\n";
+    }
+
+    // save results
+    if (!quiet) std::cout << "saving results " << output << "\n";
+    auto fs = std::ofstream(output);
+    if (!fs) {
+        std::cout << "cannot save results " << output << "\n";
+        exit(1);
+    }
+    fs << js.dump(4) << "\n";
+
+    // done
+    return 0;
+}
@@ -144,6 +144,12 @@ inline void update_glbuffer(uint bid, const std::vector<T>& data, bool elems) {
     check_glerror();
 }
 
+inline void clear_glbuffer(uint& bid) {
+    if (!bid) return;
+    glDeleteBuffers(1, &bid);
+    bid = 0;
+}
+
 inline uint make_gltexture(const image4f& img, bool linear, bool mipmap) {
     auto tid = (uint)0;
     check_glerror();
@@ -183,6 +189,41 @@ inline void update_gltexture(uint tid, const image4f& img,
     check_glerror();
 }
 
+// Resizes a texture, leaving its texels undefined.
+inline void resize_gltexture(uint tid, const vec2i& size) {
+    check_glerror();
+    glBindTexture(GL_TEXTURE_2D, tid);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.x, size.y, 0, GL_RGBA,
+        GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    check_glerror();
+}
+
+// Uploads the rows [j0, j1) of an image to a texture of the same size, so
+// that large images can be uploaded in chunks over several frames.
+inline void update_gltexture_rows(
+    uint tid, const image4f& img, int j0, int j1) {
+    check_glerror();
+    glBindTexture(GL_TEXTURE_2D, tid);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, j0, img.size.x, j1 - j0, GL_RGBA,
+        GL_FLOAT, img.pxl.data() + (size_t)j0 * img.size.x);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    check_glerror();
+}
+
+// Uploads the region [min, max) of an image to a texture of the same size.
+inline void update_gltexture_region(
+    uint tid, const image4f& img, const vec2i& min, const vec2i& max) {
+    check_glerror();
+    glBindTexture(GL_TEXTURE_2D, tid);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, img.size.x);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, min.x, min.y, max.x - min.x,
+        max.y - min.y, GL_RGBA, GL_FLOAT, &img[min]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    check_glerror();
+}
+
 inline void set_gluniform(uint loc, int val) {
     check_glerror();
     glUniform1i(loc, val);
@@ -282,6 +323,36 @@ inline void set_glvertattrib(uint pid, const char* name, uint bid, const T& val)
     check_glerror();
 }
 
+// Binds a per-instance matrix attribute from the buffer `bid`, starting at
+// the matrix `first`. Matrices take four consecutive attribute locations.
+inline void set_glvertattrib_instanced(uint loc, uint bid, int first) {
+    check_glerror();
+    glBindBuffer(GL_ARRAY_BUFFER, bid);
+    for (auto c = 0; c < 4; c++) {
+        auto offset = sizeof(mat4f) * first + sizeof(vec4f) * c;
+        glEnableVertexAttribArray(loc + c);
+        glVertexAttribPointer(
+            loc + c, 4, GL_FLOAT, false, sizeof(mat4f), (void*)offset);
+        glVertexAttribDivisor(loc + c, 1);
+    }
+    check_glerror();
+}
+inline void set_glvertattrib_instanced(
+    uint pid, const char* name, uint bid, int first) {
+    set_glvertattrib_instanced(glGetAttribLocation(pid, name), bid, first);
+}
+
+// Resets a per-instance matrix attribute to a per-vertex one.
+inline void clear_glvertattrib_instanced(uint loc) {
+    for (auto c = 0; c < 4; c++) {
+        glVertexAttribDivisor(loc + c, 0);
+        glDisableVertexAttribArray(loc + c);
+    }
+}
+inline void clear_glvertattrib_instanced(uint pid, const char* name) {
+    clear_glvertattrib_instanced(glGetAttribLocation(pid, name));
+}
+
 inline void draw_glpoints(uint bid, int num) {
     check_glerror();
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bid);
@@ -301,6 +372,29 @@ inline void draw_gltriangles(uint bid, int num) {
     check_glerror();
 }
 
+// Draws `ninstances` copies of the elements, for use with per-instance
+// attributes.
+inline void draw_glpoints_instanced(uint bid, int num, int ninstances) {
+    check_glerror();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bid);
+    glDrawElementsInstanced(
+        GL_POINTS, 1 * num, GL_UNSIGNED_INT, 0, ninstances);
+    check_glerror();
+}
+inline void draw_gllines_instanced(uint bid, int num, int ninstances) {
+    check_glerror();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bid);
+    glDrawElementsInstanced(GL_LINES, 2 * num, GL_UNSIGNED_INT, 0, ninstances);
+    check_glerror();
+}
+inline void draw_gltriangles_instanced(uint bid, int num, int ninstances) {
+    check_glerror();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bid);
+    glDrawElementsInstanced(
+        GL_TRIANGLES, 3 * num, GL_UNSIGNED_INT, 0, ninstances);
+    check_glerror();
+}
+
 inline void bind_glprog(uint pid) {
     check_glerror();
     glUseProgram(pid);
@@ -337,12 +431,10 @@ static const char* draw_image_fragment =
     }
     )";
 
-inline void draw_glimage(const image4f& img, const frame2f& imframe,
-    const vec2i& win_size) {
-    static uint gl_prog = 0, gl_pbo = 0, gl_tbo = 0, gl_ebo = 0, gl_txt = 0;
-    static vec2i gl_imsize = zero2i;
+inline void draw_glimage(uint gl_txt, const vec2i& imsize,
+    const frame2f& imframe, const vec2i& win_size) {
+    static uint gl_prog = 0, gl_pbo = 0, gl_tbo = 0, gl_ebo = 0;
 
-    auto imsize = img.size;
     auto pos_ = std::vector<vec2f>{{0, 0}, {0, 1}, {1, 1}, {1, 0}};
     auto texcoord = std::vector<vec2f>{{0, 0}, {1, 0}, {1, 1}, {0, 1}};
     auto triangles = std::vector<vec3i>{{0, 1, 2}, {0, 2, 3}};
@@ -353,13 +445,6 @@ inline void draw_glimage(const image4f& img, const frame2f& imframe,
     if (!gl_tbo) gl_tbo = make_glbuffer(texcoord, false);
     if (!gl_ebo) gl_ebo = make_glbuffer(triangles, true);
 
-    if (!gl_txt) {
-        gl_txt = make_gltexture(img, false, false);
-    } else {
-        update_gltexture(gl_txt, img, gl_imsize, false);
-        gl_imsize = img.size;
-    }
-
     bind_glprog(gl_prog);
 
     set_gluniform_texture(gl_prog, "img", gl_txt, 0);
@@ -383,6 +468,47 @@ inline void draw_glimage(const image4f& img, const frame2f& imframe,
     glUseProgram(0);
 }
 
+inline void draw_glimage(const image4f& img, const frame2f& imframe,
+    const vec2i& win_size) {
+    static uint gl_txt = 0;
+    static vec2i gl_imsize = zero2i;
+
+    if (!gl_txt) {
+        gl_txt = make_gltexture(img, false, false);
+    } else {
+        update_gltexture(gl_txt, img, gl_imsize, false);
+    }
+    gl_imsize = img.size;
+
+    draw_glimage(gl_txt, img.size, imframe, win_size);
+}
+
+// Draws a texture of size `imsize` in the window, or only clears the
+// background if the texture is 0.
+inline void draw_glimage(GLFWwindow* win, uint gl_txt, const vec2i& imsize,
+    frame2f& imframe, bool zoom_to_fit, const vec4f& background) {
+    auto win_size = zero2i, framebuffer_size = zero2i;
+    glfwGetWindowSize(win, &win_size.x, &win_size.y);
+    glfwGetFramebufferSize(win, &framebuffer_size.x, &framebuffer_size.y);
+
+    check_glerror();
+    glViewport(0, 0, framebuffer_size.x, framebuffer_size.y);
+    glClearColor(background.x, background.y, background.z, background.w);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (!gl_txt) return;
+
+    center_image(imframe, imsize, win_size, zoom_to_fit);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    check_glerror();
+
+    draw_glimage(gl_txt, imsize, imframe, win_size);
+
+    check_glerror();
+    glDisable(GL_BLEND);
+    check_glerror();
+}
+
 inline void draw_glimage(GLFWwindow* win, const image4f& img,
     frame2f& imframe, bool zoom_to_fit, const vec4f& background) {
     auto win_size = zero2i, framebuffer_size = zero2i;
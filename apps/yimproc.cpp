@@ -73,66 +73,168 @@ ygl::image4f filter_bilateral(const ygl::image4f& img, float spatial_sigma,
     auto fw = std::vector<float>();
     for (auto feature_sigma : features_sigma)
         fw.push_back(1 / (2.0f * feature_sigma * feature_sigma));
-    for (auto j = 0; j < img.size.y; j++) {
-        for (auto i = 0; i < img.size.x; i++) {
-            auto av = ygl::zero4f;
-            auto aw = 0.0f;
-            for (auto fj = -filter_width; fj <= filter_width; fj++) {
-                for (auto fi = -filter_width; fi <= filter_width; fi++) {
-                    auto ii = i + fi, jj = j + fj;
-                    if (ii < 0 || jj < 0) continue;
-                    if (ii >= img.size.x || jj >= img.size.y) continue;
-                    auto uv = ygl::vec2f{float(i - ii), float(j - jj)};
-                    auto rgb = img[{i, j}] - img[{ii, jj}];
-                    auto w = (float)std::exp(-dot(uv, uv) * sw) *
-                             (float)std::exp(-dot(rgb, rgb) * rw);
-                    for (auto fi = 0; fi < features.size(); fi++) {
-                        auto feat =
-                            features[fi][{i, j}] - features[fi][{ii, jj}];
-                        w *= exp(-dot(feat, feat) * fw[fi]);
+    // spatial weights, shared by all pixels
+    auto filter_size = 2 * filter_width + 1;
+    auto spatial_weights = std::vector<float>(filter_size * filter_size);
+    for (auto fj = -filter_width; fj <= filter_width; fj++) {
+        for (auto fi = -filter_width; fi <= filter_width; fi++) {
+            auto uv = ygl::vec2f{(float)fi, (float)fj};
+            spatial_weights[(fj + filter_width) * filter_size + fi +
+                            filter_width] = std::exp(-dot(uv, uv) * sw);
+        }
+    }
+    ygl::parallel_rows(img.size, [&](int j0, int j1) {
+        for (auto j = j0; j < j1; j++) {
+            for (auto i = 0; i < img.size.x; i++) {
+                auto av = ygl::zero4f;
+                auto aw = 0.0f;
+                auto fj0 = std::max(-filter_width, -j),
+                     fj1 = std::min(filter_width, img.size.y - 1 - j);
+                auto fi0 = std::max(-filter_width, -i),
+                     fi1 = std::min(filter_width, img.size.x - 1 - i);
+                for (auto fj = fj0; fj <= fj1; fj++) {
+                    auto spatial_row = spatial_weights.data() +
+                                       (fj + filter_width) * filter_size +
+                                       filter_width;
+                    for (auto fi = fi0; fi <= fi1; fi++) {
+                        auto ii = i + fi, jj = j + fj;
+                        auto rgb = img[{i, j}] - img[{ii, jj}];
+                        auto w = spatial_row[fi] *
+                                 (float)std::exp(-dot(rgb, rgb) * rw);
+                        for (auto fi = 0; fi < features.size(); fi++) {
+                            auto feat =
+                                features[fi][{i, j}] - features[fi][{ii, jj}];
+                            w *= exp(-dot(feat, feat) * fw[fi]);
+                        }
+                        av += w * img[{ii, jj}];
+                        aw += w;
                     }
-                    av += w * img[{ii, jj}];
-                    aw += w;
                 }
+                filtered[{i, j}] = av / aw;
             }
-            filtered[{i, j}] = av / aw;
         }
-    }
+    });
     return filtered;
 }
 
 ygl::image4f filter_bilateral(
     const ygl::image4f& img, float spatial_sigma, float range_sigma) {
+    return filter_bilateral(img, spatial_sigma, range_sigma, {}, {});
+}
+
+// Bilateral filter with the range on luminance, approximated on a grid
+// sampled at the spatial sigma in image space and the range sigma in
+// luminance [Paris and Durand 2006]. Its cost does not grow with the sigmas.
+// The luminance axis is capped at `max_range_cells`, coarsening the range
+// sampling for images with a high dynamic range.
+ygl::image4f filter_bilateral_grid(const ygl::image4f& img,
+    float spatial_sigma, float range_sigma, int max_range_cells = 256) {
+    // grid size, padded for the blur and interpolation
+    auto min_lum = ygl::flt_max, max_lum = -ygl::flt_max;
+    for (auto& p : img.pxl) {
+        auto lum = ygl::luminance(p);
+        if (!std::isfinite(lum)) continue;
+        min_lum = std::min(min_lum, lum);
+        max_lum = std::max(max_lum, lum);
+    }
+    if (min_lum > max_lum) min_lum = max_lum = 0;
+    auto range_step = std::max(range_sigma, (max_lum - min_lum) /
+                                                (max_range_cells - 1));
+    auto pad = 2;
+    auto gsize = ygl::vec3i{(int)((img.size.x - 1) / spatial_sigma) + 1,
+        (int)((img.size.y - 1) / spatial_sigma) + 1,
+        (int)((max_lum - min_lum) / range_step) + 1};
+    gsize = {gsize.x + 2 * pad, gsize.y + 2 * pad, gsize.z + 2 * pad};
+    auto grid_coord = [&](int i, int j) {
+        auto lum = (ygl::luminance(img[{i, j}]) - min_lum) / range_step;
+        return ygl::vec3f{i / spatial_sigma + pad, j / spatial_sigma + pad,
+            ygl::clamp(lum, 0.0f, (float)(gsize.z - 2 * pad - 1)) + pad};
+    };
+    auto grid_idx = [&gsize](int gi, int gj, int gk) {
+        return ((size_t)gk * gsize.y + gj) * gsize.x + gi;
+    };
+
+    // splat pixels to their nearest cell, with weights in the alpha of a
+    // second grid; grid rows gather their image rows, so they do not race
+    auto grid = std::vector<ygl::vec4f>((size_t)gsize.x * gsize.y * gsize.z);
+    auto weights = std::vector<float>(grid.size());
+    ygl::parallel_for(gsize.y, [&](int gj) {
+        auto j0 = std::max(0, (int)((gj - pad - 0.5f) * spatial_sigma) - 1),
+             j1 = std::min(img.size.y,
+                 (int)((gj - pad + 0.5f) * spatial_sigma) + 2);
+        for (auto j = j0; j < j1; j++) {
+            for (auto i = 0; i < img.size.x; i++) {
+                auto gc = grid_coord(i, j);
+                if ((int)(gc.y + 0.5f) != gj) continue;
+                auto idx =
+                    grid_idx((int)(gc.x + 0.5f), gj, (int)(gc.z + 0.5f));
+                grid[idx] += img[{i, j}];
+                weights[idx] += 1;
+            }
+        }
+    });
+
+    // blur the grid along each axis with a [1 4 6 4 1] / 16 kernel
+    auto blurred = grid;
+    auto blurred_weights = weights;
+    auto strides = ygl::vec3i{1, gsize.x, gsize.x * gsize.y};
+    for (auto axis = 0; axis < 3; axis++) {
+        auto stride = (size_t)(&strides.x)[axis];
+        auto size = (&gsize.x)[axis];
+        auto kernel = std::array<float, 5>{
+            1 / 16.0f, 4 / 16.0f, 6 / 16.0f, 4 / 16.0f, 1 / 16.0f};
+        ygl::parallel_for(gsize.z, [&](int gk) {
+            for (auto gj = 0; gj < gsize.y; gj++) {
+                for (auto gi = 0; gi < gsize.x; gi++) {
+                    auto idx = grid_idx(gi, gj, gk);
+                    auto gc = ygl::vec3i{gi, gj, gk};
+                    auto g = (&gc.x)[axis];
+                    auto sum = ygl::zero4f;
+                    auto wsum = 0.0f;
+                    for (auto k = -2; k <= 2; k++) {
+                        if (g + k < 0 || g + k >= size) continue;
+                        auto nidx = idx + k * (std::ptrdiff_t)stride;
+                        sum += kernel[k + 2] * grid[nidx];
+                        wsum += kernel[k + 2] * weights[nidx];
+                    }
+                    blurred[idx] = sum;
+                    blurred_weights[idx] = wsum;
+                }
+            }
+        });
+        std::swap(grid, blurred);
+        std::swap(weights, blurred_weights);
+    }
+
+    // slice the grid with trilinear interpolation
     auto filtered = ygl::image4f{img.size};
-    auto fwidth = (int)ceil(2.57f * spatial_sigma);
-    auto sw = 1 / (2.0f * spatial_sigma * spatial_sigma);
-    auto rw = 1 / (2.0f * range_sigma * range_sigma);
-    for (auto j = 0; j < img.size.y; j++) {
-        for (auto i = 0; i < img.size.x; i++) {
-            auto av = ygl::zero4f;
-            auto aw = 0.0f;
-            for (auto fj = -fwidth; fj <= fwidth; fj++) {
-                for (auto fi = -fwidth; fi <= fwidth; fi++) {
-                    auto ii = i + fi, jj = j + fj;
-                    if (ii < 0 || jj < 0) continue;
-                    if (ii >= img.size.x || jj >= img.size.y) continue;
-                    auto uv = ygl::vec2f{float(i - ii), float(j - jj)};
-                    auto rgb = img[{i, j}] - img[{ii, jj}];
-                    auto w = std::exp(-dot(uv, uv) * sw) *
-                             std::exp(-dot(rgb, rgb) * rw);
-                    av += w * img[{ii, jj}];
-                    aw += w;
+    ygl::parallel_rows(img.size, [&](int j0, int j1) {
+        for (auto j = j0; j < j1; j++) {
+            for (auto i = 0; i < img.size.x; i++) {
+                auto gc = grid_coord(i, j);
+                auto g = ygl::vec3i{(int)gc.x, (int)gc.y, (int)gc.z};
+                auto t = gc - ygl::vec3f{(float)g.x, (float)g.y, (float)g.z};
+                auto sum = ygl::zero4f;
+                auto wsum = 0.0f;
+                for (auto c = 0; c < 8; c++) {
+                    auto o = ygl::vec3i{c & 1, (c >> 1) & 1, c >> 2};
+                    auto w = (o.x ? t.x : 1 - t.x) * (o.y ? t.y : 1 - t.y) *
+                             (o.z ? t.z : 1 - t.z);
+                    auto idx = grid_idx(g.x + o.x, g.y + o.y, g.z + o.z);
+                    sum += w * grid[idx];
+                    wsum += w * weights[idx];
                 }
+                filtered[{i, j}] = (wsum) ? sum / wsum : img[{i, j}];
             }
-            filtered[{i, j}] = av / aw;
         }
-    }
+    });
     return filtered;
 }
 
 int main(int argc, char* argv[]) {
     // command line parameters
-    auto filename = "img.png"s;                    // input image
+    auto filenames = std::vector<std::string>();   // input images
+    auto merge = false;                            // merge accumulations
     auto output = "out.png"s;                      // output image
     auto tonemap = false;                          // enable tonemapping
     auto exposure = 0.0f;                          // tonemap exposure
@@ -144,6 +246,7 @@ int main(int argc, char* argv[]) {
     auto coloralpha_filename = ""s;  // file to set alpha from color
     auto spatial_sigma = 0.0f;       // spatial sigma for bilateral blur
     auto range_sigma = 0.0f;         // range sigma for bilateral blur
+    auto grid_sigma = 0.0f;          // spatial sigma for the grid bilateral
 
     // command line params
     CLI::App parser("image processing utility", "yimproc");
@@ -158,25 +261,48 @@ int main(int argc, char* argv[]) {
     parser.add_option("--spatial-sigma", spatial_sigma, "blur spatial sigma");
     parser.add_option(
         "--range-sigma", range_sigma, "bilateral blur range sigma");
+    parser.add_option("--grid-sigma", grid_sigma,
+        "spatial sigma from which bilateral blur uses a grid (0 to disable)");
     parser.add_option(
         "--set-alpha", alpha_filename, "set alpha as this image alpha");
     parser.add_option("--set-color-as-alpha", coloralpha_filename,
         "set alpha as this image color");
+    parser.add_flag("--merge", merge,
+        "merge the raw accumulations of ytrace regions or sample ranges");
     parser.add_option("--output,-o", output, "output image filename");
-    parser.add_option("filename", filename, "input image filename")
+    parser.add_option("filenames", filenames, "input image filenames")
         ->required(true);
     try {
         parser.parse(argc, argv);
     } catch (const CLI::ParseError& e) { return parser.exit(e); }
+    if (!merge && filenames.size() != 1) {
+        std::cout << "only one input image can be processed\n";
+        exit(1);
+    }
 
     // load
     auto img = ygl::image4f();
-    try {
-        img = ygl::load_image(filename);
-    } catch (std::exception& e) {
-        std::cout << "cannot load image" << filename << "\n";
-        std::cout << "error: " << e.what() << "\n";
-        exit(1);
+    if (merge) {
+        auto merged = ygl::trace_accumulation();
+        for (auto& filename : filenames) {
+            try {
+                ygl::merge_trace_accumulation(
+                    merged, ygl::load_trace_accumulation(filename));
+            } catch (std::exception& e) {
+                std::cout << "cannot merge accumulation " << filename << "\n";
+                std::cout << "error: " << e.what() << "\n";
+                exit(1);
+            }
+        }
+        img = ygl::resolve_trace_accumulation(merged);
+    } else {
+        try {
+            img = ygl::load_image(filenames[0]);
+        } catch (std::exception& e) {
+            std::cout << "cannot load image" << filenames[0] << "\n";
+            std::cout << "error: " << e.what() << "\n";
+            exit(1);
+        }
     }
 
     // set alpha
@@ -205,7 +331,11 @@ int main(int argc, char* argv[]) {
 
     // multiply
     if (multiply_color != ygl::vec4f{1, 1, 1, 1}) {
-        for (auto& c : img.pxl) c *= multiply_color;
+        ygl::parallel_rows(img.size, [&](int j0, int j1) {
+            auto end = (size_t)j1 * img.size.x;
+            for (auto idx = (size_t)j0 * img.size.x; idx < end; idx++)
+                img.pxl[idx] *= multiply_color;
+        });
     }
 
     // resize
@@ -213,7 +343,11 @@ int main(int argc, char* argv[]) {
 
     // bilateral
     if (spatial_sigma && range_sigma) {
-        img = filter_bilateral(img, spatial_sigma, range_sigma, {}, {});
+        if (grid_sigma && spatial_sigma >= grid_sigma) {
+            img = filter_bilateral_grid(img, spatial_sigma, range_sigma);
+        } else {
+            img = filter_bilateral(img, spatial_sigma, range_sigma, {}, {});
+        }
     }
 
     // hdr correction
@@ -32,7 +32,9 @@
 #include "yglui.h"
 using namespace std::literals;
 
+#include <atomic>
 #include <memory>
+#include <thread>
 #include <unordered_map>
 
 // Generic image that contains either an HDR or an LDR image, giving access
@@ -43,6 +45,16 @@ struct gimage {
     std::string filename = ""s;  // path
     ygl::image4f img = {};       // image
 
+    // loading state, set once img is ready or error is set
+    std::atomic<bool> loaded{false};
+    std::string error = ""s;
+
+    // diff inputs, for diffs computed when first shown
+    std::shared_ptr<gimage> diff_a = nullptr;
+    std::shared_ptr<gimage> diff_b = nullptr;
+    bool diff_color = true;
+    bool diff_started = false;
+
     // min/max values
     ygl::bbox4f pxl_bounds = ygl::invalid_bbox4f;
     ygl::bbox1f lum_bounds = ygl::invalid_bbox1f;
@@ -58,6 +70,9 @@ struct gimage {
     ygl::image4f display;
 };
 
+// Pixels uploaded to the display texture per frame.
+const auto gl_upload_pixels = 1 << 20;
+
 struct app_state {
     std::vector<std::shared_ptr<gimage>> imgs;
     std::shared_ptr<gimage> img = nullptr;
@@ -68,6 +83,17 @@ struct app_state {
     ygl::frame2f imframe = ygl::identity_frame2f;
     bool zoom_to_fit = false;
     ygl::vec4f background = {0.8f, 0.8f, 0.8f, 0};
+
+    // display texture, uploaded in chunks of rows from gl_img
+    uint gl_txt = 0;
+    ygl::vec2i gl_size = ygl::zero2i;
+    std::shared_ptr<gimage> gl_img = nullptr;
+    int gl_rows = 0;
+
+    // background loading and diffing
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop{false};
+    bool quiet = false;
 };
 
 // compute min/max
@@ -80,8 +106,8 @@ void update_minmax(std::shared_ptr<gimage> img) {
     }
 }
 
-// Loads a generic image
-std::shared_ptr<gimage> load_gimage(
+// Makes a generic image to be loaded later
+std::shared_ptr<gimage> make_gimage(
     const std::string& filename, float exposure, float gamma, bool filmic) {
     auto img = std::make_shared<gimage>();
     img->filename = filename;
@@ -90,44 +116,95 @@ std::shared_ptr<gimage> load_gimage(
     img->gamma = gamma;
     img->filmic = filmic;
     img->is_hdr = ygl::is_hdr_filename(filename);
-    img->img = ygl::load_image(filename);
-    update_minmax(img);
     return img;
 }
 
-std::shared_ptr<gimage> diff_gimage(
+// Loads a generic image, setting its error instead of throwing
+void load_gimage(const std::shared_ptr<gimage>& img) {
+    try {
+        img->img = ygl::load_image(img->filename);
+        update_minmax(img);
+    } catch (const std::exception& e) {
+        std::cout << "cannot load image " << img->filename << "\n";
+        std::cout << "error: " << e.what() << "\n";
+        img->error = e.what();
+    }
+    img->loaded = true;
+}
+
+// Makes a diff image to be computed later
+std::shared_ptr<gimage> make_diff_gimage(
     std::shared_ptr<gimage> a, std::shared_ptr<gimage> b, bool color) {
-    if (a->img.size != b->img.size) return nullptr;
     auto d = std::make_shared<gimage>();
     d->name = "diff " + a->name + " " + b->name;
     d->filename = "";
-    d->img = a->img;
-    if (color) {
-        for (auto j = 0; j < a->img.size.y; j++) {
-            for (auto i = 0; i < a->img.size.x; i++) {
-                d->img[{i, j}] = {std::abs(a->img[{i, j}].x - b->img[{i, j}].x),
-                    std::abs(a->img[{i, j}].y - b->img[{i, j}].y),
-                    std::abs(a->img[{i, j}].z - b->img[{i, j}].z),
-                    std::max(a->img[{i, j}].w, b->img[{i, j}].w)};
-            }
-        }
+    d->diff_a = a;
+    d->diff_b = b;
+    d->diff_color = color;
+    return d;
+}
+
+// Computes a diff image once its inputs are loaded
+void diff_gimage(const std::shared_ptr<gimage>& d) {
+    auto& a = d->diff_a->img;
+    auto& b = d->diff_b->img;
+    if (d->diff_a->error != "" || d->diff_b->error != "") {
+        d->error = "missing images";
+    } else if (a.size != b.size) {
+        d->error = "images of different sizes";
     } else {
-        for (auto j = 0; j < a->img.size.y; j++) {
-            for (auto i = 0; i < a->img.size.x; i++) {
-                auto la =
-                    (a->img[{i, j}].x + a->img[{i, j}].y + a->img[{i, j}].z) /
-                    3;
-                auto lb =
-                    (b->img[{i, j}].x + b->img[{i, j}].y + b->img[{i, j}].z) /
-                    3;
-                auto ld = fabsf(la - lb);
-                d->img[{i, j}] = {
-                    ld, ld, ld, std::max(a->img[{i, j}].w, b->img[{i, j}].w)};
+        d->img = ygl::image4f{a.size};
+        ygl::parallel_rows(a.size, [&](int j0, int j1) {
+            auto end = (size_t)j1 * a.size.x;
+            for (auto idx = (size_t)j0 * a.size.x; idx < end; idx++) {
+                auto pa = a.pxl[idx], pb = b.pxl[idx];
+                if (d->diff_color) {
+                    d->img.pxl[idx] = {std::abs(pa.x - pb.x),
+                        std::abs(pa.y - pb.y), std::abs(pa.z - pb.z),
+                        std::max(pa.w, pb.w)};
+                } else {
+                    auto la = (pa.x + pa.y + pa.z) / 3;
+                    auto lb = (pb.x + pb.y + pb.z) / 3;
+                    auto ld = fabsf(la - lb);
+                    d->img.pxl[idx] = {ld, ld, ld, std::max(pa.w, pb.w)};
+                }
             }
-        }
+        });
+        update_minmax(d);
     }
-    update_minmax(d);
-    return d;
+    d->loaded = true;
+}
+
+// Loads all images in parallel in the background, waking up the ui as each
+// one is ready.
+void start_loading(const std::shared_ptr<app_state>& app) {
+    auto imgs = std::vector<std::shared_ptr<gimage>>();
+    for (auto img : app->imgs)
+        if (!img->diff_a) imgs.push_back(img);
+    app->threads.push_back(std::thread([app = app.get(), imgs]() {
+        ygl::parallel_for((int)imgs.size(), [app, &imgs](int idx) {
+            if (app->stop) return;
+            if (!app->quiet)
+                std::cout << "loading " << imgs[idx]->filename << "\n";
+            load_gimage(imgs[idx]);
+            glfwPostEmptyEvent();
+        });
+    }));
+}
+
+// Computes a diff in the background when first shown.
+void start_diffing(
+    const std::shared_ptr<app_state>& app, const std::shared_ptr<gimage>& d) {
+    if (!d->diff_a || d->diff_started) return;
+    if (!d->diff_a->loaded || !d->diff_b->loaded) return;
+    d->diff_started = true;
+    if (!app->quiet)
+        std::cout << "diffing " << d->diff_a->filename << " "
+                  << d->diff_b->filename << "\n";
+    app->threads.push_back(std::thread([d]() {
+        diff_gimage(d);
+        glfwPostEmptyEvent();
+    }));
 }
 
 void update_display_image(const std::shared_ptr<gimage>& img) {
@@ -138,10 +215,48 @@ void update_display_image(const std::shared_ptr<gimage>& img) {
     }
 }
 
+// Updates the display of the current image if needed, restarting its upload,
+// then uploads the next chunk of rows. Returns whether rows are left.
+bool update_display_texture(const std::shared_ptr<app_state>& app) {
+    auto img = app->img;
+    if (img->loaded && img->error == "") {
+        if (img->updated) {
+            update_display_image(img);
+            img->updated = false;
+            app->gl_img = nullptr;
+        }
+        if (app->gl_img != img) {
+            if (!app->gl_txt)
+                app->gl_txt = ygl::make_gltexture(
+                    ygl::image4f{{1, 1}}, false, false);
+            if (app->gl_size != img->display.size) {
+                ygl::resize_gltexture(app->gl_txt, img->display.size);
+                app->gl_size = img->display.size;
+            }
+            app->gl_img = img;
+            app->gl_rows = 0;
+        }
+    }
+    if (app->gl_img != img) return false;
+    auto& display = app->gl_img->display;
+    if (app->gl_rows >= display.size.y) return false;
+    auto rows = std::max(1, gl_upload_pixels / std::max(display.size.x, 1));
+    auto j1 = std::min(display.size.y, app->gl_rows + rows);
+    ygl::update_gltexture_rows(app->gl_txt, display, app->gl_rows, j1);
+    app->gl_rows = j1;
+    return app->gl_rows < display.size.y;
+}
+
 void draw_widgets(GLFWwindow* win, app_state* app) {
     if (ygl::begin_widgets_frame(win, "yimview", &app->widgets_open)) {
         ImGui::Combo("image", &app->img, app->imgs, false);
         ImGui::LabelText("filename", "%s", app->img->filename.c_str());
+        if (!app->img->loaded || app->img->error != "") {
+            ImGui::LabelText("status", "%s",
+                (app->img->loaded) ? app->img->error.c_str() : "loading");
+            ygl::end_widgets_frame();
+            return;
+        }
         ImGui::LabelText(
             "size", "%d x %d ", app->img->img.size.x, app->img->img.size.y);
         auto edited = 0;
@@ -179,20 +294,23 @@ void draw_widgets(GLFWwindow* win, app_state* app) {
 
 void draw(GLFWwindow* win) {
     auto app = (app_state*)glfwGetWindowUserPointer(win);
-    draw_glimage(win, app->img->display, app->imframe, app->zoom_to_fit,
-        app->background);
+    auto ready = app->gl_img && app->gl_img == app->img;
+    ygl::draw_glimage(win, (ready) ? app->gl_txt : 0, app->gl_size,
+        app->imframe, app->zoom_to_fit, app->background);
     draw_widgets(win, app);
     glfwSwapBuffers(win);
 }
 
 void run_ui(const std::shared_ptr<app_state>& app) {
-    // window
-    auto win_size = ygl::clamp(app->imgs[0]->img.size, 512, 1024);
-    auto win = make_window(win_size, "yimview", app.get(), draw);
+    // window, sized before images are loaded
+    auto win = ygl::make_window({1024, 768}, "yimview", app.get(), draw);
 
     // init widgets
     ygl::init_widgets(win);
 
+    // load images in the background
+    start_loading(app);
+
     // window values
     auto mouse_pos = ygl::zero2f, last_pos = ygl::zero2f;
     auto mouse_button = 0;
@@ -212,22 +330,24 @@ void run_ui(const std::shared_ptr<app_state>& app) {
             }
         }
 
-        // update texture
-        if (app->img->updated) {
-            update_display_image(app->img);
-            app->img->updated = false;
-        }
+        // update texture, computing diffs when first shown
+        start_diffing(app, app->img);
+        auto uploading = update_display_texture(app);
 
         // draw
         draw(win);
 
         // event hadling
-        if (mouse_button || widgets_active) {
+        if (mouse_button || widgets_active || uploading) {
             glfwPollEvents();
         } else {
             glfwWaitEvents();
         }
     }
+
+    // stop loading and wait for the background threads
+    app->stop = true;
+    for (auto& t : app->threads) t.join();
 }
 
 int main(int argc, char* argv[]) {
@@ -256,20 +376,18 @@ int main(int argc, char* argv[]) {
     // prepare application
     auto app = std::make_shared<app_state>();
 
-    // loading images
+    // images, loaded in the background once the window is open
+    app->quiet = quiet;
     for (auto filename : filenames) {
-        if (!quiet) std::cout << "loading " << filename << "\n";
-        app->imgs.push_back(load_gimage(filename, exposure, gamma, filmic));
+        app->imgs.push_back(make_gimage(filename, exposure, gamma, filmic));
     }
     app->img = app->imgs.at(0);
     if (diff) {
-        for (auto i = 0; i < app->imgs.size(); i++) {
-            for (auto j = i + 1; j < app->imgs.size(); j++) {
-                if (!quiet)
-                    std::cout << "diffing " << app->imgs[i]->filename << " "
-                              << app->imgs[j]->filename << "\n";
-                auto diff = diff_gimage(app->imgs[i], app->imgs[j], !lum_diff);
-                if (diff) app->imgs.push_back(diff);
+        auto nimgs = (int)app->imgs.size();
+        for (auto i = 0; i < nimgs; i++) {
+            for (auto j = i + 1; j < nimgs; j++) {
+                app->imgs.push_back(
+                    make_diff_gimage(app->imgs[i], app->imgs[j], !lum_diff));
             }
         }
     }
@@ -38,19 +38,20 @@ using namespace std::literals;
 struct app_state {
     // scene
     std::shared_ptr<ygl::scene> scn = nullptr;
+    std::shared_ptr<ygl::texture_stream> textures = nullptr;
 
     // rendering params
     std::string filename = "scene.json"s;
     std::string imfilename = "out.obj"s;
-    int camid = 0;                             // camera index
-    int resolution = 512;                      // image resolution
-    int nsamples = 256;                        // number of samples
-    std::string tracer = "pathtrace"s;         // tracer name
-    ygl::trace_func tracef = ygl::trace_path;  // tracer
-    int nbounces = 4;                          // max depth
-    int seed = ygl::trace_default_seed;        // seed
-    float pixel_clamp = 100.0f;                // pixel clamping
-    int pratio = 8;                            // preview ratio
+    int camid = 0;                                   // camera index
+    int resolution = 512;                            // image resolution
+    int nsamples = 256;                              // number of samples
+    std::string tracer = "pathtrace"s;               // tracer name
+    ygl::trace_type tracef = ygl::trace_type::path;  // tracer
+    int nbounces = 4;                                // max depth
+    int seed = ygl::trace_default_seed;              // seed
+    float pixel_clamp = 100.0f;                      // pixel clamping
+    int pratio = 8;                                  // preview ratio
 
     // rendering state
     ygl::trace_async_state trace_state = {};
@@ -62,7 +63,9 @@ struct app_state {
     float gamma = 2.2f;
     bool filmic = false;
     ygl::vec4f background = {0.8f, 0.8f, 0.8f, 0};
-    uint gl_txt = 0;
+    ygl::image4f display = {};          // display image copy
+    uint gl_txt = 0;                    // display texture
+    ygl::vec2i gl_size = ygl::zero2i;  // display texture size
     uint gl_prog = 0, gl_vbo = 0, gl_ebo;
     bool widgets_open = false;
     ygl::scene_selection selection = {};
@@ -77,19 +80,21 @@ auto trace_names = std::vector<std::string>{"pathtrace", "direct",
     "direct_nomis", "debug_normal", "debug_albedo", "debug_texcoord",
     "debug_frontfacing", "debug_diffuse", "debug_specular", "debug_roughness"};
 
-auto tracer_names = std::unordered_map<std::string, ygl::trace_func>{
-    {"pathtrace", ygl::trace_path}, {"direct", ygl::trace_direct},
-    {"environment", ygl::trace_environment}, {"eyelight", ygl::trace_eyelight},
-    {"pathtrace-nomis", ygl::trace_path_nomis},
-    {"pathtrace-naive", ygl::trace_path_naive},
-    {"direct-nomis", ygl::trace_direct_nomis},
-    {"debug_normal", ygl::trace_debug_normal},
-    {"debug_albedo", ygl::trace_debug_albedo},
-    {"debug_texcoord", ygl::trace_debug_texcoord},
-    {"debug_frontfacing", ygl::trace_debug_frontfacing},
-    {"debug_diffuse", ygl::trace_debug_diffuse},
-    {"debug_specular", ygl::trace_debug_specular},
-    {"debug_roughness", ygl::trace_debug_roughness}};
+auto tracer_names = std::unordered_map<std::string, ygl::trace_type>{
+    {"pathtrace", ygl::trace_type::path},
+    {"direct", ygl::trace_type::direct},
+    {"environment", ygl::trace_type::environment},
+    {"eyelight", ygl::trace_type::eyelight},
+    {"pathtrace-nomis", ygl::trace_type::path_nomis},
+    {"pathtrace-naive", ygl::trace_type::path_naive},
+    {"direct-nomis", ygl::trace_type::direct_nomis},
+    {"debug_normal", ygl::trace_type::debug_normal},
+    {"debug_albedo", ygl::trace_type::debug_albedo},
+    {"debug_texcoord", ygl::trace_type::debug_texcoord},
+    {"debug_frontfacing", ygl::trace_type::debug_frontfacing},
+    {"debug_diffuse", ygl::trace_type::debug_diffuse},
+    {"debug_specular", ygl::trace_type::debug_specular},
+    {"debug_roughness", ygl::trace_type::debug_roughness}};
 
 void draw_widgets(GLFWwindow* win, app_state* app) {
     if (ygl::begin_widgets_frame(win, "yitrace", &app->widgets_open)) {
@@ -157,37 +162,102 @@ void draw_widgets(GLFWwindow* win, app_state* app) {
     ygl::end_widgets_frame();
 }
 
+// Uploads the display regions published by the renderer since the last
+// frame, merging the tiles in each row of tiles.
+void update_display_texture(app_state* app) {
+    auto regions =
+        ygl::trace_async_sync_display(app->trace_state, app->display);
+    if (regions.empty()) return;
+    if (!app->gl_txt) {
+        app->gl_txt = ygl::make_gltexture(app->display, false, false);
+        app->gl_size = app->display.size;
+        return;
+    }
+    if (app->gl_size != app->display.size) {
+        ygl::update_gltexture(app->gl_txt, app->display, app->gl_size, false);
+        app->gl_size = app->display.size;
+        return;
+    }
+    auto rows = std::unordered_map<int, std::pair<ygl::vec2i, ygl::vec2i>>();
+    for (auto& region : regions) {
+        auto it = rows.find(region.first.y);
+        if (it == rows.end()) {
+            rows[region.first.y] = region;
+        } else {
+            it->second.first.x = std::min(it->second.first.x, region.first.x);
+            it->second.second.x =
+                std::max(it->second.second.x, region.second.x);
+        }
+    }
+    for (auto& row : rows) {
+        ygl::update_gltexture_region(
+            app->gl_txt, app->display, row.second.first, row.second.second);
+    }
+}
+
 void draw(GLFWwindow* win) {
     auto app = (app_state*)glfwGetWindowUserPointer(win);
-    ygl::draw_glimage(win, app->trace_state.display, app->imframe,
+    update_display_texture(app);
+    ygl::draw_glimage(win, app->gl_txt, app->gl_size, app->imframe,
         app->zoom_to_fit, app->background);
     draw_widgets(win, app);
     glfwSwapBuffers(win);
 }
 
+// Refit the scene bvh after edits to a shape, if given, or to the shapes
+// of a subdiv. Compressed trees cannot be refit, so they are built again
+// with their original settings.
+void refit_edited_bvh(const std::shared_ptr<ygl::scene>& scn,
+    const std::shared_ptr<ygl::shape>& shp = nullptr) {
+    if (shp && shp->bvh->compressed_nodes.empty()) {
+        ygl::refit_bvh(shp);
+    } else if (shp) {
+        ygl::update_bvh(shp, shp->bvh->params);
+    }
+    if (scn->bvh->compressed_nodes.empty()) {
+        ygl::refit_bvh(scn, false);
+    } else {
+        ygl::update_bvh(scn, false, scn->bvh->params);
+    }
+}
+
 bool update(const std::shared_ptr<app_state>& app) {
     // exit if no updated
-    if (app->update_list.empty()) return false;
+    auto ntextures = ygl::get_texture_stream_ready(app->textures);
+    if (app->update_list.empty() && !ntextures) return false;
 
     // stop renderer
     ygl::trace_async_stop(app->trace_state);
 
+    // move streamed textures into the scene
+    if (ntextures) ygl::update_texture_stream(app->textures);
+
     // update BVH
     for (auto sel : app->update_list) {
         if (sel.as<ygl::shape>()) {
-            ygl::refit_bvh(sel.as<ygl::shape>());
-            ygl::refit_bvh(app->scn, false);
+            refit_edited_bvh(app->scn, sel.as<ygl::shape>());
         }
-        if (sel.as<ygl::instance>()) { ygl::refit_bvh(app->scn, false); }
+        if (sel.as<ygl::subdiv>()) {
+            sel.as<ygl::subdiv>()->dirty = true;
+            ygl::update_tesselation(app->scn);
+            for (auto ist : app->scn->instances) {
+                if (ist->sbd != sel.as<ygl::subdiv>()) continue;
+                ygl::update_bvh(ist->shp, (ist->shp->bvh) ?
+                                              ist->shp->bvh->params :
+                                              ygl::bvh_params());
+            }
+            refit_edited_bvh(app->scn);
+            ygl::update_lights(app->scn);
+        }
+        if (sel.as<ygl::instance>()) ygl::refit_bvh_instances(app->scn);
         if (sel.as<ygl::node>()) {
             ygl::update_transforms(app->scn, 0);
-            ygl::refit_bvh(app->scn, false);
+            ygl::refit_bvh_instances(app->scn);
         }
     }
     app->update_list.clear();
 
     app->tracef = tracer_names.at(app->tracer);
-    app->trace_state = {};
     app->trace_start = ygl::get_time();
     ygl::trace_async_start(app->trace_state, app->scn, app->camid,
         app->resolution, app->nsamples, app->tracef, app->exposure, app->gamma,
@@ -275,6 +345,7 @@ int main(int argc, char* argv[]) {
     auto add_skyenv = false;        // add sky environment
     auto pratio = 8;                // preview ratio
     auto quiet = false;             // quiet mode
+    auto stream_textures = false;   // load textures while rendering
 
     // parse command line
     CLI::App parser("progressive path tracing", "yitrace");
@@ -283,7 +354,7 @@ int main(int argc, char* argv[]) {
         "--resolution,-r", resolution, "Image vertical resolution.");
     parser.add_option("--nsamples,-s", nsamples, "Number of samples.");
     parser.add_option("--tracer,-t", tracer, "Trace type.")
-        ->check([](const std::string& s) -> std::string {
+        ->transform([](const std::string& s) -> std::string {
             if (tracer_names.find(s) == tracer_names.end())
                 throw CLI::ValidationError("unknown tracer name");
             return s;
@@ -295,6 +366,8 @@ int main(int argc, char* argv[]) {
         "--double-sided,-D", double_sided, "Double-sided rendering.");
     parser.add_flag("--add-skyenv,-E", add_skyenv, "add missing env map");
     parser.add_flag("--quiet,-q", quiet, "Print only errors messages");
+    parser.add_flag("--stream-textures", stream_textures,
+        "Load textures while rendering (skips OBJ/glTF alpha opacity).");
     parser.add_option(
         "--pration", pratio, "Preview ratio for async rendering.");
     parser.add_option("--output-image,-o", imfilename, "Image filename");
@@ -308,7 +381,7 @@ int main(int argc, char* argv[]) {
     if (!quiet) std::cout << "loading scene" << filename << "\n";
     auto load_start = ygl::get_time();
     try {
-        scn = ygl::load_scene(filename);
+        scn = ygl::load_scene(filename, !stream_textures);
     } catch (const std::exception& e) {
         std::cout << "cannot load scene " << filename << "\n";
         std::cout << "error: " << e.what() << "\n";
@@ -318,16 +391,26 @@ int main(int argc, char* argv[]) {
         std::cout << "loading in "
                   << ygl::format_duration(ygl::get_time() - load_start) << "\n";
 
-    // tesselate
-    if (!quiet) std::cout << "tesselating scene elements\n";
-    ygl::update_tesselation(scn);
+    // stream textures while rendering
+    auto textures = std::shared_ptr<ygl::texture_stream>();
+    if (stream_textures)
+        textures =
+            ygl::load_scene_textures_async(scn, ygl::get_dirname(filename));
+
+    // tesselate, unless loaded from a binary scene with prebuilt data
+    auto prebuilt = (bool)scn->bvh;
+    if (!prebuilt) {
+        if (!quiet) std::cout << "tesselating scene elements\n";
+        ygl::update_tesselation(scn);
+    }
 
     // update bbox and transforms
     ygl::update_transforms(scn);
-    ygl::update_bbox(scn);
+    ygl::update_bbox(scn, !prebuilt);
 
     // add components
     if (!quiet) std::cout << "adding scene elements\n";
+    auto nenvironments = scn->environments.size();
     if (add_skyenv && scn->environments.empty()) {
         scn->environments.push_back(ygl::make_sky_environment("sky"));
         scn->textures.push_back(scn->environments.back()->ke_txt);
@@ -340,16 +423,21 @@ int main(int argc, char* argv[]) {
     for (auto err : ygl::validate(scn)) std::cout << "warning: " << err << "\n";
 
     // build bvh
-    if (!quiet) std::cout << "building bvh\n";
     auto bvh_start = ygl::get_time();
-    ygl::update_bvh(scn);
+    if (!prebuilt) {
+        if (!quiet) std::cout << "building bvh\n";
+        ygl::update_bvh(scn);
+    } else {
+        if (!quiet) std::cout << "using prebuilt bvh\n";
+    }
     if (!quiet)
         std::cout << "building bvh in "
                   << ygl::format_duration(ygl::get_time() - bvh_start) << "\n";
 
     // init renderer
     if (!quiet) std::cout << "initializing lights\n";
-    ygl::update_lights(scn);
+    if (!prebuilt || scn->environments.size() != nenvironments)
+        ygl::update_lights(scn);
 
     // fix renderer type if no lights
     if (scn->lights.empty() && scn->environments.empty() &&
@@ -362,6 +450,7 @@ int main(int argc, char* argv[]) {
     // prepare application
     auto app = std::make_shared<app_state>();
     app->scn = scn;
+    app->textures = textures;
     app->filename = filename;
     app->imfilename = imfilename;
     app->camid = camid;
@@ -41,17 +41,57 @@ void mkdir(const std::string& dir) {
 #endif
 }
 
+auto bvh_names = std::unordered_map<std::string, ygl::bvh_build_type>{
+    {"median", ygl::bvh_build_type::median},
+    {"equalsize", ygl::bvh_build_type::equal_size},
+    {"sah", ygl::bvh_build_type::sah}};
+
+auto light_sampling_names =
+    std::unordered_map<std::string, ygl::light_sampling_type>{
+        {"uniform", ygl::light_sampling_type::uniform},
+        {"power", ygl::light_sampling_type::power},
+        {"tree", ygl::light_sampling_type::tree}};
+
 int main(int argc, char** argv) {
     // command line parameters
     auto filename = "scene.json"s;
     auto output = "output.json"s;
     auto notextures = false;
     auto uniform_txt = false;
+    auto bvh_type = "median"s;
+    auto bvh_prims = ygl::bvh_max_prims;
+    auto bvh_wide = false;
+    auto bvh_triangles = false;
+    auto bvh_compressed = false;
+    auto light_sampling = "uniform"s;
+    auto texture_mips = false;
 
     // command line params
     CLI::App parser("scene processing utility", "yscnproc");
     parser.add_flag("--notextures", notextures, "Disable textures.");
     parser.add_flag("--uniform-txt", uniform_txt, "uniform texture formats");
+    parser.add_option("--bvh", bvh_type, "Bvh build heuristic for ybin.")
+        ->transform([](const std::string& s) -> std::string {
+            if (bvh_names.find(s) == bvh_names.end())
+                throw CLI::ValidationError("unknown bvh build type");
+            return s;
+        });
+    parser.add_option(
+        "--bvh-prims", bvh_prims, "Maximum primitives per bvh leaf for ybin.");
+    parser.add_flag("--bvh-wide", bvh_wide, "Build wide bvh nodes for ybin.");
+    parser.add_flag("--bvh-triangles", bvh_triangles,
+        "Precompute triangles in bvh leaf order for ybin.");
+    parser.add_flag("--bvh-compressed", bvh_compressed,
+        "Build compressed bvh nodes for ybin.");
+    parser.add_option(
+        "--lights", light_sampling, "Light sampling type for ybin.")
+        ->transform([](const std::string& s) -> std::string {
+            if (light_sampling_names.find(s) == light_sampling_names.end())
+                throw CLI::ValidationError("unknown light sampling type");
+            return s;
+        });
+    parser.add_flag(
+        "--texture-mips", texture_mips, "Build texture mip levels for ybin.");
     parser.add_option("--output,-o", output, "output scene")->required(true);
     parser.add_option("scene", filename, "input scene")->required(true);
     try {
@@ -88,6 +128,25 @@ int main(int argc, char** argv) {
         }
     }
 
+    // process the scene for rendering when saving a binary cache
+    auto ext = ygl::get_extension(output);
+    if (ext == "ybin" || ext == "YBIN") {
+        if (texture_mips) ygl::update_texture_mips(scn);
+        ygl::update_tesselation(scn);
+        ygl::update_transforms(scn);
+        ygl::update_bbox(scn);
+        ygl::add_missing_names(scn);
+        auto params = ygl::bvh_params();
+        params.build_type = bvh_names.at(bvh_type);
+        params.max_prims = bvh_prims;
+        params.wide = bvh_wide;
+        params.triangles = bvh_triangles;
+        params.compressed = bvh_compressed;
+        ygl::update_bvh(scn, true, params);
+        ygl::update_lights(
+            scn, true, false, light_sampling_names.at(light_sampling));
+    }
+
     // make a directory if needed
     try {
         mkdir(ygl::get_dirname(output));
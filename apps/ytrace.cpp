@@ -27,23 +27,37 @@
 //
 
 #include "../yocto/ygl.h"
+#include "../yocto/json.hpp"
 #include "../yocto/yglio.h"
 #include "CLI11.hpp"
 using namespace std::literals;
 
-auto tracer_names = std::unordered_map<std::string, ygl::trace_func>{
-    {"pathtrace", ygl::trace_path}, {"direct", ygl::trace_direct},
-    {"environment", ygl::trace_environment}, {"eyelight", ygl::trace_eyelight},
-    {"pathtrace-nomis", ygl::trace_path_nomis},
-    {"pathtrace-naive", ygl::trace_path_naive},
-    {"direct-nomis", ygl::trace_direct_nomis},
-    {"debug_normal", ygl::trace_debug_normal},
-    {"debug_albedo", ygl::trace_debug_albedo},
-    {"debug_texcoord", ygl::trace_debug_texcoord},
-    {"debug_frontfacing", ygl::trace_debug_frontfacing},
-    {"debug_diffuse", ygl::trace_debug_diffuse},
-    {"debug_specular", ygl::trace_debug_specular},
-    {"debug_roughness", ygl::trace_debug_roughness}};
+auto tracer_names = std::unordered_map<std::string, ygl::trace_type>{
+    {"pathtrace", ygl::trace_type::path},
+    {"direct", ygl::trace_type::direct},
+    {"environment", ygl::trace_type::environment},
+    {"eyelight", ygl::trace_type::eyelight},
+    {"pathtrace-nomis", ygl::trace_type::path_nomis},
+    {"pathtrace-naive", ygl::trace_type::path_naive},
+    {"direct-nomis", ygl::trace_type::direct_nomis},
+    {"debug_normal", ygl::trace_type::debug_normal},
+    {"debug_albedo", ygl::trace_type::debug_albedo},
+    {"debug_texcoord", ygl::trace_type::debug_texcoord},
+    {"debug_frontfacing", ygl::trace_type::debug_frontfacing},
+    {"debug_diffuse", ygl::trace_type::debug_diffuse},
+    {"debug_specular", ygl::trace_type::debug_specular},
+    {"debug_roughness", ygl::trace_type::debug_roughness}};
+
+auto bvh_names = std::unordered_map<std::string, ygl::bvh_build_type>{
+    {"median", ygl::bvh_build_type::median},
+    {"equalsize", ygl::bvh_build_type::equal_size},
+    {"sah", ygl::bvh_build_type::sah}};
+
+auto light_sampling_names =
+    std::unordered_map<std::string, ygl::light_sampling_type>{
+        {"uniform", ygl::light_sampling_type::uniform},
+        {"power", ygl::light_sampling_type::power},
+        {"tree", ygl::light_sampling_type::tree}};
 
 int main(int argc, char* argv[]) {
     // command line parameters
@@ -54,10 +68,21 @@ int main(int argc, char* argv[]) {
     auto nsamples = 256;                  // image samples
     auto tracer = "pathtrace"s;           // tracer algorithm
     auto nbounces = 4;                    // number of bounces
+    auto bvh_type = "median"s;            // bvh build heuristic
+    auto bvh_prims = ygl::bvh_max_prims;  // bvh leaf size
+    auto bvh_wide = false;                // wide bvh traversal
+    auto bvh_triangles = false;           // precomputed bvh triangles
+    auto bvh_compressed = false;          // compressed bvh nodes
+    auto light_sampling = "uniform"s;     // light sampling
+    auto texture_mips = false;            // texture mip levels
+    auto texture_cache = 0;               // texture cache budget in MB
+    auto texture_compact = false;         // compact texture texels
     auto pixel_clamp = 100.0f;            // pixel clamping
     auto noparallel = false;              // disable parallel
+    auto nthreads = 0;                    // number of threads
     auto seed = ygl::trace_default_seed;  // random seed
     auto nbatch = 16;                     // batch size
+    auto adaptive_threshold = 0.0f;       // adaptive sampling threshold
     auto save_batch = false;              // whether to save bacthes
     auto exposure = 0.0f;                 // exposure
     auto gamma = 2.2;                     // gamma
@@ -65,6 +90,13 @@ int main(int argc, char* argv[]) {
     auto double_sided = false;            // double sided
     auto add_skyenv = false;              // add environment
     auto quiet = false;                   // quiet mode
+    auto stats = false;                   // print stats as json
+    auto region = std::vector<int>();     // render region
+    auto sample_start = 0;                // first sample of the range
+    auto raw = false;                     // save raw accumulation
+    auto denoise = false;                 // denoise the image
+    auto save_aovs = false;               // save albedo, normal and depth
+    auto wavefront = false;               // wavefront path tracing
 
     // parse command line
     CLI::App parser("Offline path tracing", "ytrace");
@@ -73,34 +105,88 @@ int main(int argc, char* argv[]) {
         "--resolution,-r", resolution, "Image vertical resolution.");
     parser.add_option("--nsamples,-s", nsamples, "Number of samples.");
     parser.add_option("--tracer,-t", tracer, "Trace type.")
-        ->check([](const std::string& s) -> std::string {
+        ->transform([](const std::string& s) -> std::string {
             if (tracer_names.find(s) == tracer_names.end())
                 throw CLI::ValidationError("unknown tracer name");
             return s;
         });
     parser.add_option("--nbounces", nbounces, "Maximum number of bounces.");
+    parser.add_option("--bvh", bvh_type, "Bvh build heuristic.")
+        ->transform([](const std::string& s) -> std::string {
+            if (bvh_names.find(s) == bvh_names.end())
+                throw CLI::ValidationError("unknown bvh build type");
+            return s;
+        });
+    parser.add_option(
+        "--bvh-prims", bvh_prims, "Maximum primitives per bvh leaf.");
+    parser.add_flag("--bvh-wide", bvh_wide, "Use wide bvh nodes for tracing.");
+    parser.add_flag("--bvh-triangles", bvh_triangles,
+        "Precompute triangles in bvh leaf order.");
+    parser.add_flag("--bvh-compressed", bvh_compressed,
+        "Use compressed bvh nodes to save memory.");
+    parser.add_option("--lights", light_sampling, "Light sampling type.")
+        ->transform([](const std::string& s) -> std::string {
+            if (light_sampling_names.find(s) == light_sampling_names.end())
+                throw CLI::ValidationError("unknown light sampling type");
+            return s;
+        });
+    parser.add_flag("--texture-mips", texture_mips,
+        "Filter textures with mip levels and ray cones.");
+    parser.add_option("--texture-cache", texture_cache,
+        "Page textures in a cache of this many MB (0 to load all).");
+    parser.add_flag("--texture-compact", texture_compact,
+        "Store textures with 8-bit or half float texels.");
     parser.add_option("--pixel-clamp", pixel_clamp, "Final pixel clamping.");
     parser.add_flag("--noparallel", noparallel, "Disable parallel execution.");
+    parser.add_option(
+        "--nthreads", nthreads, "Number of threads (0 for all hardware).");
     parser.add_option("--seed", seed, "Seed for the random number generators.");
     parser.add_option("--nbatch", nbatch, "Sample batch size.");
+    parser.add_option("--adaptive-threshold", adaptive_threshold,
+        "Relative error below which pixels stop sampling (0 to disable).");
     parser.add_flag("--save-batch", save_batch, "Save images progressively");
     parser.add_option("--exposure,-e", exposure, "Hdr exposure");
     parser.add_flag(
         "--double-sided,-D", double_sided, "Double-sided rendering.");
     parser.add_flag("--add-skyenv,-E", add_skyenv, "add missing env map");
     parser.add_flag("--quiet,-q", quiet, "Print only errors messages");
+    parser.add_flag("--stats", stats, "Print rendering stats as json");
+    parser
+        .add_option("--region", region,
+            "Render the pixels in [xmin, xmax) x [ymin, ymax), given as xmin "
+            "ymin xmax ymax, saving a raw accumulation.")
+        ->expected(4);
+    parser.add_option("--sample-start", sample_start,
+        "Render the samples from this one on, saving a raw accumulation.");
+    parser.add_flag("--raw", raw,
+        "Save a raw accumulation EXR to merge with yimproc --merge. Samples "
+        "use per-sample random streams, so the merged image differs from a "
+        "plain render by noise.");
+    parser.add_flag("--denoise", denoise,
+        "Denoise the image guided by first-hit albedo, normal and depth.");
+    parser.add_flag("--aovs", save_aovs,
+        "Save first-hit albedo, normal, depth and emission EXRs next to the "
+        "image.");
+    parser.add_flag("--wavefront", wavefront,
+        "Path trace tiles as a wavefront of sorted ray queues.");
     parser.add_option("--output-image,-o", imfilename, "Image filename");
     parser.add_option("scene", filename, "Scene filename")->required(true);
     try {
         parser.parse(argc, argv);
     } catch (const CLI::ParseError& e) { return parser.exit(e); }
+    if (wavefront && (tracer != "pathtrace" || adaptive_threshold > 0 ||
+                         denoise || save_aovs)) {
+        std::cout << "wavefront rendering supports only the path tracer "
+                     "without adaptive sampling and aovs\n";
+        exit(1);
+    }
 
     // scene loading
     auto scn = std::shared_ptr<ygl::scene>();
     if (!quiet) std::cout << "loading scene" << filename << "\n";
     auto load_start = ygl::get_time();
     try {
-        scn = ygl::load_scene(filename);
+        scn = ygl::load_scene(filename, !texture_cache && !texture_compact);
     } catch (const std::exception& e) {
         std::cout << "cannot load scene " << filename << "\n";
         std::cout << "error: " << e.what() << "\n";
@@ -110,16 +196,33 @@ int main(int argc, char* argv[]) {
         std::cout << "loading in "
                   << ygl::format_duration(ygl::get_time() - load_start) << "\n";
 
-    // tesselate
-    if (!quiet) std::cout << "tesselating scene elements\n";
-    ygl::update_tesselation(scn);
+    // textures
+    auto txt_cache = std::shared_ptr<ygl::texture_cache>();
+    if (texture_cache) {
+        txt_cache = ygl::add_texture_cache(scn, ygl::get_dirname(filename),
+            (size_t)texture_cache * 1024 * 1024);
+    } else if (texture_compact) {
+        ygl::load_scene_textures(scn, ygl::get_dirname(filename), true, true);
+    }
+    if (texture_mips) ygl::update_texture_mips(scn);
+    auto load_time = ygl::get_time() - load_start;
+
+    // tesselate, unless loaded from a binary scene with prebuilt data
+    auto prebuilt = (bool)scn->bvh;
+    auto tesselate_start = ygl::get_time();
+    if (!prebuilt) {
+        if (!quiet) std::cout << "tesselating scene elements\n";
+        ygl::update_tesselation(scn);
+    }
+    auto tesselate_time = ygl::get_time() - tesselate_start;
 
     // update bbox and transforms
     ygl::update_transforms(scn);
-    ygl::update_bbox(scn);
+    ygl::update_bbox(scn, !prebuilt);
 
     // add components
     if (!quiet) std::cout << "adding scene elements\n";
+    auto nenvironments = scn->environments.size();
     if (add_skyenv && scn->environments.empty()) {
         scn->environments.push_back(ygl::make_sky_environment("sky"));
         scn->textures.push_back(scn->environments.back()->ke_txt);
@@ -131,22 +234,101 @@ int main(int argc, char* argv[]) {
     ygl::add_missing_names(scn);
     for (auto err : ygl::validate(scn)) std::cout << "warning: " << err << "\n";
 
-    // build bvh
-    if (!quiet) std::cout << "building bvh\n";
+    // build bvh, reusing a prebuilt one only if built with the same settings
+    auto params = ygl::bvh_params();
+    params.build_type = bvh_names.at(bvh_type);
+    params.max_prims = bvh_prims;
+    params.noparallel = noparallel;
+    params.wide = bvh_wide;
+    params.triangles = bvh_triangles;
+    params.compressed = bvh_compressed;
+    auto same_params = [&params](const std::shared_ptr<ygl::bvh_tree>& bvh) {
+        return bvh && bvh->params.build_type == params.build_type &&
+               bvh->params.max_prims == params.max_prims &&
+               bvh->params.wide == params.wide &&
+               bvh->params.triangles == params.triangles &&
+               bvh->params.compressed == params.compressed;
+    };
+    auto reuse_bvh = prebuilt && same_params(scn->bvh);
+    for (auto shp : scn->shapes) {
+        if (!reuse_bvh) break;
+        if (!same_params(shp->bvh)) reuse_bvh = false;
+    }
     auto bvh_start = ygl::get_time();
-    ygl::update_bvh(scn);
-    if (!quiet)
-        std::cout << "building bvh in "
-                  << ygl::format_duration(ygl::get_time() - bvh_start) << "\n";
+    if (!reuse_bvh) {
+        if (!quiet && prebuilt)
+            std::cout << "replacing prebuilt bvh built with other settings\n";
+        if (!quiet) std::cout << "building bvh\n";
+        scn->bvh = nullptr;
+        for (auto shp : scn->shapes) shp->bvh = nullptr;
+        ygl::update_bvh(scn, true, params);
+    } else {
+        if (!quiet) std::cout << "using prebuilt bvh\n";
+    }
+    auto bvh_time = ygl::get_time() - bvh_start;
+    if (!quiet) {
+        std::cout << "building bvh in " << ygl::format_duration(bvh_time)
+                  << "\n";
+        auto bvh_memory = ygl::get_bvh_memory(scn);
+        std::cout << "bvh memory: " << bvh_memory.first / (1024.0 * 1024.0)
+                  << " MB nodes, " << bvh_memory.second / (1024.0 * 1024.0)
+                  << " MB triangles\n";
+        auto bvh_savings = ygl::get_bvh_compressed_savings(scn);
+        if (bvh_savings)
+            std::cout << "bvh compression saved "
+                      << bvh_savings / (1024.0 * 1024.0) << " MB\n";
+    }
 
     // init renderer
     if (!quiet) std::cout << "initializing lights\n";
-    ygl::update_lights(scn);
+    auto lights_start = ygl::get_time();
+    if (!prebuilt || scn->environments.size() != nenvironments ||
+        scn->light_sampling != light_sampling_names.at(light_sampling)) {
+        ygl::update_lights(
+            scn, true, false, light_sampling_names.at(light_sampling));
+    }
+    auto lights_time = ygl::get_time() - lights_start;
 
     // initialize rendering objects
     if (!quiet) std::cout << "initializing tracer data\n";
     auto tracef = tracer_names.at(tracer);
     auto st = ygl::trace_state();
+    auto rscn = ygl::make_render_scene(scn);
+
+    // render a region or sample range, to be merged with others
+    if (raw || !region.empty() || sample_start) {
+        if (ygl::get_extension(imfilename) != "exr") {
+            std::cout << "raw accumulations are saved as exr\n";
+            exit(1);
+        }
+        auto region_min = ygl::zero2i;
+        auto region_max = ygl::vec2i{std::numeric_limits<int>::max(),
+            std::numeric_limits<int>::max()};
+        if (!region.empty()) {
+            region_min = {region[0], region[1]};
+            region_max = {region[2], region[3]};
+        }
+        if (!quiet)
+            std::cout << "rendering samples " << sample_start << "-"
+                      << sample_start + nsamples << "\n";
+        auto render_start = ygl::get_time();
+        auto acc = ygl::trace_accumulation();
+        try {
+            acc = ygl::trace_accumulate(rscn, camid, resolution, region_min,
+                region_max, sample_start, sample_start + nsamples, tracef,
+                nbounces, pixel_clamp, noparallel, seed, nthreads);
+        } catch (const std::exception& e) {
+            std::cout << "error: " << e.what() << "\n";
+            exit(1);
+        }
+        if (!quiet)
+            std::cout << "rendering in "
+                      << ygl::format_duration(ygl::get_time() - render_start)
+                      << "\n";
+        if (!quiet) std::cout << "saving accumulation " << imfilename << "\n";
+        ygl::save_trace_accumulation(imfilename, acc);
+        return 0;
+    }
 
     // render
     if (!quiet) std::cout << "rendering image\n";
@@ -157,8 +339,15 @@ int main(int argc, char* argv[]) {
             std::cout << "rendering sample " << st.sample << "/" << nsamples
                       << "\n";
         auto block_start = ygl::get_time();
-        done = ygl::trace_samples(st, scn, camid, resolution, nsamples, tracef,
-            nbatch, nbounces, pixel_clamp, noparallel, seed);
+        if (wavefront) {
+            done = ygl::trace_samples_wavefront(st, rscn, camid, resolution,
+                nsamples, nbatch, nbounces, pixel_clamp, noparallel, seed,
+                nthreads);
+        } else {
+            done = ygl::trace_samples(st, rscn, camid, resolution, nsamples,
+                tracef, nbatch, nbounces, pixel_clamp, noparallel, seed,
+                nthreads, adaptive_threshold, denoise || save_aovs);
+        }
         if (!quiet)
             std::cout << "rendering block in "
                       << ygl::format_duration(ygl::get_time() - block_start)
@@ -176,17 +365,74 @@ int main(int argc, char* argv[]) {
             }
         }
     }
+    auto render_time = ygl::get_time() - render_start;
     if (!quiet)
-        std::cout << "rendering image in "
-                  << ygl::format_duration(ygl::get_time() - render_start)
+        std::cout << "rendering image in " << ygl::format_duration(render_time)
                   << "\n";
 
-    // stata
+    // stats
+    auto trace_stats = ygl::get_trace_stats();
     if (!quiet) {
-        std::cout << "using " << ygl::format_num(ygl::get_trace_stats().first)
-                  << " rays in "
-                  << ygl::format_num(ygl::get_trace_stats().second)
+        std::cout << "using " << ygl::format_num(trace_stats.nrays)
+                  << " rays in " << ygl::format_num(trace_stats.npaths)
                   << " paths\n";
+        std::cout << "using " << ygl::format_num(st.samples_spent)
+                  << " samples, "
+                  << (double)st.samples_spent / (st.img.size.x * st.img.size.y)
+                  << " per pixel\n";
+        if (txt_cache)
+            std::cout << "texture cache: " << txt_cache->loads << " loads, "
+                      << txt_cache->memory / (1024.0 * 1024.0)
+                      << " MB resident\n";
+    }
+
+    if (stats) {
+        auto seconds = [](int64_t duration) { return duration / 1.0e9; };
+        auto js = nlohmann::json::object();
+        js["scene"] = filename;
+        js["tracer"] = tracer;
+        js["resolution"] = {st.img.size.x, st.img.size.y};
+        js["samples"] = st.samples_spent;
+        js["threads"] = (noparallel) ? 1 :
+                        (nthreads) ? nthreads :
+                                     (int)std::thread::hardware_concurrency();
+        js["timings"] = {{"load", seconds(load_time)},
+            {"tesselate", seconds(tesselate_time)},
+            {"bvh", seconds(bvh_time)}, {"lights", seconds(lights_time)},
+            {"render", seconds(render_time)}};
+        js["paths"] = trace_stats.npaths;
+        js["rays"] = trace_stats.nrays;
+        js["shadow_rays"] = trace_stats.nshadow_rays;
+        js["bounce_rays"] = trace_stats.nrays - trace_stats.nshadow_rays;
+        js["bvh_nodes"] = trace_stats.nbvh_nodes;
+        js["bvh_prims"] = trace_stats.nbvh_prims;
+        js["rays_per_second"] =
+            (render_time) ? trace_stats.nrays / seconds(render_time) : 0.0;
+        std::cout << js.dump(4) << "\n";
+    }
+
+    // denoise
+    if (denoise) {
+        if (!quiet) std::cout << "denoising image\n";
+        auto denoise_start = ygl::get_time();
+        st.img = ygl::denoise_trace_image(st);
+        if (!quiet)
+            std::cout << "denoising in "
+                      << ygl::format_duration(ygl::get_time() - denoise_start)
+                      << "\n";
+    }
+
+    // save aovs
+    if (save_aovs) {
+        auto aovs = std::vector<std::pair<std::string, ygl::image4f*>>{
+            {"albedo", &st.albedo}, {"normal", &st.normal},
+            {"depth", &st.depth}, {"emission", &st.emission}};
+        for (auto& aov : aovs) {
+            auto filename =
+                ygl::replace_extension(imfilename, aov.first + ".exr");
+            if (!quiet) std::cout << "saving aov " << filename << "\n";
+            ygl::save_image(filename, *aov.second);
+        }
     }
 
     // save image
@@ -69,6 +69,7 @@ struct app_state {
 void draw_glscene(const std::shared_ptr<ygl::scene>& scn, int camid, uint prog,
     const ygl::vec2i& viewport_size, const std::shared_ptr<void>& highlighted,
     bool eyelight, bool wireframe, bool edges, float exposure, float gamma);
+void update_glshape(const std::shared_ptr<ygl::shape>& shp);
 
 // draw with shading
 void draw(GLFWwindow* win) {
@@ -86,8 +87,12 @@ void draw(GLFWwindow* win) {
             std::cout << "texture update not supported\n";
         }
         if (sel.as<ygl::subdiv>()) {
-            // TODO: update subdiv
-            std::cout << "texture update not supported\n";
+            sel.as<ygl::subdiv>()->dirty = true;
+            ygl::update_tesselation(app->scn);
+            ygl::update_bbox(app->scn);
+            for (auto ist : app->scn->instances) {
+                if (ist->sbd == sel.as<ygl::subdiv>()) update_glshape(ist->shp);
+            }
         }
         if (sel.as<ygl::shape>()) {
             // TODO: update shape
@@ -96,6 +101,7 @@ void draw(GLFWwindow* win) {
         if (sel.as<ygl::node>() || sel.as<ygl::animation>() ||
             app->time != last_time) {
             ygl::update_transforms(app->scn, app->time, app->anim_group);
+            ygl::update_bbox(app->scn, false);
             last_time = app->time;
         }
         if (sel.as<ygl::shape>() || sel.as<ygl::material>() ||
@@ -171,8 +177,8 @@ static const char* vertex =
         layout(location = 2) in vec2 vert_texcoord;       // vertex texcoords
         layout(location = 3) in vec4 vert_color;          // vertex color
         layout(location = 4) in vec4 vert_tangsp;         // vertex tangent space
+        layout(location = 5) in mat4 inst_xform;          // instance transform (per instance)
 
-        uniform mat4 shape_xform;           // shape transform
         uniform float shape_normal_offset;           // shape normal offset
 
         uniform mat4 cam_xform;          // camera xform
@@ -198,9 +204,9 @@ static const char* vertex =
             }
 
             // world projection
-            pos = (shape_xform * vec4(pos,1)).xyz;
-            norm = (shape_xform * vec4(norm,0)).xyz;
-            tangsp.xyz = (shape_xform * vec4(tangsp.xyz,0)).xyz;
+            pos = (inst_xform * vec4(pos,1)).xyz;
+            norm = (inst_xform * vec4(norm,0)).xyz;
+            tangsp.xyz = (inst_xform * vec4(tangsp.xyz,0)).xyz;
 
             // copy other vertex properties
             texcoord = vert_texcoord;
@@ -467,13 +473,8 @@ static const char* fragment =
 #pragma GCC diagnostic pop
 #endif
 
-// Draw a shape
-void draw_glshape(const std::shared_ptr<ygl::shape>& shp,
-    const std::shared_ptr<ygl::material>& mat, const ygl::mat4f& xform,
-    bool highlighted, uint prog, bool eyelight, bool edges) {
-    ygl::set_gluniform(prog, "shape_xform", xform);
-    ygl::set_gluniform(prog, "shape_normal_offset", 0.0f);
-
+// Binds the material state
+void set_glmaterial(const std::shared_ptr<ygl::material>& mat, uint prog) {
     auto uniform_texture = [](auto& prog, const char* name, const char* name_on,
                                const std::shared_ptr<ygl::texture>& txt,
                                int unit) {
@@ -501,7 +502,13 @@ void draw_glshape(const std::shared_ptr<ygl::shape>& shp,
     uniform_texture(prog, "mat_rs_txt", "mat_rs_txt_on", mat->rs_txt, 3);
     uniform_texture(prog, "mat_op_txt", "mat_op_txt_on", mat->op_txt, 4);
     uniform_texture(prog, "mat_norm_txt", "mat_norm_txt_on", mat->norm_txt, 5);
+}
 
+// Draw `ninstances` instances of a shape, whose transforms are stored
+// in `gl_xforms` starting at `first`.
+void draw_glshape(const std::shared_ptr<ygl::shape>& shp, uint gl_xforms,
+    int first, int ninstances, uint prog, bool edges) {
+    ygl::set_gluniform(prog, "shape_normal_offset", 0.0f);
     ygl::set_gluniform(prog, "elem_faceted", (int)shp->norm.empty());
     ygl::set_glvertattrib(prog, "vert_pos", shp->gl_pos, ygl::zero3f);
     ygl::set_glvertattrib(prog, "vert_norm", shp->gl_norm, ygl::zero3f);
@@ -510,42 +517,65 @@ void draw_glshape(const std::shared_ptr<ygl::shape>& shp,
         prog, "vert_color", shp->gl_color, ygl::vec4f{1, 1, 1, 1});
     ygl::set_glvertattrib(
         prog, "vert_tangsp", shp->gl_norm, ygl::vec4f{0, 0, 1, 1});
+    ygl::set_glvertattrib_instanced(prog, "inst_xform", gl_xforms, first);
 
     if (!shp->points.empty()) {
         ygl::set_gluniform(prog, "elem_type", 1);
-        ygl::draw_glpoints(shp->gl_points, shp->points.size());
+        ygl::draw_glpoints_instanced(
+            shp->gl_points, shp->points.size(), ninstances);
     }
     if (!shp->lines.empty()) {
         ygl::set_gluniform(prog, "elem_type", 2);
-        ygl::draw_gllines(shp->gl_lines, shp->lines.size());
+        ygl::draw_gllines_instanced(
+            shp->gl_lines, shp->lines.size(), ninstances);
     }
     if (!shp->triangles.empty()) {
         ygl::set_gluniform(prog, "elem_type", 3);
-        ygl::draw_gltriangles(shp->gl_triangles, shp->triangles.size());
+        ygl::draw_gltriangles_instanced(
+            shp->gl_triangles, shp->triangles.size(), ninstances);
     }
 
-#if 0
-    if ((shp->gl_edges && edges && !wireframe) || highlighted) {
-        ygl::enable_glculling(false);
-        check_glerror();
-        glUniform1i(glGetUniformLocation(prog, "mtype"), 0);
-        glUniform3f(glGetUniformLocation(prog, "ke"), 0, 0, 0);
-        glUniform1f(glGetUniformLocation(prog, "op"), mat->op);
-        glUniform1f(glGetUniformLocation(prog, "shp_normal_offset"), 0.01f);
-        check_glerror();
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, shp->gl_edges);
-        glDrawElements(GL_LINES, shp->triangles.size() * 3, GL_UNSIGNED_INT, nullptr);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-        check_glerror();
-    }
-#endif
     if (edges) std::cout << "edges are momentarily disabled\n";
 
     ygl::check_glerror();
+    ygl::clear_glvertattrib_instanced(prog, "inst_xform");
     for (int i = 0; i < 16; i++) { glDisableVertexAttribArray(i); }
     ygl::check_glerror();
 }
 
+// View frustum planes, with points inside at non-negative distance. Side
+// planes come from the view-projection matrix, the near and far planes
+// from the camera since the infinite projection has no far plane.
+std::vector<ygl::vec4f> make_glfrustum(
+    const std::shared_ptr<ygl::camera>& cam, const ygl::mat4f& view_proj) {
+    auto rows = transpose(view_proj);
+    auto planes = std::vector<ygl::vec4f>{rows.w + rows.x, rows.w - rows.x,
+        rows.w + rows.y, rows.w - rows.y};
+    auto dir = -cam->frame.z;
+    planes.push_back(
+        {dir.x, dir.y, dir.z, -dot(dir, cam->frame.o) - cam->near});
+    if (cam->far < ygl::flt_max) {
+        planes.push_back(
+            {-dir.x, -dir.y, -dir.z, dot(dir, cam->frame.o) + cam->far});
+    }
+    return planes;
+}
+
+// Checks whether a bounding box is outside the view frustum.
+bool cull_glbbox(
+    const std::vector<ygl::vec4f>& planes, const ygl::bbox3f& bbox) {
+    if (bbox.min.x > bbox.max.x) return true;
+    for (auto& plane : planes) {
+        // test the corner farthest along the plane normal
+        auto p = ygl::vec3f{(plane.x > 0) ? bbox.max.x : bbox.min.x,
+            (plane.y > 0) ? bbox.max.y : bbox.min.y,
+            (plane.z > 0) ? bbox.max.z : bbox.min.z};
+        if (plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w < 0)
+            return true;
+    }
+    return false;
+}
+
 // Display a scene
 void draw_glscene(const std::shared_ptr<ygl::scene>& scn, int camid, uint prog,
     const ygl::vec2i& viewport_size, const std::shared_ptr<void>& highlighted,
@@ -610,12 +640,44 @@ void draw_glscene(const std::shared_ptr<ygl::scene>& scn, int camid, uint prog,
         ygl::check_glerror();
     }
 
-    if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    // cull instances and sort them by material and shape, so that each
+    // shape is drawn once per material with all its instances
+    auto frustum = make_glfrustum(cam, camera_proj * camera_view);
+    auto instances = std::vector<ygl::instance*>();
     for (auto ist : scn->instances) {
-        draw_glshape(ist->shp, ist->mat, frame_to_mat(ist->frame),
-            ist == highlighted || ist->shp == highlighted ||
-                ist->mat == highlighted,
-            prog, eyelight, edges);
+        if (!cull_glbbox(frustum, ist->bbox)) instances.push_back(ist.get());
+    }
+    std::sort(instances.begin(), instances.end(), [](auto a, auto b) {
+        if (a->mat != b->mat) return a->mat < b->mat;
+        return a->shp < b->shp;
+    });
+
+    // upload the instance transforms, growing the buffer as needed
+    static auto gl_xforms = (uint)0;
+    static auto gl_xforms_size = (size_t)0;
+    auto xforms = std::vector<ygl::mat4f>();
+    xforms.reserve(instances.size());
+    for (auto ist : instances) xforms.push_back(frame_to_mat(ist->frame));
+    if (xforms.size() > gl_xforms_size) {
+        ygl::clear_glbuffer(gl_xforms);
+        gl_xforms = ygl::make_glbuffer(xforms, false, true);
+        gl_xforms_size = xforms.size();
+    } else if (!xforms.empty()) {
+        ygl::update_glbuffer(gl_xforms, xforms, false);
+    }
+
+    if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    auto last_mat = (ygl::material*)nullptr;
+    for (auto first = 0; first < instances.size();) {
+        auto ist = instances[first];
+        auto last = first + 1;
+        while (last < instances.size() && instances[last]->mat == ist->mat &&
+               instances[last]->shp == ist->shp)
+            last++;
+        if (ist->mat.get() != last_mat) set_glmaterial(ist->mat, prog);
+        last_mat = ist->mat.get();
+        draw_glshape(ist->shp, gl_xforms, first, last - first, prog, edges);
+        first = last;
     }
 
     ygl::check_glerror();
@@ -626,30 +688,37 @@ void draw_glscene(const std::shared_ptr<ygl::scene>& scn, int camid, uint prog,
     if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
 
+// (re)creates the vbos of a shape
+void update_glshape(const std::shared_ptr<ygl::shape>& shp) {
+    for (auto bid : {&shp->gl_pos, &shp->gl_norm, &shp->gl_texcoord,
+             &shp->gl_color, &shp->gl_tangsp, &shp->gl_points, &shp->gl_lines,
+             &shp->gl_triangles})
+        ygl::clear_glbuffer(*bid);
+    if (!shp->pos.empty())
+        shp->gl_pos = ygl::make_glbuffer(shp->pos, false);
+    if (!shp->norm.empty())
+        shp->gl_norm = ygl::make_glbuffer(shp->norm, false);
+    if (!shp->texcoord.empty())
+        shp->gl_texcoord = ygl::make_glbuffer(shp->texcoord, false);
+    if (!shp->color.empty())
+        shp->gl_color = ygl::make_glbuffer(shp->color, false);
+    if (!shp->tangsp.empty())
+        shp->gl_tangsp = ygl::make_glbuffer(shp->tangsp, false);
+    if (!shp->points.empty())
+        shp->gl_points = ygl::make_glbuffer(shp->points, true);
+    if (!shp->lines.empty())
+        shp->gl_lines = ygl::make_glbuffer(shp->lines, true);
+    if (!shp->triangles.empty())
+        shp->gl_triangles = ygl::make_glbuffer(shp->triangles, true);
+}
+
 void init_drawscene(GLFWwindow* win) {
     auto app = (app_state*)glfwGetWindowUserPointer(win);
     // load textures and vbos
     app->gl_prog = ygl::make_glprogram(vertex, fragment);
     for (auto& txt : app->scn->textures)
         txt->gl_txt = ygl::make_gltexture(txt->img, true, true);
-    for (auto& shp : app->scn->shapes) {
-        if (!shp->pos.empty())
-            shp->gl_pos = ygl::make_glbuffer(shp->pos, false);
-        if (!shp->norm.empty())
-            shp->gl_norm = ygl::make_glbuffer(shp->norm, false);
-        if (!shp->texcoord.empty())
-            shp->gl_texcoord = ygl::make_glbuffer(shp->texcoord, false);
-        if (!shp->color.empty())
-            shp->gl_color = ygl::make_glbuffer(shp->color, false);
-        if (!shp->tangsp.empty())
-            shp->gl_tangsp = ygl::make_glbuffer(shp->tangsp, false);
-        if (!shp->points.empty())
-            shp->gl_points = ygl::make_glbuffer(shp->points, true);
-        if (!shp->lines.empty())
-            shp->gl_lines = ygl::make_glbuffer(shp->lines, true);
-        if (!shp->triangles.empty())
-            shp->gl_triangles = ygl::make_glbuffer(shp->triangles, true);
-    }
+    for (auto& shp : app->scn->shapes) update_glshape(shp);
 }
 
 // run ui loop
@@ -54,6 +54,14 @@
 
 #include <atomic>
 
+// SSE is used to test the children of wide BVH nodes at once.
+#if !defined(YGL_SSE) && (defined(__SSE2__) || defined(_M_X64))
+#define YGL_SSE 1
+#endif
+#if YGL_SSE
+#include <xmmintrin.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR PERLIN NOISE
 // -----------------------------------------------------------------------------
@@ -404,56 +412,81 @@ std::pair<std::vector<vec3f>, std::vector<vec3f>> compute_matrix_skinning(
 // Initialize an edge map with elements.
 edge_map make_edge_map(const std::vector<vec3i>& triangles) {
     auto emap = edge_map{};
+    reserve_edges(emap, (int)triangles.size() * 3 / 2 + 3);
+    emap.element_edges.reserve(triangles.size());
     for (auto& t : triangles) {
-        insert_edge(emap, {t.x, t.y});
-        insert_edge(emap, {t.y, t.z});
-        insert_edge(emap, {t.z, t.x});
+        emap.element_edges.push_back({insert_edge(emap, {t.x, t.y}),
+            insert_edge(emap, {t.y, t.z}), insert_edge(emap, {t.z, t.x}), -1});
     }
     return emap;
 }
 edge_map make_edge_map(const std::vector<vec4i>& quads) {
     auto emap = edge_map{};
+    reserve_edges(emap, (int)quads.size() * 2 + 4);
+    emap.element_edges.reserve(quads.size());
     for (auto& q : quads) {
-        insert_edge(emap, {q.x, q.y});
-        insert_edge(emap, {q.y, q.z});
-        if (q.z != q.w) insert_edge(emap, {q.z, q.w});
-        insert_edge(emap, {q.w, q.x});
+        auto x = insert_edge(emap, {q.x, q.y});
+        auto y = insert_edge(emap, {q.y, q.z});
+        auto z = (q.z != q.w) ? insert_edge(emap, {q.z, q.w}) : -1;
+        auto w = insert_edge(emap, {q.w, q.x});
+        emap.element_edges.push_back({x, y, z, w});
     }
     return emap;
 }
+// Hash table slot for an edge with sorted vertices
+inline size_t find_edge_slot(const edge_map& emap, const vec2i& es) {
+    auto key = ((uint64_t)(uint32_t)es.x << 32) | (uint64_t)(uint32_t)es.y;
+    auto mask = emap.table.size() - 1;
+    auto slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+    while (emap.table[slot] >= 0 && emap.edges[emap.table[slot]] != es)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+// Reserve space for a number of edges, avoiding rehashing on insertion.
+void reserve_edges(edge_map& emap, int nedges) {
+    auto size = (size_t)16;
+    while (size < 2 * (size_t)nedges) size *= 2;
+    emap.edges.reserve(nedges);
+    emap.counts.reserve(nedges);
+    if (size <= emap.table.size()) return;
+    emap.table.assign(size, -1);
+    for (auto idx = 0; idx < emap.edges.size(); idx++)
+        emap.table[find_edge_slot(emap, emap.edges[idx])] = idx;
+}
 // Insert an edge and return its index
 int insert_edge(edge_map& emap, const vec2i& e) {
+    if (2 * (emap.edges.size() + 1) > emap.table.size())
+        reserve_edges(emap, (int)emap.edges.size() * 2 + 1);
     auto es = vec2i{min(e.x, e.y), max(e.x, e.y)};
-    auto it = emap.find(es);
-    if (it == emap.end()) {
-        auto idx = (int)emap.size();
-        emap.insert(it, {es, {idx, 1}});
-        return idx;
+    auto slot = find_edge_slot(emap, es);
+    auto idx = emap.table[slot];
+    if (idx < 0) {
+        idx = (int)emap.edges.size();
+        emap.table[slot] = idx;
+        emap.edges.push_back(es);
+        emap.counts.push_back(1);
     } else {
-        it->second.y += 1;
-        return it->second.x;
+        emap.counts[idx] += 1;
     }
+    return idx;
 }
 // Get the edge index
 int get_edge_index(const edge_map& emap, const vec2i& e) {
     auto es = vec2i{min(e.x, e.y), max(e.x, e.y)};
-    return emap.at(es).x;
+    auto idx = emap.table.empty() ? -1 : emap.table[find_edge_slot(emap, es)];
+    if (idx < 0) throw std::out_of_range("missing edge");
+    return idx;
 }
 // Get the edge index
 int get_edge_count(const edge_map& emap, const vec2i& e) {
-    auto es = vec2i{min(e.x, e.y), max(e.x, e.y)};
-    return emap.at(es).y;
+    return emap.counts[get_edge_index(emap, e)];
 }
 // Get a list of edges, boundary edges, boundary vertices
-std::vector<vec2i> get_edges(const edge_map& emap) {
-    auto edges = std::vector<vec2i>(emap.size());
-    for (auto& kv : emap) edges[kv.second.x] = kv.first;
-    return edges;
-}
+std::vector<vec2i> get_edges(const edge_map& emap) { return emap.edges; }
 std::vector<vec2i> get_boundary(const edge_map& emap) {
     auto boundary = std::vector<vec2i>();
-    for (auto& kv : emap)
-        if (kv.second.y < 2) boundary.push_back(kv.first);
+    for (auto idx = 0; idx < emap.edges.size(); idx++)
+        if (emap.counts[idx] < 2) boundary.push_back(emap.edges[idx]);
     return boundary;
 }
 
@@ -591,30 +624,42 @@ template std::pair<std::vector<vec2i>, std::vector<vec3f>> subdivide_lines(
 template std::pair<std::vector<vec2i>, std::vector<vec4f>> subdivide_lines(
     const std::vector<vec2i>&, const std::vector<vec4f>&);
 
+// Runs `func(idx)` for all element indices in [0, count) in parallel, in
+// blocks large enough to amortize threading costs.
+template <typename Func>
+inline void parallel_elements(int count, const Func& func) {
+    auto nblocks = (count + 4095) / 4096;
+    parallel_for(nblocks, [&func, count](int block) {
+        auto end = min(count, (block + 1) * 4096);
+        for (auto idx = block * 4096; idx < end; idx++) func(idx);
+    });
+}
+
 // Subdivide triangle.
 template <typename T>
 std::pair<std::vector<vec3i>, std::vector<T>> subdivide_triangles(
     const std::vector<vec3i>& triangles, const std::vector<T>& vert) {
     // get edges
     auto emap = make_edge_map(triangles);
-    auto edges = get_edges(emap);
     // create vertices
-    auto tvert = vert;
-    auto eoffset = (int)tvert.size();
-    for (auto& e : edges) tvert.push_back((vert[e.x] + vert[e.y]) / 2);
+    auto eoffset = (int)vert.size();
+    auto tvert = std::vector<T>(eoffset + emap.edges.size());
+    std::copy(vert.begin(), vert.end(), tvert.begin());
+    parallel_elements((int)emap.edges.size(), [&](int ei) {
+        auto& e = emap.edges[ei];
+        tvert[eoffset + ei] = (vert[e.x] + vert[e.y]) / 2;
+    });
     // create triangles
-    auto ttriangles = std::vector<vec3i>();
-    for (auto& t : triangles) {
-        ttriangles.push_back({t.x, eoffset + get_edge_index(emap, {t.x, t.y}),
-            eoffset + get_edge_index(emap, {t.z, t.x})});
-        ttriangles.push_back({t.y, eoffset + get_edge_index(emap, {t.y, t.z}),
-            eoffset + get_edge_index(emap, {t.x, t.y})});
-        ttriangles.push_back({t.z, eoffset + get_edge_index(emap, {t.z, t.x}),
-            eoffset + get_edge_index(emap, {t.y, t.z})});
-        ttriangles.push_back({eoffset + get_edge_index(emap, {t.x, t.y}),
-            eoffset + get_edge_index(emap, {t.y, t.z}),
-            eoffset + get_edge_index(emap, {t.z, t.x})});
-    }
+    auto ttriangles = std::vector<vec3i>(triangles.size() * 4);
+    auto eoffsets = vec4i{eoffset, eoffset, eoffset, eoffset};
+    parallel_elements((int)triangles.size(), [&](int ti) {
+        auto& t = triangles[ti];
+        auto e = emap.element_edges[ti] + eoffsets;
+        ttriangles[ti * 4 + 0] = {t.x, e.x, e.z};
+        ttriangles[ti * 4 + 1] = {t.y, e.y, e.x};
+        ttriangles[ti * 4 + 2] = {t.z, e.z, e.y};
+        ttriangles[ti * 4 + 3] = {e.x, e.y, e.z};
+    });
     // done
     return {ttriangles, tvert};
 }
@@ -628,46 +673,68 @@ template std::pair<std::vector<vec3i>, std::vector<vec3f>> subdivide_triangles(
 template std::pair<std::vector<vec3i>, std::vector<vec4f>> subdivide_triangles(
     const std::vector<vec3i>&, const std::vector<vec4f>&);
 
-// Subdivide quads.
+// Split quads vertices, adding vertices at edge midpoints and face centers.
 template <typename T>
-std::pair<std::vector<vec4i>, std::vector<T>> subdivide_quads(
-    const std::vector<vec4i>& quads, const std::vector<T>& vert) {
-    // get edges
-    auto emap = make_edge_map(quads);
-    auto edges = get_edges(emap);
-    // create vertices
-    auto tvert = vert;
-    auto eoffset = (int)tvert.size();
-    for (auto& e : edges) tvert.push_back((vert[e.x] + vert[e.y]) / 2);
-    auto foffset = (int)tvert.size();
-    for (auto& q : quads)
-        tvert.push_back(
+std::vector<T> split_quads_vertices(const std::vector<vec4i>& quads,
+    const std::vector<T>& vert, const edge_map& emap) {
+    auto eoffset = (int)vert.size();
+    auto foffset = eoffset + (int)emap.edges.size();
+    auto tvert = std::vector<T>(foffset + quads.size());
+    std::copy(vert.begin(), vert.end(), tvert.begin());
+    parallel_elements((int)emap.edges.size(), [&](int ei) {
+        auto& e = emap.edges[ei];
+        tvert[eoffset + ei] = (vert[e.x] + vert[e.y]) / 2;
+    });
+    parallel_elements((int)quads.size(), [&](int qi) {
+        auto& q = quads[qi];
+        tvert[foffset + qi] =
             q.z != q.w ? (vert[q.x] + vert[q.y] + vert[q.z] + vert[q.w]) / 4 :
-                         (vert[q.x] + vert[q.y] + vert[q.y]) / 3);
-    // create quads
-    auto tquads = std::vector<vec4i>();
-    auto qi = 0;
-    for (auto& q : quads) {
+                         (vert[q.x] + vert[q.y] + vert[q.y]) / 3;
+    });
+    return tvert;
+}
+
+// Split quads in four, and triangles stored as quads in three, using the
+// vertices from `split_quads_vertices()`.
+std::vector<vec4i> split_quads(
+    const std::vector<vec4i>& quads, const edge_map& emap, int nverts) {
+    // offsets of the split quads, since triangles split in three
+    auto nquads = (int)quads.size();
+    auto qoffsets = std::vector<int>(nquads + 1, 0);
+    for (auto qi = 0; qi < nquads; qi++) {
+        auto& q = quads[qi];
+        qoffsets[qi + 1] = qoffsets[qi] + ((q.z != q.w) ? 4 : 3);
+    }
+    auto eoffset = nverts;
+    auto foffset = eoffset + (int)emap.edges.size();
+    auto eoffsets = vec4i{eoffset, eoffset, eoffset, eoffset};
+    auto tquads = std::vector<vec4i>(qoffsets.back());
+    parallel_elements(nquads, [&](int qi) {
+        auto& q = quads[qi];
+        auto e = emap.element_edges[qi] + eoffsets;
+        auto f = foffset + qi;
+        auto tq = tquads.data() + qoffsets[qi];
         if (q.z != q.w) {
-            tquads.push_back({q.x, eoffset + get_edge_index(emap, {q.x, q.y}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.w, q.x})});
-            tquads.push_back({q.y, eoffset + get_edge_index(emap, {q.y, q.z}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.x, q.y})});
-            tquads.push_back({q.z, eoffset + get_edge_index(emap, {q.z, q.w}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.y, q.z})});
-            tquads.push_back({q.w, eoffset + get_edge_index(emap, {q.w, q.x}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.z, q.w})});
+            tq[0] = {q.x, e.x, f, e.w};
+            tq[1] = {q.y, e.y, f, e.x};
+            tq[2] = {q.z, e.z, f, e.y};
+            tq[3] = {q.w, e.w, f, e.z};
         } else {
-            tquads.push_back({q.x, eoffset + get_edge_index(emap, {q.x, q.y}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.z, q.x})});
-            tquads.push_back({q.y, eoffset + get_edge_index(emap, {q.y, q.z}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.x, q.y})});
-            tquads.push_back({q.z, eoffset + get_edge_index(emap, {q.z, q.x}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.y, q.z})});
+            tq[0] = {q.x, e.x, f, e.w};
+            tq[1] = {q.y, e.y, f, e.x};
+            tq[2] = {q.z, e.w, f, e.y};
         }
-        qi += 1;
-    }
-    // done
+    });
+    return tquads;
+}
+
+// Subdivide quads.
+template <typename T>
+std::pair<std::vector<vec4i>, std::vector<T>> subdivide_quads(
+    const std::vector<vec4i>& quads, const std::vector<T>& vert) {
+    auto emap = make_edge_map(quads);
+    auto tvert = split_quads_vertices(quads, vert, emap);
+    auto tquads = split_quads(quads, emap, (int)vert.size());
     return {tquads, tvert};
 }
 
@@ -726,48 +793,19 @@ std::pair<std::vector<vec4i>, std::vector<T>> subdivide_catmullclark(
     bool lock_boundary) {
     // get edges
     auto emap = make_edge_map(quads);
-    auto edges = get_edges(emap);
-    auto boundary = get_boundary(emap);
 
     // split elements ------------------------------------
-    // create vertices
-    auto tvert = vert;
-    auto eoffset = (int)tvert.size();
-    for (auto& e : edges) tvert.push_back((vert[e.x] + vert[e.y]) / 2);
-    auto foffset = (int)tvert.size();
-    for (auto& q : quads)
-        tvert.push_back(
-            q.z != q.w ? (vert[q.x] + vert[q.y] + vert[q.z] + vert[q.w]) / 4 :
-                         (vert[q.x] + vert[q.y] + vert[q.y]) / 3);
-    // create quads
-    auto tquads = std::vector<vec4i>();
-    auto qi = 0;
-    for (auto& q : quads) {
-        if (q.z != q.w) {
-            tquads.push_back({q.x, eoffset + get_edge_index(emap, {q.x, q.y}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.w, q.x})});
-            tquads.push_back({q.y, eoffset + get_edge_index(emap, {q.y, q.z}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.x, q.y})});
-            tquads.push_back({q.z, eoffset + get_edge_index(emap, {q.z, q.w}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.y, q.z})});
-            tquads.push_back({q.w, eoffset + get_edge_index(emap, {q.w, q.x}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.z, q.w})});
-        } else {
-            tquads.push_back({q.x, eoffset + get_edge_index(emap, {q.x, q.y}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.z, q.x})});
-            tquads.push_back({q.y, eoffset + get_edge_index(emap, {q.y, q.z}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.x, q.y})});
-            tquads.push_back({q.z, eoffset + get_edge_index(emap, {q.z, q.x}),
-                foffset + qi, eoffset + get_edge_index(emap, {q.y, q.z})});
-        }
-        qi += 1;
-    }
+    auto eoffset = (int)vert.size();
+    auto tvert = split_quads_vertices(quads, vert, emap);
+    auto tquads = split_quads(quads, emap, eoffset);
 
     // split boundary
     auto tboundary = std::vector<vec2i>();
-    for (auto& e : boundary) {
-        tboundary.push_back({e.x, eoffset + get_edge_index(emap, e)});
-        tboundary.push_back({eoffset + get_edge_index(emap, e), e.y});
+    for (auto idx = 0; idx < emap.edges.size(); idx++) {
+        if (emap.counts[idx] >= 2) continue;
+        auto& e = emap.edges[idx];
+        tboundary.push_back({e.x, eoffset + idx});
+        tboundary.push_back({eoffset + idx, e.y});
     }
 
     // setup creases -----------------------------------
@@ -805,23 +843,29 @@ std::pair<std::vector<vec4i>, std::vector<T>> subdivide_catmullclark(
             acount[vid] += 1;
         }
     }
-    for (auto& q : tquads) {
-        auto c = (tvert[q.x] + tvert[q.y] + tvert[q.z] + tvert[q.w]) / 4.0f;
+    auto qcenters = std::vector<T>(tquads.size());
+    parallel_elements((int)tquads.size(), [&](int qi) {
+        auto& q = tquads[qi];
+        qcenters[qi] =
+            (tvert[q.x] + tvert[q.y] + tvert[q.z] + tvert[q.w]) / 4.0f;
+    });
+    for (auto qi = 0; qi < tquads.size(); qi++) {
+        auto& q = tquads[qi];
         for (auto vid : {q.x, q.y, q.z, q.w}) {
             if (tvert_val[vid] != 2) continue;
-            avert[vid] += c;
+            avert[vid] += qcenters[qi];
             acount[vid] += 1;
         }
     }
-    for (auto i = 0; i < tvert.size(); i++) avert[i] /= (float)acount[i];
 
     // correction pass ----------------------------------
     // p = p + (avg_p - p) * (4/avg_count)
-    for (auto i = 0; i < tvert.size(); i++) {
-        if (tvert_val[i] != 2) continue;
+    parallel_elements((int)tvert.size(), [&](int i) {
+        avert[i] /= (float)acount[i];
+        if (tvert_val[i] != 2) return;
         avert[i] = tvert[i] + (avert[i] - tvert[i]) * (4.0f / acount[i]);
-    }
-    tvert = avert;
+    });
+    tvert = std::move(avert);
 
     return {tquads, tvert};
 }
@@ -881,20 +925,133 @@ void merge_quads(std::vector<vec4i>& quads, std::vector<vec3f>& pos,
     for (auto v : texcoord1) texcoord.push_back(v);
 }
 
-// Weld vertices within a threshold. For noe the implementation is O(n^2).
+// Weld vertices within a threshold. Vertices are bucketed in a hash grid
+// with cells twice the threshold, so only the neighboring cells on the side
+// of each vertex are searched. Neighbors are found in parallel, and a final
+// sequential pass welds each vertex to the first earlier kept vertex within
+// threshold, as a linear scan over the kept vertices would do.
 std::pair<std::vector<vec3f>, std::vector<int>> weld_vertices(
     const std::vector<vec3f>& pos, float threshold) {
-    auto vid = std::vector<int>(pos.size());
+    auto nverts = (int)pos.size();
+    auto vid = std::vector<int>(nverts);
     auto wpos = std::vector<vec3f>();
-    for (auto i = 0; i < pos.size(); i++) {
-        vid[i] = (int)wpos.size();
-        for (auto j = 0; j < wpos.size(); j++) {
-            if (length(pos[i] - wpos[j]) < threshold) {
-                vid[i] = j;
-                break;
+    if (threshold <= 0) {
+        for (auto i = 0; i < nverts; i++) vid[i] = i;
+        return {pos, vid};
+    }
+
+    // cell coordinates, clamped so that close vertices stay in neighboring
+    // cells, and the position in the cell
+    auto cell_size = 2 * threshold;
+    auto vert_cells = std::vector<vec3i>(nverts);
+    auto vert_sides = std::vector<vec3f>(nverts);
+    auto nblocks = (nverts + 4095) / 4096;
+    auto parallel_verts = [nverts, nblocks](const auto& func) {
+        parallel_for(nblocks, [&](int block) {
+            auto end = std::min(nverts, (block + 1) * 4096);
+            for (auto i = block * 4096; i < end; i++) func(i, block);
+        });
+    };
+    parallel_verts([&](int i, int) {
+        for (auto k = 0; k < 3; k++) {
+            auto x = clamp((&pos[i].x)[k] / cell_size, -1e9f, 1e9f);
+            (&vert_cells[i].x)[k] = (int)std::floor(x);
+            (&vert_sides[i].x)[k] = x - std::floor(x);
+        }
+    });
+
+    // open addressing table from cells to the vertices in them, sorted
+    auto hash_cell = [](const vec3i& c) {
+        auto h = (uint64_t)(uint32_t)c.x * 0x9E3779B97F4A7C15ull ^
+                 (uint64_t)(uint32_t)c.y * 0xC2B2AE3D27D4EB4Full ^
+                 (uint64_t)(uint32_t)c.z * 0x165667B19E3779F9ull;
+        return (size_t)(h ^ (h >> 29));
+    };
+    auto table_mask = (size_t)1;
+    while (table_mask < 2 * (size_t)nverts) table_mask *= 2;
+    auto table = std::vector<int>(table_mask--, -1);
+    auto cell_keys = std::vector<vec3i>();
+    auto find_cell = [&](const vec3i& c) {
+        auto h = hash_cell(c) & table_mask;
+        while (table[h] >= 0 && cell_keys[table[h]] != c)
+            h = (h + 1) & table_mask;
+        return h;
+    };
+    auto vert_cell = std::vector<int>(nverts);
+    auto cell_start = std::vector<int>();
+    for (auto i = 0; i < nverts; i++) {
+        auto h = find_cell(vert_cells[i]);
+        if (table[h] < 0) {
+            table[h] = (int)cell_keys.size();
+            cell_keys.push_back(vert_cells[i]);
+            cell_start.push_back(0);
+        }
+        vert_cell[i] = table[h];
+        cell_start[vert_cell[i]]++;
+    }
+    auto ncells = (int)cell_keys.size();
+    for (auto c = 0, start = 0; c < ncells; c++) {
+        auto count = cell_start[c];
+        cell_start[c] = start;
+        start += count;
+    }
+    cell_start.push_back(nverts);
+    auto cell_verts = std::vector<int>(nverts);
+    auto cell_fill = std::vector<int>(cell_start.begin(), cell_start.end() - 1);
+    for (auto i = 0; i < nverts; i++) cell_verts[cell_fill[vert_cell[i]]++] = i;
+
+    // find the earlier vertices within threshold of each vertex, checking
+    // the neighboring cells only on the sides the vertex is close to
+    auto block_neighbors = std::vector<std::vector<int>>(nblocks);
+    auto neighbor_count = std::vector<int>(nverts);
+    parallel_verts([&](int i, int block) {
+        auto& neighbors = block_neighbors[block];
+        auto start = neighbors.size();
+        auto cell = vert_cells[i];
+        auto side = vert_sides[i];
+        for (auto dz = -1; dz <= 1; dz++) {
+            if ((dz < 0 && side.z > 0.75f) || (dz > 0 && side.z < 0.25f))
+                continue;
+            for (auto dy = -1; dy <= 1; dy++) {
+                if ((dy < 0 && side.y > 0.75f) || (dy > 0 && side.y < 0.25f))
+                    continue;
+                for (auto dx = -1; dx <= 1; dx++) {
+                    if ((dx < 0 && side.x > 0.75f) ||
+                        (dx > 0 && side.x < 0.25f))
+                        continue;
+                    auto h = find_cell({cell.x + dx, cell.y + dy, cell.z + dz});
+                    if (table[h] < 0) continue;
+                    auto c = table[h];
+                    for (auto k = cell_start[c]; k < cell_start[c + 1]; k++) {
+                        auto j = cell_verts[k];
+                        if (j >= i) break;
+                        if (length(pos[i] - pos[j]) < threshold)
+                            neighbors.push_back(j);
+                    }
+                }
             }
         }
-        if (vid[i] == (int)wpos.size()) wpos.push_back(pos[i]);
+        std::sort(neighbors.begin() + start, neighbors.end());
+        neighbor_count[i] = (int)(neighbors.size() - start);
+    });
+
+    // weld to the first kept neighbor, as the kept vertices are in order
+    auto kept = std::vector<int>(nverts, -1);
+    for (auto block = 0; block < nblocks; block++) {
+        auto neighbor = block_neighbors[block].data();
+        auto end = std::min(nverts, (block + 1) * 4096);
+        for (auto i = block * 4096; i < end; i++) {
+            vid[i] = -1;
+            for (auto k = 0; k < neighbor_count[i]; k++) {
+                if (vid[i] < 0 && kept[neighbor[k]] >= 0)
+                    vid[i] = kept[neighbor[k]];
+            }
+            neighbor += neighbor_count[i];
+            if (vid[i] >= 0) continue;
+            vid[i] = (int)wpos.size();
+            kept[i] = vid[i];
+            wpos.push_back(pos[i]);
+        }
     }
     return {wpos, vid};
 }
@@ -1346,13 +1503,151 @@ struct bvh_prim {
     int primid = 0;
 };
 
+// Number of bins used by the binned SAH split.
+const int bvh_sah_nbins = 16;
+
+// Half surface area of a bounding box used in the SAH cost.
+inline float bvh_bbox_area(const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+}
+
+// Split the primitives from start to end with the binned surface area
+// heuristic, by binning the centroids along each axis and picking the
+// partition with the lowest cost. Returns the split position or start if
+// no valid split was found.
+int split_bvh_sah(std::vector<bvh_prim>& prims, int start, int end,
+    const bbox3f& cbbox, int& split_axis) {
+    auto csize = cbbox.max - cbbox.min;
+    auto best_cost = flt_max;
+    auto best_axis = -1, best_bin = -1;
+    for (auto axis = 0; axis < 3; axis++) {
+        auto amin = (&cbbox.min.x)[axis], asize = (&csize.x)[axis];
+        if (asize <= 0) continue;
+        auto scale = bvh_sah_nbins / asize;
+
+        // bin primitives by their centroid
+        bbox3f bin_bbox[bvh_sah_nbins];
+        int bin_count[bvh_sah_nbins];
+        for (auto b = 0; b < bvh_sah_nbins; b++) {
+            bin_bbox[b] = invalid_bbox3f;
+            bin_count[b] = 0;
+        }
+        for (auto i = start; i < end; i++) {
+            auto b = clamp((int)(((&prims[i].center.x)[axis] - amin) * scale),
+                0, bvh_sah_nbins - 1);
+            bin_bbox[b] += prims[i].bbox;
+            bin_count[b] += 1;
+        }
+
+        // sweep from the right to accumulate the right side costs
+        float right_area[bvh_sah_nbins];
+        auto right_bbox = invalid_bbox3f;
+        auto right_count = 0;
+        for (auto b = bvh_sah_nbins - 1; b > 0; b--) {
+            right_bbox += bin_bbox[b];
+            right_count += bin_count[b];
+            right_area[b] = bvh_bbox_area(right_bbox) * right_count;
+        }
+
+        // sweep from the left and evaluate each split
+        auto left_bbox = invalid_bbox3f;
+        auto left_count = 0;
+        for (auto b = 1; b < bvh_sah_nbins; b++) {
+            left_bbox += bin_bbox[b - 1];
+            left_count += bin_count[b - 1];
+            if (!left_count || left_count == end - start) continue;
+            auto cost = bvh_bbox_area(left_bbox) * left_count + right_area[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+    if (best_axis < 0) return start;
+
+    // partition the primitives at the selected bin boundary
+    split_axis = best_axis;
+    auto amin = (&cbbox.min.x)[best_axis];
+    auto scale = bvh_sah_nbins / (&csize.x)[best_axis];
+    return (int)(std::partition(prims.data() + start, prims.data() + end,
+                     [best_axis, best_bin, amin, scale](auto& a) {
+                         auto b = clamp(
+                             (int)(((&a.center.x)[best_axis] - amin) * scale),
+                             0, bvh_sah_nbins - 1);
+                         return b < best_bin;
+                     }) -
+                 prims.data());
+}
+
+// Splits the primitives from start to end according to the build heuristic.
+// Returns the split position and sets the split axis.
+int split_bvh_node(std::vector<bvh_prim>& prims, int start, int end,
+    bvh_build_type build_type, int& split_axis) {
+    // initialize split axis and position
+    split_axis = 0;
+    auto mid = (start + end) / 2;
+
+    // compute primintive bounds and size
+    auto cbbox = invalid_bbox3f;
+    for (auto i = start; i < end; i++) cbbox += prims[i].center;
+    auto csize = cbbox.max - cbbox.min;
+
+    // choose the split axis and position
+    if (csize != zero3f) {
+        // split along largest
+        auto largest_axis = 0;
+        if (csize.x >= csize.y && csize.x >= csize.z) largest_axis = 0;
+        if (csize.y >= csize.x && csize.y >= csize.z) largest_axis = 1;
+        if (csize.z >= csize.x && csize.z >= csize.y) largest_axis = 2;
+
+        // check heuristic
+        if (build_type == bvh_build_type::sah) {
+            // binned surface area heuristic over all axes
+            split_axis = largest_axis;
+            mid = split_bvh_sah(prims, start, end, cbbox, split_axis);
+        } else if (build_type == bvh_build_type::equal_size) {
+            // split the space in the middle along the largest axis
+            split_axis = largest_axis;
+            auto csize = (cbbox.max + cbbox.min) / 2;
+            auto middle = (&csize.x)[largest_axis];
+            mid = (int)(std::partition(prims.data() + start,
+                            prims.data() + end,
+                            [split_axis, middle](auto& a) {
+                                return (&a.center.x)[split_axis] < middle;
+                            }) -
+                        prims.data());
+        } else {
+            // balanced tree split: find the largest axis of the bounding
+            // box and split along this one right in the middle
+            split_axis = largest_axis;
+            mid = (start + end) / 2;
+            std::nth_element(prims.data() + start, prims.data() + mid,
+                prims.data() + end, [split_axis](auto& a, auto& b) {
+                    return (&a.center.x)[split_axis] <
+                           (&b.center.x)[split_axis];
+                });
+        }
+
+        // if we were able to split, just break the primitives in half
+        if (mid == start || mid == end) {
+            split_axis = 0;
+            mid = (start + end) / 2;
+        }
+    }
+
+    return mid;
+}
+
 // Initializes the BVH node node that contains the primitives sorted_prims
 // from start to end, by either splitting it into two other nodes,
 // or initializing it as a leaf. When splitting, the heuristic heuristic is
 // used and nodes added sequentially in the preallocated nodes array and
 // the number of nodes nnodes is updated.
 int make_bvh_node(std::vector<bvh_node>& nodes, std::vector<bvh_prim>& prims,
-    int start, int end, bvh_node_type type, bool equal_size) {
+    int start, int end, bvh_node_type type, bvh_build_type build_type,
+    int max_prims) {
     // add a new node
     auto nodeid = (int)nodes.size();
     nodes.push_back({});
@@ -1363,65 +1658,23 @@ int make_bvh_node(std::vector<bvh_node>& nodes, std::vector<bvh_prim>& prims,
     for (auto i = start; i < end; i++) node.bbox += prims[i].bbox;
 
     // split into two children
-    if (end - start > bvh_max_prims) {
-        // initialize split axis and position
+    if (end - start > max_prims) {
+        // split primitives
         auto split_axis = 0;
-        auto mid = (start + end) / 2;
-
-        // compute primintive bounds and size
-        auto cbbox = invalid_bbox3f;
-        for (auto i = start; i < end; i++) cbbox += prims[i].center;
-        auto csize = cbbox.max - cbbox.min;
-
-        // choose the split axis and position
-        if (csize != zero3f) {
-            // split along largest
-            auto largest_axis = 0;
-            if (csize.x >= csize.y && csize.x >= csize.z) largest_axis = 0;
-            if (csize.y >= csize.x && csize.y >= csize.z) largest_axis = 1;
-            if (csize.z >= csize.x && csize.z >= csize.y) largest_axis = 2;
-
-            // check heuristic
-            if (equal_size) {
-                // split the space in the middle along the largest axis
-                split_axis = largest_axis;
-                auto csize = (cbbox.max + cbbox.min) / 2;
-                auto middle = (&csize.x)[largest_axis];
-                mid = (int)(std::partition(prims.data() + start,
-                                prims.data() + end,
-                                [split_axis, middle](auto& a) {
-                                    return (&a.center.x)[split_axis] < middle;
-                                }) -
-                            prims.data());
-            } else {
-                // balanced tree split: find the largest axis of the bounding
-                // box and split along this one right in the middle
-                split_axis = largest_axis;
-                mid = (start + end) / 2;
-                std::nth_element(prims.data() + start, prims.data() + mid,
-                    prims.data() + end, [split_axis](auto& a, auto& b) {
-                        return (&a.center.x)[split_axis] <
-                               (&b.center.x)[split_axis];
-                    });
-            }
-
-            // if we were able to split, just break the primitives in half
-            if (mid == start || mid == end) {
-                split_axis = 0;
-                mid = (start + end) / 2;
-            }
-        }
+        auto mid = split_bvh_node(prims, start, end, build_type, split_axis);
 
         // make an internal node
         node.type = bvh_node_type::internal;
         node.split_axis = split_axis;
         node.count = 2;
-        node.prims[0] =
-            make_bvh_node(nodes, prims, start, mid, type, equal_size);
-        node.prims[1] = make_bvh_node(nodes, prims, mid, end, type, equal_size);
+        node.prims[0] = make_bvh_node(
+            nodes, prims, start, mid, type, build_type, max_prims);
+        node.prims[1] =
+            make_bvh_node(nodes, prims, mid, end, type, build_type, max_prims);
     } else {
         // Make a leaf node
         node.type = type;
+        node.start = start;
         node.count = end - start;
         for (auto i = 0; i < node.count; i++)
             node.prims[i] = prims[start + i].primid;
@@ -1431,8 +1684,70 @@ int make_bvh_node(std::vector<bvh_node>& nodes, std::vector<bvh_prim>& prims,
     return nodeid;
 }
 
+// Minimum number of primitives in a subtree to build it on its own thread.
+const int bvh_parallel_min_prims = 16384;
+
+// Appends the nodes of a subtree built in its own array, offsetting the
+// children indices of the internal nodes.
+void append_bvh_nodes(
+    std::vector<bvh_node>& nodes, const std::vector<bvh_node>& subtree) {
+    auto offset = (uint32_t)nodes.size();
+    for (auto node : subtree) {
+        if (node.type == bvh_node_type::internal) {
+            node.prims[0] += offset;
+            node.prims[1] += offset;
+        }
+        nodes.push_back(node);
+    }
+}
+
+// Parallel version of make_bvh_node. The two subtrees of large nodes are
+// built concurrently into separate arrays, that are then concatenated in
+// depth-first order, so that the nodes match the ones of the serial build.
+// New threads are spawned until `depth` reaches zero.
+void make_bvh_node_parallel(std::vector<bvh_node>& nodes,
+    std::vector<bvh_prim>& prims, int start, int end, bvh_node_type type,
+    bvh_build_type build_type, int max_prims, int depth) {
+    // build small nodes serially
+    if (depth <= 0 || end - start < bvh_parallel_min_prims) {
+        make_bvh_node(nodes, prims, start, end, type, build_type, max_prims);
+        return;
+    }
+
+    // add a new internal node
+    auto nodeid = (int)nodes.size();
+    nodes.push_back({});
+    nodes[nodeid].bbox = invalid_bbox3f;
+    for (auto i = start; i < end; i++) nodes[nodeid].bbox += prims[i].bbox;
+    auto split_axis = 0;
+    auto mid = split_bvh_node(prims, start, end, build_type, split_axis);
+
+    // build children concurrently
+    auto left = std::vector<bvh_node>(), right = std::vector<bvh_node>();
+    left.reserve((mid - start) * 2);
+    right.reserve((end - mid) * 2);
+    auto left_thread = std::thread([&]() {
+        make_bvh_node_parallel(left, prims, start, mid, type, build_type,
+            max_prims, depth - 1);
+    });
+    make_bvh_node_parallel(
+        right, prims, mid, end, type, build_type, max_prims, depth - 1);
+    left_thread.join();
+
+    // link children
+    auto& node = nodes[nodeid];
+    node.type = bvh_node_type::internal;
+    node.split_axis = split_axis;
+    node.count = 2;
+    node.prims[0] = (uint32_t)nodes.size();
+    append_bvh_nodes(nodes, left);
+    node.prims[1] = (uint32_t)nodes.size();
+    append_bvh_nodes(nodes, right);
+}
+
 // Build a BVH from a set of primitives.
-void build_bvh(const std::shared_ptr<bvh_tree>& bvh, bool equal_size) {
+void build_bvh(const std::shared_ptr<bvh_tree>& bvh, bvh_build_type build_type,
+    int max_prims, bool noparallel) {
     // get the number of primitives and the primitive type
     auto prims = std::vector<bvh_prim>();
     auto type = bvh_node_type::internal;
@@ -1480,9 +1795,25 @@ void build_bvh(const std::shared_ptr<bvh_tree>& bvh, bool equal_size) {
 
     // build nodes
     bvh->nodes.clear();
+    bvh->compressed_nodes.clear();
+    bvh->compressed_prims.clear();
+    bvh->wide_nodes.clear();
+    bvh->node_wides.clear();
+    bvh->leaf_triangles.clear();
     bvh->nodes.reserve(prims.size() * 2);
-    make_bvh_node(bvh->nodes, prims, 0, (int)prims.size(), type, equal_size);
+    max_prims = clamp(max_prims, 1, bvh_max_prims);
+    if (noparallel || prims.size() < bvh_parallel_min_prims) {
+        make_bvh_node(bvh->nodes, prims, 0, (int)prims.size(), type,
+            build_type, max_prims);
+    } else {
+        // split into at least as many subtrees as hardware threads
+        auto depth = 1;
+        while ((1u << depth) < std::thread::hardware_concurrency()) depth++;
+        make_bvh_node_parallel(bvh->nodes, prims, 0, (int)prims.size(), type,
+            build_type, max_prims, depth);
+    }
     bvh->nodes.shrink_to_fit();
+    bvh->node_parents.clear();
 }
 
 // Recursively recomputes the node bounds for a shape bvh
@@ -1540,224 +1871,1036 @@ void refit_bvh(const std::shared_ptr<bvh_tree>& bvh, int nodeid) {
     }
 }
 
-// Recursively recomputes the node bounds for a shape bvh
-void refit_bvh(const std::shared_ptr<bvh_tree>& bvh) { refit_bvh(bvh, 0); }
+// Recursively collapses binary nodes into a wide node, opening the internal
+// child with the largest surface area until the wide node is full.
+int make_wide_bvh_node(const std::shared_ptr<bvh_tree>& bvh, int nodeid) {
+    // gather children
+    int children[bvh_wide_width];
+    auto count = 0;
+    if (bvh->nodes[nodeid].type == bvh_node_type::internal) {
+        children[count++] = bvh->nodes[nodeid].prims[0];
+        children[count++] = bvh->nodes[nodeid].prims[1];
+    } else {
+        children[count++] = nodeid;
+    }
+    while (count < bvh_wide_width) {
+        auto best = -1;
+        auto best_area = -1.0f;
+        for (auto i = 0; i < count; i++) {
+            auto& child = bvh->nodes[children[i]];
+            if (child.type != bvh_node_type::internal) continue;
+            auto area = bvh_bbox_area(child.bbox);
+            if (area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0) break;
+        auto& child = bvh->nodes[children[best]];
+        children[best] = child.prims[0];
+        children[count++] = child.prims[1];
+    }
+
+    // set bounds, with empty bounds for unused children
+    auto wide = bvh_wide_node();
+    wide.count = count;
+    wide.leaf_mask = 0;
+    for (auto i = 0; i < bvh_wide_width; i++) {
+        auto bbox = invalid_bbox3f;
+        if (i < count) bbox = bvh->nodes[children[i]].bbox;
+        wide.min_x[i] = bbox.min.x;
+        wide.min_y[i] = bbox.min.y;
+        wide.min_z[i] = bbox.min.z;
+        wide.max_x[i] = bbox.max.x;
+        wide.max_y[i] = bbox.max.y;
+        wide.max_z[i] = bbox.max.z;
+        wide.children[i] = 0;
+    }
+
+    // add node before its children to keep depth-first order
+    auto wideid = (int)bvh->wide_nodes.size();
+    bvh->wide_nodes.push_back(wide);
+    for (auto i = 0; i < count; i++) {
+        if (!bvh->node_wides.empty())
+            bvh->node_wides[children[i]] = wideid * bvh_wide_width + i;
+        if (bvh->nodes[children[i]].type == bvh_node_type::internal) {
+            auto childid = make_wide_bvh_node(bvh, children[i]);
+            bvh->wide_nodes[wideid].children[i] = childid;
+        } else {
+            bvh->wide_nodes[wideid].children[i] = children[i];
+            bvh->wide_nodes[wideid].leaf_mask |= 1 << i;
+        }
+    }
+    return wideid;
+}
+
+// Collapse the binary nodes into wide nodes.
+void build_wide_bvh(const std::shared_ptr<bvh_tree>& bvh) {
+    bvh->wide_nodes.clear();
+    bvh->node_wides.clear();
+    if (!bvh->ist_bvhs.empty()) bvh->node_wides.assign(bvh->nodes.size(), -1);
+    if (bvh->nodes.empty()) return;
+    bvh->wide_nodes.reserve(bvh->nodes.size() / 2 + 1);
+    make_wide_bvh_node(bvh, 0);
+    bvh->wide_nodes.shrink_to_fit();
+}
+
+// Store the triangles of a shape bvh in leaf order.
+void build_bvh_triangles(const std::shared_ptr<bvh_tree>& bvh) {
+    bvh->leaf_triangles.clear();
+    if (bvh->triangles.empty()) return;
+    bvh->leaf_triangles.resize(bvh->triangles.size());
+    for (auto& node : bvh->nodes) {
+        if (node.type != bvh_node_type::triangle) continue;
+        for (auto i = 0; i < node.count; i++) {
+            auto& t = bvh->triangles[node.prims[i]];
+            auto& v0 = bvh->pos[t.x];
+            bvh->leaf_triangles[node.start + i] = {
+                v0, bvh->pos[t.y] - v0, bvh->pos[t.z] - v0};
+        }
+    }
+}
 
-// Intersect ray with a bvh.
-bool intersect_bvh(const std::shared_ptr<bvh_tree>& bvh, const ray3f& ray_,
-    bool find_any, float& dist, int& iid, int& eid, vec2f& uv) {
-    // node stack
-    int node_stack[128];
-    auto node_cur = 0;
-    node_stack[node_cur++] = 0;
+// Quantization step of a compressed node axis, a power of two made directly
+// from the bits of its exponent.
+inline float get_compressed_step(int8_t exponent) {
+    auto bits = (uint32_t)(exponent + 127) << 23;
+    auto step = 0.0f;
+    memcpy(&step, &bits, sizeof(step));
+    return step;
+}
+
+// Decodes the bounds of the child `c` of a compressed node.
+inline bbox3f decode_compressed_bbox(const bvh_compressed_node& node, int c) {
+    auto bbox = bbox3f();
+    for (auto a = 0; a < 3; a++) {
+        auto origin = (&node.origin.x)[a];
+        auto step = get_compressed_step(node.exponent[a]);
+        (&bbox.min.x)[a] = origin + node.qmin[c][a] * step;
+        (&bbox.max.x)[a] = origin + node.qmax[c][a] * step;
+    }
+    return bbox;
+}
+
+// Sets the quantization origin and steps of a compressed node so that the
+// node bounds fit in 8 bits per axis.
+void init_compressed_node(bvh_compressed_node& node, const bbox3f& bbox) {
+    node.origin = bbox.min;
+    for (auto a = 0; a < 3; a++) {
+        auto size = (&bbox.max.x)[a] - (&bbox.min.x)[a];
+        auto exponent = -126;
+        if (size > 0)
+            exponent = clamp((int)std::ceil(std::log2(size / 255)), -126, 127);
+        while (exponent < 127 && 255 * get_compressed_step(exponent) < size)
+            exponent++;
+        node.exponent[a] = (int8_t)exponent;
+    }
+}
+
+// Quantizes the bounds of the child `c` of a compressed node, rounding them
+// outwards with the same arithmetic used to decode them. Empty bounds are
+// encoded with the minimum above the maximum.
+void encode_compressed_bbox(
+    bvh_compressed_node& node, int c, const bbox3f& bbox) {
+    for (auto a = 0; a < 3; a++) {
+        auto bmin = (&bbox.min.x)[a], bmax = (&bbox.max.x)[a];
+        if (bmin > bmax) {
+            node.qmin[c][a] = 255;
+            node.qmax[c][a] = 0;
+            continue;
+        }
+        auto origin = (&node.origin.x)[a];
+        auto step = get_compressed_step(node.exponent[a]);
+        auto qmin =
+            (int)clamp(std::floor((bmin - origin) / step), 0.0f, 255.0f);
+        while (qmin > 0 && origin + qmin * step > bmin) qmin--;
+        auto qmax =
+            (int)clamp(std::ceil((bmax - origin) / step), 0.0f, 255.0f);
+        while (qmax < 255 && origin + qmax * step < bmax) qmax++;
+        node.qmin[c][a] = (uint8_t)qmin;
+        node.qmax[c][a] = (uint8_t)qmax;
+    }
+}
+
+// Recursively compresses the children of the internal node `nodeid`,
+// storing nodes in depth-first order. Returns the compressed node index.
+int make_compressed_bvh_node(const std::shared_ptr<bvh_tree>& bvh, int nodeid) {
+    auto& node = bvh->nodes[nodeid];
+    auto cnode = bvh_compressed_node{};
+    init_compressed_node(cnode, node.bbox);
+    cnode.split_axis = node.split_axis;
+    auto cnodeid = (int)bvh->compressed_nodes.size();
+    bvh->compressed_nodes.push_back(cnode);
+    for (auto c = 0; c < 2; c++) {
+        auto& child = bvh->nodes[node.prims[c]];
+        encode_compressed_bbox(cnode, c, child.bbox);
+        if (child.type == bvh_node_type::internal) {
+            cnode.children[c] = make_compressed_bvh_node(bvh, node.prims[c]);
+        } else {
+            cnode.type = child.type;
+            cnode.leaf_mask |= 1 << c;
+            cnode.counts[c] = (uint8_t)child.count;
+            cnode.children[c] = child.start;
+        }
+    }
+    bvh->compressed_nodes[cnodeid] = cnode;
+    return cnodeid;
+}
 
-    // shared variables
-    auto hit = false;
+// Replace the binary and wide nodes with compressed nodes.
+void compress_bvh(const std::shared_ptr<bvh_tree>& bvh) {
+    bvh->compressed_nodes.clear();
+    bvh->compressed_prims.clear();
+    if (bvh->nodes.empty()) return;
 
-    // copy ray to modify it
-    auto ray = ray_;
+    // copy leaf primitives in leaf order
+    for (auto& node : bvh->nodes) {
+        if (node.type == bvh_node_type::internal) continue;
+        if (bvh->compressed_prims.size() < node.start + node.count)
+            bvh->compressed_prims.resize(node.start + node.count);
+        for (auto i = 0; i < node.count; i++)
+            bvh->compressed_prims[node.start + i] = node.prims[i];
+    }
 
-    // prepare ray for fast queries
-    auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-    auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-        (ray_dinv.z < 0) ? 1 : 0};
+    // compress nodes, storing a root leaf as the only child of a node
+    auto& root = bvh->nodes[0];
+    if (root.type == bvh_node_type::internal) {
+        bvh->compressed_nodes.reserve(bvh->nodes.size() / 2);
+        make_compressed_bvh_node(bvh, 0);
+    } else {
+        auto cnode = bvh_compressed_node{};
+        init_compressed_node(cnode, root.bbox);
+        encode_compressed_bbox(cnode, 0, root.bbox);
+        encode_compressed_bbox(cnode, 1, invalid_bbox3f);
+        cnode.type = root.type;
+        cnode.leaf_mask = 3;
+        cnode.counts[0] = (uint8_t)root.count;
+        cnode.children[0] = root.start;
+        bvh->compressed_nodes.push_back(cnode);
+    }
+    bvh->compressed_nodes.shrink_to_fit();
+
+    // keep only the binary root for its bounds
+    bvh->nodes.resize(1);
+    bvh->nodes.shrink_to_fit();
+    bvh->wide_nodes = {};
+    bvh->node_wides = {};
+    bvh->node_parents = {};
+    bvh->prim_leaves = {};
+}
+
+// Recursively recomputes the node bounds for a shape bvh. Wide nodes and
+// leaf triangles are built again since this is linear in the tree size.
+// The data for incremental refits is reset, so their SAH area and cost
+// start again from the refit bounds.
+void refit_bvh(const std::shared_ptr<bvh_tree>& bvh) {
+    if (!bvh->compressed_nodes.empty())
+        throw std::runtime_error("cannot refit a compressed bvh");
+    refit_bvh(bvh, 0);
+    if (!bvh->wide_nodes.empty()) build_wide_bvh(bvh);
+    if (!bvh->leaf_triangles.empty()) build_bvh_triangles(bvh);
+    bvh->node_parents.clear();
+}
+
+// Weighted node area for SAH costs, counting primitives in leaves.
+inline double bvh_sah_area(const bvh_node& node) {
+    if (node.bbox.min.x > node.bbox.max.x) return 0;
+    auto weight = (node.type == bvh_node_type::internal) ? 1 : node.count;
+    return (double)bvh_bbox_area(node.bbox) * weight;
+}
+
+// Compute the SAH cost of a bvh.
+float compute_bvh_sah_cost(const std::shared_ptr<bvh_tree>& bvh) {
+    if (bvh->nodes.empty() || !bvh->compressed_nodes.empty()) return 0;
+    auto root_area = bvh_bbox_area(bvh->nodes[0].bbox);
+    if (!root_area) return 0;
+    auto sah_area = 0.0;
+    for (auto& node : bvh->nodes) sah_area += bvh_sah_area(node);
+    return (float)(sah_area / root_area);
+}
+
+// Initialize the parents and leaves used by incremental refits.
+void init_bvh_refit(const std::shared_ptr<bvh_tree>& bvh) {
+    bvh->node_parents.assign(bvh->nodes.size(), -1);
+    bvh->prim_leaves.assign(bvh->ist_bvhs.size(), -1);
+    bvh->sah_area = 0;
+    for (auto nodeid = 0; nodeid < bvh->nodes.size(); nodeid++) {
+        auto& node = bvh->nodes[nodeid];
+        bvh->sah_area += bvh_sah_area(node);
+        if (node.type == bvh_node_type::internal) {
+            bvh->node_parents[node.prims[0]] = nodeid;
+            bvh->node_parents[node.prims[1]] = nodeid;
+        } else if (node.type == bvh_node_type::instance) {
+            for (auto i = 0; i < node.count; i++)
+                bvh->prim_leaves[node.prims[i]] = nodeid;
+        }
+    }
+    bvh->refit_sah_cost = compute_bvh_sah_cost(bvh);
+}
 
-    // walking stack
-    while (node_cur) {
-        // grab node
-        auto& node = bvh->nodes[node_stack[--node_cur]];
+// Sets a node bounds, updating its wide node slot and the SAH area.
+inline void set_bvh_node_bbox(
+    const std::shared_ptr<bvh_tree>& bvh, int nodeid, const bbox3f& bbox) {
+    auto& node = bvh->nodes[nodeid];
+    bvh->sah_area -= bvh_sah_area(node);
+    node.bbox = bbox;
+    bvh->sah_area += bvh_sah_area(node);
+    if (bvh->node_wides.empty() || bvh->node_wides[nodeid] < 0) return;
+    auto& wide = bvh->wide_nodes[bvh->node_wides[nodeid] / bvh_wide_width];
+    auto i = bvh->node_wides[nodeid] % bvh_wide_width;
+    wide.min_x[i] = bbox.min.x;
+    wide.min_y[i] = bbox.min.y;
+    wide.min_z[i] = bbox.min.z;
+    wide.max_x[i] = bbox.max.x;
+    wide.max_y[i] = bbox.max.y;
+    wide.max_z[i] = bbox.max.z;
+}
+
+// Update the node bounds of an instance bvh for the given instances. Leaves
+// are recomputed and their ancestors updated until the bounds stop changing.
+void refit_bvh(
+    const std::shared_ptr<bvh_tree>& bvh, const std::vector<int>& instances) {
+    if (!bvh->compressed_nodes.empty())
+        throw std::runtime_error("cannot refit a compressed bvh");
+    if (bvh->nodes.empty()) return;
+    if (bvh->node_parents.size() != bvh->nodes.size()) init_bvh_refit(bvh);
+    if (!bvh->wide_nodes.empty() && bvh->node_wides.size() != bvh->nodes.size())
+        build_wide_bvh(bvh);
+    for (auto idx : instances) {
+        auto nodeid = bvh->prim_leaves.at(idx);
+        auto& leaf = bvh->nodes[nodeid];
+        auto bbox = invalid_bbox3f;
+        for (auto i = 0; i < leaf.count; i++) {
+            auto prim = leaf.prims[i];
+            bbox += transform_bbox(
+                bvh->ist_frames[prim], bvh->ist_bvhs[prim]->nodes[0].bbox);
+        }
+        set_bvh_node_bbox(bvh, nodeid, bbox);
+        for (nodeid = bvh->node_parents[nodeid]; nodeid >= 0;
+             nodeid = bvh->node_parents[nodeid]) {
+            auto& node = bvh->nodes[nodeid];
+            auto bbox = bvh->nodes[node.prims[0]].bbox;
+            bbox += bvh->nodes[node.prims[1]].bbox;
+            if (bbox.min == node.bbox.min && bbox.max == node.bbox.max) break;
+            set_bvh_node_bbox(bvh, nodeid, bbox);
+        }
+    }
+}
 
-        // intersect bbox
-        if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
+// Intersect a ray with a precomputed triangle. This matches
+// `intersect_triangle()` since edges are computed in the same way.
+inline bool intersect_triangle(
+    const ray3f& ray, const bvh_triangle& tri, float& dist, vec2f& uv) {
+    // compute determinant to solve a linear system
+    auto pvec = cross(ray.d, tri.e2);
+    auto det = dot(tri.e1, pvec);
 
-        // intersect node, switching based on node type
-        // for each type, iterate over the the primitive list
-        switch (node.type) {
-            case bvh_node_type::internal: {
-                // for internal nodes, attempts to proceed along the
-                // split axis from smallest to largest nodes
-                if ((&ray_dsign.x)[node.split_axis]) {
-                    node_stack[node_cur++] = node.prims[0];
-                    node_stack[node_cur++] = node.prims[1];
-                } else {
-                    node_stack[node_cur++] = node.prims[1];
-                    node_stack[node_cur++] = node.prims[0];
-                }
-            } break;
-            case bvh_node_type::triangle: {
+    // check determinant and exit if triangle and ray are parallel
+    if (det == 0) return false;
+    auto inv_det = 1.0f / det;
+
+    // compute and check first bricentric coordinated
+    auto tvec = ray.o - tri.v0;
+    auto u = dot(tvec, pvec) * inv_det;
+    if (u < 0 || u > 1) return false;
+
+    // compute and check second bricentric coordinated
+    auto qvec = cross(tvec, tri.e1);
+    auto v = dot(ray.d, qvec) * inv_det;
+    if (v < 0 || u + v > 1) return false;
+
+    // compute and check ray parameter
+    auto t = dot(tri.e2, qvec) * inv_det;
+    if (t < ray.tmin || t > ray.tmax) return false;
+
+    // intersection occurred: set params and exit
+    dist = t;
+    uv = {u, v};
+    return true;
+}
+
+// Intersect a ray with the children bounds of a wide node. Returns a
+// bitmask of the children hit and stores their entry distances in `tmins`.
+// Computations match `intersect_bbox()` including the NaN behaviour.
+inline int intersect_wide_bbox(const ray3f& ray, const vec3f& ray_dinv,
+    const vec3i& ray_dsign, const bvh_wide_node& node, float* tmins) {
+#if YGL_SSE
+    auto ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y),
+         oz = _mm_set1_ps(ray.o.z);
+    auto dx = _mm_set1_ps(ray_dinv.x), dy = _mm_set1_ps(ray_dinv.y),
+         dz = _mm_set1_ps(ray_dinv.z);
+    auto txmin = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(ray_dsign.x ? node.max_x : node.min_x), ox),
+        dx);
+    auto txmax = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(ray_dsign.x ? node.min_x : node.max_x), ox),
+        dx);
+    auto tymin = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(ray_dsign.y ? node.max_y : node.min_y), oy),
+        dy);
+    auto tymax = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(ray_dsign.y ? node.min_y : node.max_y), oy),
+        dy);
+    auto tzmin = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(ray_dsign.z ? node.max_z : node.min_z), oz),
+        dz);
+    auto tzmax = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(ray_dsign.z ? node.min_z : node.max_z), oz),
+        dz);
+    auto tmin = _mm_max_ps(tzmin,
+        _mm_max_ps(tymin, _mm_max_ps(txmin, _mm_set1_ps(ray.tmin))));
+    auto tmax = _mm_min_ps(tzmax,
+        _mm_min_ps(tymax, _mm_min_ps(txmax, _mm_set1_ps(ray.tmax))));
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+    _mm_storeu_ps(tmins, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    auto mask = 0;
+    for (auto i = 0; i < bvh_wide_width; i++) {
+        auto bbox = bbox3f{{node.min_x[i], node.min_y[i], node.min_z[i]},
+            {node.max_x[i], node.max_y[i], node.max_z[i]}};
+        auto bounds = &bbox.min;
+        auto txmin = (bounds[ray_dsign.x].x - ray.o.x) * ray_dinv.x;
+        auto txmax = (bounds[1 - ray_dsign.x].x - ray.o.x) * ray_dinv.x;
+        auto tymin = (bounds[ray_dsign.y].y - ray.o.y) * ray_dinv.y;
+        auto tymax = (bounds[1 - ray_dsign.y].y - ray.o.y) * ray_dinv.y;
+        auto tzmin = (bounds[ray_dsign.z].z - ray.o.z) * ray_dinv.z;
+        auto tzmax = (bounds[1 - ray_dsign.z].z - ray.o.z) * ray_dinv.z;
+        auto tmin = _safemax(tzmin, _safemax(tymin, _safemax(txmin, ray.tmin)));
+        auto tmax = _safemin(tzmax, _safemin(tymax, _safemin(txmax, ray.tmax)));
+        tmax *= 1.00000024f;
+        tmins[i] = tmin;
+        if (tmin <= tmax) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Check the distance of a point to the children bounds of a wide node.
+// Returns a bitmask of the children within `dist_max`.
+inline int distance_check_wide_bbox(
+    const vec3f& pos, float dist_max, const bvh_wide_node& node) {
+#if YGL_SSE
+    auto zero = _mm_setzero_ps();
+    auto px = _mm_set1_ps(pos.x), py = _mm_set1_ps(pos.y),
+         pz = _mm_set1_ps(pos.z);
+    auto dx = _mm_max_ps(zero,
+        _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), px),
+            _mm_sub_ps(px, _mm_loadu_ps(node.max_x))));
+    auto dy = _mm_max_ps(zero,
+        _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), py),
+            _mm_sub_ps(py, _mm_loadu_ps(node.max_y))));
+    auto dz = _mm_max_ps(zero,
+        _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), pz),
+            _mm_sub_ps(pz, _mm_loadu_ps(node.max_z))));
+    auto dd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+        _mm_mul_ps(dz, dz));
+    return _mm_movemask_ps(
+        _mm_cmplt_ps(dd, _mm_set1_ps(dist_max * dist_max)));
+#else
+    auto mask = 0;
+    for (auto i = 0; i < bvh_wide_width; i++) {
+        auto bbox = bbox3f{{node.min_x[i], node.min_y[i], node.min_z[i]},
+            {node.max_x[i], node.max_y[i], node.max_z[i]}};
+        if (distance_check_bbox(pos, dist_max, bbox)) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Traversal counters of each thread.
+thread_local bvh_stats _bvh_stats;
+
+// Traversal counters of the calling thread.
+bvh_stats& get_bvh_thread_stats() { return _bvh_stats; }
+
+// Intersect ray with the primitives of a bvh leaf, shortening the ray on hit.
+bool intersect_bvh_leaf(const std::shared_ptr<bvh_tree>& bvh,
+    const bvh_node& node, ray3f& ray, bool find_any, float& dist, int& iid,
+    int& eid, vec2f& uv) {
+    auto hit = false;
+    if (node.type != bvh_node_type::instance) _bvh_stats.nprims += node.count;
+    switch (node.type) {
+        case bvh_node_type::internal: break;
+        case bvh_node_type::triangle: {
+            if (!bvh->leaf_triangles.empty()) {
+                auto tris = bvh->leaf_triangles.data() + node.start;
                 for (auto i = 0; i < node.count; i++) {
-                    auto& t = bvh->triangles[node.prims[i]];
-                    if (intersect_triangle(ray, bvh->pos[t.x], bvh->pos[t.y],
-                            bvh->pos[t.z], dist, uv)) {
+                    if (intersect_triangle(ray, tris[i], dist, uv)) {
                         hit = true;
                         ray.tmax = dist;
                         eid = node.prims[i];
                     }
                 }
-            } break;
-            case bvh_node_type::quad: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& t = bvh->quads[node.prims[i]];
-                    if (intersect_quad(ray, bvh->pos[t.x], bvh->pos[t.y],
-                            bvh->pos[t.z], bvh->pos[t.w], dist, uv)) {
-                        hit = true;
-                        ray.tmax = dist;
-                        eid = node.prims[i];
-                    }
+                break;
+            }
+            for (auto i = 0; i < node.count; i++) {
+                auto& t = bvh->triangles[node.prims[i]];
+                if (intersect_triangle(ray, bvh->pos[t.x], bvh->pos[t.y],
+                        bvh->pos[t.z], dist, uv)) {
+                    hit = true;
+                    ray.tmax = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-            case bvh_node_type::line: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& l = bvh->lines[node.prims[i]];
-                    if (intersect_line(ray, bvh->pos[l.x], bvh->pos[l.y],
-                            bvh->radius[l.x], bvh->radius[l.y], dist, uv)) {
-                        hit = true;
-                        ray.tmax = dist;
-                        eid = node.prims[i];
-                    }
+            }
+        } break;
+        case bvh_node_type::quad: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& t = bvh->quads[node.prims[i]];
+                if (intersect_quad(ray, bvh->pos[t.x], bvh->pos[t.y],
+                        bvh->pos[t.z], bvh->pos[t.w], dist, uv)) {
+                    hit = true;
+                    ray.tmax = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-            case bvh_node_type::point: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& p = bvh->points[node.prims[i]];
-                    if (intersect_point(
-                            ray, bvh->pos[p], bvh->radius[p], dist, uv)) {
-                        hit = true;
-                        ray.tmax = dist;
-                        eid = node.prims[i];
-                    }
+            }
+        } break;
+        case bvh_node_type::line: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& l = bvh->lines[node.prims[i]];
+                if (intersect_line(ray, bvh->pos[l.x], bvh->pos[l.y],
+                        bvh->radius[l.x], bvh->radius[l.y], dist, uv)) {
+                    hit = true;
+                    ray.tmax = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-            case bvh_node_type::vertex: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto idx = node.prims[i];
-                    if (intersect_point(
-                            ray, bvh->pos[idx], bvh->radius[idx], dist, uv)) {
-                        hit = true;
-                        ray.tmax = dist;
-                        eid = node.prims[i];
-                    }
+            }
+        } break;
+        case bvh_node_type::point: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& p = bvh->points[node.prims[i]];
+                if (intersect_point(
+                        ray, bvh->pos[p], bvh->radius[p], dist, uv)) {
+                    hit = true;
+                    ray.tmax = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-            case bvh_node_type::instance: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto idx = node.prims[i];
-                    if (intersect_bvh(bvh->ist_bvhs[idx],
-                            transform_ray(bvh->ist_inv_frames[idx], ray),
-                            find_any, dist, iid, eid, uv)) {
-                        hit = true;
-                        ray.tmax = dist;
-                        iid = node.prims[i];
-                    }
+            }
+        } break;
+        case bvh_node_type::vertex: {
+            for (auto i = 0; i < node.count; i++) {
+                auto idx = node.prims[i];
+                if (intersect_point(
+                        ray, bvh->pos[idx], bvh->radius[idx], dist, uv)) {
+                    hit = true;
+                    ray.tmax = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-        }
-
-        // check for early exit
-        if (find_any && hit) return true;
+            }
+        } break;
+        case bvh_node_type::instance: {
+            for (auto i = 0; i < node.count; i++) {
+                auto idx = node.prims[i];
+                if (intersect_bvh(bvh->ist_bvhs[idx],
+                        transform_ray(bvh->ist_inv_frames[idx], ray),
+                        find_any, dist, iid, eid, uv)) {
+                    hit = true;
+                    ray.tmax = dist;
+                    iid = node.prims[i];
+                }
+            }
+        } break;
     }
-
     return hit;
 }
 
-// Finds the closest element with a bvh.
-bool overlap_bvh(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
-    float max_dist, bool find_any, float& dist, int& iid, int& eid, vec2f& uv) {
-    // node stack
-    int node_stack[64];
+// Intersect ray with a wide bvh. Children are visited front to back and
+// the stack keeps their entry distance to skip nodes behind the closest hit.
+bool intersect_wide_bvh(const std::shared_ptr<bvh_tree>& bvh,
+    const ray3f& ray_, bool find_any, float& dist, int& iid, int& eid,
+    vec2f& uv) {
+    // node stack, with leaves stored as negative binary node indices
+    int node_stack[256];
+    float tmin_stack[256];
     auto node_cur = 0;
-    node_stack[node_cur++] = 0;
+    node_stack[node_cur] = 0;
+    tmin_stack[node_cur++] = ray_.tmin;
 
-    // hit
+    // shared variables
     auto hit = false;
 
-    // walking stack
+    // copy ray to modify it
+    auto ray = ray_;
+
+    // prepare ray for fast queries
+    auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+    auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+        (ray_dinv.z < 0) ? 1 : 0};
+
+    // walking stack, counting visited nodes
+    auto nnodes = (uint64_t)0;
     while (node_cur) {
         // grab node
-        auto node = bvh->nodes[node_stack[--node_cur]];
+        node_cur--;
+        auto nodeid = node_stack[node_cur];
+        if (tmin_stack[node_cur] > ray.tmax * 1.00000024f) continue;
+        nnodes++;
+
+        // intersect leaf
+        if (nodeid < 0) {
+            if (intersect_bvh_leaf(bvh, bvh->nodes[~nodeid], ray, find_any,
+                    dist, iid, eid, uv)) {
+                hit = true;
+                if (find_any) break;
+            }
+            continue;
+        }
+
+        // intersect children bboxes
+        auto& node = bvh->wide_nodes[nodeid];
+        float tmins[bvh_wide_width];
+        auto mask = intersect_wide_bbox(ray, ray_dinv, ray_dsign, node, tmins);
+        mask &= (1 << node.count) - 1;
+        if (!mask) continue;
+
+        // sort hit children from farthest to closest
+        int hits[bvh_wide_width];
+        auto nhits = 0;
+        for (auto i = 0; i < node.count; i++) {
+            if (!(mask & (1 << i))) continue;
+            auto j = nhits++;
+            while (j > 0 && tmins[hits[j - 1]] < tmins[i]) {
+                hits[j] = hits[j - 1];
+                j--;
+            }
+            hits[j] = i;
+        }
+
+        // push children so that the closest is popped first
+        for (auto i = 0; i < nhits; i++) {
+            auto child = hits[i];
+            node_stack[node_cur] = (node.leaf_mask & (1 << child)) ?
+                                       ~(int)node.children[child] :
+                                       (int)node.children[child];
+            tmin_stack[node_cur++] = tmins[child];
+        }
+    }
+
+    _bvh_stats.nnodes += nnodes;
+    return hit;
+}
+
+// Leaf with the primitives of the child `c` of a compressed node.
+inline bvh_node get_compressed_leaf(const std::shared_ptr<bvh_tree>& bvh,
+    const bvh_compressed_node& node, int c) {
+    auto leaf = bvh_node{};
+    leaf.type = node.type;
+    leaf.start = node.children[c];
+    leaf.count = node.counts[c];
+    for (auto i = 0; i < leaf.count; i++)
+        leaf.prims[i] = bvh->compressed_prims[leaf.start + i];
+    return leaf;
+}
+
+// Intersect ray with a compressed bvh. The stack holds node children, as
+// twice the node index plus the child slot, whose bounds are decoded when
+// popped, so that nodes are visited as in the binary tree.
+bool intersect_compressed_bvh(const std::shared_ptr<bvh_tree>& bvh,
+    const ray3f& ray_, bool find_any, float& dist, int& iid, int& eid,
+    vec2f& uv) {
+    // shared variables
+    auto hit = false;
+
+    // copy ray to modify it
+    auto ray = ray_;
+
+    // prepare ray for fast queries
+    auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+    auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+        (ray_dinv.z < 0) ? 1 : 0};
+
+    // node stack, proceeding along the split axis from smallest to largest
+    int node_stack[128];
+    auto node_cur = 0;
+    auto push_children = [&](int nodeid) {
+        auto& node = bvh->compressed_nodes[nodeid];
+        auto first = (&ray_dsign.x)[node.split_axis] ? 0 : 1;
+        node_stack[node_cur++] = nodeid * 2 + first;
+        node_stack[node_cur++] = nodeid * 2 + 1 - first;
+    };
+    push_children(0);
+
+    // walking stack, counting visited nodes
+    auto nnodes = (uint64_t)0;
+    while (node_cur) {
+        // grab node child
+        auto child = node_stack[--node_cur];
+        auto& node = bvh->compressed_nodes[child / 2];
+        auto c = child % 2;
+        auto leaf = (bool)(node.leaf_mask & (1 << c));
+        if (leaf && !node.counts[c]) continue;
+        nnodes++;
 
         // intersect bbox
-        if (!distance_check_bbox(pos, max_dist, node.bbox)) continue;
+        if (!intersect_bbox(
+                ray, ray_dinv, ray_dsign, decode_compressed_bbox(node, c)))
+            continue;
+
+        // intersect node, switching based on node type
+        if (!leaf) {
+            push_children(node.children[c]);
+        } else if (intersect_bvh_leaf(bvh, get_compressed_leaf(bvh, node, c),
+                       ray, find_any, dist, iid, eid, uv)) {
+            hit = true;
+        }
+
+        // check for early exit
+        if (find_any && hit) break;
+    }
+
+    _bvh_stats.nnodes += nnodes;
+    return hit;
+}
+
+// Intersect ray with a bvh.
+bool intersect_bvh(const std::shared_ptr<bvh_tree>& bvh, const ray3f& ray_,
+    bool find_any, float& dist, int& iid, int& eid, vec2f& uv) {
+    // use compressed or wide nodes when available
+    if (!bvh->compressed_nodes.empty())
+        return intersect_compressed_bvh(
+            bvh, ray_, find_any, dist, iid, eid, uv);
+    if (!bvh->wide_nodes.empty())
+        return intersect_wide_bvh(bvh, ray_, find_any, dist, iid, eid, uv);
+
+    // node stack
+    int node_stack[128];
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+
+    // shared variables
+    auto hit = false;
+
+    // copy ray to modify it
+    auto ray = ray_;
+
+    // prepare ray for fast queries
+    auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+    auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+        (ray_dinv.z < 0) ? 1 : 0};
+
+    // walking stack, counting visited nodes
+    auto nnodes = (uint64_t)0;
+    while (node_cur) {
+        // grab node
+        auto& node = bvh->nodes[node_stack[--node_cur]];
+        nnodes++;
+
+        // intersect bbox
+        if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
 
         // intersect node, switching based on node type
-        // for each type, iterate over the the primitive list
-        switch (node.type) {
-            case bvh_node_type::internal: {
-                // internal node
+        if (node.type == bvh_node_type::internal) {
+            // for internal nodes, attempts to proceed along the
+            // split axis from smallest to largest nodes
+            if ((&ray_dsign.x)[node.split_axis]) {
                 node_stack[node_cur++] = node.prims[0];
                 node_stack[node_cur++] = node.prims[1];
-            } break;
-            case bvh_node_type::triangle: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& t = bvh->triangles[node.prims[i]];
-                    if (overlap_triangle(pos, max_dist, bvh->pos[t.x],
-                            bvh->pos[t.y], bvh->pos[t.z], bvh->radius[t.x],
-                            bvh->radius[t.y], bvh->radius[t.z], dist, uv)) {
-                        hit = true;
-                        max_dist = dist;
-                        eid = node.prims[i];
-                    }
+            } else {
+                node_stack[node_cur++] = node.prims[1];
+                node_stack[node_cur++] = node.prims[0];
+            }
+        } else if (intersect_bvh_leaf(
+                       bvh, node, ray, find_any, dist, iid, eid, uv)) {
+            hit = true;
+        }
+
+        // check for early exit
+        if (find_any && hit) break;
+    }
+
+    _bvh_stats.nnodes += nnodes;
+    return hit;
+}
+
+// Intersect a packet of at most `bvh_packet_size` rays with a bvh. Nodes are
+// fetched once per packet and tested against the rays still active in the
+// subtree. Instance leaves pass the transformed packet to the shape bvhs.
+void intersect_bvh_packet(const std::shared_ptr<bvh_tree>& bvh,
+    const ray3f* rays_, int nrays, bool find_any, float* dist, int* iid,
+    int* eid, vec2f* uv, bool* hit) {
+    // compressed nodes are traversed one ray at a time
+    if (!bvh->compressed_nodes.empty()) {
+        for (auto r = 0; r < nrays; r++) {
+            hit[r] = intersect_compressed_bvh(
+                bvh, rays_[r], find_any, dist[r], iid[r], eid[r], uv[r]);
+        }
+        return;
+    }
+
+    // node stack, with the mask of rays that reached each node
+    int node_stack[128];
+    uint32_t mask_stack[128];
+    auto node_cur = 0;
+    node_stack[node_cur] = 0;
+    mask_stack[node_cur++] = (1u << nrays) - 1;
+
+    // copy rays to modify them and prepare them for fast queries
+    ray3f rays[bvh_packet_size];
+    vec3f rays_dinv[bvh_packet_size];
+    vec3i rays_dsign[bvh_packet_size];
+    for (auto r = 0; r < nrays; r++) {
+        rays[r] = rays_[r];
+        rays_dinv[r] = {1 / rays[r].d.x, 1 / rays[r].d.y, 1 / rays[r].d.z};
+        rays_dsign[r] = {(rays_dinv[r].x < 0) ? 1 : 0,
+            (rays_dinv[r].y < 0) ? 1 : 0, (rays_dinv[r].z < 0) ? 1 : 0};
+        hit[r] = false;
+    }
+
+    // rays that do not need further traversal
+    auto done_mask = 0u;
+
+    // walking stack, counting visited nodes
+    auto nnodes = (uint64_t)0;
+    while (node_cur) {
+        // grab node
+        node_cur--;
+        auto& node = bvh->nodes[node_stack[node_cur]];
+        auto active = mask_stack[node_cur] & ~done_mask;
+        nnodes++;
+
+        // intersect bbox with all active rays
+        auto mask = 0u;
+        for (auto r = 0; r < nrays; r++) {
+            if (!(active & (1u << r))) continue;
+            if (intersect_bbox(rays[r], rays_dinv[r], rays_dsign[r], node.bbox))
+                mask |= 1u << r;
+        }
+        if (!mask) continue;
+
+        // intersect node, switching based on node type
+        if (node.type == bvh_node_type::internal) {
+            // proceed along the split axis using the first active ray
+            auto first = 0;
+            while (!(mask & (1u << first))) first++;
+            auto first_child = (&rays_dsign[first].x)[node.split_axis] ? 1 : 0;
+            node_stack[node_cur] = node.prims[1 - first_child];
+            mask_stack[node_cur++] = mask;
+            node_stack[node_cur] = node.prims[first_child];
+            mask_stack[node_cur++] = mask;
+        } else if (node.type == bvh_node_type::instance) {
+            for (auto i = 0; i < node.count; i++) {
+                // gather active rays in instance space
+                auto idx = node.prims[i];
+                ray3f irays[bvh_packet_size];
+                int ids[bvh_packet_size];
+                auto n = 0;
+                for (auto r = 0; r < nrays; r++) {
+                    if (!(mask & (1u << r)) || (done_mask & (1u << r)))
+                        continue;
+                    ids[n] = r;
+                    irays[n++] =
+                        transform_ray(bvh->ist_inv_frames[idx], rays[r]);
                 }
-            } break;
-            case bvh_node_type::quad: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& q = bvh->quads[node.prims[i]];
-                    if (overlap_quad(pos, max_dist, bvh->pos[q.x],
-                            bvh->pos[q.y], bvh->pos[q.z], bvh->pos[q.w],
-                            bvh->radius[q.x], bvh->radius[q.y],
-                            bvh->radius[q.z], bvh->radius[q.w], dist, uv)) {
-                        hit = true;
-                        max_dist = dist;
-                        eid = node.prims[i];
-                    }
+                if (!n) break;
+
+                // intersect shape bvh and scatter the results
+                float idist[bvh_packet_size];
+                int iiid[bvh_packet_size], ieid[bvh_packet_size];
+                vec2f iuv[bvh_packet_size];
+                bool ihit[bvh_packet_size];
+                intersect_bvh_packet(bvh->ist_bvhs[idx], irays, n, find_any,
+                    idist, iiid, ieid, iuv, ihit);
+                for (auto k = 0; k < n; k++) {
+                    if (!ihit[k]) continue;
+                    auto r = ids[k];
+                    hit[r] = true;
+                    dist[r] = idist[k];
+                    eid[r] = ieid[k];
+                    uv[r] = iuv[k];
+                    iid[r] = idx;
+                    rays[r].tmax = idist[k];
+                    if (find_any) done_mask |= 1u << r;
                 }
-            } break;
-            case bvh_node_type::line: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& l = bvh->lines[node.prims[i]];
-                    if (overlap_line(pos, max_dist, bvh->pos[l.x],
-                            bvh->pos[l.y], bvh->radius[l.x], bvh->radius[l.y],
-                            dist, uv)) {
-                        hit = true;
-                        max_dist = dist;
-                        eid = node.prims[i];
-                    }
+            }
+        } else {
+            for (auto r = 0; r < nrays; r++) {
+                if (!(mask & (1u << r))) continue;
+                if (intersect_bvh_leaf(bvh, node, rays[r], find_any, dist[r],
+                        iid[r], eid[r], uv[r])) {
+                    hit[r] = true;
+                    if (find_any) done_mask |= 1u << r;
                 }
-            } break;
-            case bvh_node_type::point: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto& p = bvh->points[node.prims[i]];
-                    if (overlap_point(pos, max_dist, bvh->pos[p],
-                            bvh->radius[p], dist, uv)) {
-                        hit = true;
-                        max_dist = dist;
-                        eid = node.prims[i];
-                    }
+            }
+        }
+
+        // check for early exit
+        if (find_any && done_mask == (1u << nrays) - 1) break;
+    }
+
+    _bvh_stats.nnodes += nnodes;
+}
+
+// Intersect a group of rays with a bvh, in packets of `bvh_packet_size`.
+void intersect_bvh(const std::shared_ptr<bvh_tree>& bvh, const ray3f* rays,
+    int nrays, bool find_any, float* dist, int* iid, int* eid, vec2f* uv,
+    bool* hit) {
+    for (auto start = 0; start < nrays; start += bvh_packet_size) {
+        intersect_bvh_packet(bvh, rays + start,
+            min(bvh_packet_size, nrays - start), find_any, dist + start,
+            iid + start, eid + start, uv + start, hit + start);
+    }
+}
+
+// Finds the closest element within the primitives of a bvh leaf, shrinking
+// `max_dist` on overlap.
+bool overlap_bvh_leaf(const std::shared_ptr<bvh_tree>& bvh,
+    const bvh_node& node, const vec3f& pos, float& max_dist, bool find_any,
+    float& dist, int& iid, int& eid, vec2f& uv) {
+    // radius is optional for triangles and quads
+    auto radius = [&bvh](int vid) {
+        return bvh->radius.empty() ? 0.0f : bvh->radius[vid];
+    };
+    auto hit = false;
+    switch (node.type) {
+        case bvh_node_type::internal: break;
+        case bvh_node_type::triangle: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& t = bvh->triangles[node.prims[i]];
+                if (overlap_triangle(pos, max_dist, bvh->pos[t.x],
+                        bvh->pos[t.y], bvh->pos[t.z], radius(t.x),
+                        radius(t.y), radius(t.z), dist, uv)) {
+                    hit = true;
+                    max_dist = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-            case bvh_node_type::vertex: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto idx = node.prims[i];
-                    if (overlap_point(pos, max_dist, bvh->pos[idx],
-                            bvh->radius[idx], dist, uv)) {
-                        hit = true;
-                        max_dist = dist;
-                        eid = node.prims[i];
-                    }
+            }
+        } break;
+        case bvh_node_type::quad: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& q = bvh->quads[node.prims[i]];
+                if (overlap_quad(pos, max_dist, bvh->pos[q.x], bvh->pos[q.y],
+                        bvh->pos[q.z], bvh->pos[q.w], radius(q.x), radius(q.y),
+                        radius(q.z), radius(q.w), dist, uv)) {
+                    hit = true;
+                    max_dist = dist;
+                    eid = node.prims[i];
                 }
-            } break;
-            case bvh_node_type::instance: {
-                for (auto i = 0; i < node.count; i++) {
-                    auto idx = node.prims[i];
-                    if (overlap_bvh(bvh->ist_bvhs[idx],
-                            transform_point(bvh->ist_inv_frames[idx], pos),
-                            max_dist, find_any, dist, iid, eid, uv)) {
-                        hit = true;
-                        max_dist = dist;
-                        iid = node.prims[i];
-                    }
+            }
+        } break;
+        case bvh_node_type::line: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& l = bvh->lines[node.prims[i]];
+                if (overlap_line(pos, max_dist, bvh->pos[l.x], bvh->pos[l.y],
+                        bvh->radius[l.x], bvh->radius[l.y], dist, uv)) {
+                    hit = true;
+                    max_dist = dist;
+                    eid = node.prims[i];
                 }
-            } break;
+            }
+        } break;
+        case bvh_node_type::point: {
+            for (auto i = 0; i < node.count; i++) {
+                auto& p = bvh->points[node.prims[i]];
+                if (overlap_point(pos, max_dist, bvh->pos[p], bvh->radius[p],
+                        dist, uv)) {
+                    hit = true;
+                    max_dist = dist;
+                    eid = node.prims[i];
+                }
+            }
+        } break;
+        case bvh_node_type::vertex: {
+            for (auto i = 0; i < node.count; i++) {
+                auto idx = node.prims[i];
+                if (overlap_point(pos, max_dist, bvh->pos[idx],
+                        bvh->radius[idx], dist, uv)) {
+                    hit = true;
+                    max_dist = dist;
+                    eid = node.prims[i];
+                }
+            }
+        } break;
+        case bvh_node_type::instance: {
+            for (auto i = 0; i < node.count; i++) {
+                auto idx = node.prims[i];
+                if (overlap_bvh(bvh->ist_bvhs[idx],
+                        transform_point(bvh->ist_inv_frames[idx], pos),
+                        max_dist, find_any, dist, iid, eid, uv)) {
+                    hit = true;
+                    max_dist = dist;
+                    iid = node.prims[i];
+                }
+            }
+        } break;
+    }
+    return hit;
+}
+
+// Finds the closest element with a wide bvh.
+bool overlap_wide_bvh(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
+    float max_dist, bool find_any, float& dist, int& iid, int& eid, vec2f& uv) {
+    // node stack, with leaves stored as negative binary node indices
+    int node_stack[256];
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+
+    // hit
+    auto hit = false;
+
+    // walking stack
+    while (node_cur) {
+        // grab node
+        auto nodeid = node_stack[--node_cur];
+
+        // overlap leaf
+        if (nodeid < 0) {
+            if (overlap_bvh_leaf(bvh, bvh->nodes[~nodeid], pos, max_dist,
+                    find_any, dist, iid, eid, uv)) {
+                hit = true;
+                if (find_any) return true;
+            }
+            continue;
+        }
+
+        // check children bboxes
+        auto& node = bvh->wide_nodes[nodeid];
+        auto mask = distance_check_wide_bbox(pos, max_dist, node);
+        for (auto i = 0; i < node.count; i++) {
+            if (!(mask & (1 << i))) continue;
+            node_stack[node_cur++] = (node.leaf_mask & (1 << i)) ?
+                                         ~(int)node.children[i] :
+                                         (int)node.children[i];
+        }
+    }
+
+    return hit;
+}
+
+// Finds the closest element with a compressed bvh, visiting nodes as in
+// the binary tree.
+bool overlap_compressed_bvh(const std::shared_ptr<bvh_tree>& bvh,
+    const vec3f& pos, float max_dist, bool find_any, float& dist, int& iid,
+    int& eid, vec2f& uv) {
+    // node stack, holding node children as in `intersect_compressed_bvh()`
+    int node_stack[64];
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+    node_stack[node_cur++] = 1;
+
+    // hit
+    auto hit = false;
+
+    // walking stack
+    while (node_cur) {
+        // grab node child
+        auto child = node_stack[--node_cur];
+        auto& node = bvh->compressed_nodes[child / 2];
+        auto c = child % 2;
+        auto leaf = (bool)(node.leaf_mask & (1 << c));
+        if (leaf && !node.counts[c]) continue;
+
+        // intersect bbox
+        if (!distance_check_bbox(
+                pos, max_dist, decode_compressed_bbox(node, c)))
+            continue;
+
+        // intersect node, switching based on node type
+        if (!leaf) {
+            node_stack[node_cur++] = node.children[c] * 2;
+            node_stack[node_cur++] = node.children[c] * 2 + 1;
+        } else if (overlap_bvh_leaf(bvh, get_compressed_leaf(bvh, node, c),
+                       pos, max_dist, find_any, dist, iid, eid, uv)) {
+            hit = true;
         }
 
         // check for early exit
@@ -1767,6 +2910,246 @@ bool overlap_bvh(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
     return hit;
 }
 
+// Finds the closest element with a bvh.
+bool overlap_bvh(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
+    float max_dist, bool find_any, float& dist, int& iid, int& eid, vec2f& uv) {
+    // use compressed or wide nodes when available
+    if (!bvh->compressed_nodes.empty()) {
+        return overlap_compressed_bvh(
+            bvh, pos, max_dist, find_any, dist, iid, eid, uv);
+    }
+    if (!bvh->wide_nodes.empty()) {
+        return overlap_wide_bvh(
+            bvh, pos, max_dist, find_any, dist, iid, eid, uv);
+    }
+
+    // node stack
+    int node_stack[64];
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+
+    // hit
+    auto hit = false;
+
+    // walking stack
+    while (node_cur) {
+        // grab node
+        auto node = bvh->nodes[node_stack[--node_cur]];
+
+        // intersect bbox
+        if (!distance_check_bbox(pos, max_dist, node.bbox)) continue;
+
+        // intersect node, switching based on node type
+        if (node.type == bvh_node_type::internal) {
+            // internal node
+            node_stack[node_cur++] = node.prims[0];
+            node_stack[node_cur++] = node.prims[1];
+        } else if (overlap_bvh_leaf(bvh, node, pos, max_dist, find_any, dist,
+                       iid, eid, uv)) {
+            hit = true;
+        }
+
+        // check for early exit
+        if (find_any && hit) return true;
+    }
+
+    return hit;
+}
+
+// Number of positions in the chunks of batched queries run as one task.
+const int bvh_batch_chunk = 256;
+
+// Order of positions along a Morton curve over their bounds, so that
+// consecutive queries are close in space.
+std::vector<int> make_morton_order(const vec3f* pos, int npos) {
+    auto bbox = invalid_bbox3f;
+    for (auto i = 0; i < npos; i++) bbox += pos[i];
+    auto size = bbox.max - bbox.min;
+    auto scale = vec3f{(size.x > 0) ? 1023 / size.x : 0,
+        (size.y > 0) ? 1023 / size.y : 0, (size.z > 0) ? 1023 / size.z : 0};
+    // spreads the 10 low bits of v two bits apart
+    auto expand = [](uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    };
+    auto codes = std::vector<std::pair<uint32_t, int>>(npos);
+    for (auto i = 0; i < npos; i++) {
+        auto q = (pos[i] - bbox.min) * scale;
+        codes[i] = {expand((uint32_t)clamp(q.x, 0.0f, 1023.0f)) |
+                        (expand((uint32_t)clamp(q.y, 0.0f, 1023.0f)) << 1) |
+                        (expand((uint32_t)clamp(q.z, 0.0f, 1023.0f)) << 2),
+            i};
+    }
+    std::sort(codes.begin(), codes.end());
+    auto order = std::vector<int>(npos);
+    for (auto i = 0; i < npos; i++) order[i] = codes[i].second;
+    return order;
+}
+
+// Runs `func(idx)` for all positions, in Morton order, over chunks run in
+// parallel. The first error raised by a chunk is rethrown after the join.
+template <typename Func>
+void run_bvh_batch(
+    const vec3f* pos, int npos, int nthreads, const Func& func) {
+    auto order = make_morton_order(pos, npos);
+    auto nchunks = (npos + bvh_batch_chunk - 1) / bvh_batch_chunk;
+    auto error = std::exception_ptr();
+    std::mutex error_mutex;
+    parallel_for(nchunks,
+        [&](int chunk) {
+            try {
+                auto end = min((chunk + 1) * bvh_batch_chunk, npos);
+                for (auto i = chunk * bvh_batch_chunk; i < end; i++)
+                    func(order[i]);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        },
+        nthreads);
+    if (error) std::rethrow_exception(error);
+}
+
+// Finds the closest elements to many positions with a bvh.
+void overlap_bvh_batch(const std::shared_ptr<bvh_tree>& bvh, const vec3f* pos,
+    int npos, float max_dist, bool find_any, bvh_overlap* overlaps,
+    int nthreads) {
+    run_bvh_batch(pos, npos, nthreads, [&](int idx) {
+        auto& overlap = overlaps[idx];
+        overlap = {};
+        if (!overlap_bvh(bvh, pos[idx], max_dist, find_any, overlap.dist,
+                overlap.iid, overlap.eid, overlap.uv)) {
+            overlap = {};
+        }
+    });
+}
+std::vector<bvh_overlap> overlap_bvh_batch(
+    const std::shared_ptr<bvh_tree>& bvh, const std::vector<vec3f>& pos,
+    float max_dist, bool find_any, int nthreads) {
+    auto overlaps = std::vector<bvh_overlap>(pos.size());
+    overlap_bvh_batch(bvh, pos.data(), (int)pos.size(), max_dist, find_any,
+        overlaps.data(), nthreads);
+    return overlaps;
+}
+
+// Checks that a bvh holds points or vertices, as built by `build_bvh()`.
+void check_point_bvh(const std::shared_ptr<bvh_tree>& bvh) {
+    if (!bvh->lines.empty() || !bvh->triangles.empty() ||
+        !bvh->quads.empty() || bvh->pos.empty())
+        throw std::runtime_error("nearest points need a point bvh");
+}
+
+// Adds the points of a leaf to the `count` nearest points found so far,
+// kept sorted by distance, and shrinks `max_dist` once `k` are found.
+void nearest_bvh_leaf(const std::shared_ptr<bvh_tree>& bvh,
+    const bvh_node& node, const vec3f& pos, int k, float& max_dist,
+    int& count, int* eids, float* dists) {
+    for (auto i = 0; i < node.count; i++) {
+        auto eid = node.prims[i];
+        auto vid = (node.type == bvh_node_type::point) ? bvh->points[eid] : eid;
+        auto dist2 = length_sqr(bvh->pos[vid] - pos);
+        if (dist2 > max_dist * max_dist) continue;
+        auto dist = sqrt(dist2);
+        if (count == k && dist >= dists[k - 1]) continue;
+        // insertion into the sorted list
+        auto j = (count < k) ? count++ : k - 1;
+        while (j > 0 && dists[j - 1] > dist) {
+            eids[j] = eids[j - 1];
+            dists[j] = dists[j - 1];
+            j--;
+        }
+        eids[j] = eid;
+        dists[j] = dist;
+        if (count == k) max_dist = dists[k - 1];
+    }
+}
+
+// Finds the k nearest points with a compressed bvh.
+int nearest_compressed_bvh_points(const std::shared_ptr<bvh_tree>& bvh,
+    const vec3f& pos, int k, float max_dist, int* eids, float* dists) {
+    // node stack, holding node children as in `intersect_compressed_bvh()`
+    int node_stack[64];
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+    node_stack[node_cur++] = 1;
+
+    // walking stack
+    auto count = 0;
+    while (node_cur) {
+        auto child = node_stack[--node_cur];
+        auto& node = bvh->compressed_nodes[child / 2];
+        auto c = child % 2;
+        auto leaf = (bool)(node.leaf_mask & (1 << c));
+        if (leaf && !node.counts[c]) continue;
+        if (!distance_check_bbox(
+                pos, max_dist, decode_compressed_bbox(node, c)))
+            continue;
+        if (!leaf) {
+            node_stack[node_cur++] = node.children[c] * 2;
+            node_stack[node_cur++] = node.children[c] * 2 + 1;
+        } else {
+            nearest_bvh_leaf(bvh, get_compressed_leaf(bvh, node, c), pos, k,
+                max_dist, count, eids, dists);
+        }
+    }
+    return count;
+}
+
+// Finds the k nearest points with a bvh.
+int nearest_bvh_points(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
+    int k, float max_dist, int* eids, float* dists) {
+    for (auto i = 0; i < k; i++) {
+        eids[i] = -1;
+        dists[i] = flt_max;
+    }
+    if (k <= 0 || bvh->nodes.empty()) return 0;
+    check_point_bvh(bvh);
+    if (!bvh->compressed_nodes.empty()) {
+        return nearest_compressed_bvh_points(
+            bvh, pos, k, max_dist, eids, dists);
+    }
+
+    // node stack
+    int node_stack[64];
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+
+    // walking stack
+    auto count = 0;
+    while (node_cur) {
+        auto& node = bvh->nodes[node_stack[--node_cur]];
+        if (!distance_check_bbox(pos, max_dist, node.bbox)) continue;
+        if (node.type == bvh_node_type::internal) {
+            // visit the closer child first, so the distance shrinks sooner
+            auto& bbox0 = bvh->nodes[node.prims[0]].bbox;
+            auto& bbox1 = bvh->nodes[node.prims[1]].bbox;
+            auto near0 = length_sqr((bbox0.min + bbox0.max) / 2 - pos) <
+                         length_sqr((bbox1.min + bbox1.max) / 2 - pos);
+            node_stack[node_cur++] = node.prims[near0 ? 1 : 0];
+            node_stack[node_cur++] = node.prims[near0 ? 0 : 1];
+        } else {
+            nearest_bvh_leaf(
+                bvh, node, pos, k, max_dist, count, eids, dists);
+        }
+    }
+    return count;
+}
+void nearest_bvh_points_batch(const std::shared_ptr<bvh_tree>& bvh,
+    const std::vector<vec3f>& pos, int k, float max_dist,
+    std::vector<int>& eids, std::vector<float>& dists, int nthreads) {
+    eids.assign(pos.size() * max(k, 0), -1);
+    dists.assign(pos.size() * max(k, 0), flt_max);
+    if (k <= 0 || bvh->nodes.empty()) return;
+    check_point_bvh(bvh);
+    run_bvh_batch(pos.data(), (int)pos.size(), nthreads, [&](int idx) {
+        nearest_bvh_points(bvh, pos[idx], k, max_dist,
+            eids.data() + (size_t)idx * k, dists.data() + (size_t)idx * k);
+    });
+}
+
 #if 0
     // Finds the overlap between BVH leaf nodes.
     template <typename OverlapElem>
@@ -2900,7 +4283,7 @@ vec3f tonemap_filmic(const vec3f& hdr) {
 vec3f tonemap_hdr(const vec3f& hdr, float exposure, float gamma, bool filmic) {
     auto ldr = hdr * pow(2.0f, exposure);
     if (filmic) ldr = tonemap_filmic(ldr);
-    ldr = linear_to_gamma(ldr);
+    if (gamma != 1) ldr = linear_to_gamma(ldr, gamma);
     return ldr;
 }
 
@@ -2915,56 +4298,156 @@ namespace ygl {
 image4f gamma_to_linear(const image4f& srgb, float gamma) {
     if (gamma == 1) return srgb;
     auto lin = image4f{srgb.size};
-    for (auto j = 0; j < srgb.size.y; j++) {
-        for (auto i = 0; i < srgb.size.x; i++) {
-            xyz(lin[{i, j}]) = gamma_to_linear(xyz(srgb[{i, j}]), gamma);
-            lin[{i, j}].w = srgb[{i, j}].w;
-        }
-    }
+    parallel_rows(srgb.size, [&](int j0, int j1) {
+        auto end = (size_t)j1 * srgb.size.x;
+        for (auto idx = (size_t)j0 * srgb.size.x; idx < end; idx++)
+            lin.pxl[idx] = gamma_to_linear(srgb.pxl[idx], gamma);
+    });
     return lin;
 }
 image4f linear_to_gamma(const image4f& lin, float gamma) {
     if (gamma == 1) return lin;
     auto srgb = image4f{lin.size};
-    for (auto j = 0; j < lin.size.y; j++) {
-        for (auto i = 0; i < lin.size.x; i++) {
-            xyz(srgb[{i, j}]) = linear_to_gamma(xyz(lin[{i, j}]), gamma);
-            srgb[{i, j}].w = lin[{i, j}].w;
-        }
-    }
+    parallel_rows(lin.size, [&](int j0, int j1) {
+        auto end = (size_t)j1 * lin.size.x;
+        for (auto idx = (size_t)j0 * lin.size.x; idx < end; idx++)
+            srgb.pxl[idx] = linear_to_gamma(lin.pxl[idx], gamma);
+    });
     return srgb;
 }
 
-// Conversion from/to floats.
+// Conversion from/to floats, over the flat channel arrays so that the
+// loops vectorize.
 image4f byte_to_float(const image4b& bt) {
     auto fl = image4f{bt.size};
-    for (auto j = 0; j < bt.size.y; j++)
-        for (auto i = 0; i < bt.size.x; i++)
-            fl[{i, j}] = byte_to_float(bt[{i, j}]);
+    parallel_rows(bt.size, [&](int j0, int j1) {
+        auto src = (const byte*)bt.pxl.data();
+        auto dst = (float*)fl.pxl.data();
+        auto end = (size_t)j1 * bt.size.x * 4;
+        for (auto c = (size_t)j0 * bt.size.x * 4; c < end; c++)
+            dst[c] = src[c] / 255.0f;
+    });
     return fl;
 }
 image4b float_to_byte(const image4f& fl) {
     auto bt = image4b{fl.size};
-    for (auto j = 0; j < fl.size.y; j++)
-        for (auto i = 0; i < fl.size.x; i++)
-            bt[{i, j}] = float_to_byte(fl[{i, j}]);
+    parallel_rows(fl.size, [&](int j0, int j1) {
+        auto src = (const float*)fl.pxl.data();
+        auto dst = (byte*)bt.pxl.data();
+        auto end = (size_t)j1 * fl.size.x * 4;
+        for (auto c = (size_t)j0 * fl.size.x * 4; c < end; c++)
+            dst[c] = (byte)clamp(int(src[c] * 256), 0, 255);
+    });
     return bt;
 }
 
+// Bytes per texel of compact formats.
+int get_texel_size(texel_format format) {
+    switch (format) {
+        case texel_format::rgba8: return 4;
+        case texel_format::r8: return 1;
+        case texel_format::rgba16f: return 8;
+    }
+    return 0;
+}
+
+// Makes an empty texel image with its decoding table.
+texel_image init_texel_image(
+    const vec2i& size, texel_format format, float gamma) {
+    auto img = texel_image();
+    img.size = size;
+    img.format = format;
+    img.data.resize((size_t)size.x * size.y * get_texel_size(format));
+    for (auto b = 0; b < 256; b++) {
+        img.lut[b] = (gamma == 1) ? b / 255.0f : pow(b / 255.0f, gamma);
+    }
+    return img;
+}
+
+// Conversion from/to compact texel images.
+texel_image make_texel_image(
+    const image4f& img, texel_format format, float gamma) {
+    auto timg = init_texel_image(img.size, format, gamma);
+    auto encode = [gamma](float a) {
+        if (gamma != 1) a = pow(max(a, 0.0f), 1 / gamma);
+        return (byte)clamp((int)(a * 255 + 0.5f), 0, 255);
+    };
+    auto data = timg.data.data();
+    for (auto& p : img.pxl) {
+        switch (format) {
+            case texel_format::rgba8:
+                *data++ = encode(p.x);
+                *data++ = encode(p.y);
+                *data++ = encode(p.z);
+                *data++ = (byte)clamp((int)(p.w * 255 + 0.5f), 0, 255);
+                break;
+            case texel_format::r8: *data++ = encode(p.x); break;
+            case texel_format::rgba16f: {
+                auto h = vec<uint16_t, 4>{float_to_half(p.x),
+                    float_to_half(p.y), float_to_half(p.z), float_to_half(p.w)};
+                memcpy(data, &h, sizeof(h));
+                data += sizeof(h);
+            } break;
+        }
+    }
+    return timg;
+}
+texel_image make_texel_image(
+    const image4b& img, texel_format format, float gamma) {
+    if (format == texel_format::rgba16f)
+        return make_texel_image(byte_to_float(img), format, 1);
+    auto timg = init_texel_image(img.size, format, gamma);
+    if (format == texel_format::rgba8) {
+        memcpy(timg.data.data(), img.pxl.data(), timg.data.size());
+    } else {
+        for (auto i = 0; i < img.pxl.size(); i++) timg.data[i] = img.pxl[i].x;
+    }
+    return timg;
+}
+image4f texel_to_float(const texel_image& img) {
+    auto fl = image4f{img.size};
+    for (auto j = 0; j < img.size.y; j++)
+        for (auto i = 0; i < img.size.x; i++)
+            fl[{i, j}] = lookup_texel(img, {i, j});
+    return fl;
+}
+
+// Decodes a compact texel to linear floats.
+vec4f lookup_texel(const texel_image& img, const vec2i& ij) {
+    auto idx = (size_t)ij.y * img.size.x + ij.x;
+    switch (img.format) {
+        case texel_format::rgba8: {
+            auto t = img.data.data() + idx * 4;
+            return {img.lut[t[0]], img.lut[t[1]], img.lut[t[2]], t[3] / 255.0f};
+        }
+        case texel_format::r8: {
+            auto c = img.lut[img.data[idx]];
+            return {c, c, c, 1};
+        }
+        case texel_format::rgba16f: {
+            auto h = vec<uint16_t, 4>();
+            memcpy(&h, img.data.data() + idx * 8, sizeof(h));
+            return {half_to_float(h.x), half_to_float(h.y), half_to_float(h.z),
+                half_to_float(h.w)};
+        }
+    }
+    return {};
+}
+
 // Tonemap image
 image4f tonemap_image(
     const image4f& hdr, float exposure, float gamma, bool filmic) {
     auto ldr = image4f{hdr.size};
     auto scale = pow(2.0f, exposure);
-    for (auto j = 0; j < hdr.size.y; j++) {
-        for (auto i = 0; i < hdr.size.x; i++) {
-            auto c = xyz(hdr[{i, j}]);
-            c = c * scale;
+    parallel_rows(hdr.size, [&](int j0, int j1) {
+        auto end = (size_t)j1 * hdr.size.x;
+        for (auto idx = (size_t)j0 * hdr.size.x; idx < end; idx++) {
+            auto c = xyz(hdr.pxl[idx]) * scale;
             if (filmic) c = tonemap_filmic(c);
-            if (gamma != 1) c = linear_to_gamma(c);
-            ldr[{i, j}] = {c.x, c.y, c.z, hdr[{i, j}].w};
+            if (gamma != 1) c = linear_to_gamma(c, gamma);
+            ldr.pxl[idx] = {c.x, c.y, c.z, hdr.pxl[idx].w};
         }
-    }
+    });
     return ldr;
 }
 
@@ -3361,6 +4844,64 @@ void update_bbox(const std::shared_ptr<scene>& scn, bool do_shapes) {
     }
 }
 
+// Updates the scene bvh for instances whose frame or shape bvh changed.
+int refit_bvh_instances(
+    const std::shared_ptr<scene>& scn, float rebuild_ratio) {
+    auto bvh = scn->bvh;
+    if (!bvh) throw std::runtime_error("missing scene bvh");
+    auto& params = bvh->params;
+
+    // rebuild the instance tree if instances were added or removed
+    auto compressed = !bvh->compressed_nodes.empty();
+    auto wide = !bvh->wide_nodes.empty();
+    if (bvh->ist_bvhs.size() != scn->instances.size()) {
+        bvh->ist_frames.resize(scn->instances.size());
+        bvh->ist_inv_frames.resize(scn->instances.size());
+        bvh->ist_bvhs.resize(scn->instances.size());
+        for (auto i = 0; i < scn->instances.size(); i++) {
+            auto ist = scn->instances[i];
+            bvh->ist_frames[i] = ist->frame;
+            bvh->ist_inv_frames[i] = inverse(ist->frame, false);
+            bvh->ist_bvhs[i] = ist->shp->bvh;
+        }
+        build_bvh(bvh, params.build_type, params.max_prims, params.noparallel);
+        if (wide) build_wide_bvh(bvh);
+        if (compressed) compress_bvh(bvh);
+        return (int)scn->instances.size();
+    }
+
+    // refit the changed instances
+    auto updated = std::vector<int>();
+    for (auto i = 0; i < scn->instances.size(); i++) {
+        auto ist = scn->instances[i];
+        if (bvh->ist_frames[i] == ist->frame &&
+            bvh->ist_bvhs[i] == ist->shp->bvh)
+            continue;
+        bvh->ist_frames[i] = ist->frame;
+        bvh->ist_inv_frames[i] = inverse(ist->frame, false);
+        bvh->ist_bvhs[i] = ist->shp->bvh;
+        updated.push_back(i);
+    }
+    if (updated.empty()) return 0;
+
+    // compressed trees cannot be refit, so rebuild them
+    if (compressed) {
+        build_bvh(bvh, params.build_type, params.max_prims, params.noparallel);
+        compress_bvh(bvh);
+        return (int)updated.size();
+    }
+    refit_bvh(bvh, updated);
+
+    // rebuild if the refits degraded the tree too much
+    auto root_area = bvh_bbox_area(bvh->nodes[0].bbox);
+    auto sah_cost = root_area ? (float)(bvh->sah_area / root_area) : 0;
+    if (sah_cost > rebuild_ratio * bvh->refit_sah_cost) {
+        build_bvh(bvh, params.build_type, params.max_prims, params.noparallel);
+        if (wide) build_wide_bvh(bvh);
+    }
+    return (int)updated.size();
+}
+
 // Updates tesselation.
 void update_tesselation(
     const std::shared_ptr<subdiv>& sbd, std::shared_ptr<shape> shp) {
@@ -3388,10 +4929,33 @@ void update_tesselation(
     update_bbox(shp);
 }
 void update_tesselation(const std::shared_ptr<scene>& scn) {
+    // collect the shapes of dirty subdivs, once each
+    auto updates = std::vector<std::shared_ptr<instance>>();
+    auto visited = std::unordered_set<shape*>();
     for (auto ist : scn->instances) {
-        if (!ist->sbd) continue;
-        update_tesselation(ist->sbd, ist->shp);
+        if (!ist->sbd || !ist->sbd->dirty) continue;
+        if (!visited.insert(ist->shp.get()).second) continue;
+        updates.push_back(ist);
+    }
+    if (updates.empty()) return;
+
+    // tesselate concurrently, or in parallel within a single subdiv
+    if (updates.size() == 1) {
+        update_tesselation(updates[0]->sbd, updates[0]->shp);
+    } else {
+        auto error = std::exception_ptr();
+        std::mutex error_mutex;
+        parallel_for((int)updates.size(), [&](int idx) {
+            try {
+                update_tesselation(updates[idx]->sbd, updates[idx]->shp);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        });
+        if (error) std::rethrow_exception(error);
     }
+    for (auto ist : updates) ist->sbd->dirty = false;
 }
 
 // Update animation transforms
@@ -3484,26 +5048,182 @@ vec2f compute_animation_range(
 }
 
 // Update lights.
-void update_lights(
-    const std::shared_ptr<scene>& scn, bool do_shapes, bool do_environments) {
+// Recursively builds a light tree node over the lights in [start, end).
+static int make_light_tree_node(std::vector<light_node>& nodes,
+    std::vector<int>& lights, const std::vector<bbox3f>& bboxes,
+    const std::vector<float>& powers, int start, int end, int parent) {
+    auto nodeid = (int)nodes.size();
+    nodes.emplace_back();
+    auto node = light_node();
+    node.parent = parent;
+    auto cbbox = invalid_bbox3f;
+    for (auto i = start; i < end; i++) {
+        node.bbox += bboxes[lights[i]];
+        node.power += powers[lights[i]];
+        cbbox += (bboxes[lights[i]].min + bboxes[lights[i]].max) / 2;
+    }
+    if (end - start == 1) {
+        node.light = lights[start];
+    } else {
+        // split at the median of the largest centroid axis
+        auto csize = cbbox.max - cbbox.min;
+        auto axis = 0;
+        if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
+        if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
+        auto mid = (start + end) / 2;
+        std::nth_element(lights.data() + start, lights.data() + mid,
+            lights.data() + end, [axis, &bboxes](auto a, auto b) {
+                return (&bboxes[a].min.x)[axis] + (&bboxes[a].max.x)[axis] <
+                       (&bboxes[b].min.x)[axis] + (&bboxes[b].max.x)[axis];
+            });
+        node.children[0] = make_light_tree_node(
+            nodes, lights, bboxes, powers, start, mid, nodeid);
+        node.children[1] = make_light_tree_node(
+            nodes, lights, bboxes, powers, mid, end, nodeid);
+    }
+    nodes[nodeid] = node;
+    return nodeid;
+}
+
+// Update lights.
+void update_lights(const std::shared_ptr<scene>& scn, bool do_shapes,
+    bool do_environments, light_sampling_type sampling) {
     if (do_shapes) {
-        for (auto shp : scn->shapes) shp->elem_cdf.clear();
+        for (auto shp : scn->shapes) {
+            shp->elem_cdf.clear();
+            shp->elem_alias.clear();
+        }
     }
     if (do_environments) {
-        for (auto env : scn->environments) env->elem_cdf.clear();
+        for (auto env : scn->environments) {
+            env->row_alias.clear();
+            env->texel_alias.clear();
+            env->texel_sum = 0;
+        }
     }
     scn->lights.clear();
+    for (auto ist : scn->instances) ist->light_id = -1;
+
+    for (auto ist : scn->instances) {
+        if (!ist->mat || ist->mat->ke == zero3f) continue;
+        if (ist->shp->triangles.empty()) continue;
+        ist->light_id = (int)scn->lights.size();
+        scn->lights.push_back(ist);
+        if (ist->shp->elem_cdf.empty()) update_shape_cdf(ist->shp);
+    }
+
+    for (auto env : scn->environments) {
+        if (env->ke == zero3f) continue;
+        if (env->row_alias.empty()) update_environment_cdf(env);
+    }
+
+    // light selection
+    scn->light_sampling = sampling;
+    scn->light_cdf.clear();
+    scn->light_tree.clear();
+    scn->light_leaves.clear();
+    if (sampling == light_sampling_type::uniform) return;
+
+    // power estimates, ignoring textures
+    auto powers = std::vector<float>();
+    for (auto lgt : scn->lights) {
+        auto area = lgt->shp->elem_cdf.back();
+        powers.push_back(pi * area * (lgt->mat->ke.x + lgt->mat->ke.y +
+                                         lgt->mat->ke.z) / 3);
+    }
+    auto bsize = (scn->bbox == invalid_bbox3f) ? zero3f :
+                                                 scn->bbox.max - scn->bbox.min;
+    auto radius = length(bsize) / 2;
+    for (auto env : scn->environments) {
+        powers.push_back(pi * pi * radius * radius *
+                         (env->ke.x + env->ke.y + env->ke.z) / 3);
+    }
+    scn->light_cdf.resize(powers.size());
+    for (auto i = 0; i < powers.size(); i++) {
+        scn->light_cdf[i] = powers[i] + ((i) ? scn->light_cdf[i - 1] : 0);
+    }
+    if (sampling != light_sampling_type::tree || scn->lights.empty()) return;
+
+    // light tree over lights, while environments are picked by power
+    auto bboxes = std::vector<bbox3f>();
+    for (auto lgt : scn->lights) {
+        bboxes.push_back(transform_bbox(lgt->frame, lgt->shp->bbox));
+    }
+    auto lights = std::vector<int>(scn->lights.size());
+    for (auto i = 0; i < lights.size(); i++) lights[i] = i;
+    scn->light_tree.reserve(2 * lights.size() - 1);
+    make_light_tree_node(scn->light_tree, lights, bboxes, powers, 0,
+        (int)lights.size(), -1);
+    scn->light_leaves.assign(scn->lights.size(), -1);
+    for (auto nodeid = 0; nodeid < scn->light_tree.size(); nodeid++) {
+        auto& node = scn->light_tree[nodeid];
+        if (node.light >= 0) scn->light_leaves[node.light] = nodeid;
+    }
+}
+
+// Builds mip levels after an image by box filtering.
+std::vector<image4f> make_texture_mips(const image4f& img) {
+    auto mips = std::vector<image4f>();
+    auto src = &img;
+    while (src->size.x > 1 || src->size.y > 1) {
+        auto size = vec2i{max(src->size.x / 2, 1), max(src->size.y / 2, 1)};
+        auto mip = image4f{size};
+        for (auto j = 0; j < size.y; j++) {
+            for (auto i = 0; i < size.x; i++) {
+                auto i0 = min(2 * i, src->size.x - 1);
+                auto i1 = min(2 * i + 1, src->size.x - 1);
+                auto j0 = min(2 * j, src->size.y - 1);
+                auto j1 = min(2 * j + 1, src->size.y - 1);
+                mip[{i, j}] = ((*src)[{i0, j0}] + (*src)[{i1, j0}] +
+                                  (*src)[{i0, j1}] + (*src)[{i1, j1}]) /
+                              4;
+            }
+        }
+        mips.push_back(std::move(mip));
+        src = &mips.back();
+    }
+    return mips;
+}
 
-    for (auto ist : scn->instances) {
-        if (!ist->mat || ist->mat->ke == zero3f) continue;
-        if (ist->shp->triangles.empty()) continue;
-        scn->lights.push_back(ist);
-        if (ist->shp->elem_cdf.empty()) update_shape_cdf(ist->shp);
+// Update texture mip levels.
+void update_texture_mips(const std::shared_ptr<texture>& txt) {
+    txt->mips = make_texture_mips(txt->img);
+    txt->texel_mips.clear();
+    if (txt->texels.data.empty()) return;
+    auto gamma = (txt->texels.format == texel_format::rgba16f) ? 1 : txt->gamma;
+    for (auto& mip : make_texture_mips(texel_to_float(txt->texels))) {
+        txt->texel_mips.push_back(
+            make_texel_image(mip, txt->texels.format, gamma));
     }
+}
+void update_texture_mips(const std::shared_ptr<scene>& scn) {
+    for (auto txt : scn->textures) update_texture_mips(txt);
+}
 
-    for (auto env : scn->environments) {
-        if (env->ke == zero3f) continue;
-        if (env->elem_cdf.empty()) update_environment_cdf(env);
+// Converts texture images to compact texels.
+void compact_texture(const std::shared_ptr<texture>& txt) {
+    if (txt->img.pxl.empty()) return;
+    auto hdr = false, gray = true;
+    for (auto& p : txt->img.pxl) {
+        if (p.x > 1 || p.y > 1 || p.z > 1) hdr = true;
+        if (p.x != p.y || p.x != p.z || p.w != 1) gray = false;
+    }
+    auto format = (hdr) ? texel_format::rgba16f :
+                          (gray) ? texel_format::r8 : texel_format::rgba8;
+    auto gamma = (hdr) ? 1 : txt->gamma;
+    txt->texels = make_texel_image(txt->img, format, gamma);
+    txt->texel_mips.clear();
+    for (auto& mip : txt->mips) {
+        txt->texel_mips.push_back(make_texel_image(mip, format, gamma));
+    }
+    txt->img = {};
+    txt->mips.clear();
+}
+void compact_textures(const std::shared_ptr<scene>& scn) {
+    auto env_txts = std::unordered_set<std::shared_ptr<texture>>();
+    for (auto env : scn->environments) env_txts.insert(env->ke_txt);
+    for (auto txt : scn->textures) {
+        if (!env_txts.count(txt)) compact_texture(txt);
     }
 }
 
@@ -3511,6 +5231,7 @@ void update_lights(
 // on area/length.
 void update_shape_cdf(const std::shared_ptr<shape>& shp) {
     shp->elem_cdf.clear();
+    shp->elem_alias.clear();
     if (!shp->triangles.empty()) {
         shp->elem_cdf = sample_triangles_cdf(shp->triangles, shp->pos);
     } else if (!shp->lines.empty()) {
@@ -3520,43 +5241,108 @@ void update_shape_cdf(const std::shared_ptr<shape>& shp) {
     } else {
         throw std::runtime_error("empty shape not supported");
     }
+    auto weights = std::vector<float>(shp->elem_cdf.size());
+    for (auto i = 0; i < weights.size(); i++)
+        weights[i] = sample_discrete_pdf(shp->elem_cdf, i);
+    shp->elem_alias = make_alias_table(weights);
+}
+
+// Environment texel weight for sampling, i.e. intensity times solid angle.
+static inline float get_environment_texel_weight(
+    const texture& txt, int i, int j) {
+    auto th = (j + 0.5f) * pi / txt.img.size.y;
+    return max(xyz(txt.img[{i, j}])) * sin(th);
 }
 
 // Update environment CDF for sampling.
 void update_environment_cdf(std::shared_ptr<environment> env) {
-    env->elem_cdf.clear();
+    env->row_alias.clear();
+    env->texel_alias.clear();
+    env->texel_sum = 0;
     auto txt = env->ke_txt;
     if (!txt) return;
-    env->elem_cdf.resize(txt->img.pxl.size());
-    if (!txt->img.pxl.empty()) {
-        for (auto i = 0; i < env->elem_cdf.size(); i++) {
-            auto th = (i / txt->img.size.x + 0.5f) * pi / txt->img.size.y;
-            env->elem_cdf[i] = max(xyz(txt->img.pxl[i])) * sin(th);
-            if (i) env->elem_cdf[i] += env->elem_cdf[i - 1];
-        }
+    if (txt->img.pxl.empty()) throw std::runtime_error("empty texture");
+    auto size = txt->img.size;
+    env->texel_alias.resize(txt->img.pxl.size());
+    auto weights = std::vector<float>(size.x);
+    auto row_weights = std::vector<float>(size.y);
+    auto sum = 0.0;
+    for (auto j = 0; j < size.y; j++) {
+        for (auto i = 0; i < size.x; i++)
+            weights[i] = get_environment_texel_weight(*txt, i, j);
+        auto row_sum = make_alias_table(
+            weights.data(), size.x, env->texel_alias.data() + j * size.x);
+        row_weights[j] = (float)row_sum;
+        sum += row_sum;
+    }
+    // black textures are sampled uniformly
+    if (sum <= 0) {
+        env->texel_alias.clear();
+        return;
+    }
+    env->row_alias = make_alias_table(row_weights);
+    env->texel_sum = (float)sum;
+}
+
+// Points the shape bvh to the shape data without copying it. Points and
+// lines without radius use a default one.
+void update_bvh_views(const std::shared_ptr<shape>& shp) {
+    auto bvh = shp->bvh;
+    bvh->pos = shp->pos;
+    bvh->points = shp->points;
+    bvh->lines = shp->lines;
+    bvh->triangles = shp->triangles;
+    auto needs_radius = !shp->points.empty() || !shp->lines.empty() ||
+                        shp->triangles.empty();
+    if (shp->radius.empty() && needs_radius) {
+        bvh->default_radius.resize(shp->pos.size(), 0.001f);
+        bvh->radius = bvh->default_radius;
     } else {
-        throw std::runtime_error("empty texture");
+        bvh->default_radius.clear();
+        bvh->radius = shp->radius;
     }
 }
 
 // Build a shape BVH
-void update_bvh(const std::shared_ptr<shape>& shp, bool equalsize) {
+void update_bvh(const std::shared_ptr<shape>& shp, const bvh_params& params) {
     if (!shp->bvh) shp->bvh = std::make_shared<bvh_tree>();
-    shp->bvh->pos = shp->pos;
-    shp->bvh->radius = shp->radius;
-    if (shp->bvh->radius.empty())
-        shp->bvh->radius.assign(shp->bvh->radius.size(), 0.001f);
-    shp->bvh->points = shp->points;
-    shp->bvh->lines = shp->lines;
-    shp->bvh->triangles = shp->triangles;
-    build_bvh(shp->bvh, equalsize);
+    shp->bvh->params = params;
+    update_bvh_views(shp);
+    build_bvh(
+        shp->bvh, params.build_type, params.max_prims, params.noparallel);
+    if (params.wide && !params.compressed) build_wide_bvh(shp->bvh);
+    if (params.triangles) build_bvh_triangles(shp->bvh);
+    if (params.compressed) compress_bvh(shp->bvh);
 }
 
 // Build a scene BVH
-void update_bvh(
-    const std::shared_ptr<scene>& scn, bool do_shapes, bool equalsize) {
+void update_bvh(const std::shared_ptr<scene>& scn, bool do_shapes,
+    const bvh_params& params) {
     if (do_shapes) {
-        for (auto shp : scn->shapes) update_bvh(shp, equalsize);
+        if (params.noparallel) {
+            for (auto shp : scn->shapes) update_bvh(shp, params);
+        } else {
+            // large shapes are built one at a time with parallel subtrees,
+            // while small shapes are built concurrently with each other
+            auto small_shapes = std::vector<std::shared_ptr<shape>>();
+            for (auto shp : scn->shapes) {
+                auto nprims = std::max({shp->points.size(),
+                    shp->lines.size(), shp->triangles.size(), shp->pos.size()});
+                if (nprims >= bvh_parallel_min_prims) {
+                    update_bvh(shp, params);
+                } else {
+                    small_shapes.push_back(shp);
+                }
+            }
+            // small shapes are built serially, but keep the given settings
+            parallel_for((int)small_shapes.size(), [&](int idx) {
+                auto shp = small_shapes[idx];
+                auto serial_params = params;
+                serial_params.noparallel = true;
+                update_bvh(shp, serial_params);
+                shp->bvh->params = params;
+            });
+        }
     }
 
     // tree bvh
@@ -3570,15 +5356,15 @@ void update_bvh(
         scn->bvh->ist_inv_frames[i] = inverse(ist->frame, false);
         scn->bvh->ist_bvhs[i] = ist->shp->bvh;
     }
-    build_bvh(scn->bvh, equalsize);
+    scn->bvh->params = params;
+    build_bvh(scn->bvh, params.build_type, params.max_prims, params.noparallel);
+    if (params.wide && !params.compressed) build_wide_bvh(scn->bvh);
+    if (params.compressed) compress_bvh(scn->bvh);
 }
 
 // Refits a scene BVH
 void refit_bvh(const std::shared_ptr<shape>& shp) {
-    shp->bvh->pos = shp->pos;
-    shp->bvh->radius = shp->radius;
-    if (shp->bvh->radius.empty())
-        shp->bvh->radius.assign(shp->bvh->radius.size(), 0.001f);
+    update_bvh_views(shp);
     refit_bvh(shp->bvh);
 }
 
@@ -3674,7 +5460,8 @@ std::vector<std::string> validate(
     auto check_empty_textures =
         [&errs](const std::vector<std::shared_ptr<texture>>& vals) {
             for (auto val : vals) {
-                if (val->img.pxl.empty())
+                if (val->img.pxl.empty() && val->texels.data.empty() &&
+                    !val->cache)
                     errs.push_back("empty texture " + val->name);
             }
         };
@@ -3731,36 +5518,63 @@ scene_intersection intersect_ray(
     return isec;
 }
 
+// Scene intersection for a group of rays.
+void intersect_rays(const std::shared_ptr<scene>& scn, const ray3f* rays,
+    int nrays, scene_intersection* isecs, bool find_any) {
+    float dist[bvh_packet_size];
+    int iid[bvh_packet_size], eid[bvh_packet_size];
+    vec2f uv[bvh_packet_size];
+    bool hit[bvh_packet_size];
+    for (auto start = 0; start < nrays; start += bvh_packet_size) {
+        auto n = min(bvh_packet_size, nrays - start);
+        intersect_bvh(
+            scn->bvh, rays + start, n, find_any, dist, iid, eid, uv, hit);
+        for (auto r = 0; r < n; r++) {
+            auto& isec = isecs[start + r];
+            if (!hit[r]) {
+                isec = {};
+                continue;
+            }
+            isec.ist = scn->instances[iid[r]];
+            isec.ei = eid[r];
+            isec.uv = uv[r];
+            isec.dist = dist[r];
+        }
+    }
+}
+
 // Shape element normal.
-vec3f eval_elem_norm(const std::shared_ptr<shape>& shp, int ei) {
+vec3f eval_elem_norm(const shape& shp, int ei) {
     auto norm = zero3f;
-    if (!shp->triangles.empty()) {
-        auto t = shp->triangles[ei];
-        norm = triangle_normal(shp->pos[t.x], shp->pos[t.y], shp->pos[t.z]);
-    } else if (!shp->lines.empty()) {
-        auto l = shp->lines[ei];
-        norm = line_tangent(shp->pos[l.x], shp->pos[l.y]);
+    if (!shp.triangles.empty()) {
+        auto t = shp.triangles[ei];
+        norm = triangle_normal(shp.pos[t.x], shp.pos[t.y], shp.pos[t.z]);
+    } else if (!shp.lines.empty()) {
+        auto l = shp.lines[ei];
+        norm = line_tangent(shp.pos[l.x], shp.pos[l.y]);
     } else {
         norm = {0, 0, 1};
     }
     return norm;
 }
+vec3f eval_elem_norm(const std::shared_ptr<shape>& shp, int ei) {
+    return eval_elem_norm(*shp, ei);
+}
 
 // Shape element normal.
-vec4f eval_elem_tangsp(const std::shared_ptr<shape>& shp, int ei) {
+vec4f eval_elem_tangsp(const shape& shp, int ei) {
     auto tangsp = zero4f;
-    if (!shp->triangles.empty()) {
-        auto t = shp->triangles[ei];
-        auto norm =
-            triangle_normal(shp->pos[t.x], shp->pos[t.y], shp->pos[t.z]);
+    if (!shp.triangles.empty()) {
+        auto t = shp.triangles[ei];
+        auto norm = triangle_normal(shp.pos[t.x], shp.pos[t.y], shp.pos[t.z]);
         auto txty = std::pair<vec3f, vec3f>();
-        if (shp->texcoord.empty()) {
-            txty = triangle_tangents_fromuv(shp->pos[t.x], shp->pos[t.y],
-                shp->pos[t.z], {0, 0}, {1, 0}, {0, 1});
+        if (shp.texcoord.empty()) {
+            txty = triangle_tangents_fromuv(shp.pos[t.x], shp.pos[t.y],
+                shp.pos[t.z], {0, 0}, {1, 0}, {0, 1});
         } else {
-            txty = triangle_tangents_fromuv(shp->pos[t.x], shp->pos[t.y],
-                shp->pos[t.z], shp->texcoord[t.x], shp->texcoord[t.y],
-                shp->texcoord[t.z]);
+            txty = triangle_tangents_fromuv(shp.pos[t.x], shp.pos[t.y],
+                shp.pos[t.z], shp.texcoord[t.x], shp.texcoord[t.y],
+                shp.texcoord[t.z]);
         }
         auto tx = txty.first, ty = txty.second;
         tx = orthonormalize(tx, norm);
@@ -3769,143 +5583,190 @@ vec4f eval_elem_tangsp(const std::shared_ptr<shape>& shp, int ei) {
     }
     return tangsp;
 }
+vec4f eval_elem_tangsp(const std::shared_ptr<shape>& shp, int ei) {
+    return eval_elem_tangsp(*shp, ei);
+}
 
 // Shape value interpolated using barycentric coordinates
 template <typename T>
-T eval_elem(const std::shared_ptr<shape>& shp, const std::vector<T>& vals,
-    int ei, const vec2f& uv) {
+T eval_elem(const shape& shp, const std::vector<T>& vals, int ei,
+    const vec2f& uv) {
     if (vals.empty()) return {};
-    if (!shp->triangles.empty()) {
-        return interpolate_triangle(vals, shp->triangles[ei], uv);
-    } else if (!shp->lines.empty()) {
-        return interpolate_line(vals, shp->lines[ei], uv.x);
-    } else if (!shp->points.empty()) {
-        return vals[shp->points[ei]];
-    } else if (!shp->pos.empty()) {
+    if (!shp.triangles.empty()) {
+        return interpolate_triangle(vals, shp.triangles[ei], uv);
+    } else if (!shp.lines.empty()) {
+        return interpolate_line(vals, shp.lines[ei], uv.x);
+    } else if (!shp.points.empty()) {
+        return vals[shp.points[ei]];
+    } else if (!shp.pos.empty()) {
         return vals[ei];
     } else {
         return {};
     }
 }
 
-// Shape values interpolated using barycentric coordinates
+// Shape values interpolated using barycentric coordinates. The overloads
+// taking references are used by the renderers.
+vec3f eval_pos(const shape& shp, int ei, const vec2f& uv) {
+    return eval_elem(shp, shp.pos, ei, uv);
+}
+vec3f eval_norm(const shape& shp, int ei, const vec2f& uv) {
+    if (shp.norm.empty()) return eval_elem_norm(shp, ei);
+    return normalize(eval_elem(shp, shp.norm, ei, uv));
+}
+vec2f eval_texcoord(const shape& shp, int ei, const vec2f& uv) {
+    if (shp.texcoord.empty()) return uv;
+    return eval_elem(shp, shp.texcoord, ei, uv);
+}
+vec4f eval_color(const shape& shp, int ei, const vec2f& uv) {
+    if (shp.color.empty()) return {1, 1, 1, 1};
+    return eval_elem(shp, shp.color, ei, uv);
+}
+float eval_radius(const shape& shp, int ei, const vec2f& uv) {
+    if (shp.radius.empty()) return 0.001f;
+    return eval_elem(shp, shp.radius, ei, uv);
+}
+vec4f eval_tangsp(const shape& shp, int ei, const vec2f& uv) {
+    if (shp.tangsp.empty()) return eval_elem_tangsp(shp, ei);
+    return eval_elem(shp, shp.tangsp, ei, uv);
+}
+vec3f eval_tangsp(
+    const shape& shp, int ei, const vec2f& uv, bool& left_handed) {
+    auto tangsp = (shp.tangsp.empty()) ? eval_elem_tangsp(shp, ei) :
+                                         eval_elem(shp, shp.tangsp, ei, uv);
+    left_handed = tangsp.w < 0;
+    return {tangsp.x, tangsp.y, tangsp.z};
+}
 vec3f eval_pos(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv) {
-    return eval_elem(shp, shp->pos, ei, uv);
+    return eval_pos(*shp, ei, uv);
 }
 vec3f eval_norm(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv) {
-    if (shp->norm.empty()) return eval_elem_norm(shp, ei);
-    return normalize(eval_elem(shp, shp->norm, ei, uv));
+    return eval_norm(*shp, ei, uv);
 }
 vec2f eval_texcoord(
     const std::shared_ptr<shape>& shp, int ei, const vec2f& uv) {
-    if (shp->texcoord.empty()) return uv;
-    return eval_elem(shp, shp->texcoord, ei, uv);
+    return eval_texcoord(*shp, ei, uv);
 }
 vec4f eval_color(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv) {
-    if (shp->color.empty()) return {1, 1, 1, 1};
-    return eval_elem(shp, shp->color, ei, uv);
+    return eval_color(*shp, ei, uv);
 }
 float eval_radius(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv) {
-    if (shp->radius.empty()) return 0.001f;
-    return eval_elem(shp, shp->radius, ei, uv);
+    return eval_radius(*shp, ei, uv);
 }
 vec4f eval_tangsp(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv) {
-    if (shp->tangsp.empty()) return eval_elem_tangsp(shp, ei);
-    return eval_elem(shp, shp->tangsp, ei, uv);
+    return eval_tangsp(*shp, ei, uv);
 }
 vec3f eval_tangsp(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv,
     bool& left_handed) {
-    auto tangsp = (shp->tangsp.empty()) ? eval_elem_tangsp(shp, ei) :
-                                          eval_elem(shp, shp->tangsp, ei, uv);
-    left_handed = tangsp.w < 0;
-    return {tangsp.x, tangsp.y, tangsp.z};
+    return eval_tangsp(*shp, ei, uv, left_handed);
 }
 
 // Instance values interpolated using barycentric coordinates.
 vec3f eval_pos(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
-    return transform_point(ist->frame, eval_pos(ist->shp, ei, uv));
+    return transform_point(ist->frame, eval_pos(*ist->shp, ei, uv));
 }
 vec3f eval_norm(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
-    return transform_direction(ist->frame, eval_norm(ist->shp, ei, uv));
+    return transform_direction(ist->frame, eval_norm(*ist->shp, ei, uv));
 }
 vec2f eval_texcoord(
     const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
-    return eval_texcoord(ist->shp, ei, uv);
+    return eval_texcoord(*ist->shp, ei, uv);
 }
 vec4f eval_color(
     const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
-    return eval_color(ist->shp, ei, uv);
+    return eval_color(*ist->shp, ei, uv);
 }
 float eval_radius(
     const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
-    return eval_radius(ist->shp, ei, uv);
+    return eval_radius(*ist->shp, ei, uv);
 }
 vec3f eval_tangsp(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv,
     bool& left_handed) {
     return transform_direction(
-        ist->frame, eval_tangsp(ist->shp, ei, uv, left_handed));
+        ist->frame, eval_tangsp(*ist->shp, ei, uv, left_handed));
 }
 // Instance element values.
 vec3f eval_elem_norm(const std::shared_ptr<instance>& ist, int ei) {
-    return transform_direction(ist->frame, eval_elem_norm(ist->shp, ei));
-}
-// Shading normals including material perturbations.
-vec3f eval_shading_norm(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv, vec3f o) {
-    if (!ist->shp->triangles.empty()) {
-        auto n = eval_norm(ist, ei, uv);
-        if (ist->mat && ist->mat->norm_txt) {
-            auto texcoord = eval_texcoord(ist, ei, uv);
+    return transform_direction(ist->frame, eval_elem_norm(*ist->shp, ei));
+}
+// Shading normals including material perturbations, given the texture
+// coordinates at the shading point, for a shape with `frame` and `mat`.
+inline vec3f eval_shading_norm(const frame3f& frame, const shape& shp,
+    const material* mat, int ei, const vec2f& uv, const vec2f& texcoord,
+    vec3f o) {
+    if (!shp.triangles.empty()) {
+        auto n = transform_direction(frame, eval_norm(shp, ei, uv));
+        if (mat && mat->norm_txt) {
             auto left_handed = false;
-            auto txt = xyz(eval_texture(ist->mat->norm_txt, texcoord));
+            auto txt = xyz(eval_texture(mat->norm_txt, texcoord));
             txt = txt * 2 - vec3f{1, 1, 1};
             txt.y = -txt.y;  // flip vertical axis to align green with image up
-            auto tu = orthonormalize(eval_tangsp(ist, ei, uv, left_handed), n);
+            auto tu = orthonormalize(
+                transform_direction(
+                    frame, eval_tangsp(shp, ei, uv, left_handed)),
+                n);
             auto tv = normalize(cross(n, tu) * (left_handed ? -1.0f : 1.0f));
             n = normalize(txt.x * tu + txt.y * tv + txt.z * n);
         }
-        if (ist->mat && ist->mat->double_sided && dot(n, o) < 0) n = -n;
+        if (mat && mat->double_sided && dot(n, o) < 0) n = -n;
         return n;
-    } else if (!ist->shp->lines.empty()) {
-        return orthonormalize(o, eval_norm(ist, ei, uv));
+    } else if (!shp.lines.empty()) {
+        return orthonormalize(
+            o, transform_direction(frame, eval_norm(shp, ei, uv)));
     } else {
         return o;
     }
 }
+vec3f eval_shading_norm(
+    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv, vec3f o) {
+    auto texcoord = zero2f;
+    if (ist->mat && ist->mat->norm_txt) texcoord = eval_texcoord(ist, ei, uv);
+    return eval_shading_norm(
+        ist->frame, *ist->shp, ist->mat.get(), ei, uv, texcoord, o);
+}
 
 // Environment texture coordinates from the direction.
-vec2f eval_texcoord(const std::shared_ptr<environment>& env, vec3f w) {
-    auto wl = transform_direction_inverse(env->frame, w);
+vec2f eval_texcoord(const environment& env, vec3f w) {
+    auto wl = transform_direction_inverse(env.frame, w);
     auto uv = vec2f{
         atan2(wl.z, wl.x) / (2 * pi), acos(clamp(wl.y, -1.0f, 1.0f)) / pi};
     if (uv.x < 0) uv.x += 1;
     return uv;
 }
+vec2f eval_texcoord(const std::shared_ptr<environment>& env, vec3f w) {
+    return eval_texcoord(*env, w);
+}
 // Evaluate the environment direction.
-vec3f eval_direction(const std::shared_ptr<environment>& env, const vec2f& uv) {
+vec3f eval_direction(const environment& env, const vec2f& uv) {
     return transform_direction(
-        env->frame, {cos(uv.x * 2 * pi) * sin(uv.y * pi), cos(uv.y * pi),
-                        sin(uv.x * 2 * pi) * sin(uv.y * pi)});
+        env.frame, {cos(uv.x * 2 * pi) * sin(uv.y * pi), cos(uv.y * pi),
+                       sin(uv.x * 2 * pi) * sin(uv.y * pi)});
+}
+vec3f eval_direction(const std::shared_ptr<environment>& env, const vec2f& uv) {
+    return eval_direction(*env, uv);
 }
 // Evaluate the environment color.
-vec3f eval_environment(const std::shared_ptr<environment>& env, vec3f w) {
-    auto ke = env->ke;
-    if (env->ke_txt) {
-        ke *= xyz(eval_texture(env->ke_txt, eval_texcoord(env, w)));
+vec3f eval_environment(const environment& env, vec3f w) {
+    auto ke = env.ke;
+    if (env.ke_txt) {
+        ke *= xyz(eval_texture(env.ke_txt, eval_texcoord(env, w)));
     }
     return ke;
 }
+vec3f eval_environment(const std::shared_ptr<environment>& env, vec3f w) {
+    return eval_environment(*env, w);
+}
 
-// Evaluate a texture
-vec4f eval_texture(const std::shared_ptr<texture>& txt, const vec2f& texcoord) {
-    if (!txt || txt->img.pxl.empty()) return {1, 1, 1, 1};
-
+// Bilinear lookup of a texture level of `size` with a texel accessor.
+template <typename Func>
+inline vec4f eval_texture_bilinear(
+    const vec2i& size, bool clamp_, const vec2f& texcoord, Func&& texel) {
     // get image width/height
-    auto w = txt->img.size.x, h = txt->img.size.y;
+    auto w = size.x, h = size.y;
 
     // get coordinates normalized for tiling
     auto s = 0.0f, t = 0.0f;
-    if (txt->clamp) {
+    if (clamp_) {
         s = clamp(texcoord.x, 0.0f, 1.0f) * w;
         t = clamp(texcoord.y, 0.0f, 1.0f) * h;
     } else {
@@ -3921,9 +5782,184 @@ vec4f eval_texture(const std::shared_ptr<texture>& txt, const vec2f& texcoord) {
     auto u = s - i, v = t - j;
 
     // handle interpolation
-    return txt->img[{i, j}] * (1 - u) * (1 - v) +
-           txt->img[{i, jj}] * (1 - u) * v + txt->img[{ii, j}] * u * (1 - v) +
-           txt->img[{ii, jj}] * u * v;
+    return texel(i, j) * (1 - u) * (1 - v) + texel(i, jj) * (1 - u) * v +
+           texel(ii, j) * u * (1 - v) + texel(ii, jj) * u * v;
+}
+
+// Trilinear lookup over `nlevels` mip levels, given a bilinear lookup.
+template <typename Func>
+inline vec4f eval_texture_trilinear(
+    const vec2i& size, int nlevels, float footprint, Func&& bilinear) {
+    if (footprint <= 0 || nlevels <= 1) return bilinear(0);
+    auto lod = std::log2(footprint * max(size.x, size.y));
+    if (lod <= 0) return bilinear(0);
+    if (lod >= nlevels - 1) return bilinear(nlevels - 1);
+    auto level = (int)lod;
+    auto t = lod - level;
+    return bilinear(level) * (1 - t) + bilinear(level + 1) * t;
+}
+
+// Key of a texture cache tile.
+inline uint64_t get_texture_tile_key(int id, int level, const vec2i& tile) {
+    return ((uint64_t)id << 40) | ((uint64_t)level << 32) |
+           ((uint64_t)tile.y << 16) | (uint64_t)tile.x;
+}
+
+// Loads a texture in the cache, adding all its tiles. Called with the lock.
+void load_texture_tiles(
+    texture_cache& cache, const std::shared_ptr<texture>& txt, int id) {
+    auto img = cache.load(txt);
+    if (img.pxl.empty()) img = image4f{{1, 1}, {1, 1, 1, 1}};
+    cache.loads += 1;
+    auto mips = make_texture_mips(img);
+    auto& sizes = cache.sizes[id];
+    if (sizes.empty()) {
+        sizes.push_back(img.size);
+        for (auto& mip : mips) sizes.push_back(mip.size);
+    }
+    for (auto level = 0; level <= mips.size(); level++) {
+        auto& mip = (level) ? mips[level - 1] : img;
+        auto ntiles = vec2i{mip.size.x + texture_tile_size - 1,
+                          mip.size.y + texture_tile_size - 1} /
+                      texture_tile_size;
+        for (auto tj = 0; tj < ntiles.y; tj++) {
+            for (auto ti = 0; ti < ntiles.x; ti++) {
+                auto key = get_texture_tile_key(id, level, {ti, tj});
+                if (cache.tiles.find(key) != cache.tiles.end()) continue;
+                auto tw = min(texture_tile_size,
+                    mip.size.x - ti * texture_tile_size);
+                auto th = min(texture_tile_size,
+                    mip.size.y - tj * texture_tile_size);
+                auto pxl = std::make_shared<std::vector<vec4f>>(tw * th);
+                for (auto j = 0; j < th; j++) {
+                    for (auto i = 0; i < tw; i++) {
+                        (*pxl)[j * tw + i] =
+                            mip[{ti * texture_tile_size + i,
+                                tj * texture_tile_size + j}];
+                    }
+                }
+                cache.lru.push_front(key);
+                cache.tiles[key] = {pxl, cache.lru.begin()};
+                cache.memory += pxl->size() * sizeof(vec4f);
+            }
+        }
+    }
+}
+
+// Gets a texture id in the cache and its mip sizes, loading it if needed.
+const std::vector<vec2i>& get_texture_sizes(
+    texture_cache& cache, const std::shared_ptr<texture>& txt, int& id) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.ids.find(txt.get());
+    if (it == cache.ids.end()) {
+        it = cache.ids.insert({txt.get(), (int)cache.sizes.size()}).first;
+        cache.sizes.emplace_back();
+        load_texture_tiles(cache, txt, it->second);
+    }
+    id = it->second;
+    return cache.sizes[id];
+}
+
+// Gets a cached texture tile, paging in the texture if needed, and evicts
+// the least recently used tiles over budget.
+std::shared_ptr<std::vector<vec4f>> get_texture_tile(texture_cache& cache,
+    const std::shared_ptr<texture>& txt, int id, int level,
+    const vec2i& tile) {
+    auto key = get_texture_tile_key(id, level, tile);
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.tiles.find(key);
+    if (it == cache.tiles.end()) {
+        load_texture_tiles(cache, txt, id);
+        it = cache.tiles.find(key);
+    }
+    cache.lru.splice(cache.lru.begin(), cache.lru, it->second.lru);
+    auto pxl = it->second.pxl;
+    while (cache.memory > cache.budget && cache.lru.size() > 1) {
+        auto evicted = cache.tiles.find(cache.lru.back());
+        cache.memory -= evicted->second.pxl->size() * sizeof(vec4f);
+        cache.tiles.erase(evicted);
+        cache.lru.pop_back();
+    }
+    return pxl;
+}
+
+// Evaluates a texture paged in by its cache.
+vec4f eval_cached_texture(
+    const std::shared_ptr<texture>& txt, const vec2f& texcoord,
+    float footprint) {
+    auto& cache = *txt->cache;
+    auto id = 0;
+    auto& sizes = get_texture_sizes(cache, txt, id);
+    auto bilinear = [&](int level) {
+        auto size = sizes[level];
+        auto tile = vec2i{-1, -1};
+        auto pxl = std::shared_ptr<std::vector<vec4f>>();
+        return eval_texture_bilinear(
+            size, txt->clamp, texcoord, [&](int i, int j) {
+                auto ij = vec2i{i, j} / texture_tile_size;
+                if (ij != tile) {
+                    tile = ij;
+                    pxl = get_texture_tile(cache, txt, id, level, tile);
+                }
+                auto tw = min(texture_tile_size,
+                    size.x - tile.x * texture_tile_size);
+                return (*pxl)[(j % texture_tile_size) * tw +
+                              i % texture_tile_size];
+            });
+    };
+    return eval_texture_trilinear(
+        sizes[0], (int)sizes.size(), footprint, bilinear);
+}
+
+// Evaluate a texture
+vec4f eval_texture(const std::shared_ptr<texture>& txt, const vec2f& texcoord,
+    float footprint) {
+    if (!txt) return {1, 1, 1, 1};
+    if (txt->img.pxl.empty() && !txt->texels.data.empty()) {
+        auto bilinear = [&txt, &texcoord](int level) {
+            auto& img = (level) ? txt->texel_mips[level - 1] : txt->texels;
+            return eval_texture_bilinear(img.size, txt->clamp, texcoord,
+                [&img](int i, int j) { return lookup_texel(img, {i, j}); });
+        };
+        return eval_texture_trilinear(txt->texels.size,
+            (int)txt->texel_mips.size() + 1, footprint, bilinear);
+    }
+    if (txt->img.pxl.empty()) {
+        if (!txt->cache) return {1, 1, 1, 1};
+        return eval_cached_texture(txt, texcoord, footprint);
+    }
+    auto bilinear = [&txt, &texcoord](int level) {
+        auto& img = (level) ? txt->mips[level - 1] : txt->img;
+        return eval_texture_bilinear(img.size, txt->clamp, texcoord,
+            [&img](int i, int j) { return img[{i, j}]; });
+    };
+    return eval_texture_trilinear(
+        txt->img.size, (int)txt->mips.size() + 1, footprint, bilinear);
+}
+
+// Texture coordinates footprint of a ray cone at an element of a shape
+// placed with `frame`.
+float eval_texture_footprint(
+    const frame3f& frame, const shape& shp, int ei, float width) {
+    if (width <= 0 || shp.triangles.empty()) return 0;
+    auto t = shp.triangles[ei];
+    auto p0 = transform_point(frame, shp.pos[t.x]);
+    auto p1 = transform_point(frame, shp.pos[t.y]);
+    auto p2 = transform_point(frame, shp.pos[t.z]);
+    auto parea = length(cross(p1 - p0, p2 - p0));
+    if (parea == 0) return 0;
+    auto tarea = 1.0f;
+    if (!shp.texcoord.empty()) {
+        auto uv0 = shp.texcoord[t.x], uv1 = shp.texcoord[t.y],
+             uv2 = shp.texcoord[t.z];
+        tarea = fabs(cross(uv1 - uv0, uv2 - uv0));
+    }
+    return width * std::sqrt(tarea / parea);
+}
+float eval_texture_footprint(
+    const std::shared_ptr<instance>& ist, int ei, float width) {
+    if (!ist) return 0;
+    return eval_texture_footprint(ist->frame, *ist->shp, ei, width);
 }
 
 // Set and evaluate camera parameters. Setters take zeros as default values.
@@ -3939,117 +5975,134 @@ void set_camera_fovy(
 
 // Generates a ray from a camera for image plane coordinate uv and
 // the lens coordinates luv.
-ray3f eval_camera_ray(
-    const std::shared_ptr<camera>& cam, const vec2f& uv, const vec2f& luv) {
-    auto dist = cam->focal;
-    if (cam->focus < flt_max) {
-        dist = cam->focal * cam->focus / (cam->focus - cam->focal);
+ray3f eval_camera_ray(const camera& cam, const vec2f& uv, const vec2f& luv) {
+    auto dist = cam.focal;
+    if (cam.focus < flt_max) {
+        dist = cam.focal * cam.focus / (cam.focus - cam.focal);
     }
-    auto e = vec3f{luv.x * cam->aperture, luv.y * cam->aperture, 0};
+    auto e = vec3f{luv.x * cam.aperture, luv.y * cam.aperture, 0};
     // auto q = vec3f{cam->width * (uv.x - 0.5f),
     //     cam->height * (uv.y - 0.5f), dist};
     // X flipped for mirror
     auto q = vec3f{
-        cam->imsize.x * (0.5f - uv.x), cam->imsize.y * (uv.y - 0.5f), dist};
-    auto ray = make_ray(transform_point(cam->frame, e),
-        transform_direction(cam->frame, normalize(e - q)));
+        cam.imsize.x * (0.5f - uv.x), cam.imsize.y * (uv.y - 0.5f), dist};
+    auto ray = make_ray(transform_point(cam.frame, e),
+        transform_direction(cam.frame, normalize(e - q)));
     return ray;
 }
+ray3f eval_camera_ray(
+    const std::shared_ptr<camera>& cam, const vec2f& uv, const vec2f& luv) {
+    return eval_camera_ray(*cam, uv, luv);
+}
 
+vec2i eval_image_resolution(const camera& cam, int yresolution) {
+    return {(int)round(yresolution * cam.imsize.x / cam.imsize.y), yresolution};
+}
 vec2i eval_image_resolution(
     const std::shared_ptr<camera>& cam, int yresolution) {
-    return {
-        (int)round(yresolution * cam->imsize.x / cam->imsize.y), yresolution};
+    return eval_image_resolution(*cam, yresolution);
 }
 
 // Generates a ray from a camera for pixel coordinates `ij`, the
 // resolution `res`, the sub-pixel coordinates `puv` and the lens
 // coordinates `luv` and the image resolution `res`.
-ray3f eval_camera_ray(const std::shared_ptr<camera>& cam, const vec2i& ij,
-    const vec2i& imsize, const vec2f& puv, const vec2f& luv) {
+ray3f eval_camera_ray(const camera& cam, const vec2i& ij, const vec2i& imsize,
+    const vec2f& puv, const vec2f& luv) {
     auto uv = vec2f{(ij.x + puv.x) / imsize.x, (ij.y + puv.y) / imsize.y};
     return eval_camera_ray(cam, uv, luv);
 }
+ray3f eval_camera_ray(const std::shared_ptr<camera>& cam, const vec2i& ij,
+    const vec2i& imsize, const vec2f& puv, const vec2f& luv) {
+    return eval_camera_ray(*cam, ij, imsize, puv, luv);
+}
 
 // Evaluates material parameters.
-vec3f eval_emission(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
+vec3f eval_emission(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint) {
     if (!ist || !ist->mat) return zero3f;
+    auto texcoord = eval_texcoord(ist, ei, uv);
     return ist->mat->ke * xyz(eval_color(ist, ei, uv)) *
-           xyz(eval_texture(ist->mat->ke_txt, eval_texcoord(ist, ei, uv)));
+           xyz(eval_texture(ist->mat->ke_txt, texcoord, footprint));
 }
-vec3f eval_diffuse(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
+vec3f eval_diffuse(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint) {
     if (!ist || !ist->mat) return zero3f;
+    auto texcoord = eval_texcoord(ist, ei, uv);
     if (!ist->mat->base_metallic) {
         return ist->mat->kd * xyz(eval_color(ist, ei, uv)) *
-               xyz(eval_texture(ist->mat->kd_txt, eval_texcoord(ist, ei, uv)));
+               xyz(eval_texture(ist->mat->kd_txt, texcoord, footprint));
     } else {
-        auto kb =
-            ist->mat->kd * xyz(eval_color(ist, ei, uv)) *
-            xyz(eval_texture(ist->mat->kd_txt, eval_texcoord(ist, ei, uv)));
+        auto kb = ist->mat->kd * xyz(eval_color(ist, ei, uv)) *
+                  xyz(eval_texture(ist->mat->kd_txt, texcoord, footprint));
         auto km = ist->mat->ks.x *
-                  eval_texture(ist->mat->ks_txt, eval_texcoord(ist, ei, uv)).z;
+                  eval_texture(ist->mat->ks_txt, texcoord, footprint).z;
         return kb * (1 - km);
     }
 }
-vec3f eval_specular(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
+vec3f eval_specular(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint) {
     if (!ist || !ist->mat) return zero3f;
+    auto texcoord = eval_texcoord(ist, ei, uv);
     if (!ist->mat->base_metallic) {
         return ist->mat->ks * xyz(eval_color(ist, ei, uv)) *
-               xyz(eval_texture(ist->mat->ks_txt, eval_texcoord(ist, ei, uv)));
+               xyz(eval_texture(ist->mat->ks_txt, texcoord, footprint));
     } else {
-        auto kb =
-            ist->mat->kd * xyz(eval_color(ist, ei, uv)) *
-            xyz(eval_texture(ist->mat->kd_txt, eval_texcoord(ist, ei, uv)));
+        auto kb = ist->mat->kd * xyz(eval_color(ist, ei, uv)) *
+                  xyz(eval_texture(ist->mat->kd_txt, texcoord, footprint));
         auto km = ist->mat->ks.x *
-                  eval_texture(ist->mat->ks_txt, eval_texcoord(ist, ei, uv)).z;
+                  eval_texture(ist->mat->ks_txt, texcoord, footprint).z;
         return kb * km + vec3f{0.04f, 0.04f, 0.04f} * (1 - km);
     }
 }
-float eval_roughness(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
+float eval_roughness(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint) {
     if (!ist || !ist->mat) return 1;
+    auto texcoord = eval_texcoord(ist, ei, uv);
     if (!ist->mat->base_metallic) {
         if (!ist->mat->gltf_textures) {
-            auto rs =
-                ist->mat->rs *
-                eval_texture(ist->mat->rs_txt, eval_texcoord(ist, ei, uv)).x;
+            auto rs = ist->mat->rs *
+                      eval_texture(ist->mat->rs_txt, texcoord, footprint).x;
             return rs * rs;
         } else {
-            auto gs =
-                (1 - ist->mat->rs) *
-                eval_texture(ist->mat->rs_txt, eval_texcoord(ist, ei, uv)).w;
+            auto gs = (1 - ist->mat->rs) *
+                      eval_texture(ist->mat->rs_txt, texcoord, footprint).w;
             auto rs = 1 - gs;
             return rs * rs;
         }
     } else {
         auto rs = ist->mat->rs *
-                  eval_texture(ist->mat->rs_txt, eval_texcoord(ist, ei, uv)).y;
+                  eval_texture(ist->mat->rs_txt, texcoord, footprint).y;
         return rs * rs;
     }
 }
-vec3f eval_transmission(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
+vec3f eval_transmission(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint) {
     if (!ist || !ist->mat) return zero3f;
+    auto texcoord = eval_texcoord(ist, ei, uv);
     return ist->mat->kt * xyz(eval_color(ist, ei, uv)) *
-           xyz(eval_texture(ist->mat->kt_txt, eval_texcoord(ist, ei, uv)));
+           xyz(eval_texture(ist->mat->kt_txt, texcoord, footprint));
 }
-float eval_opacity(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
-    if (!ist || !ist->mat) return 1;
-    return ist->mat->op * eval_color(ist->shp, ei, uv).w *
-           eval_texture(ist->mat->op_txt, eval_texcoord(ist, ei, uv)).w;
+float eval_opacity(const shape& shp, const material* mat, int ei,
+    const vec2f& uv, float footprint) {
+    if (!mat) return 1;
+    auto texcoord = eval_texcoord(shp, ei, uv);
+    return mat->op * eval_color(shp, ei, uv).w *
+           eval_texture(mat->op_txt, texcoord, footprint).w;
+}
+float eval_opacity(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint) {
+    if (!ist) return 1;
+    return eval_opacity(*ist->shp, ist->mat.get(), ei, uv, footprint);
 }
 
 // Evaluates the bsdf at a location.
-bsdf eval_bsdf(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
+bsdf eval_bsdf(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv,
+    float footprint) {
     auto f = bsdf();
-    f.kd = eval_diffuse(ist, ei, uv);
-    f.ks = eval_specular(ist, ei, uv);
-    f.kt = eval_transmission(ist, ei, uv);
-    f.rs = eval_roughness(ist, ei, uv);
+    f.kd = eval_diffuse(ist, ei, uv, footprint);
+    f.ks = eval_specular(ist, ei, uv, footprint);
+    f.kt = eval_transmission(ist, ei, uv, footprint);
+    f.rs = eval_roughness(ist, ei, uv, footprint);
     f.refract = (ist && ist->mat) ? ist->mat->refract : false;
     if (f.kd != zero3f) {
         f.rs = clamp(f.rs, 0.03f * 0.03f, 1.0f);
@@ -4059,21 +6112,83 @@ bsdf eval_bsdf(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv) {
 }
 bool is_delta_bsdf(const bsdf& f) { return f.rs == 0 && f.kd == zero3f; }
 
+// Evaluates a shading point of a shape placed with `frame`, computing the
+// material if `material` is set. Values are combined in the same order as
+// in the individual functions.
+inline shading_point eval_shading_point(const frame3f& frame,
+    const shape& shp, const material* mat, int ei, const vec2f& uv,
+    const vec3f& o, float width, bool material) {
+    auto sp = shading_point();
+    sp.p = transform_point(frame, eval_pos(shp, ei, uv));
+    sp.texcoord = eval_texcoord(shp, ei, uv);
+    sp.n = eval_shading_norm(frame, shp, mat, ei, uv, sp.texcoord, o);
+    if (!mat) return sp;
+
+    // lookup textures once
+    auto fp = eval_texture_footprint(frame, shp, ei, width);
+    auto color = eval_color(shp, ei, uv);
+    auto kc = xyz(color);
+    sp.ke = mat->ke * kc * xyz(eval_texture(mat->ke_txt, sp.texcoord, fp));
+    if (!material) return sp;
+    auto kd_txt = eval_texture(mat->kd_txt, sp.texcoord, fp);
+    auto ks_txt = eval_texture(mat->ks_txt, sp.texcoord, fp);
+    auto kt_txt = eval_texture(mat->kt_txt, sp.texcoord, fp);
+    auto rs_txt = eval_texture(mat->rs_txt, sp.texcoord, fp);
+    auto op_txt = eval_texture(mat->op_txt, sp.texcoord, fp);
+
+    // bsdf
+    auto& f = sp.f;
+    if (!mat->base_metallic) {
+        f.kd = mat->kd * kc * xyz(kd_txt);
+        f.ks = mat->ks * kc * xyz(ks_txt);
+        auto rs = (!mat->gltf_textures) ? mat->rs * rs_txt.x :
+                                          1 - (1 - mat->rs) * rs_txt.w;
+        f.rs = rs * rs;
+    } else {
+        auto kb = mat->kd * kc * xyz(kd_txt);
+        auto km = mat->ks.x * ks_txt.z;
+        f.kd = kb * (1 - km);
+        f.ks = kb * km + vec3f{0.04f, 0.04f, 0.04f} * (1 - km);
+        auto rs = mat->rs * rs_txt.y;
+        f.rs = rs * rs;
+    }
+    f.kt = mat->kt * kc * xyz(kt_txt);
+    f.refract = mat->refract;
+    if (f.kd != zero3f) {
+        f.rs = clamp(f.rs, 0.03f * 0.03f, 1.0f);
+    } else if (f.rs <= 0.03f * 0.03f)
+        f.rs = 0;
+    sp.op = mat->op * color.w * op_txt.w;
+    return sp;
+}
+shading_point eval_shading_point(const std::shared_ptr<instance>& ist,
+    int ei, const vec2f& uv, const vec3f& o, float width) {
+    return eval_shading_point(
+        ist->frame, *ist->shp, ist->mat.get(), ei, uv, o, width, true);
+}
+shading_point eval_light_point(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, const vec3f& o) {
+    return eval_shading_point(
+        ist->frame, *ist->shp, ist->mat.get(), ei, uv, o, 0, false);
+}
+
 // Sample a shape based on a distribution.
 std::pair<int, vec2f> sample_shape(
-    const std::shared_ptr<shape>& shp, float re, const vec2f& ruv) {
+    const shape& shp, float re, const vec2f& ruv) {
     // TODO: implement sampling without cdf
-    if (shp->elem_cdf.empty()) return {};
-    if (!shp->triangles.empty()) {
-        return sample_triangles(shp->elem_cdf, re, ruv);
-    } else if (!shp->lines.empty()) {
-        return {sample_lines(shp->elem_cdf, re, ruv.x).first, ruv};
-    } else if (!shp->pos.empty()) {
-        return {sample_points(shp->elem_cdf, re), ruv};
+    if (shp.elem_alias.empty()) return {};
+    auto rp = ruv.x;
+    auto eid = sample_alias(shp.elem_alias, re, rp);
+    if (!shp.triangles.empty()) {
+        return {eid, sample_triangle(vec2f{rp, ruv.y})};
     } else {
-        return {0, zero2f};
+        return {eid, {rp, ruv.y}};
     }
 }
+std::pair<int, vec2f> sample_shape(
+    const std::shared_ptr<shape>& shp, float re, const vec2f& ruv) {
+    return sample_shape(*shp, re, ruv);
+}
 
 }  // namespace ygl
 
@@ -4098,6 +6213,41 @@ void merge_into(const std::shared_ptr<scene>& merge_into,
     merge(merge_into->animations, merge_from->animations);
 }
 
+// Memory used by the scene BVHs.
+std::pair<uint64_t, uint64_t> get_bvh_memory(
+    const std::shared_ptr<scene>& scn) {
+    auto nodes = (uint64_t)0, triangles = (uint64_t)0;
+    auto bvhs = std::vector<std::shared_ptr<bvh_tree>>{scn->bvh};
+    for (auto shp : scn->shapes) bvhs.push_back(shp->bvh);
+    for (auto bvh : bvhs) {
+        if (!bvh) continue;
+        nodes += bvh->nodes.size() * sizeof(bvh_node) +
+                 bvh->wide_nodes.size() * sizeof(bvh_wide_node) +
+                 bvh->compressed_nodes.size() * sizeof(bvh_compressed_node) +
+                 bvh->compressed_prims.size() * sizeof(uint32_t);
+        triangles += bvh->leaf_triangles.size() * sizeof(bvh_triangle);
+    }
+    return {nodes, triangles};
+}
+
+// Memory saved by compressed bvh nodes. Each compressed node replaces the
+// two binary nodes of its children.
+uint64_t get_bvh_compressed_savings(const std::shared_ptr<scene>& scn) {
+    auto saved = (int64_t)0;
+    auto bvhs = std::vector<std::shared_ptr<bvh_tree>>{scn->bvh};
+    for (auto shp : scn->shapes) bvhs.push_back(shp->bvh);
+    for (auto bvh : bvhs) {
+        if (!bvh || bvh->compressed_nodes.empty()) continue;
+        auto nbinary = (int64_t)bvh->compressed_nodes.size() * 2;
+        if (bvh->nodes[0].type != bvh_node_type::internal) nbinary = 0;
+        saved += nbinary * (int64_t)sizeof(bvh_node) -
+                 (int64_t)(bvh->compressed_nodes.size() *
+                               sizeof(bvh_compressed_node) +
+                           bvh->compressed_prims.size() * sizeof(uint32_t));
+    }
+    return (saved > 0) ? (uint64_t)saved : 0;
+}
+
 void print_stats(const std::shared_ptr<scene>& scn) {
     uint64_t num_cameras = 0;
     uint64_t num_shape_groups = 0;
@@ -4124,6 +6274,8 @@ void print_stats(const std::shared_ptr<scene>& scn) {
     uint64_t memory_imgs = 0;
     uint64_t memory_elems = 0;
     uint64_t memory_verts = 0;
+    uint64_t memory_bvh_nodes = 0;
+    uint64_t memory_bvh_triangles = 0;
 
     update_bbox(scn, true);
     auto bbox = scn->bbox;
@@ -4152,9 +6304,23 @@ void print_stats(const std::shared_ptr<scene>& scn) {
                    vert_texcoord * sizeof(vec3f) + vert_color * sizeof(vec4f) +
                    vert_tangsp * sizeof(vec4f) + vert_radius * sizeof(float);
 
-    for (auto txt : scn->textures)
-        texel_hdr += txt->img.size.x * txt->img.size.y;
-    memory_imgs = texel_hdr * sizeof(vec4f) + texel_ldr * sizeof(vec4b);
+    for (auto txt : scn->textures) {
+        auto texel_float = (uint64_t)txt->img.size.x * txt->img.size.y;
+        for (auto& mip : txt->mips) texel_float += mip.size.x * mip.size.y;
+        texel_hdr += texel_float;
+        memory_imgs += texel_float * sizeof(vec4f);
+        auto& texels = (txt->texels.format == texel_format::rgba16f) ?
+                           texel_hdr :
+                           texel_ldr;
+        texels += txt->texels.size.x * txt->texels.size.y;
+        memory_imgs += txt->texels.data.size();
+        for (auto& mip : txt->texel_mips) {
+            texels += mip.size.x * mip.size.y;
+            memory_imgs += mip.data.size();
+        }
+    }
+
+    std::tie(memory_bvh_nodes, memory_bvh_triangles) = get_bvh_memory(scn);
 
     std::cout << "num_cameras: " << num_cameras << "\n";
     std::cout << "num_shape_groups: " << num_shape_groups << "\n";
@@ -4178,6 +6344,12 @@ void print_stats(const std::shared_ptr<scene>& scn) {
     std::cout << "memory_imgs: " << memory_imgs << "\n";
     std::cout << "memory_elems: " << memory_elems << "\n";
     std::cout << "memory_verts: " << memory_verts << "\n";
+    std::cout << "memory_bvh_nodes: " << memory_bvh_nodes << "\n";
+    std::cout << "memory_bvh_triangles: " << memory_bvh_triangles << "\n";
+    std::cout << "memory_bvh_compressed_savings: "
+              << get_bvh_compressed_savings(scn) << "\n";
+    if (scn->bvh && scn->bvh->compressed_nodes.empty())
+        std::cout << "bvh_sah_cost: " << compute_bvh_sah_cost(scn->bvh) << "\n";
     std::cout << "bbox: " << bbox << "\n";
 }
 
@@ -4188,26 +6360,214 @@ void print_stats(const std::shared_ptr<scene>& scn) {
 // -----------------------------------------------------------------------------
 namespace ygl {
 
-// Trace stats.
-std::atomic<uint64_t> _trace_npaths{0};
-std::atomic<uint64_t> _trace_nrays{0};
+// Trace stats of each thread, merged in the totals by the renderers.
+thread_local trace_stats _trace_thread_stats;
+std::mutex _trace_stats_mutex;
+trace_stats _trace_stats;
+
+// Clears the trace stats of the calling thread, so that they only count
+// what the renderers trace.
+void clear_trace_thread_stats() {
+    _trace_thread_stats = {};
+    get_bvh_thread_stats() = {};
+}
+
+// Merges the trace stats of the calling thread in the totals and clears them.
+void merge_trace_thread_stats() {
+    auto& tst = _trace_thread_stats;
+    auto& bst = get_bvh_thread_stats();
+    {
+        std::lock_guard<std::mutex> lock(_trace_stats_mutex);
+        _trace_stats.npaths += tst.npaths;
+        _trace_stats.nrays += tst.nrays;
+        _trace_stats.nshadow_rays += tst.nshadow_rays;
+        _trace_stats.nbvh_nodes += bst.nnodes;
+        _trace_stats.nbvh_prims += bst.nprims;
+    }
+    clear_trace_thread_stats();
+}
+
+// Makes a render snapshot of a scene.
+render_scene make_render_scene(const std::shared_ptr<scene>& scn) {
+    auto rscn = render_scene();
+    for (auto& cam : scn->cameras) rscn.cameras.push_back(cam.get());
+    auto shape_ids = std::unordered_map<const shape*, int>();
+    auto material_ids = std::unordered_map<const material*, int>();
+    auto instance_ids = std::unordered_map<const instance*, int>();
+    for (auto& ist : scn->instances) {
+        auto rist = render_instance();
+        rist.frame = ist->frame;
+        auto sit = shape_ids.find(ist->shp.get());
+        if (sit == shape_ids.end()) {
+            sit = shape_ids.insert({ist->shp.get(), (int)rscn.shapes.size()})
+                      .first;
+            rscn.shapes.push_back(ist->shp.get());
+        }
+        rist.shape = sit->second;
+        if (ist->mat) {
+            auto mit = material_ids.find(ist->mat.get());
+            if (mit == material_ids.end()) {
+                mit = material_ids
+                          .insert({ist->mat.get(), (int)rscn.materials.size()})
+                          .first;
+                rscn.materials.push_back(ist->mat.get());
+            }
+            rist.material = mit->second;
+        }
+        rist.light_id = ist->light_id;
+        instance_ids[ist.get()] = (int)rscn.instances.size();
+        rscn.instances.push_back(rist);
+    }
+    for (auto& env : scn->environments) rscn.environments.push_back(env.get());
+    for (auto& lgt : scn->lights)
+        rscn.lights.push_back(instance_ids.at(lgt.get()));
+    rscn.bvh = scn->bvh;
+    rscn.light_sampling = scn->light_sampling;
+    rscn.light_cdf = scn->light_cdf;
+    rscn.light_tree = scn->light_tree;
+    rscn.light_leaves = scn->light_leaves;
+    return rscn;
+}
+
+// First intersection traced by the calling thread after `pending` is set,
+// so that aovs reuse the camera ray intersection of the tracers.
+struct trace_first_hit {
+    bool pending = false;
+    render_intersection isec = {};
+};
+thread_local trace_first_hit _trace_first_hit;
+
+// Render scene intersection.
+render_intersection intersect_ray(
+    const render_scene& scn, const ray3f& ray, bool find_any) {
+    _trace_thread_stats.nrays += 1;
+    auto isec = render_intersection();
+    if (!intersect_bvh(
+            scn.bvh, ray, find_any, isec.dist, isec.iid, isec.ei, isec.uv))
+        isec = {};
+    if (_trace_first_hit.pending) _trace_first_hit = {false, isec};
+    return isec;
+}
+
+// Intersects a ray testing light visibility, counted as a shadow ray.
+inline render_intersection intersect_shadow_ray(
+    const render_scene& scn, const ray3f& ray) {
+    _trace_thread_stats.nshadow_rays += 1;
+    return intersect_ray(scn, ray);
+}
+
+// Render scene intersection for a group of rays, traversed in packets.
+void intersect_rays(const render_scene& scn, const ray3f* rays, int nrays,
+    render_intersection* isecs, bool find_any) {
+    _trace_thread_stats.nrays += nrays;
+    float dist[bvh_packet_size];
+    int iid[bvh_packet_size], eid[bvh_packet_size];
+    vec2f uv[bvh_packet_size];
+    bool hit[bvh_packet_size];
+    for (auto start = 0; start < nrays; start += bvh_packet_size) {
+        auto n = min(bvh_packet_size, nrays - start);
+        intersect_bvh(
+            scn.bvh, rays + start, n, find_any, dist, iid, eid, uv, hit);
+        for (auto r = 0; r < n; r++) {
+            auto& isec = isecs[start + r];
+            if (!hit[r]) {
+                isec = {};
+                continue;
+            }
+            isec.iid = iid[r];
+            isec.ei = eid[r];
+            isec.uv = uv[r];
+            isec.dist = dist[r];
+        }
+    }
+}
+
+// Shape and material of a render scene instance.
+inline const shape& get_shape(const render_scene& scn, int iid) {
+    return *scn.shapes[scn.instances[iid].shape];
+}
+inline const material* get_material(const render_scene& scn, int iid) {
+    auto mid = scn.instances[iid].material;
+    return (mid >= 0) ? scn.materials[mid] : nullptr;
+}
+
+// Evaluates a shading point at a render scene intersection, computing the
+// material only if `material` is set.
+inline shading_point eval_shading_point(const render_scene& scn,
+    const render_intersection& isec, const vec3f& o, float width = 0,
+    bool material = true) {
+    return eval_shading_point(scn.instances[isec.iid].frame,
+        get_shape(scn, isec.iid), get_material(scn, isec.iid), isec.ei,
+        isec.uv, o, width, material);
+}
+inline shading_point eval_light_point(
+    const render_scene& scn, const render_intersection& isec, const vec3f& o) {
+    return eval_shading_point(scn, isec, o, 0, false);
+}
 
-// Intersect a scene handling opacity.
-scene_intersection intersect_ray_cutout(const std::shared_ptr<scene>& scn,
-    const ray3f& ray_, rng_state& rng, int nbounces) {
+// Intersect a scene handling opacity. Rays are counted as shadow rays if
+// `shadow` is set.
+render_intersection intersect_ray_cutout(const render_scene& scn,
+    const ray3f& ray_, rng_state& rng, int nbounces, bool shadow = false) {
     auto ray = ray_;
     for (auto b = 0; b < nbounces; b++) {
-        _trace_nrays += 1;
-        auto isec = intersect_ray(scn, ray);
-        if (!isec.ist) return isec;
-        auto op = eval_opacity(isec.ist, isec.ei, isec.uv);
+        auto isec = (shadow) ? intersect_shadow_ray(scn, ray) :
+                               intersect_ray(scn, ray);
+        if (isec.iid < 0) return isec;
+        auto& shp = get_shape(scn, isec.iid);
+        auto op = eval_opacity(
+            shp, get_material(scn, isec.iid), isec.ei, isec.uv, 0);
         if (op > 0.999f) return isec;
         if (rand1f(rng) < op) return isec;
-        ray = make_ray(eval_pos(isec.ist, isec.ei, isec.uv), ray.d);
+        ray = make_ray(transform_point(scn.instances[isec.iid].frame,
+                           eval_pos(shp, isec.ei, isec.uv)),
+            ray.d);
     }
     return {};
 }
 
+// Intersect a group of rays handling opacity as `intersect_ray_cutout()`,
+// with ray `r` drawing from `rngs[r]`. Rays that pass through a surface are
+// intersected again together. Rays are modified along the way.
+void intersect_rays_cutout(const render_scene& scn, std::vector<ray3f>& rays,
+    const std::vector<rng_state*>& rngs, int nbounces, bool shadow,
+    std::vector<render_intersection>& isecs) {
+    auto nrays = (int)rays.size();
+    isecs.assign(nrays, render_intersection{});
+    auto pending = std::vector<int>(nrays);
+    for (auto r = 0; r < nrays; r++) pending[r] = r;
+    auto batch = std::vector<ray3f>();
+    auto hits = std::vector<render_intersection>();
+    for (auto b = 0; b < nbounces && !pending.empty(); b++) {
+        auto npending = (int)pending.size();
+        batch.resize(npending);
+        hits.resize(npending);
+        for (auto k = 0; k < npending; k++) batch[k] = rays[pending[k]];
+        if (shadow) _trace_thread_stats.nshadow_rays += npending;
+        intersect_rays(scn, batch.data(), npending, hits.data());
+        auto nleft = 0;
+        for (auto k = 0; k < npending; k++) {
+            auto r = pending[k];
+            auto& isec = hits[k];
+            if (isec.iid >= 0) {
+                auto& shp = get_shape(scn, isec.iid);
+                auto op = eval_opacity(
+                    shp, get_material(scn, isec.iid), isec.ei, isec.uv, 0);
+                if (op <= 0.999f && rand1f(*rngs[r]) >= op) {
+                    rays[r] = make_ray(
+                        transform_point(scn.instances[isec.iid].frame,
+                            eval_pos(shp, isec.ei, isec.uv)),
+                        rays[r].d);
+                    pending[nleft++] = r;
+                    continue;
+                }
+            }
+            isecs[r] = isec;
+        }
+        pending.resize(nleft);
+    }
+}
+
 // Check if we are near the mirror direction.
 inline bool check_near_mirror(const vec3f& n, const vec3f& o, const vec3f& i) {
     return fabs(dot(i, normalize(n * 2.0f * dot(o, n) - o)) - 1) < 0.001f;
@@ -4428,16 +6788,15 @@ float sample_delta_brdf_pdf(
 }
 
 // Sample pdf for an environment.
-float sample_environment_pdf(
-    const std::shared_ptr<environment> env, const vec3f& i) {
-    auto txt = env->ke_txt;
-    if (!env->elem_cdf.empty() && txt) {
+float sample_environment_pdf(const environment& env, const vec3f& i) {
+    auto& txt = env.ke_txt;
+    if (!env.row_alias.empty() && txt) {
         auto texcoord = eval_texcoord(env, i);
-        auto i = (int)(texcoord.x * txt->img.size.x);
-        auto j = (int)(texcoord.y * txt->img.size.y);
-        auto idx = j * txt->img.size.x + i;
-        auto prob =
-            sample_discrete_pdf(env->elem_cdf, idx) / env->elem_cdf.back();
+        auto i = clamp((int)(texcoord.x * txt->img.size.x), 0,
+            txt->img.size.x - 1);
+        auto j = clamp((int)(texcoord.y * txt->img.size.y), 0,
+            txt->img.size.y - 1);
+        auto prob = get_environment_texel_weight(*txt, i, j) / env.texel_sum;
         auto angle = (2 * pi / txt->img.size.x) * (pi / txt->img.size.y) *
                      sin(pi * (j + 0.5f) / txt->img.size.y);
         return prob / angle;
@@ -4448,250 +6807,188 @@ float sample_environment_pdf(
 
 // Picks a point on an environment.
 vec3f sample_environment(
-    const std::shared_ptr<environment> env, float rel, const vec2f& ruv) {
-    auto txt = env->ke_txt;
-    if (!env->elem_cdf.empty() && txt) {
-        auto idx = sample_discrete(env->elem_cdf, rel);
-        auto u = (idx % txt->img.size.x + 0.5f) / txt->img.size.x;
-        auto v = (idx / txt->img.size.x + 0.5f) / txt->img.size.y;
+    const environment& env, float rel, const vec2f& ruv) {
+    auto& txt = env.ke_txt;
+    if (!env.row_alias.empty() && txt) {
+        auto size = txt->img.size;
+        auto rp = ruv.y;
+        auto j = sample_alias(env.row_alias, rel, rp);
+        auto i = sample_alias(
+            env.texel_alias.data() + j * size.x, size.x, ruv.x, rp);
+        auto u = (i + 0.5f) / size.x;
+        auto v = (j + 0.5f) / size.y;
         return eval_direction(env, {u, v});
     } else {
         return sample_sphere(ruv);
-    }
-}
-
-// Picks a point on a light.
-vec3f sample_light(const std::shared_ptr<instance> ist, const vec3f& p,
-    float rel, const vec2f& ruv) {
-    auto sample = sample_shape(ist->shp, rel, ruv);
-    return normalize(eval_pos(ist, sample.first, sample.second) - p);
-}
-
-// Sample pdf for a light point.
-float sample_light_pdf(const std::shared_ptr<instance> ist, const vec3f& p,
-    const vec3f& i, const vec3f& lp, const vec3f& ln) {
-    if (ist->mat->ke == zero3f) return 0;
-    // prob triangle * area triangle = area triangle mesh
-    auto area = ist->shp->elem_cdf.back();
-    return dot(lp - p, lp - p) / (fabs(dot(ln, i)) * area);
-}
-
-// Test occlusion.
-vec3f eval_transmission(const std::shared_ptr<scene>& scn, const vec3f& from,
-    const vec3f& to, int nbounces) {
-    auto weight = vec3f{1, 1, 1};
-    auto p = from;
-    for (auto bounce = 0; bounce < nbounces; bounce++) {
-        auto ray = make_segment(p, to);
-        auto isec = intersect_ray(scn, ray);
-        if (!isec.ist) break;
-        auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
-        auto op = eval_opacity(isec.ist, isec.ei, isec.uv);
-        weight *= f.kt + vec3f{1 - op, 1 - op, 1 - op};
-        if (weight == zero3f) break;
-        p = eval_pos(isec.ist, isec.ei, isec.uv);
-    }
-    return weight;
-}
-
-// Recursive path tracing.
-vec3f trace_path(const std::shared_ptr<scene>& scn, const ray3f& ray_,
-    rng_state& rng, int nbounces, bool* hit) {
-    if (scn->lights.empty() && scn->environments.empty()) return zero3f;
-
-    // initialize
-    auto l = zero3f;
-    auto weight = vec3f{1, 1, 1};
-    auto emission = true;
-    auto ray = ray_;
-
-    // trace  path
-    for (auto bounce = 0; bounce < nbounces; bounce++) {
-        // intersect ray
-        auto isec = intersect_ray_cutout(scn, ray, rng, nbounces);
-        if (!isec.ist) {
-            if (emission) {
-                for (auto env : scn->environments)
-                    l += weight * eval_environment(env, ray.d);
-            }
-            break;
-        }
-        if (hit) *hit = true;
-
-        // point
-        auto o = -ray.d;
-        auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-        auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-        auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
-
-        // emission
-        if (emission) l += weight * eval_emission(isec.ist, isec.ei, isec.uv);
-
-        // early exit and russian roulette
-        if (f.kd + f.ks + f.kt == zero3f || bounce >= nbounces - 1) break;
-        if (bounce > 2) {
-            auto rrprob = 1.0f - min(max(weight), 0.95f);
-            if (rand1f(rng) < rrprob) break;
-            weight *= 1 / (1 - rrprob);
-        }
-
-        // direct
-        if (!is_delta_bsdf(f) &&
-            (!scn->lights.empty() || !scn->environments.empty())) {
-            auto i = zero3f;
-            auto nlights = (int)(scn->lights.size() + scn->environments.size());
-            if (rand1f(rng) < 0.5f) {
-                auto idx = sample_index(nlights, rand1f(rng));
-                if (idx < scn->lights.size()) {
-                    auto lgt = scn->lights[idx];
-                    i = sample_light(lgt, p, rand1f(rng), rand2f(rng));
-                } else {
-                    auto env = scn->environments[idx - scn->lights.size()];
-                    i = sample_environment(env, rand1f(rng), rand2f(rng));
-                }
-            } else {
-                i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
-            }
-            auto isec =
-                intersect_ray_cutout(scn, make_ray(p, i), rng, nbounces);
-            auto pdf = 0.5f * sample_brdf_pdf(f, n, o, i);
-            auto le = zero3f;
-            if (isec.ist) {
-                auto lp = eval_pos(isec.ist, isec.ei, isec.uv);
-                auto ln = eval_shading_norm(isec.ist, isec.ei, isec.uv, -i);
-                pdf += 0.5f * sample_light_pdf(isec.ist, p, i, lp, ln) *
-                       sample_index_pdf<float>(nlights);
-                le += eval_emission(isec.ist, isec.ei, isec.uv);
-            } else {
-                for (auto env : scn->environments) {
-                    pdf += 0.5f * sample_environment_pdf(env, i) *
-                           sample_index_pdf<float>(nlights);
-                    le += eval_environment(env, i);
-                }
-            }
-            auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-            if (pdf != 0) l += weight * le * brdfcos / pdf;
-        }
-
-        // continue path
-        auto i = zero3f, brdfcos = zero3f;
-        auto pdf = 0.0f;
-        if (!is_delta_bsdf(f)) {
-            i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
-            brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-            pdf = sample_brdf_pdf(f, n, o, i);
-        } else {
-            i = sample_delta_brdf(f, n, o, rand1f(rng), rand2f(rng));
-            brdfcos = eval_delta_brdf(f, n, o, i) * fabs(dot(n, i));
-            pdf = sample_delta_brdf_pdf(f, n, o, i);
-        }
-
-        // accumulate weight
-        if (pdf == 0) break;
-        weight *= brdfcos / pdf;
-        if (weight == zero3f) break;
-
-        // setup next ray
-        ray = make_ray(p, i);
-        emission = is_delta_bsdf(f);
-    }
-
-    return l;
-}
-
-// Recursive path tracing.
-vec3f trace_path_naive(const std::shared_ptr<scene>& scn, const ray3f& ray_,
-    rng_state& rng, int nbounces, bool* hit) {
-    if (scn->lights.empty() && scn->environments.empty()) return zero3f;
-
-    // initialize
-    auto l = zero3f;
-    auto weight = vec3f{1, 1, 1};
-    auto ray = ray_;
+    }
+}
 
-    // trace  path
-    for (auto bounce = 0; bounce < nbounces; bounce++) {
-        // intersect ray
-        auto isec = intersect_ray_cutout(scn, ray, rng, nbounces);
-        if (!isec.ist) {
-            for (auto env : scn->environments)
-                l += weight * eval_environment(env, ray.d);
-            break;
+// Light tree node importance for a shading point.
+static float light_node_importance(const light_node& node, const vec3f& p) {
+    auto center = (node.bbox.min + node.bbox.max) / 2;
+    auto size = node.bbox.max - node.bbox.min;
+    auto dist2 = max(length_sqr(p - center), length_sqr(size) / 4);
+    return (dist2 > 0) ? node.power / dist2 : node.power;
+}
+
+// Probability of picking the first child of a light tree node.
+static float light_node_prob(
+    const std::vector<light_node>& nodes, const light_node& node,
+    const vec3f& p) {
+    auto w0 = light_node_importance(nodes[node.children[0]], p);
+    auto w1 = light_node_importance(nodes[node.children[1]], p);
+    return (w0 + w1 > 0) ? w0 / (w0 + w1) : 0.5f;
+}
+
+// Picks a light for the shading point using the scene light sampling.
+// Works on scenes and render scenes, that share the light sampling data.
+template <typename Scene>
+int pick_light_index(
+    const Scene& scn, const vec3f& p, float rl, bool environments = true) {
+    auto nlights = (int)scn.lights.size();
+    auto nenvs = (environments) ? (int)scn.environments.size() : 0;
+    if (scn.light_sampling == light_sampling_type::uniform ||
+        scn.light_cdf.empty())
+        return sample_index(nlights + nenvs, rl);
+    auto& cdf = scn.light_cdf;
+    auto total = (nenvs) ? cdf.back() : (nlights) ? cdf[nlights - 1] : 0;
+    if (total <= 0) return sample_index(nlights + nenvs, rl);
+    rl = clamp(rl * total, 0.0f, total * 0.99999f);
+    auto idx = (int)(std::upper_bound(cdf.data(), cdf.data() + nlights + nenvs,
+                         rl) -
+                     cdf.data());
+    idx = clamp(idx, 0, nlights + nenvs - 1);
+    if (scn.light_sampling != light_sampling_type::tree || idx >= nlights)
+        return idx;
+    // descend the tree, rescaling the random number at each step
+    rl = clamp(rl / cdf[nlights - 1], 0.0f, 0.99999f);
+    auto nodeid = 0;
+    while (scn.light_tree[nodeid].light < 0) {
+        auto& node = scn.light_tree[nodeid];
+        auto prob = light_node_prob(scn.light_tree, node, p);
+        if (rl < prob) {
+            rl = rl / prob;
+            nodeid = node.children[0];
+        } else {
+            rl = (rl - prob) / (1 - prob);
+            nodeid = node.children[1];
         }
-        if (hit) *hit = true;
-
-        // point
-        auto o = -ray.d;
-        auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-        auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-        auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+        rl = clamp(rl, 0.0f, 0.99999f);
+    }
+    return scn.light_tree[nodeid].light;
+}
+
+// Probability of picking a light index with `pick_light_index()`.
+template <typename Scene>
+float pick_light_index_pdf(const Scene& scn, const vec3f& p, int idx,
+    bool environments = true) {
+    auto nlights = (int)scn.lights.size();
+    auto nenvs = (environments) ? (int)scn.environments.size() : 0;
+    if (scn.light_sampling == light_sampling_type::uniform ||
+        scn.light_cdf.empty())
+        return sample_index_pdf<float>(nlights + nenvs);
+    if (idx < 0 || idx >= nlights + nenvs) return 0;
+    auto& cdf = scn.light_cdf;
+    auto total = (nenvs) ? cdf.back() : (nlights) ? cdf[nlights - 1] : 0;
+    if (total <= 0) return sample_index_pdf<float>(nlights + nenvs);
+    if (scn.light_sampling != light_sampling_type::tree || idx >= nlights)
+        return sample_discrete_pdf(cdf, idx) / total;
+    // walk up the tree from the light leaf
+    auto pdf = cdf[nlights - 1] / total;
+    auto nodeid = scn.light_leaves[idx];
+    while (scn.light_tree[nodeid].parent >= 0) {
+        auto& parent = scn.light_tree[scn.light_tree[nodeid].parent];
+        auto prob = light_node_prob(scn.light_tree, parent, p);
+        pdf *= (parent.children[0] == nodeid) ? prob : 1 - prob;
+        nodeid = scn.light_tree[nodeid].parent;
+    }
+    return pdf;
+}
 
-        // emission
-        l += weight * eval_emission(isec.ist, isec.ei, isec.uv);
+int sample_light_index(const std::shared_ptr<scene>& scn, const vec3f& p,
+    float rl, bool environments) {
+    return pick_light_index(*scn, p, rl, environments);
+}
+float sample_light_index_pdf(const std::shared_ptr<scene>& scn,
+    const vec3f& p, int idx, bool environments) {
+    return pick_light_index_pdf(*scn, p, idx, environments);
+}
 
-        // early exit and russian roulette
-        if (f.kd + f.ks + f.kt == zero3f || bounce >= nbounces - 1) break;
-        if (bounce > 2) {
-            auto rrprob = 1.0f - min(max(weight), 0.95f);
-            if (rand1f(rng) < rrprob) break;
-            weight *= 1 / (1 - rrprob);
-        }
+// Picks a point on the light instance `iid`.
+vec3f sample_light(const render_scene& scn, int iid, const vec3f& p,
+    float rel, const vec2f& ruv) {
+    auto& shp = get_shape(scn, iid);
+    auto sample = sample_shape(shp, rel, ruv);
+    auto lp = eval_pos(shp, sample.first, sample.second);
+    return normalize(transform_point(scn.instances[iid].frame, lp) - p);
+}
 
-        // continue path
-        auto i = zero3f, brdfcos = zero3f;
-        auto pdf = 0.0f;
-        if (!is_delta_bsdf(f)) {
-            i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
-            brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-            pdf = sample_brdf_pdf(f, n, o, i);
-        } else {
-            i = sample_delta_brdf(f, n, o, rand1f(rng), rand2f(rng));
-            brdfcos = eval_delta_brdf(f, n, o, i) * fabs(dot(n, i));
-            pdf = sample_delta_brdf_pdf(f, n, o, i);
-        }
+// Sample pdf for a light point on the instance `iid`.
+float sample_light_pdf(const render_scene& scn, int iid, const vec3f& p,
+    const vec3f& i, const vec3f& lp, const vec3f& ln) {
+    auto mat = get_material(scn, iid);
+    if (!mat || mat->ke == zero3f) return 0;
+    // prob triangle * area triangle = area triangle mesh
+    auto area = get_shape(scn, iid).elem_cdf.back();
+    return dot(lp - p, lp - p) / (fabs(dot(ln, i)) * area);
+}
 
-        // accumulate weight
-        if (pdf == 0) break;
-        weight *= brdfcos / pdf;
+// Test occlusion.
+vec3f eval_transmission(const render_scene& scn, const vec3f& from,
+    const vec3f& to, int nbounces) {
+    auto weight = vec3f{1, 1, 1};
+    auto p = from;
+    for (auto bounce = 0; bounce < nbounces; bounce++) {
+        auto ray = make_segment(p, to);
+        auto isec = intersect_shadow_ray(scn, ray);
+        if (isec.iid < 0) break;
+        auto sp = eval_shading_point(scn, isec, -ray.d);
+        weight *= sp.f.kt + vec3f{1 - sp.op, 1 - sp.op, 1 - sp.op};
         if (weight == zero3f) break;
-
-        // setup next ray
-        ray = make_ray(p, i);
+        p = sp.p;
     }
-
-    return l;
+    return weight;
 }
 
-// Recursive path tracing.
-vec3f trace_path_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray_,
-    rng_state& rng, int nbounces, bool* hit) {
-    if (scn->lights.empty() && scn->environments.empty()) return zero3f;
+// Recursive path tracing. Lights are sampled at each bounce with multiple
+// importance sampling if `mis` is set, alone if only `direct` is set, and
+// not at all otherwise. Options are template parameters so that each tracer
+// is compiled without the branches of the others.
+template <bool direct, bool mis>
+static vec3f trace_path_generic(const render_scene& scn, const ray3f& ray_,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
+    if (scn.lights.empty() && scn.environments.empty()) return zero3f;
 
     // initialize
     auto l = zero3f;
     auto weight = vec3f{1, 1, 1};
     auto emission = true;
     auto ray = ray_;
+    auto cone = 0.0f;
 
     // trace  path
     for (auto bounce = 0; bounce < nbounces; bounce++) {
         // intersect ray
         auto isec = intersect_ray_cutout(scn, ray, rng, nbounces);
-        if (!isec.ist) {
-            for (auto env : scn->environments)
-                l += weight * eval_environment(env, ray.d);
+        if (isec.iid < 0) {
+            if (emission || !mis) {
+                for (auto env : scn.environments)
+                    l += weight * eval_environment(*env, ray.d);
+            }
             break;
         }
         if (hit) *hit = true;
 
         // point
         auto o = -ray.d;
-        auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-        auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-        auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+        cone += spread * isec.dist;
+        auto sp = eval_shading_point(scn, isec, o, cone);
+        auto &p = sp.p, &n = sp.n;
+        auto& f = sp.f;
 
         // emission
-        if (emission) l += weight * eval_emission(isec.ist, isec.ei, isec.uv);
+        if (emission)
+            l += weight * sp.ke;
 
         // early exit and russian roulette
         if (f.kd + f.ks + f.kt == zero3f || bounce >= nbounces - 1) break;
@@ -4702,18 +6999,58 @@ vec3f trace_path_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray_,
         }
 
         // direct
-        if (!is_delta_bsdf(f) && !scn->lights.empty()) {
+        if (direct && mis && !is_delta_bsdf(f) &&
+            (!scn.lights.empty() || !scn.environments.empty())) {
+            auto i = zero3f;
+            if (rand1f(rng) < 0.5f) {
+                auto idx = pick_light_index(scn, p, rand1f(rng));
+                if (idx < scn.lights.size()) {
+                    auto lgt = scn.lights[idx];
+                    i = sample_light(scn, lgt, p, rand1f(rng), rand2f(rng));
+                } else {
+                    auto& env = *scn.environments[idx - scn.lights.size()];
+                    i = sample_environment(env, rand1f(rng), rand2f(rng));
+                }
+            } else {
+                i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
+            }
+            auto isec = intersect_ray_cutout(
+                scn, make_ray(p, i), rng, nbounces, true);
+            auto pdf = 0.5f * sample_brdf_pdf(f, n, o, i);
+            auto le = zero3f;
+            if (isec.iid >= 0) {
+                auto lpt = eval_light_point(scn, isec, -i);
+                auto lid = scn.instances[isec.iid].light_id;
+                pdf += 0.5f *
+                       sample_light_pdf(scn, isec.iid, p, i, lpt.p, lpt.n) *
+                       pick_light_index_pdf(scn, p, lid);
+                le += lpt.ke;
+            } else {
+                for (auto eid = 0; eid < scn.environments.size(); eid++) {
+                    auto& env = *scn.environments[eid];
+                    pdf += 0.5f * sample_environment_pdf(env, i) *
+                           pick_light_index_pdf(
+                               scn, p, (int)scn.lights.size() + eid);
+                    le += eval_environment(env, i);
+                }
+            }
+            auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
+            if (pdf != 0) l += weight * le * brdfcos / pdf;
+        }
+
+        // direct without mis
+        if (direct && !mis && !is_delta_bsdf(f) && !scn.lights.empty()) {
             auto lgt =
-                scn->lights[sample_index(scn->lights.size(), rand1f(rng))];
-            auto i = sample_light(lgt, p, rand1f(rng), rand2f(rng));
-            auto isec =
-                intersect_ray_cutout(scn, make_ray(p, i), rng, nbounces);
-            if (isec.ist && isec.ist->mat->ke != zero3f) {
-                auto lp = eval_pos(isec.ist, isec.ei, isec.uv);
-                auto ln = eval_shading_norm(isec.ist, isec.ei, isec.uv, -i);
-                auto pdf = sample_light_pdf(isec.ist, p, i, lp, ln) *
-                           sample_index_pdf<float>(scn->lights.size());
-                auto le = eval_emission(isec.ist, isec.ei, isec.uv);
+                scn.lights[pick_light_index(scn, p, rand1f(rng), false)];
+            auto i = sample_light(scn, lgt, p, rand1f(rng), rand2f(rng));
+            auto isec = intersect_ray_cutout(
+                scn, make_ray(p, i), rng, nbounces, true);
+            if (isec.iid >= 0 && get_material(scn, isec.iid)->ke != zero3f) {
+                auto lpt = eval_light_point(scn, isec, -i);
+                auto pdf = sample_light_pdf(scn, isec.iid, p, i, lpt.p, lpt.n) *
+                           pick_light_index_pdf(
+                               scn, p, scn.instances[isec.iid].light_id, false);
+                auto le = lpt.ke;
                 auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
                 if (pdf != 0) l += weight * le * brdfcos / pdf;
             }
@@ -4739,71 +7076,102 @@ vec3f trace_path_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray_,
 
         // setup next ray
         ray = make_ray(p, i);
-        emission = is_delta_bsdf(f);
+        if (direct) emission = is_delta_bsdf(f);
     }
 
     return l;
 }
 
+// Recursive path tracing.
+vec3f trace_path(const render_scene& scn, const ray3f& ray, rng_state& rng,
+    int nbounces, bool* hit, float spread) {
+    return trace_path_generic<true, true>(
+        scn, ray, rng, nbounces, hit, spread);
+}
+
+// Recursive path tracing.
+vec3f trace_path_naive(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
+    return trace_path_generic<false, false>(
+        scn, ray, rng, nbounces, hit, spread);
+}
+
+// Recursive path tracing.
+vec3f trace_path_nomis(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
+    return trace_path_generic<true, false>(
+        scn, ray, rng, nbounces, hit, spread);
+}
+
 // Direct illumination.
-vec3f trace_direct(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
-    if (scn->lights.empty() && scn->environments.empty()) return zero3f;
+vec3f trace_direct(const render_scene& scn, const ray3f& ray, rng_state& rng,
+    int nbounces, bool* hit, float spread) {
+    if (scn.lights.empty() && scn.environments.empty()) return zero3f;
 
     // intersect scene
     auto isec = intersect_ray(scn, ray);
     auto l = zero3f;
 
     // handle environment
-    if (!isec.ist) {
-        for (auto env : scn->environments) l += eval_environment(env, ray.d);
+    if (isec.iid < 0) {
+        for (auto env : scn.environments) l += eval_environment(*env, ray.d);
         return l;
     }
     if (hit) *hit = true;
 
     // point
     auto o = -ray.d;
-    auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-    auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto sp =
+        eval_shading_point(scn, isec, o, spread * isec.dist);
+    auto &p = sp.p, &n = sp.n;
+    auto& f = sp.f;
 
     // emission
-    l += eval_emission(isec.ist, isec.ei, isec.uv);
-
-    // direct lights
-    for (auto lgt : scn->lights) {
+    l += sp.ke;
+
+    // direct lights, either all of them or one picked by the light sampling
+    auto picked = -1;
+    auto picked_pdf = 1.0f;
+    if (scn.light_sampling != light_sampling_type::uniform) {
+        picked = pick_light_index(scn, p, rand1f(rng));
+        picked_pdf = pick_light_index_pdf(scn, p, picked);
+    }
+    for (auto lid = 0; lid < scn.lights.size(); lid++) {
+        if (picked >= 0 && picked != lid) continue;
+        auto lgt = scn.lights[lid];
         auto i = zero3f;
         if (rand1f(rng) < 0.5f) {
-            i = sample_light(lgt, p, rand1f(rng), rand2f(rng));
+            i = sample_light(scn, lgt, p, rand1f(rng), rand2f(rng));
         } else {
             i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
         }
-        auto isec = intersect_ray(scn, make_ray(p, i));
-        if (lgt != isec.ist) continue;
-        auto lp = eval_pos(isec.ist, isec.ei, isec.uv);
-        auto ln = eval_shading_norm(isec.ist, isec.ei, isec.uv, -i);
-        auto pdf = 0.5f * sample_light_pdf(isec.ist, p, i, lp, ln) +
+        auto isec = intersect_shadow_ray(scn, make_ray(p, i));
+        if (isec.iid != lgt) continue;
+        auto lpt = eval_light_point(scn, isec, -i);
+        auto pdf = 0.5f * sample_light_pdf(scn, isec.iid, p, i, lpt.p, lpt.n) +
                    0.5f * sample_brdf_pdf(f, n, o, i);
-        auto le = eval_emission(isec.ist, isec.ei, isec.uv);
+        auto le = lpt.ke;
         auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-        if (pdf != 0) l += le * brdfcos / pdf;
+        if (pdf != 0) l += le * brdfcos / (pdf * picked_pdf);
     }
 
     // direct environments
-    for (auto env : scn->environments) {
+    for (auto eid = 0; eid < scn.environments.size(); eid++) {
+        if (picked >= 0 && picked != scn.lights.size() + eid) continue;
+        auto& env = *scn.environments[eid];
         auto i = zero3f;
         if (rand1f(rng) < 0.5f) {
             i = sample_environment(env, rand1f(rng), rand2f(rng));
         } else {
             i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
         }
-        auto isec = intersect_ray(scn, make_ray(p, i));
-        if (isec.ist) continue;
+        auto isec = intersect_shadow_ray(scn, make_ray(p, i));
+        if (isec.iid >= 0) continue;
         auto pdf = 0.5f * sample_environment_pdf(env, i) +
                    0.5f * sample_brdf_pdf(f, n, o, i);
         auto le = eval_environment(env, i);
         auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-        if (pdf != 0) l += le * brdfcos / pdf;
+        if (pdf != 0) l += le * brdfcos / (pdf * picked_pdf);
     }
 
     // exit if needed
@@ -4812,19 +7180,21 @@ vec3f trace_direct(const std::shared_ptr<scene>& scn, const ray3f& ray,
     // reflection
     if (f.ks != zero3f && !f.rs) {
         auto i = reflect(o, n);
-        l += f.ks * trace_direct(scn, make_ray(p, i), rng, nbounces - 1, hit);
+        l += f.ks * trace_direct(
+                        scn, make_ray(p, i), rng, nbounces - 1, hit, spread);
     }
 
     // refraction
     if (f.kt != zero3f) {
-        l += f.kt * trace_direct(scn, make_ray(p, -o), rng, nbounces - 1, hit);
+        l += f.kt * trace_direct(
+                        scn, make_ray(p, -o), rng, nbounces - 1, hit, spread);
     }
 
     // opacity
-    auto op = eval_opacity(isec.ist, isec.ei, isec.uv);
+    auto op = sp.op;
     if (op != 1) {
         l = op * l + (1 - op) * trace_direct(scn, make_ray(p, -o), rng,
-                                    nbounces - 1, hit);
+                                    nbounces - 1, hit, spread);
     }
 
     // done
@@ -4832,52 +7202,62 @@ vec3f trace_direct(const std::shared_ptr<scene>& scn, const ray3f& ray,
 }
 
 // Direct illumination.
-vec3f trace_direct_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
-    if (scn->lights.empty() && scn->environments.empty()) return zero3f;
+vec3f trace_direct_nomis(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
+    if (scn.lights.empty() && scn.environments.empty()) return zero3f;
 
     // intersect scene
     auto isec = intersect_ray(scn, ray);
     auto l = zero3f;
 
     // handle environment
-    if (!isec.ist) {
-        for (auto env : scn->environments) l += eval_environment(env, ray.d);
+    if (isec.iid < 0) {
+        for (auto env : scn.environments) l += eval_environment(*env, ray.d);
         return l;
     }
     if (hit) *hit = true;
 
     // point
     auto o = -ray.d;
-    auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-    auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto sp =
+        eval_shading_point(scn, isec, o, spread * isec.dist);
+    auto &p = sp.p, &n = sp.n;
+    auto& f = sp.f;
 
     // emission
-    l += eval_emission(isec.ist, isec.ei, isec.uv);
-
-    // direct lights
-    for (auto lgt : scn->lights) {
-        auto i = sample_light(lgt, p, rand1f(rng), rand2f(rng));
-        auto isec = intersect_ray(scn, make_ray(p, i));
-        if (lgt != isec.ist) continue;
-        auto lp = eval_pos(isec.ist, isec.ei, isec.uv);
-        auto ln = eval_shading_norm(isec.ist, isec.ei, isec.uv, -i);
-        auto pdf = sample_light_pdf(isec.ist, p, i, lp, ln);
-        auto le = eval_emission(isec.ist, isec.ei, isec.uv);
+    l += sp.ke;
+
+    // direct lights, either all of them or one picked by the light sampling
+    auto picked = -1;
+    auto picked_pdf = 1.0f;
+    if (scn.light_sampling != light_sampling_type::uniform) {
+        picked = pick_light_index(scn, p, rand1f(rng));
+        picked_pdf = pick_light_index_pdf(scn, p, picked);
+    }
+    for (auto lid = 0; lid < scn.lights.size(); lid++) {
+        if (picked >= 0 && picked != lid) continue;
+        auto lgt = scn.lights[lid];
+        auto i = sample_light(scn, lgt, p, rand1f(rng), rand2f(rng));
+        auto isec = intersect_shadow_ray(scn, make_ray(p, i));
+        if (isec.iid != lgt) continue;
+        auto lpt = eval_light_point(scn, isec, -i);
+        auto pdf = sample_light_pdf(scn, isec.iid, p, i, lpt.p, lpt.n);
+        auto le = lpt.ke;
         auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-        if (pdf != 0) l += le * brdfcos / pdf;
+        if (pdf != 0) l += le * brdfcos / (pdf * picked_pdf);
     }
 
     // direct environments
-    for (auto env : scn->environments) {
+    for (auto eid = 0; eid < scn.environments.size(); eid++) {
+        if (picked >= 0 && picked != scn.lights.size() + eid) continue;
+        auto& env = *scn.environments[eid];
         auto i = sample_environment(env, rand1f(rng), rand2f(rng));
-        auto isec = intersect_ray(scn, make_ray(p, i));
-        if (isec.ist) continue;
+        auto isec = intersect_shadow_ray(scn, make_ray(p, i));
+        if (isec.iid >= 0) continue;
         auto pdf = sample_environment_pdf(env, i);
         auto le = eval_environment(env, i);
         auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
-        if (pdf != 0) l += le * brdfcos / pdf;
+        if (pdf != 0) l += le * brdfcos / (pdf * picked_pdf);
     }
 
     // exit if needed
@@ -4886,19 +7266,22 @@ vec3f trace_direct_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray,
     // reflection
     if (f.ks != zero3f && !f.rs) {
         auto i = reflect(o, n);
-        l += f.ks * trace_direct(scn, make_ray(p, i), rng, nbounces - 1);
+        l += f.ks * trace_direct(scn, make_ray(p, i), rng, nbounces - 1,
+                        nullptr, spread);
     }
 
     // opacity
     if (f.kt != zero3f) {
-        l += f.kt * trace_direct(scn, make_ray(p, -o), rng, nbounces - 1);
+        l += f.kt * trace_direct(scn, make_ray(p, -o), rng, nbounces - 1,
+                        nullptr, spread);
     }
 
     // opacity
-    auto op = eval_opacity(isec.ist, isec.ei, isec.uv);
+    auto op = sp.op;
     if (op != 1) {
         l = op * l +
-            (1 - op) * trace_direct(scn, make_ray(p, -o), rng, nbounces - 1);
+            (1 - op) * trace_direct(scn, make_ray(p, -o), rng, nbounces - 1,
+                           nullptr, spread);
     }
 
     // done
@@ -4906,29 +7289,30 @@ vec3f trace_direct_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray,
 }
 
 // Environment illumination only with no shadows.
-vec3f trace_environment(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
-    if (scn->environments.empty()) return zero3f;
+vec3f trace_environment(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
+    if (scn.environments.empty()) return zero3f;
 
     // intersect scene
     auto isec = intersect_ray(scn, ray);
     auto l = zero3f;
 
     // handle environment
-    if (!isec.ist) {
-        for (auto env : scn->environments) l += eval_environment(env, ray.d);
+    if (isec.iid < 0) {
+        for (auto env : scn.environments) l += eval_environment(*env, ray.d);
         return l;
     }
     if (hit) *hit = true;
 
     // point
     auto o = -ray.d;
-    auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-    auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto sp =
+        eval_shading_point(scn, isec, o, spread * isec.dist);
+    auto &p = sp.p, &n = sp.n;
+    auto& f = sp.f;
 
     // emission
-    l += eval_emission(isec.ist, isec.ei, isec.uv);
+    l += sp.ke;
 
     // pick indirect direction
     auto i = zero3f, brdfcos = zero3f;
@@ -4945,18 +7329,18 @@ vec3f trace_environment(const std::shared_ptr<scene>& scn, const ray3f& ray,
 
     // accumulate environment illumination
     if (pdf != 0 && brdfcos != zero3f) {
-        for (auto env : scn->environments)
-            l += brdfcos * eval_environment(env, i) / pdf;
+        for (auto env : scn.environments)
+            l += brdfcos * eval_environment(*env, i) / pdf;
     }
 
     // exit if needed
     if (nbounces <= 0) return l;
 
     // opacity
-    auto op = eval_opacity(isec.ist, isec.ei, isec.uv);
+    auto op = sp.op;
     if (op != 1) {
         l = op * l + (1 - op) * trace_direct(scn, make_ray(p, -o), rng,
-                                    nbounces - 1, hit);
+                                    nbounces - 1, hit, spread);
     }
 
     // done
@@ -4964,27 +7348,28 @@ vec3f trace_environment(const std::shared_ptr<scene>& scn, const ray3f& ray,
 }
 
 // Eyelight for quick previewing.
-vec3f trace_eyelight(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_eyelight(const render_scene& scn, const ray3f& ray, rng_state& rng,
+    int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
     auto l = zero3f;
 
     // handle environment
-    if (!isec.ist) {
-        for (auto env : scn->environments) l += eval_environment(env, ray.d);
+    if (isec.iid < 0) {
+        for (auto env : scn.environments) l += eval_environment(*env, ray.d);
         return l;
     }
     if (hit) *hit = true;
 
     // point
     auto o = -ray.d;
-    auto p = eval_pos(isec.ist, isec.ei, isec.uv);
-    auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto sp =
+        eval_shading_point(scn, isec, o, spread * isec.dist);
+    auto &p = sp.p, &n = sp.n;
+    auto& f = sp.f;
 
     // emission
-    l += eval_emission(isec.ist, isec.ei, isec.uv);
+    l += sp.ke;
 
     // bsdf*light
     l += eval_bsdf(f, n, o, o) * fabs(dot(n, o)) * pi;
@@ -4992,12 +7377,14 @@ vec3f trace_eyelight(const std::shared_ptr<scene>& scn, const ray3f& ray,
     // opacity
     if (nbounces <= 0) return l;
     if (f.kt != zero3f) {
-        l += f.kt * trace_eyelight(scn, make_ray(p, -o), rng, nbounces - 1);
+        l += f.kt * trace_eyelight(scn, make_ray(p, -o), rng, nbounces - 1,
+                        nullptr, spread);
     }
-    auto op = eval_opacity(isec.ist, isec.ei, isec.uv);
+    auto op = sp.op;
     if (op != 1) {
         l = op * l +
-            (1 - op) * trace_eyelight(scn, make_ray(p, -o), rng, nbounces - 1);
+            (1 - op) * trace_eyelight(scn, make_ray(p, -o), rng, nbounces - 1,
+                           nullptr, spread);
     }
 
     // done
@@ -5005,126 +7392,184 @@ vec3f trace_eyelight(const std::shared_ptr<scene>& scn, const ray3f& ray,
 }
 
 // Debug previewing.
-vec3f trace_debug_normal(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_normal(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
     auto o = -ray.d;
-    auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
+    auto n = eval_shading_point(scn, isec, o, 0, false).n;
 
     // shade
     return n * 0.5f + vec3f{0.5f, 0.5f, 0.5f};
 }
 
 // Debug frontfacing.
-vec3f trace_debug_frontfacing(const std::shared_ptr<scene>& scn,
-    const ray3f& ray, rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_frontfacing(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
     auto o = -ray.d;
-    auto n = eval_shading_norm(isec.ist, isec.ei, isec.uv, o);
+    auto n = eval_shading_point(scn, isec, o, 0, false).n;
 
     // shade
     return dot(n, o) > 0 ? vec3f{0, 1, 0} : vec3f{1, 0, 0};
 }
 
 // Debug previewing.
-vec3f trace_debug_albedo(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_albedo(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto f = eval_shading_point(scn, isec, -ray.d).f;
 
     // shade
     return f.kd + f.ks + f.kt;
 }
 
 // Debug previewing.
-vec3f trace_debug_diffuse(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_diffuse(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto f = eval_shading_point(scn, isec, -ray.d).f;
 
     // shade
     return f.kd;
 }
 
 // Debug previewing.
-vec3f trace_debug_specular(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_specular(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto f = eval_shading_point(scn, isec, -ray.d).f;
 
     // shade
     return f.ks;
 }
 
 // Debug previewing.
-vec3f trace_debug_roughness(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_roughness(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
-    auto f = eval_bsdf(isec.ist, isec.ei, isec.uv);
+    auto f = eval_shading_point(scn, isec, -ray.d).f;
 
     // shade
     return {f.rs, f.rs, f.rs};
 }
 
 // Debug previewing.
-vec3f trace_debug_texcoord(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit) {
+vec3f trace_debug_texcoord(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit, float spread) {
     // intersect scene
     auto isec = intersect_ray(scn, ray);
-    if (!isec.ist) return zero3f;
+    if (isec.iid < 0) return zero3f;
     if (hit) *hit = true;
 
     // point
-    auto texcoord = eval_texcoord(isec.ist, isec.ei, isec.uv);
+    auto& shp = get_shape(scn, isec.iid);
+    auto texcoord = eval_texcoord(shp, isec.ei, isec.uv);
 
     // shade
     return {texcoord.x, texcoord.y, 0};
 }
 
-// Trace a single sample
-vec4f trace_sample(const std::shared_ptr<scene>& scn,
-    const std::shared_ptr<camera>& cam, const vec2i& ij, const vec2i& imsize,
-    rng_state& rng, trace_func tracer, int nbounces, float pixel_clamp = 100) {
-    _trace_npaths += 1;
+// Builtin trace function as a functor type, so that render loops
+// instantiated with it call the tracer directly.
+template <vec3f (*Func)(const render_scene&, const ray3f&, rng_state&, int,
+    bool*, float)>
+struct static_tracer {
+    vec3f operator()(const render_scene& scn, const ray3f& ray,
+        rng_state& rng, int nbounces, bool* hit, float spread) const {
+        return Func(scn, ray, rng, nbounces, hit, spread);
+    }
+};
+
+// Calls `func(tracer)` with the functor of a builtin trace type. Each call
+// instantiates `func` for all tracers, each specialized at compile time.
+template <typename Func>
+auto dispatch_trace_type(trace_type type, const Func& func) {
+    switch (type) {
+        case trace_type::path: return func(static_tracer<trace_path>{});
+        case trace_type::path_nomis:
+            return func(static_tracer<trace_path_nomis>{});
+        case trace_type::path_naive:
+            return func(static_tracer<trace_path_naive>{});
+        case trace_type::direct: return func(static_tracer<trace_direct>{});
+        case trace_type::direct_nomis:
+            return func(static_tracer<trace_direct_nomis>{});
+        case trace_type::environment:
+            return func(static_tracer<trace_environment>{});
+        case trace_type::eyelight:
+            return func(static_tracer<trace_eyelight>{});
+        case trace_type::debug_normal:
+            return func(static_tracer<trace_debug_normal>{});
+        case trace_type::debug_frontfacing:
+            return func(static_tracer<trace_debug_frontfacing>{});
+        case trace_type::debug_albedo:
+            return func(static_tracer<trace_debug_albedo>{});
+        case trace_type::debug_diffuse:
+            return func(static_tracer<trace_debug_diffuse>{});
+        case trace_type::debug_specular:
+            return func(static_tracer<trace_debug_specular>{});
+        case trace_type::debug_roughness:
+            return func(static_tracer<trace_debug_roughness>{});
+        case trace_type::debug_texcoord:
+            return func(static_tracer<trace_debug_texcoord>{});
+    }
+    throw std::runtime_error("unknown trace type");
+}
+
+// Trace a single sample, returning its camera ray and its first
+// intersection if requested. The intersection is the one traced by the
+// tracer, and the ray is traced again only if the tracer did not.
+template <typename Tracer>
+vec4f trace_sample(const render_scene& scn, const camera& cam, const vec2i& ij,
+    const vec2i& imsize, rng_state& rng, const Tracer& tracer, int nbounces,
+    float pixel_clamp = 100, ray3f* camera_ray = nullptr,
+    render_intersection* camera_isec = nullptr) {
+    _trace_thread_stats.npaths += 1;
     auto ray = eval_camera_ray(cam, ij, imsize, rand2f(rng), rand2f(rng));
+    if (camera_ray) *camera_ray = ray;
+    auto spread = (cam.ortho) ? 0 : cam.imsize.y / (cam.focal * imsize.y);
     auto hit = false;
-    auto l = tracer(scn, ray, rng, nbounces, &hit);
+    if (camera_isec) _trace_first_hit.pending = true;
+    auto l = tracer(scn, ray, rng, nbounces, &hit, spread);
+    if (camera_isec) {
+        if (_trace_first_hit.pending) intersect_ray(scn, ray);
+        *camera_isec = _trace_first_hit.isec;
+    }
     if (!isfinite(l.x) || !isfinite(l.y) || !isfinite(l.z)) {
         std::cout << "NaN detected\n";
         l = zero3f;
     }
     if (max(l) > pixel_clamp) l = l * (pixel_clamp / max(l));
-    return {l.x, l.y, l.z, (hit || !scn->environments.empty()) ? 1.0f : 0.0f};
+    return {l.x, l.y, l.z, (hit || !scn.environments.empty()) ? 1.0f : 0.0f};
 }
 
 // Init a sequence of random number generators.
@@ -5141,111 +7586,835 @@ image<rng_state> make_trace_rngs(const vec2i& imsize, uint64_t seed) {
     return rngs;
 }
 
+// Size of the image tiles rendered as separate parallel tasks.
+const int trace_tile_size = 32;
+
+// Thread pool shared by the renderers, made again if the number of threads
+// changes. Persisting it avoids creating threads for every batch.
+std::shared_ptr<thread_pool> get_trace_pool(int nthreads) {
+    static std::mutex pool_mutex;
+    static auto pool = std::shared_ptr<thread_pool>();
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!pool || (int)pool->threads.size() != max(nthreads, 1))
+        pool = make_thread_pool(nthreads);
+    return pool;
+}
+
+// Number of tiles of an image and the region [min, max) of tile `tid`.
+vec2i get_trace_ntiles(const vec2i& imsize) {
+    return {(imsize.x + trace_tile_size - 1) / trace_tile_size,
+        (imsize.y + trace_tile_size - 1) / trace_tile_size};
+}
+std::pair<vec2i, vec2i> get_trace_tile(const vec2i& imsize, int tid) {
+    auto ntiles = get_trace_ntiles(imsize);
+    auto tmin = vec2i{tid % ntiles.x, tid / ntiles.x} * trace_tile_size;
+    auto tmax = vec2i{min(tmin.x + trace_tile_size, imsize.x),
+        min(tmin.y + trace_tile_size, imsize.y)};
+    return {tmin, tmax};
+}
+
+// Runs `func(tid, tmin, tmax)` for every image tile in parallel on the trace
+// thread pool. Trace stats are merged at the end of each tile.
+void trace_tiles(const vec2i& imsize, int nthreads,
+    const std::function<void(int, const vec2i&, const vec2i&)>& func) {
+    auto ntiles = get_trace_ntiles(imsize);
+    parallel_for(get_trace_pool(nthreads), ntiles.x * ntiles.y, [&](int tid) {
+        auto tile = get_trace_tile(imsize, tid);
+        clear_trace_thread_stats();
+        func(tid, tile.first, tile.second);
+        merge_trace_thread_stats();
+    });
+}
+
+// Runs `func(ij)` for every pixel. Unless `noparallel` is set, tiles are
+// rendered in parallel on the trace thread pool. Trace stats are merged
+// at the end of each tile.
+template <typename Func>
+void trace_pixels(
+    const vec2i& imsize, bool noparallel, int nthreads, const Func& func) {
+    if (noparallel) {
+        clear_trace_thread_stats();
+        for (auto j = 0; j < imsize.y; j++) {
+            for (auto i = 0; i < imsize.x; i++) func({i, j});
+        }
+        merge_trace_thread_stats();
+        return;
+    }
+    trace_tiles(imsize, nthreads,
+        [&func](int tid, const vec2i& tmin, const vec2i& tmax) {
+            for (auto j = tmin.y; j < tmax.y; j++) {
+                for (auto i = tmin.x; i < tmax.x; i++) func({i, j});
+            }
+        });
+}
+
+// Adds the first-hit aovs of a camera ray and its intersection `isec`,
+// traced to sample `l`, to the running means of pixel `ij` over `nsamples`
+// samples, with the hit in alpha.
+void accumulate_trace_aovs(trace_state& st, const render_scene& scn,
+    const ray3f& ray, const render_intersection& isec, const vec4f& l,
+    const vec2i& ij, int nsamples) {
+    auto albedo = zero4f, normal = zero4f, depth = zero4f;
+    auto emission = zero4f;
+    if (isec.iid >= 0) {
+        auto sp = eval_shading_point(scn, isec, -ray.d);
+        auto kd = sp.f.kd + sp.f.ks + sp.f.kt;
+        albedo = {kd.x, kd.y, kd.z, 1};
+        normal = {sp.n.x, sp.n.y, sp.n.z, 1};
+        depth = {isec.dist, isec.dist, isec.dist, 1};
+        emission = {sp.ke.x, sp.ke.y, sp.ke.z, 1};
+    } else {
+        auto le = zero3f;
+        for (auto env : scn.environments) le += eval_environment(*env, ray.d);
+        emission = {le.x, le.y, le.z, 0};
+    }
+    auto weight = 1.0f / nsamples;
+    st.albedo[ij] += (albedo - st.albedo[ij]) * weight;
+    st.normal[ij] += (normal - st.normal[ij]) * weight;
+    st.depth[ij] += (depth - st.depth[ij]) * weight;
+    st.emission[ij] += (emission - st.emission[ij]) * weight;
+    auto residual = xyz(l) - xyz(emission);
+    auto residual2 = vec4f{residual.x * residual.x, residual.y * residual.y,
+        residual.z * residual.z, 0};
+    st.residual2[ij] += (residual2 - st.residual2[ij]) * weight;
+}
+
 // Progressively compute an image by calling trace_samples multiple times.
-image4f trace_image(const std::shared_ptr<scene>& scn, int camid,
-    int yresolution, int nsamples, trace_func tracer, int nbounces,
-    float pixel_clamp, bool noparallel, int seed) {
-    auto cam = scn->cameras.at(camid);
+template <typename Tracer>
+static image4f trace_image_generic(const render_scene& scn, int camid,
+    int yresolution, int nsamples, const Tracer& tracer, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads) {
+    auto& cam = *scn.cameras.at(camid);
     auto imsize = eval_image_resolution(cam, yresolution);
 
     auto img = image4f{imsize, zero4f};
     auto rng = make_trace_rngs(imsize, seed);
 
-    if (noparallel) {
-        for (auto j = 0; j < imsize.y; j++) {
-            for (auto i = 0; i < imsize.x; i++) {
-                for (auto s = 0; s < nsamples; s++)
-                    img[{i, j}] += trace_sample(scn, cam, {i, j}, imsize,
-                        rng[{i, j}], tracer, nbounces, pixel_clamp);
-                img[{i, j}] /= nsamples;
+    trace_pixels(imsize, noparallel, nthreads, [&](const vec2i& ij) {
+        for (auto s = 0; s < nsamples; s++)
+            img[ij] += trace_sample(
+                scn, cam, ij, imsize, rng[ij], tracer, nbounces, pixel_clamp);
+        img[ij] /= nsamples;
+    });
+    return img;
+}
+image4f trace_image(const render_scene& scn, int camid, int yresolution,
+    int nsamples, trace_func tracer, int nbounces, float pixel_clamp,
+    bool noparallel, int seed, int nthreads) {
+    return trace_image_generic(scn, camid, yresolution, nsamples, tracer,
+        nbounces, pixel_clamp, noparallel, seed, nthreads);
+}
+image4f trace_image(const render_scene& scn, int camid, int yresolution,
+    int nsamples, trace_type tracer, int nbounces, float pixel_clamp,
+    bool noparallel, int seed, int nthreads) {
+    return dispatch_trace_type(tracer, [&](const auto& tracef) {
+        return trace_image_generic(scn, camid, yresolution, nsamples, tracef,
+            nbounces, pixel_clamp, noparallel, seed, nthreads);
+    });
+}
+image4f trace_image(const std::shared_ptr<scene>& scn, int camid,
+    int yresolution, int nsamples, trace_func tracer, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads) {
+    return trace_image(make_render_scene(scn), camid, yresolution, nsamples,
+        tracer, nbounces, pixel_clamp, noparallel, seed, nthreads);
+}
+image4f trace_image(const std::shared_ptr<scene>& scn, int camid,
+    int yresolution, int nsamples, trace_type tracer, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads) {
+    return trace_image(make_render_scene(scn), camid, yresolution, nsamples,
+        tracer, nbounces, pixel_clamp, noparallel, seed, nthreads);
+}
+
+// Relative standard error of the mean of a pixel, estimated from the
+// accumulated first and second moments of its samples.
+float trace_pixel_error(const vec4f& acc, const vec4f& acc2, int nsamples) {
+    if (nsamples < 2) return flt_max;
+    auto mean = xyz(acc) / nsamples;
+    auto var = (xyz(acc2) / nsamples - mean * mean) *
+               ((float)nsamples / (nsamples - 1));
+    auto err = sqrt(max((var.x + var.y + var.z) / 3, 0.0f) / nsamples);
+    return err / max((mean.x + mean.y + mean.z) / 3, 0.01f);
+}
+
+// Progressively compute an image by calling trace_samples multiple times.
+template <typename Tracer>
+static bool trace_samples_generic(trace_state& st, const render_scene& scn,
+    int camid, int yresolution, int nsamples, const Tracer& tracer,
+    int nbatch, int nbounces, float pixel_clamp, bool noparallel, int seed,
+    int nthreads, float adaptive_threshold, bool aovs) {
+    auto adaptive = adaptive_threshold > 0;
+    if (!adaptive && st.sample >= nsamples) return true;
+
+    auto& cam = *scn.cameras.at(camid);
+    auto imsize = eval_image_resolution(cam, yresolution);
+    auto budget = (uint64_t)imsize.x * (uint64_t)imsize.y * nsamples;
+    if (adaptive && st.sample && st.samples_spent >= budget) return true;
+
+    if (!st.sample) {
+        st.img = image4f{imsize, zero4f};
+        st.acc = image4f{imsize, zero4f};
+        st.rng = make_trace_rngs(imsize, seed);
+        st.samples_spent = 0;
+        if (adaptive) {
+            st.acc2 = image4f{imsize, zero4f};
+            st.pixel_samples = image<int>{imsize, 0};
+        }
+        if (aovs) {
+            st.albedo = image4f{imsize, zero4f};
+            st.normal = image4f{imsize, zero4f};
+            st.depth = image4f{imsize, zero4f};
+            st.emission = image4f{imsize, zero4f};
+            st.residual2 = image4f{imsize, zero4f};
+        }
+    }
+
+    // uniform sampling
+    if (!adaptive) {
+        nbatch = min(nbatch, nsamples - st.sample);
+        trace_pixels(imsize, noparallel, nthreads, [&](const vec2i& ij) {
+            auto ray = ray3f();
+            auto isec = render_intersection();
+            auto camera_ray = (aovs) ? &ray : nullptr;
+            auto camera_isec = (aovs) ? &isec : nullptr;
+            for (auto s = 0; s < nbatch; s++) {
+                auto l = trace_sample(scn, cam, ij, imsize, st.rng[ij], tracer,
+                    nbounces, pixel_clamp, camera_ray, camera_isec);
+                st.acc[ij] += l;
+                if (aovs)
+                    accumulate_trace_aovs(
+                        st, scn, ray, isec, l, ij, st.sample + s + 1);
             }
+            st.img[ij] = st.acc[ij] / (st.sample + nbatch);
+        });
+        st.sample += nbatch;
+        st.samples_spent += (uint64_t)imsize.x * imsize.y * nbatch;
+        return st.sample >= nsamples;
+    }
+
+    // adaptive sampling, skipping converged pixels
+    auto max_samples = nsamples * trace_adaptive_max_ratio;
+    auto is_active = [&](const vec2i& ij) {
+        auto ns = st.pixel_samples[ij];
+        if (ns >= max_samples) return false;
+        if (ns < trace_adaptive_min_samples) return true;
+        return trace_pixel_error(st.acc[ij], st.acc2[ij], ns) >=
+               adaptive_threshold;
+    };
+
+    // spread the remaining budget over the active pixels
+    auto nactive = (uint64_t)0;
+    for (auto j = 0; j < imsize.y; j++) {
+        for (auto i = 0; i < imsize.x; i++) nactive += is_active({i, j});
+    }
+    if (!nactive) return true;
+    auto remaining = (budget - st.samples_spent) / nactive;
+    if (!remaining) return true;
+    if (remaining < nbatch) nbatch = (int)remaining;
+
+    std::atomic<uint64_t> spent(0);
+    trace_pixels(imsize, noparallel, nthreads, [&](const vec2i& ij) {
+        if (!is_active(ij)) return;
+        auto ns = st.pixel_samples[ij];
+        auto nb = min(nbatch, max_samples - ns);
+        auto ray = ray3f();
+        auto isec = render_intersection();
+        auto camera_ray = (aovs) ? &ray : nullptr;
+        auto camera_isec = (aovs) ? &isec : nullptr;
+        for (auto s = 0; s < nb; s++) {
+            auto l = trace_sample(scn, cam, ij, imsize, st.rng[ij], tracer,
+                nbounces, pixel_clamp, camera_ray, camera_isec);
+            st.acc[ij] += l;
+            st.acc2[ij] += l * l;
+            if (aovs)
+                accumulate_trace_aovs(st, scn, ray, isec, l, ij, ns + s + 1);
         }
-    } else {
-        auto nthreads = std::thread::hardware_concurrency();
-        auto threads = std::vector<std::thread>();
-        for (auto tid = 0; tid < std::thread::hardware_concurrency(); tid++) {
-            threads.push_back(std::thread([=, &img, &rng]() {
-                for (auto j = tid; j < imsize.y; j += nthreads) {
-                    for (auto i = 0; i < imsize.x; i++) {
-                        for (auto s = 0; s < nsamples; s++)
-                            img[{i, j}] +=
-                                trace_sample(scn, cam, {i, j}, imsize,
-                                    rng[{i, j}], tracer, nbounces, pixel_clamp);
-                        img[{i, j}] /= nsamples;
+        st.pixel_samples[ij] = ns + nb;
+        st.img[ij] = st.acc[ij] / st.pixel_samples[ij];
+        spent += nb;
+    });
+    st.sample += nbatch;
+    st.samples_spent += spent;
+    return !spent || st.samples_spent >= budget;
+}
+bool trace_samples(trace_state& st, const render_scene& scn, int camid,
+    int yresolution, int nsamples, trace_func tracer, int nbatch, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads,
+    float adaptive_threshold, bool aovs) {
+    return trace_samples_generic(st, scn, camid, yresolution, nsamples, tracer,
+        nbatch, nbounces, pixel_clamp, noparallel, seed, nthreads,
+        adaptive_threshold, aovs);
+}
+bool trace_samples(trace_state& st, const render_scene& scn, int camid,
+    int yresolution, int nsamples, trace_type tracer, int nbatch, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads,
+    float adaptive_threshold, bool aovs) {
+    return dispatch_trace_type(tracer, [&](const auto& tracef) {
+        return trace_samples_generic(st, scn, camid, yresolution, nsamples,
+            tracef, nbatch, nbounces, pixel_clamp, noparallel, seed, nthreads,
+            adaptive_threshold, aovs);
+    });
+}
+bool trace_samples(trace_state& st, const std::shared_ptr<scene>& scn,
+    int camid, int yresolution, int nsamples, trace_func tracer, int nbatch,
+    int nbounces, float pixel_clamp, bool noparallel, int seed, int nthreads,
+    float adaptive_threshold, bool aovs) {
+    return trace_samples(st, make_render_scene(scn), camid, yresolution,
+        nsamples, tracer, nbatch, nbounces, pixel_clamp, noparallel, seed,
+        nthreads, adaptive_threshold, aovs);
+}
+bool trace_samples(trace_state& st, const std::shared_ptr<scene>& scn,
+    int camid, int yresolution, int nsamples, trace_type tracer, int nbatch,
+    int nbounces, float pixel_clamp, bool noparallel, int seed, int nthreads,
+    float adaptive_threshold, bool aovs) {
+    return trace_samples(st, make_render_scene(scn), camid, yresolution,
+        nsamples, tracer, nbatch, nbounces, pixel_clamp, noparallel, seed,
+        nthreads, adaptive_threshold, aovs);
+}
+
+// Path traced by the wavefront path tracer, with the state kept between
+// the extend, shade and light stages.
+struct wavefront_path {
+    vec2i ij = zero2i;               // pixel
+    ray3f ray = {};                  // ray to extend
+    render_intersection isec = {};   // extended ray intersection
+    vec3f l = zero3f;                // radiance
+    vec3f weight = {1, 1, 1};        // path weight
+    float cone = 0;                  // ray cone width
+    bool emission = true;            // whether to add emission
+    bool hit = false;                // whether the camera ray hit
+    vec3f o = zero3f;                // outgoing direction
+    shading_point sp = {};           // shading point
+    vec3f i = zero3f;                // light sample direction
+    render_intersection light = {};  // light ray intersection
+};
+
+// Renders `nbatch` samples of the pixels of the tile [tmin, tmax) as a
+// wavefront, adding them to the accumulation buffer. This follows
+// `trace_sample()` and `trace_path()` stage by stage.
+void trace_wavefront_tile(trace_state& st, const render_scene& scn,
+    const camera& cam, const vec2i& imsize, const vec2i& tmin,
+    const vec2i& tmax, int nbatch, int nbounces, float pixel_clamp) {
+    auto spread = (cam.ortho) ? 0 : cam.imsize.y / (cam.focal * imsize.y);
+    auto has_lights = !scn.lights.empty() || !scn.environments.empty();
+    auto paths = std::vector<wavefront_path>();
+    auto active = std::vector<int>(), shade = std::vector<int>();
+    auto queue = std::vector<int>();
+    auto rays = std::vector<ray3f>();
+    auto rngs = std::vector<rng_state*>();
+    auto isecs = std::vector<render_intersection>();
+
+    // intersects the rays of the queued paths handling opacity
+    auto intersect_queue = [&](bool shadow) {
+        rays.resize(queue.size());
+        rngs.resize(queue.size());
+        for (auto k = 0; k < queue.size(); k++) {
+            auto& path = paths[queue[k]];
+            rays[k] = (shadow) ? make_ray(path.sp.p, path.i) : path.ray;
+            rngs[k] = &st.rng[path.ij];
+        }
+        intersect_rays_cutout(scn, rays, rngs, nbounces, shadow, isecs);
+        for (auto k = 0; k < queue.size(); k++) {
+            auto& path = paths[queue[k]];
+            if (shadow) {
+                path.light = isecs[k];
+            } else {
+                path.isec = isecs[k];
+            }
+        }
+    };
+
+    for (auto s = 0; s < nbatch; s++) {
+        // camera rays
+        paths.clear();
+        active.clear();
+        for (auto j = tmin.y; j < tmax.y; j++) {
+            for (auto i = tmin.x; i < tmax.x; i++) {
+                _trace_thread_stats.npaths += 1;
+                auto path = wavefront_path();
+                path.ij = {i, j};
+                auto& rng = st.rng[path.ij];
+                path.ray = eval_camera_ray(
+                    cam, path.ij, imsize, rand2f(rng), rand2f(rng));
+                if (has_lights) active.push_back((int)paths.size());
+                paths.push_back(path);
+            }
+        }
+
+        for (auto bounce = 0; bounce < nbounces && !active.empty();
+             bounce++) {
+            // extend paths, adding the environment to missed ones
+            queue = active;
+            intersect_queue(false);
+            shade.clear();
+            for (auto pid : active) {
+                auto& path = paths[pid];
+                if (path.isec.iid >= 0) {
+                    shade.push_back(pid);
+                } else if (path.emission) {
+                    for (auto env : scn.environments)
+                        path.l += path.weight * eval_environment(
+                                                    *env, path.ray.d);
+                }
+            }
+
+            // sort hits by material and instance for coherent shading
+            std::sort(shade.begin(), shade.end(), [&](int a, int b) {
+                auto ia = paths[a].isec.iid, ib = paths[b].isec.iid;
+                auto ma = scn.instances[ia].material,
+                     mb = scn.instances[ib].material;
+                return (ma != mb) ? ma < mb : (ia != ib) ? ia < ib : a < b;
+            });
+
+            // shade points, sampling the lights of non-delta bsdfs
+            queue.clear();
+            auto nshade = 0;
+            for (auto pid : shade) {
+                auto& path = paths[pid];
+                auto& rng = st.rng[path.ij];
+                path.hit = true;
+                path.o = -path.ray.d;
+                path.cone += spread * path.isec.dist;
+                path.sp = eval_shading_point(scn, path.isec, path.o, path.cone);
+                auto& p = path.sp.p;
+                auto& f = path.sp.f;
+                if (path.emission) path.l += path.weight * path.sp.ke;
+
+                // early exit and russian roulette
+                if (f.kd + f.ks + f.kt == zero3f || bounce >= nbounces - 1)
+                    continue;
+                if (bounce > 2) {
+                    auto rrprob = 1.0f - min(max(path.weight), 0.95f);
+                    if (rand1f(rng) < rrprob) continue;
+                    path.weight *= 1 / (1 - rrprob);
+                }
+                shade[nshade++] = pid;
+                if (is_delta_bsdf(f)) continue;
+
+                // direct
+                if (rand1f(rng) < 0.5f) {
+                    auto idx = pick_light_index(scn, p, rand1f(rng));
+                    if (idx < scn.lights.size()) {
+                        auto lgt = scn.lights[idx];
+                        path.i = sample_light(
+                            scn, lgt, p, rand1f(rng), rand2f(rng));
+                    } else {
+                        auto& env = *scn.environments[idx - scn.lights.size()];
+                        path.i = sample_environment(
+                            env, rand1f(rng), rand2f(rng));
+                    }
+                } else {
+                    path.i = sample_brdf(
+                        f, path.sp.n, path.o, rand1f(rng), rand2f(rng));
+                }
+                queue.push_back(pid);
+            }
+            shade.resize(nshade);
+
+            // test light rays
+            intersect_queue(true);
+
+            // add direct lighting and continue paths
+            active.clear();
+            for (auto pid : shade) {
+                auto& path = paths[pid];
+                auto& rng = st.rng[path.ij];
+                auto &p = path.sp.p, &n = path.sp.n, &o = path.o;
+                auto& f = path.sp.f;
+                if (!is_delta_bsdf(f)) {
+                    auto& i = path.i;
+                    auto& isec = path.light;
+                    auto pdf = 0.5f * sample_brdf_pdf(f, n, o, i);
+                    auto le = zero3f;
+                    if (isec.iid >= 0) {
+                        auto lpt = eval_light_point(scn, isec, -i);
+                        auto lid = scn.instances[isec.iid].light_id;
+                        pdf += 0.5f *
+                               sample_light_pdf(
+                                   scn, isec.iid, p, i, lpt.p, lpt.n) *
+                               pick_light_index_pdf(scn, p, lid);
+                        le += lpt.ke;
+                    } else {
+                        for (auto eid = 0; eid < scn.environments.size();
+                             eid++) {
+                            auto& env = *scn.environments[eid];
+                            pdf += 0.5f * sample_environment_pdf(env, i) *
+                                   pick_light_index_pdf(
+                                       scn, p, (int)scn.lights.size() + eid);
+                            le += eval_environment(env, i);
+                        }
                     }
+                    auto brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
+                    if (pdf != 0) path.l += path.weight * le * brdfcos / pdf;
+                }
+
+                // continue path
+                auto i = zero3f, brdfcos = zero3f;
+                auto pdf = 0.0f;
+                if (!is_delta_bsdf(f)) {
+                    i = sample_brdf(f, n, o, rand1f(rng), rand2f(rng));
+                    brdfcos = eval_bsdf(f, n, o, i) * fabs(dot(n, i));
+                    pdf = sample_brdf_pdf(f, n, o, i);
+                } else {
+                    i = sample_delta_brdf(f, n, o, rand1f(rng), rand2f(rng));
+                    brdfcos = eval_delta_brdf(f, n, o, i) * fabs(dot(n, i));
+                    pdf = sample_delta_brdf_pdf(f, n, o, i);
                 }
-            }));
+                if (pdf == 0) continue;
+                path.weight *= brdfcos / pdf;
+                if (path.weight == zero3f) continue;
+                path.ray = make_ray(p, i);
+                path.emission = is_delta_bsdf(f);
+                active.push_back(pid);
+            }
+        }
+
+        // accumulate samples
+        for (auto& path : paths) {
+            auto l = path.l;
+            if (!isfinite(l.x) || !isfinite(l.y) || !isfinite(l.z)) {
+                std::cout << "NaN detected\n";
+                l = zero3f;
+            }
+            if (max(l) > pixel_clamp) l = l * (pixel_clamp / max(l));
+            st.acc[path.ij] += {l.x, l.y, l.z,
+                (path.hit || !scn.environments.empty()) ? 1.0f : 0.0f};
         }
-        for (auto& t : threads) t.join();
     }
-    return img;
 }
 
-// Progressively compute an image by calling trace_samples multiple times.
-bool trace_samples(trace_state& st, const std::shared_ptr<scene>& scn,
-    int camid, int yresolution, int nsamples, trace_func tracer, int nbatch,
-    int nbounces, float pixel_clamp, bool noparallel, int seed) {
-    if (st.sample >= nsamples) return true;
-
-    auto cam = scn->cameras.at(camid);
+// Progressively compute an image with a wavefront path tracer.
+bool trace_samples_wavefront(trace_state& st, const render_scene& scn,
+    int camid, int yresolution, int nsamples, int nbatch, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads) {
+    auto& cam = *scn.cameras.at(camid);
     auto imsize = eval_image_resolution(cam, yresolution);
-
     if (!st.sample) {
         st.img = image4f{imsize, zero4f};
         st.acc = image4f{imsize, zero4f};
         st.rng = make_trace_rngs(imsize, seed);
+        st.samples_spent = 0;
     }
-
     nbatch = min(nbatch, nsamples - st.sample);
-    if (noparallel) {
-        for (auto j = 0; j < imsize.y; j++) {
-            for (auto i = 0; i < imsize.x; i++) {
-                for (auto s = 0; s < nbatch; s++)
-                    st.acc[{i, j}] += trace_sample(scn, cam, {i, j}, imsize,
-                        st.rng[{i, j}], tracer, nbounces, pixel_clamp);
+    auto render_tile = [&](const vec2i& tmin, const vec2i& tmax) {
+        trace_wavefront_tile(st, scn, cam, imsize, tmin, tmax, nbatch,
+            nbounces, pixel_clamp);
+        for (auto j = tmin.y; j < tmax.y; j++) {
+            for (auto i = tmin.x; i < tmax.x; i++)
                 st.img[{i, j}] = st.acc[{i, j}] / (st.sample + nbatch);
-            }
         }
-        st.sample += nbatch;
+    };
+    if (noparallel) {
+        auto ntiles = get_trace_ntiles(imsize);
+        clear_trace_thread_stats();
+        for (auto tid = 0; tid < ntiles.x * ntiles.y; tid++) {
+            auto tile = get_trace_tile(imsize, tid);
+            render_tile(tile.first, tile.second);
+        }
+        merge_trace_thread_stats();
     } else {
-        auto nthreads = std::thread::hardware_concurrency();
-        auto threads = std::vector<std::thread>();
-        for (auto tid = 0; tid < std::thread::hardware_concurrency(); tid++) {
-            threads.push_back(std::thread([=, &st]() {
-                for (auto j = tid; j < imsize.y; j += nthreads) {
-                    for (auto i = 0; i < imsize.x; i++) {
-                        for (auto s = 0; s < nbatch; s++)
-                            st.acc[{i, j}] += trace_sample(scn, cam, {i, j},
-                                imsize, st.rng[{i, j}], tracer, nbounces,
-                                pixel_clamp);
-                        st.img[{i, j}] = st.acc[{i, j}] / (st.sample + nbatch);
+        trace_tiles(imsize, nthreads,
+            [&](int tid, const vec2i& tmin, const vec2i& tmax) {
+                render_tile(tmin, tmax);
+            });
+    }
+    st.sample += nbatch;
+    st.samples_spent += (uint64_t)imsize.x * imsize.y * nbatch;
+    return st.sample >= nsamples;
+}
+
+// Denoise a rendered image with an edge-avoiding a-trous wavelet filter.
+image4f denoise_trace_image(const image4f& img, const image4f& variance,
+    const image4f& albedo, const image4f& normal, const image4f& depth,
+    const image4f& emission, int niterations, float color_sigma,
+    float normal_sigma, float depth_sigma) {
+    if (img.size != variance.size || img.size != albedo.size ||
+        img.size != normal.size || img.size != depth.size ||
+        img.size != emission.size)
+        throw std::runtime_error("aovs do not match image size");
+    auto size = img.size;
+
+    // remove the emission and demodulate the albedo, leaving misses and
+    // black surfaces untouched
+    auto get_albedo = [&](int idx) {
+        auto& a = albedo.pxl[idx];
+        auto eps = 0.01f;
+        if (a.w <= 0 || max(a.x, max(a.y, a.z)) < eps * a.w)
+            return vec3f{1, 1, 1};
+        return vec3f{max(a.x, eps), max(a.y, eps), max(a.z, eps)} / a.w;
+    };
+    auto src = std::vector<vec3f>(img.pxl.size());
+    auto var = std::vector<float>(img.pxl.size());
+    parallel_rows(size, [&](int j0, int j1) {
+        for (auto idx = j0 * size.x; idx < j1 * size.x; idx++) {
+            auto c = xyz(img.pxl[idx]) - xyz(emission.pxl[idx]);
+            auto a = get_albedo(idx);
+            c = {max(c.x, 0.0f), max(c.y, 0.0f), max(c.z, 0.0f)};
+            src[idx] = c / a;
+            var[idx] = luminance(xyz(variance.pxl[idx]) / (a * a));
+        }
+    });
+
+    // filter with kernels of increasing spacing, with color weights relative
+    // to the standard deviation of the difference of two pixels, estimated
+    // from the lower of their variances blurred in a 3x3 window; weights are
+    // symmetric so that energy is not moved between noisy and smooth
+    // regions, and the variances are filtered with the squared weights
+    const float kernel[5] = {
+        1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f, 1 / 16.0f};
+    const float kernel3[3] = {1 / 4.0f, 1 / 2.0f, 1 / 4.0f};
+    auto dst = std::vector<vec3f>(img.pxl.size());
+    auto dst_var = std::vector<float>(img.pxl.size());
+    auto blurred_var = std::vector<float>(img.pxl.size());
+    for (auto it = 0; it < niterations; it++) {
+        parallel_rows(size, [&](int j0, int j1) {
+            for (auto j = j0; j < j1; j++) {
+                for (auto i = 0; i < size.x; i++) {
+                    auto sum = 0.0f;
+                    for (auto kj = 0; kj < 3; kj++) {
+                        auto qj = clamp(j + kj - 1, 0, size.y - 1);
+                        for (auto ki = 0; ki < 3; ki++) {
+                            auto qi = clamp(i + ki - 1, 0, size.x - 1);
+                            sum += kernel3[kj] * kernel3[ki] *
+                                   var[qj * size.x + qi];
+                        }
+                    }
+                    blurred_var[j * size.x + i] = max(sum, 0.0f);
+                }
+            }
+        });
+        auto step = 1 << it;
+        parallel_rows(size, [&](int j0, int j1) {
+            for (auto j = j0; j < j1; j++) {
+                for (auto i = 0; i < size.x; i++) {
+                    auto pidx = j * size.x + i;
+                    auto pl = luminance(src[pidx]);
+                    auto pvar = blurred_var[pidx];
+                    auto& pn = normal.pxl[pidx];
+                    auto& pd = depth.pxl[pidx];
+                    auto sum = zero3f;
+                    auto wsum = 0.0f, vsum = 0.0f;
+                    for (auto kj = 0; kj < 5; kj++) {
+                        auto qj = clamp(j + (kj - 2) * step, 0, size.y - 1);
+                        for (auto ki = 0; ki < 5; ki++) {
+                            auto qi = clamp(i + (ki - 2) * step, 0, size.x - 1);
+                            auto qidx = qj * size.x + qi;
+                            auto& qn = normal.pxl[qidx];
+                            auto& qd = depth.pxl[qidx];
+                            if ((pn.w > 0) != (qn.w > 0)) continue;
+                            auto qvar = min(pvar, blurred_var[qidx]);
+                            auto dc = fabs(pl - luminance(src[qidx])) /
+                                      (color_sigma * sqrt(2 * qvar) + 0.0001f);
+                            auto dn = length(vec3f{pn.x - qn.x, pn.y - qn.y,
+                                pn.z - qn.z});
+                            auto dd = fabs(pd.x - qd.x) /
+                                      (max(pd.x, qd.x) + 0.0001f);
+                            auto w = kernel[kj] * kernel[ki] *
+                                     exp(-dc -
+                                         dn * dn / (2 * normal_sigma *
+                                                       normal_sigma) -
+                                         dd * dd / (2 * depth_sigma *
+                                                       depth_sigma));
+                            sum += src[qidx] * w;
+                            wsum += w;
+                            vsum += w * w * var[qidx];
+                        }
                     }
+                    dst[pidx] = (wsum > 0) ? sum / wsum : src[pidx];
+                    dst_var[pidx] = (wsum > 0) ? vsum / (wsum * wsum) :
+                                                 var[pidx];
                 }
-            }));
+            }
+        });
+        std::swap(src, dst);
+        std::swap(var, dst_var);
+    }
+
+    // remodulate the albedo and add back the emission
+    auto denoised = image4f{size, zero4f};
+    parallel_rows(size, [&](int j0, int j1) {
+        for (auto idx = j0 * size.x; idx < j1 * size.x; idx++) {
+            auto c = src[idx] * get_albedo(idx) + xyz(emission.pxl[idx]);
+            denoised.pxl[idx] = {c.x, c.y, c.z, img.pxl[idx].w};
+        }
+    });
+    return denoised;
+}
+image4f denoise_trace_image(const trace_state& st, int niterations,
+    float color_sigma, float normal_sigma, float depth_sigma) {
+    if (st.residual2.size != st.img.size)
+        throw std::runtime_error("denoising needs a render with aovs");
+
+    // variance of the pixel means without the emission from the residual
+    // moments, taking the mean itself as the deviation of pixels with a
+    // single sample
+    auto variance = image4f{st.img.size, zero4f};
+    auto adaptive = !st.pixel_samples.pxl.empty();
+    for (auto idx = 0; idx < st.img.pxl.size(); idx++) {
+        auto ns = (adaptive) ? st.pixel_samples.pxl[idx] : st.sample;
+        if (ns <= 0) continue;
+        auto mean = xyz(st.acc.pxl[idx]) / ns - xyz(st.emission.pxl[idx]);
+        auto var = mean * mean;
+        if (ns > 1)
+            var = (xyz(st.residual2.pxl[idx]) - mean * mean) *
+                  (1.0f / (ns - 1));
+        variance.pxl[idx] = {
+            max(var.x, 0.0f), max(var.y, 0.0f), max(var.z, 0.0f), 0};
+    }
+    return denoise_trace_image(st.img, variance, st.albedo, st.normal,
+        st.depth, st.emission, niterations, color_sigma, normal_sigma,
+        depth_sigma);
+}
+
+// Random number generator of sample `s` of pixel `ij`, so that samples can
+// be rendered in any order and on any machine. Streams are unique for up to
+// 2^24 samples per pixel.
+rng_state make_trace_sample_rng(
+    const vec2i& ij, const vec2i& imsize, int s, uint64_t seed) {
+    auto pidx = (uint64_t)ij.y * (uint64_t)imsize.x + (uint64_t)ij.x;
+    return make_rng(seed, (pidx << 24) + (uint64_t)s);
+}
+
+template <typename Tracer>
+static trace_accumulation trace_accumulate_generic(const render_scene& scn,
+    int camid, int yresolution, const vec2i& region_min,
+    const vec2i& region_max, int sample_start, int sample_end,
+    const Tracer& tracer, int nbounces, float pixel_clamp, bool noparallel,
+    int seed, int nthreads) {
+    auto& cam = *scn.cameras.at(camid);
+    auto imsize = eval_image_resolution(cam, yresolution);
+    auto rmin = vec2i{clamp(region_min.x, 0, imsize.x),
+        clamp(region_min.y, 0, imsize.y)};
+    auto rmax = vec2i{clamp(region_max.x, 0, imsize.x),
+        clamp(region_max.y, 0, imsize.y)};
+    if (rmin.x >= rmax.x || rmin.y >= rmax.y)
+        throw std::runtime_error("empty render region");
+    if (sample_start < 0 || sample_end > (1 << 24))
+        throw std::runtime_error("bad sample range");
+
+    auto acc = trace_accumulation();
+    acc.imsize = imsize;
+    acc.offset = rmin;
+    acc.acc = image4f{rmax - rmin, zero4f};
+    acc.count = image<int>{rmax - rmin, max(sample_end - sample_start, 0)};
+    acc.ranges = {{rmin, rmax, sample_start, sample_end}};
+    trace_pixels(acc.acc.size, noparallel, nthreads, [&](const vec2i& ij) {
+        auto pij = ij + rmin;
+        for (auto s = sample_start; s < sample_end; s++) {
+            auto rng = make_trace_sample_rng(pij, imsize, s, seed);
+            acc.acc[ij] += trace_sample(
+                scn, cam, pij, imsize, rng, tracer, nbounces, pixel_clamp);
+        }
+    });
+    return acc;
+}
+trace_accumulation trace_accumulate(const render_scene& scn, int camid,
+    int yresolution, const vec2i& region_min, const vec2i& region_max,
+    int sample_start, int sample_end, trace_func tracer, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads) {
+    return trace_accumulate_generic(scn, camid, yresolution, region_min,
+        region_max, sample_start, sample_end, tracer, nbounces, pixel_clamp,
+        noparallel, seed, nthreads);
+}
+trace_accumulation trace_accumulate(const render_scene& scn, int camid,
+    int yresolution, const vec2i& region_min, const vec2i& region_max,
+    int sample_start, int sample_end, trace_type tracer, int nbounces,
+    float pixel_clamp, bool noparallel, int seed, int nthreads) {
+    return dispatch_trace_type(tracer, [&](const auto& tracef) {
+        return trace_accumulate_generic(scn, camid, yresolution, region_min,
+            region_max, sample_start, sample_end, tracef, nbounces,
+            pixel_clamp, noparallel, seed, nthreads);
+    });
+}
+
+// Check whether two accumulation ranges share some samples of some pixels.
+inline bool overlap_trace_ranges(
+    const trace_accumulation_range& a, const trace_accumulation_range& b) {
+    return a.region_min.x < b.region_max.x && b.region_min.x < a.region_max.x &&
+           a.region_min.y < b.region_max.y && b.region_min.y < a.region_max.y &&
+           a.sample_start < b.sample_end && b.sample_start < a.sample_end;
+}
+
+void merge_trace_accumulation(
+    trace_accumulation& merged, const trace_accumulation& acc) {
+    // expand the merged accumulation to the full image
+    if (merged.acc.pxl.empty()) merged.imsize = acc.imsize;
+    if (merged.imsize != acc.imsize)
+        throw std::runtime_error("accumulations of different image sizes");
+    for (auto& range : acc.ranges) {
+        for (auto& merged_range : merged.ranges) {
+            if (overlap_trace_ranges(range, merged_range))
+                throw std::runtime_error("accumulations of the same samples");
         }
-        for (auto& t : threads) t.join();
-        st.sample += nbatch;
     }
-    return st.sample >= nsamples;
+    if (merged.offset != zero2i || merged.acc.size != merged.imsize) {
+        auto full = trace_accumulation();
+        full.imsize = merged.imsize;
+        full.acc = image4f{merged.imsize, zero4f};
+        full.count = image<int>{merged.imsize, 0};
+        if (!merged.acc.pxl.empty()) merge_trace_accumulation(full, merged);
+        merged = std::move(full);
+    }
+
+    // add samples
+    for (auto j = 0; j < acc.acc.size.y; j++) {
+        for (auto i = 0; i < acc.acc.size.x; i++) {
+            auto ij = vec2i{i, j} + acc.offset;
+            merged.acc[ij] += acc.acc[{i, j}];
+            merged.count[ij] += acc.count[{i, j}];
+        }
+    }
+    merged.ranges.insert(
+        merged.ranges.end(), acc.ranges.begin(), acc.ranges.end());
+}
+
+image4f resolve_trace_accumulation(const trace_accumulation& acc) {
+    auto img = image4f{acc.imsize, zero4f};
+    for (auto j = 0; j < acc.acc.size.y; j++) {
+        for (auto i = 0; i < acc.acc.size.x; i++) {
+            auto count = acc.count[{i, j}];
+            if (count) img[vec2i{i, j} + acc.offset] = acc.acc[{i, j}] / count;
+        }
+    }
+    return img;
+}
+
+// Copies a tonemapped tile to the display image and marks it dirty for the
+// viewer.
+void publish_trace_tile(trace_async_state& st, int tid, const vec2i& tmin,
+    const vec2i& tmax, const std::vector<vec4f>& tile) {
+    std::lock_guard<std::mutex> lock(st.display_mutex);
+    auto width = tmax.x - tmin.x;
+    for (auto j = tmin.y; j < tmax.y; j++) {
+        std::copy(tile.begin() + (j - tmin.y) * width,
+            tile.begin() + (j - tmin.y + 1) * width, &st.display[{tmin.x, j}]);
+    }
+    if (!st.dirty_flags[tid]) {
+        st.dirty_flags[tid] = true;
+        st.dirty_tiles.push_back(tid);
+    }
 }
 
 // Starts an anyncrhounous renderer.
-void trace_async_start(trace_async_state& st, const std::shared_ptr<scene>& scn,
-    int camid, int yresolution, int nsamples, trace_func tracer, float exposure,
-    float gamma, bool filmic, int pratio, int nbounces, float pixel_clamp,
-    int seed) {
-    auto cam = scn->cameras.at(camid);
-    auto imsize = eval_image_resolution(cam, yresolution);
+template <typename Tracer>
+static void trace_async_start_generic(trace_async_state& st,
+    const std::shared_ptr<scene>& scn, int camid, int yresolution,
+    int nsamples, const Tracer& tracer, float exposure, float gamma,
+    bool filmic, int pratio, int nbounces, float pixel_clamp, int seed,
+    int nthreads) {
+    auto rscn = make_render_scene(scn);
+    auto imsize = eval_image_resolution(*rscn.cameras.at(camid), yresolution);
 
     st.img = image4f{imsize, zero4f};
     st.display = image4f{imsize, zero4f};
     st.acc = image4f{imsize, zero4f};
     st.rng = make_trace_rngs(imsize, seed);
+    st.sample = 0;
 
     // render preview image
     if (pratio) {
-        auto pimg = ygl::trace_image(scn, camid, yresolution / pratio, 1,
-            tracer, nbounces, pixel_clamp, true, seed);
+        auto pimg = trace_image_generic(rscn, camid, yresolution / pratio, 1,
+            tracer, nbounces, pixel_clamp, true, seed, nthreads);
         auto pwidth = pimg.size.x, pheight = pimg.size.y;
         for (auto j = 0; j < imsize.y; j++) {
             for (auto i = 0; i < imsize.x; i++) {
@@ -5257,26 +8426,82 @@ void trace_async_start(trace_async_state& st, const std::shared_ptr<scene>& scn,
         st.display = ygl::tonemap_image(st.img, exposure, gamma, filmic);
     }
 
-    auto nthreads = std::thread::hardware_concurrency();
-    for (auto tid = 0; tid < nthreads; tid++) {
-        st.threads.push_back(std::thread([=, &st]() {
-            for (auto s = 0; s < nsamples; s++) {
-                if (!tid) st.sample = s;
-                for (auto j = tid; j < imsize.y; j += nthreads) {
-                    for (auto i = 0; i < imsize.x; i++) {
-                        if (st.stop_flag) return;
-                        st.acc[{i, j}] += trace_sample(scn, cam, {i, j}, imsize,
-                            st.rng[{i, j}], tracer, nbounces);
-                        st.img[{i, j}] = st.acc[{i, j}] / (s + 1);
-                        xyz(st.display[{i, j}]) = tonemap_hdr(
-                            xyz(st.img[{i, j}]), exposure, gamma, filmic);
-                        st.display[{i, j}].w = st.img[{i, j}].w;
+    // all tiles start dirty, so that the viewer copies the preview
+    auto ntiles = get_trace_ntiles(imsize);
+    st.dirty_flags.assign(ntiles.x * ntiles.y, true);
+    st.dirty_tiles.resize(ntiles.x * ntiles.y);
+    for (auto tid = 0; tid < st.dirty_tiles.size(); tid++)
+        st.dirty_tiles[tid] = tid;
+
+    // render samples one at a time, with tiles spread over the pool, keeping
+    // the scene alive for its snapshot; each tile is accumulated and
+    // tonemapped on its own, then published to the display image
+    st.threads.push_back(std::thread([&st, scn, rscn, camid, imsize, nsamples,
+                                         tracer, exposure, gamma, filmic,
+                                         nbounces, nthreads]() {
+        auto& cam = *rscn.cameras.at(camid);
+        for (auto s = 0; s < nsamples; s++) {
+            st.sample = s;
+            trace_tiles(imsize, nthreads,
+                [&](int tid, const vec2i& tmin, const vec2i& tmax) {
+                    if (st.stop_flag) return;
+                    auto tile = std::vector<vec4f>();
+                    tile.reserve((tmax.x - tmin.x) * (tmax.y - tmin.y));
+                    for (auto j = tmin.y; j < tmax.y; j++) {
+                        for (auto i = tmin.x; i < tmax.x; i++) {
+                            auto ij = vec2i{i, j};
+                            st.acc[ij] += trace_sample(rscn, cam, ij, imsize,
+                                st.rng[ij], tracer, nbounces);
+                            st.img[ij] = st.acc[ij] / (s + 1);
+                            auto c = tonemap_hdr(
+                                xyz(st.img[ij]), exposure, gamma, filmic);
+                            tile.push_back({c.x, c.y, c.z, st.img[ij].w});
+                        }
                     }
-                }
-            }
-            if (!tid) st.sample = nsamples;
-        }));
+                    publish_trace_tile(st, tid, tmin, tmax, tile);
+                });
+            if (st.stop_flag) return;
+        }
+        st.sample = nsamples;
+    }));
+}
+void trace_async_start(trace_async_state& st, const std::shared_ptr<scene>& scn,
+    int camid, int yresolution, int nsamples, trace_func tracer, float exposure,
+    float gamma, bool filmic, int pratio, int nbounces, float pixel_clamp,
+    int seed, int nthreads) {
+    trace_async_start_generic(st, scn, camid, yresolution, nsamples, tracer,
+        exposure, gamma, filmic, pratio, nbounces, pixel_clamp, seed,
+        nthreads);
+}
+void trace_async_start(trace_async_state& st, const std::shared_ptr<scene>& scn,
+    int camid, int yresolution, int nsamples, trace_type tracer,
+    float exposure, float gamma, bool filmic, int pratio, int nbounces,
+    float pixel_clamp, int seed, int nthreads) {
+    dispatch_trace_type(tracer, [&](const auto& tracef) {
+        trace_async_start_generic(st, scn, camid, yresolution, nsamples,
+            tracef, exposure, gamma, filmic, pratio, nbounces, pixel_clamp,
+            seed, nthreads);
+    });
+}
+
+// Copies the display tiles published since the last sync.
+std::vector<std::pair<vec2i, vec2i>> trace_async_sync_display(
+    trace_async_state& st, image4f& display) {
+    std::lock_guard<std::mutex> lock(st.display_mutex);
+    auto regions = std::vector<std::pair<vec2i, vec2i>>();
+    if (display.size != st.display.size) display = image4f{st.display.size};
+    for (auto tid : st.dirty_tiles) {
+        auto tile = get_trace_tile(st.display.size, tid);
+        for (auto j = tile.first.y; j < tile.second.y; j++) {
+            std::copy(&st.display[{tile.first.x, j}],
+                &st.display[{tile.first.x, j}] + tile.second.x - tile.first.x,
+                &display[{tile.first.x, j}]);
+        }
+        st.dirty_flags[tid] = false;
+        regions.push_back(tile);
     }
+    st.dirty_tiles.clear();
+    return regions;
 }
 
 // Stop the asynchronous renderer.
@@ -5287,14 +8512,14 @@ void trace_async_stop(trace_async_state& st) {
     st.threads.clear();
 }
 
-// Trace statistics for last run used for fine tuning implementation.
-// For now returns number of paths and number of rays.
-std::pair<uint64_t, uint64_t> get_trace_stats() {
-    return {_trace_nrays, _trace_npaths};
+// Trace statistics merged since the last reset.
+trace_stats get_trace_stats() {
+    std::lock_guard<std::mutex> lock(_trace_stats_mutex);
+    return _trace_stats;
 }
 void reset_trace_stats() {
-    _trace_nrays = 0;
-    _trace_npaths = 0;
+    std::lock_guard<std::mutex> lock(_trace_stats_mutex);
+    _trace_stats = {};
 }
 
 }  // namespace ygl
@@ -5407,3 +8632,80 @@ vec3f sample_ggx(float rs, const vec2f& rn) {
 }
 
 }  // namespace ygl
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF CONCURRENCY UTILITIES
+// -----------------------------------------------------------------------------
+namespace ygl {
+
+// Worker loop of a thread pool, waiting for jobs until the pool stops.
+void run_thread_pool_worker(thread_pool* pool) {
+    auto last_job = (uint64_t)0;
+    while (true) {
+        // wait for a new job
+        auto job = (const std::function<void(int)>*)nullptr;
+        auto count = 0;
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->job_cv.wait(
+                lock, [&]() { return pool->stop || pool->job_id != last_job; });
+            if (pool->stop) return;
+            last_job = pool->job_id;
+            job = pool->job;
+            count = pool->job_count;
+        }
+
+        // run tasks
+        while (true) {
+            auto idx = pool->job_next.fetch_add(1);
+            if (idx >= count) break;
+            (*job)(idx);
+        }
+
+        // signal completion
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->job_working == 0) pool->done_cv.notify_all();
+    }
+}
+
+// Stops and joins the pool workers.
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    job_cv.notify_all();
+    for (auto& t : threads) t.join();
+}
+
+// Makes a thread pool.
+std::shared_ptr<thread_pool> make_thread_pool(int nthreads) {
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    auto pool = std::make_shared<thread_pool>();
+    for (auto tid = 0; tid < max(nthreads, 1); tid++) {
+        pool->threads.push_back(
+            std::thread(run_thread_pool_worker, pool.get()));
+    }
+    return pool;
+}
+
+// Runs a parallel loop on a thread pool.
+void parallel_for(const std::shared_ptr<thread_pool>& pool, int count,
+    const std::function<void(int)>& func) {
+    if (count <= 0) return;
+    std::lock_guard<std::mutex> job_lock(pool->job_mutex);
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->job = &func;
+        pool->job_count = count;
+        pool->job_next = 0;
+        pool->job_working = (int)pool->threads.size();
+        pool->job_id += 1;
+    }
+    pool->job_cv.notify_all();
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->done_cv.wait(lock, [&]() { return pool->job_working == 0; });
+    pool->job = nullptr;
+}
+
+}  // namespace ygl
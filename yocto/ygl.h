@@ -112,7 +112,8 @@
 //    `sample_sphere()`, `sample_hemisphere_cosine()`,
 //    `sample_hemisphere_cospower()`. `sample_disk()`. `sample_cylinder()`.
 //    `sample_triangle()`, `sample_discrete()`. For each warp, you can compute
-//     the PDF with `sample_xxx_pdf()`.
+//     the PDF with `sample_xxx_pdf()`. Discrete distributions can also be
+//     sampled in constant time with `make_alias_table()` and `sample_alias()`.
 //
 //
 // ## Ray-Scene and Closest-Point Queries
@@ -131,9 +132,13 @@
 // applictions.
 //
 // 1. fill the shape or instance data
-// 2. build the BVH with `build_bvh()`
+// 2. build the BVH with `build_bvh()`, optionally collapsing it into a
+//    4-wide BVH for faster traversal with `build_wide_bvh()`, or replacing
+//    its nodes with quantized ones to save memory with `compress_bvh()`
 // 3. perform ray-element intersection with `intersect_bvh()`
-// 4. perform point overlap queries with `overlap_bvh()`
+// 4. perform point overlap queries with `overlap_bvh()`, for many points at
+//    once with `overlap_bvh_batch()`, or find the k nearest points of a point
+//    bvh with `nearest_bvh_points()`
 // 5. refit the BVH with `refit_bvh()` after updating internal data
 //
 //
@@ -201,8 +206,13 @@
 // 1. prepare the scene for tracing
 //    - build the ray-tracing acceleration structure with `update_bvh()`
 //     - prepare lights for rendering with `update_lights()`
+//     - optionally build texture mip levels with `update_texture_mips()`
+//     - make a read-only render snapshot with `make_render_scene()`
 // 2. create the inmage buffer and random number generators `make_trace_rngs()`
 // 3. render blocks of samples with `trace_samples()`
+//    - to split renders over machines, accumulate regions or sample ranges
+//      with `trace_accumulate()` and merge them with
+//      `merge_trace_accumulation()`
 // 4. you can also start an asynchronous renderer with `trace_asynch_start()`
 //
 //
@@ -249,17 +259,24 @@
 // -----------------------------------------------------------------------------
 
 #include <algorithm>  // for std::upper_bound
+#include <array>
+#include <atomic>
 #include <cctype>
 #include <cfloat>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <functional>  // for std::hash
 #include <iostream>
 #include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -1908,6 +1925,71 @@ inline T sample_discrete_pdf(const std::vector<T>& cdf, int idx) {
     return cdf.at(idx) - cdf.at(idx - 1);
 }
 
+// Bin of an alias table. A bin keeps its own index with probability `prob`
+// and returns its `alias` otherwise.
+struct alias_bin {
+    float prob = 1;  // probability of keeping the bin
+    int alias = 0;   // index returned when the bin is not kept
+};
+
+// Builds in `bins` the alias table for `count` weights with Vose's method.
+// Returns the sum of the weights. Tables with zero sum sample uniformly.
+inline double make_alias_table(
+    const float* weights, int count, alias_bin* bins) {
+    auto sum = 0.0;
+    for (auto i = 0; i < count; i++) sum += weights[i];
+    auto scaled = std::vector<double>(count, 1);
+    auto small = std::vector<int>(), large = std::vector<int>();
+    for (auto i = 0; i < count; i++) {
+        if (sum > 0) scaled[i] = weights[i] * count / sum;
+        if (scaled[i] < 1) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back();
+        bins[s] = {(float)scaled[s], l};
+        scaled[l] = (scaled[l] + scaled[s]) - 1;
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // leftovers are one up to numerical precision
+    for (auto l : large) bins[l] = {1, l};
+    for (auto s : small) bins[s] = {1, s};
+    return sum;
+}
+inline std::vector<alias_bin> make_alias_table(
+    const std::vector<float>& weights) {
+    auto bins = std::vector<alias_bin>(weights.size());
+    make_alias_table(weights.data(), (int)weights.size(), bins.data());
+    return bins;
+}
+
+// Sample a discrete distribution represented by an alias table in constant
+// time. The bin is picked with `ri` and kept or aliased with `rp`, that is
+// then remapped to a fresh uniform number for later use.
+inline int sample_alias(
+    const alias_bin* bins, int count, float ri, float& rp) {
+    auto idx = clamp((int)(ri * count), 0, count - 1);
+    auto& bin = bins[idx];
+    if (rp < bin.prob) {
+        rp = min(rp / bin.prob, 1 - flt_eps);
+        return idx;
+    } else {
+        rp = min((rp - bin.prob) / (1 - bin.prob), 1 - flt_eps);
+        return bin.alias;
+    }
+}
+inline int sample_alias(
+    const std::vector<alias_bin>& bins, float ri, float& rp) {
+    return sample_alias(bins.data(), (int)bins.size(), ri, rp);
+}
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -2150,12 +2232,21 @@ std::pair<std::vector<vec3f>, std::vector<vec3f>> compute_matrix_skinning(
     const std::vector<vec4f>& weights, const std::vector<vec4i>& joints,
     const std::vector<mat4f>& xforms);
 
-// Dictionary to store edge information.
-using edge_map = std::unordered_map<vec2i, vec2i>;
+// Edge map storing unique edges in insertion order, with an open addressing
+// table from vertex pairs to edge indices. When made from elements, it also
+// stores the edges of each element, so subdivision needs no lookups.
+struct edge_map {
+    std::vector<vec2i> edges;          // edges with sorted vertices
+    std::vector<int> counts;           // edge insertion counts
+    std::vector<vec4i> element_edges;  // element edges, -1 if missing
+    std::vector<int> table;            // edge indices, -1 if empty
+};
 
 // Initialize an edge map with elements.
 edge_map make_edge_map(const std::vector<vec3i>& triangles);
 edge_map make_edge_map(const std::vector<vec4i>& quads);
+// Reserve space for a number of edges, avoiding rehashing on insertion.
+void reserve_edges(edge_map& emap, int nedges);
 // Insert an edge and return its index
 int insert_edge(edge_map& emap, const vec2i& edge);
 // Get the edge index / insertion count
@@ -2240,7 +2331,9 @@ void merge_faces(std::vector<vec3i>& triangles, std::vector<vec4i>& quads,
     const std::vector<vec4i>& quads1, const std::vector<vec3f>& pos1,
     const std::vector<vec3f>& norm1, const std::vector<vec2f>& texcoord1);
 
-// Weld vertices within a threshold. For noe the implementation is O(n^2).
+// Weld vertices within a threshold, mapping each vertex to the first
+// earlier kept vertex closer than `threshold`. Uses a grid with cells of
+// size `2 * threshold`, so it runs in expected linear time.
 std::pair<std::vector<vec3f>, std::vector<int>> weld_vertices(
     const std::vector<vec3f>& pos, float threshold);
 std::pair<std::vector<vec3i>, std::vector<vec3f>> weld_triangles(
@@ -2409,19 +2502,113 @@ enum struct bvh_node_type : uint8_t {
 // Maximum number of primitives per BVH node.
 const int bvh_max_prims = 4;
 
+// Heuristic used to split BVH nodes during construction. The median split
+// balances the tree by primitive count, the equal size split partitions
+// the centroid bounds in the middle, and the SAH split uses a binned
+// surface area heuristic that produces faster trees at a higher build cost.
+enum struct bvh_build_type { median, equal_size, sah };
+
+// BVH build settings used by `update_bvh()`, and kept on the built tree so
+// that later rebuilds match it. Unless `noparallel` is set, large subtrees
+// and small shapes are built concurrently. If `wide` is set, wide nodes are
+// built for traversal. If `triangles` is set, shape triangles are
+// precomputed in leaf order. If `compressed` is set, nodes are compressed,
+// instead of made wide.
+struct bvh_params {
+    bvh_build_type build_type = bvh_build_type::median;  // split heuristic
+    int max_prims = bvh_max_prims;  // maximum primitives per leaf
+    bool noparallel = false;        // build serially
+    bool wide = false;              // build wide nodes
+    bool triangles = false;         // precompute leaf triangles
+    bool compressed = false;        // compress nodes
+};
+
 // BVH tree node containing its bounds, indices to the BVH arrays of either
 // primitives or internal nodes, the node element type,
 // and the split axis. Leaf and internal nodes are identical, except that
 // indices refer to primitives for leaf nodes or other nodes for internal
-// nodes. See bvh_tree for more details.
+// nodes. Leaves also store the offset of their primitives in leaf order,
+// used to index precomputed leaf data. See bvh_tree for more details.
 struct bvh_node {
     bbox3f bbox;                    // bouds
     uint32_t prims[bvh_max_prims];  // primitives
+    uint32_t start;                 // leaf primitives offset in leaf order
     uint16_t count;                 // number of prims
     bvh_node_type type;             // node type
     uint8_t split_axis;             // split axis
 };
 
+// Triangle precomputed for intersection, stored as a vertex and two edges.
+struct bvh_triangle {
+    vec3f v0;  // first vertex
+    vec3f e1;  // edge from v0 to v1
+    vec3f e2;  // edge from v0 to v2
+};
+
+// Number of children of a wide BVH node, matching the SSE register width.
+const int bvh_wide_width = 4;
+
+// Wide BVH node obtained by collapsing the binary tree. Child bounds are
+// stored as structure-of-arrays so that a ray can be tested against all
+// children at once with SIMD instructions. Children are indices to other
+// wide nodes or, if their bit in `leaf_mask` is set, to binary leaf nodes.
+// Unused children have empty bounds.
+struct bvh_wide_node {
+    float min_x[bvh_wide_width];        // children bounds min x
+    float min_y[bvh_wide_width];        // children bounds min y
+    float min_z[bvh_wide_width];        // children bounds min z
+    float max_x[bvh_wide_width];        // children bounds max x
+    float max_y[bvh_wide_width];        // children bounds max y
+    float max_z[bvh_wide_width];        // children bounds max z
+    uint32_t children[bvh_wide_width];  // children
+    uint8_t count;                      // number of children
+    uint8_t leaf_mask;                  // bitmask of leaf children
+};
+
+// Compressed BVH node holding the bounds of its two children quantized to
+// 8 bits within the node bounds. Bounds are decoded as `origin + q * step`,
+// with a power of two step per axis given by its exponent, and are rounded
+// outwards when encoded so that the decoded bounds contain the exact ones.
+// Children are other compressed nodes or, if their bit in `leaf_mask` is
+// set, leaves with `counts` primitives of `type` starting at `children`
+// in the compressed primitive array. Unused children have no primitives and
+// empty bounds.
+struct bvh_compressed_node {
+    vec3f origin;          // quantization origin
+    int8_t exponent[3];    // quantization step exponents
+    uint8_t leaf_mask;     // bitmask of leaf children
+    uint8_t qmin[2][3];    // children quantized bounds min
+    uint8_t qmax[2][3];    // children quantized bounds max
+    uint8_t counts[2];     // number of leaf primitives
+    bvh_node_type type;    // leaf type
+    uint8_t split_axis;    // split axis
+    uint32_t children[2];  // children nodes or leaf primitives start
+};
+
+// Non-owning view of a contiguous array. BVHs use views to refer to shape
+// data without copying it, so the viewed data has to outlive the view.
+// Views cannot be made from temporary vectors.
+template <typename T>
+struct array_view {
+    // constructors
+    array_view() {}
+    array_view(const T* ptr_, size_t count_) : ptr{ptr_}, count{count_} {}
+    array_view(const std::vector<T>& vec)
+        : ptr{vec.data()}, count{vec.size()} {}
+    array_view(std::vector<T>&& vec) = delete;
+
+    // element access
+    const T& operator[](size_t i) const { return ptr[i]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+
+    const T* ptr = nullptr;
+    size_t count = 0;
+};
+
 // BVH tree, stored as a node array. The tree structure is encoded using array
 // indices instead of pointers, both for speed but also to simplify code.
 // BVH nodes indices refer to either the node array, for internal nodes,
@@ -2431,15 +2618,18 @@ struct bvh_node {
 // a two-level hierarchy with the outer BVH, the scene BVH, containing inner
 // BVHs, shape BVHs, each of which of a uniform primitive type.
 // To build a BVH, first fill in either the shape or instance data, then
-// call `build_bvh()`.
+// call `build_bvh()`. Shape data is referenced, not copied, so it has to
+// outlive the BVH; after moving vertices in place, call `refit_bvh()`.
+// Radii are needed for points and lines, and are optional otherwise.
 struct bvh_tree {
     // data for shape BVH
-    std::vector<vec3f> pos;        // Positions for shape BVHs.
-    std::vector<float> radius;     // Radius for shape BVHs.
-    std::vector<int> points;       // Points for shape BVHs.
-    std::vector<vec2i> lines;      // Lines for shape BVHs.
-    std::vector<vec3i> triangles;  // Triangles for shape BVHs.
-    std::vector<vec4i> quads;      // Quads for shape BVHs.
+    array_view<vec3f> pos;              // Positions for shape BVHs.
+    array_view<float> radius;           // Radius for shape BVHs.
+    array_view<int> points;             // Points for shape BVHs.
+    array_view<vec2i> lines;            // Lines for shape BVHs.
+    array_view<vec3i> triangles;        // Triangles for shape BVHs.
+    array_view<vec4i> quads;            // Quads for shape BVHs.
+    std::vector<float> default_radius;  // Radius for shapes without one.
 
     // data for instance BVH
     std::vector<frame3f> ist_frames;                  // instance frames
@@ -2447,13 +2637,59 @@ struct bvh_tree {
     std::vector<std::shared_ptr<bvh_tree>> ist_bvhs;  // instance shape bvhs
 
     // bvh nodes
-    std::vector<bvh_node> nodes;  // Internal nodes.
+    std::vector<bvh_node> nodes;               // Internal nodes.
+    std::vector<bvh_wide_node> wide_nodes;     // Optional collapsed nodes.
+    std::vector<bvh_triangle> leaf_triangles;  // Optional leaf triangles.
+
+    // optional compressed nodes, replacing the binary and wide ones
+    std::vector<bvh_compressed_node> compressed_nodes;  // quantized nodes
+    std::vector<uint32_t> compressed_prims;             // leaf primitives
+
+    // data for incremental refits of instance BVHs; wide slots are set when
+    // building wide nodes, the rest on the first refit
+    std::vector<int> node_wides;    // wide node child slot of each node or -1
+    std::vector<int> node_parents;  // parent of each node, -1 for the root
+    std::vector<int> prim_leaves;   // leaf node of each instance
+    double sah_area = 0;            // SAH cost times the root area
+    float refit_sah_cost = 0;       // SAH cost before the first refit
+
+    // settings of the last `update_bvh()`, reused by rebuilds
+    bvh_params params = {};
 };
 
-// Build a BVH from the given set of primitives.
-void build_bvh(const std::shared_ptr<bvh_tree>& bvh, bool equalsize);
-// Update the node bounds for a shape bvh.
+// Build a BVH from the given set of primitives. Leaves hold at most
+// `max_prims` primitives, clamped to [1, bvh_max_prims]. Unless `noparallel`
+// is set, large subtrees are built concurrently; the resulting node order
+// is the same as the serial build. Wide and compressed nodes and leaf
+// triangles of a previous build are discarded.
+void build_bvh(const std::shared_ptr<bvh_tree>& bvh,
+    bvh_build_type build_type = bvh_build_type::median,
+    int max_prims = bvh_max_prims, bool noparallel = false);
+// Collapse the binary nodes into wide nodes, which are then used by
+// `intersect_bvh()` and `overlap_bvh()`. The binary nodes are kept since
+// wide nodes refer to their leaves.
+void build_wide_bvh(const std::shared_ptr<bvh_tree>& bvh);
+// Replace the binary and wide nodes with compressed nodes, which are then
+// used by `intersect_bvh()` and `overlap_bvh()`, keeping only the binary
+// root for its bounds. Compressed bvhs use less than half the node memory
+// but are slower to traverse, since bounds are decoded on the fly, and
+// cannot be refit, so build them again after changes.
+void compress_bvh(const std::shared_ptr<bvh_tree>& bvh);
+// Store the triangles of a shape bvh in leaf order, precomputed for
+// intersection, so that a leaf is read contiguously instead of loading
+// triangle indices and vertices separately, at the cost of extra memory.
+void build_bvh_triangles(const std::shared_ptr<bvh_tree>& bvh);
+// Update the node bounds for a shape bvh, including its wide nodes and
+// precomputed triangles.
 void refit_bvh(const std::shared_ptr<bvh_tree>& bvh);
+// Update the node bounds of an instance bvh for the instances whose frame
+// or shape bvh changed, touching only their leaves, ancestors and wide nodes.
+void refit_bvh(
+    const std::shared_ptr<bvh_tree>& bvh, const std::vector<int>& instances);
+// Compute the SAH cost of a bvh, with unit costs for traversing nodes and
+// intersecting primitives, relative to the area of the root bounds. Returns
+// 0 for compressed bvhs, whose binary nodes are gone.
+float compute_bvh_sah_cost(const std::shared_ptr<bvh_tree>& bvh);
 
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance `dist`, the instance
@@ -2462,6 +2698,27 @@ void refit_bvh(const std::shared_ptr<bvh_tree>& bvh);
 bool intersect_bvh(const std::shared_ptr<bvh_tree>& bvh, const ray3f& ray,
     bool find_any, float& dist, int& iid, int& eid, vec2f& uv);
 
+// Number of rays traversed together by the packet version of
+// `intersect_bvh()`.
+const int bvh_packet_size = 8;
+
+// Intersect `nrays` rays with a bvh, as above, writing results to arrays of
+// size `nrays`, with `hit` set for the rays that hit. Rays are traversed in
+// packets of `bvh_packet_size` over the binary nodes, so coherent rays,
+// like camera or shadow rays, share node fetches.
+void intersect_bvh(const std::shared_ptr<bvh_tree>& bvh, const ray3f* rays,
+    int nrays, bool find_any, float* dist, int* iid, int* eid, vec2f* uv,
+    bool* hit);
+
+// Bvh traversal counters. Packets count each node once for all their rays.
+struct bvh_stats {
+    uint64_t nnodes = 0;  // nodes visited
+    uint64_t nprims = 0;  // primitives tested
+};
+// Traversal counters of the calling thread, incremented by `intersect_bvh()`
+// without synchronization. Callers read and reset them.
+bvh_stats& get_bvh_thread_stats();
+
 // Find a shape element that overlaps a point within a given distance
 // `max_dist`, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance `dist`, the instance id `iid`, the
@@ -2470,6 +2727,41 @@ bool intersect_bvh(const std::shared_ptr<bvh_tree>& bvh, const ray3f& ray,
 bool overlap_bvh(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
     float max_dist, bool find_any, float& dist, int& iid, int& eid, vec2f& uv);
 
+// Element found by the batched overlap queries, with the outputs of
+// `overlap_bvh()`. The element index is -1 if nothing was found, while the
+// instance index is only set for scene bvhs.
+struct bvh_overlap {
+    float dist = 0;     // distance from the query position
+    int iid = -1;       // instance index
+    int eid = -1;       // shape element index or -1
+    vec2f uv = zero2f;  // shape element coordinates
+};
+
+// Finds, as in `overlap_bvh()`, an element within `max_dist` of each of
+// `npos` positions, writing one result per position to `overlaps`. Queries
+// are sorted along a Morton curve, so that nearby ones visit the same nodes
+// in turn, and run in chunks on `nthreads` threads, or all hardware threads
+// if `nthreads` is 0.
+void overlap_bvh_batch(const std::shared_ptr<bvh_tree>& bvh, const vec3f* pos,
+    int npos, float max_dist, bool find_any, bvh_overlap* overlaps,
+    int nthreads = 0);
+std::vector<bvh_overlap> overlap_bvh_batch(
+    const std::shared_ptr<bvh_tree>& bvh, const std::vector<vec3f>& pos,
+    float max_dist, bool find_any = false, int nthreads = 0);
+
+// Finds the `k` points of a point or vertex bvh nearest to `pos` within
+// `max_dist`, by distance to the point centers. Writes their element
+// indices to `eids` and distances to `dists`, from the nearest, padding
+// with -1 and `flt_max` if fewer are found. Returns the number found.
+// Throws for bvhs of other elements.
+int nearest_bvh_points(const std::shared_ptr<bvh_tree>& bvh, const vec3f& pos,
+    int k, float max_dist, int* eids, float* dists);
+// Finds the `k` nearest points to each position as above, writing `k`
+// results per position, with queries run as in `overlap_bvh_batch()`.
+void nearest_bvh_points_batch(const std::shared_ptr<bvh_tree>& bvh,
+    const std::vector<vec3f>& pos, int k, float max_dist,
+    std::vector<int>& eids, std::vector<float>& dists, int nthreads = 0);
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -2599,6 +2891,22 @@ struct image {
 using image4f = image<vec4f>;
 using image4b = image<vec4b>;
 
+// Compact texel formats, decoded to linear floats on lookup.
+enum struct texel_format {
+    rgba8,    // 8-bit rgba with gamma-encoded color
+    r8,       // 8-bit gamma-encoded gray, with alpha one
+    rgba16f,  // half float rgba
+};
+
+// Image with compact texels. The 8-bit formats decode color with a lookup
+// table built for their gamma.
+struct texel_image {
+    vec2i size = {0, 0};                        // image size
+    texel_format format = texel_format::rgba8;  // texel format
+    std::vector<byte> data = {};                // texel data
+    std::array<float, 256> lut = {};            // 8-bit decoding table
+};
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -2614,6 +2922,18 @@ image4b float_to_byte(const image4f& fl);
 image4f gamma_to_linear(const image4f& srgb, float gamma = 2.2f);
 image4f linear_to_gamma(const image4f& lin, float gamma = 2.2f);
 
+// Conversion from/to compact texel images. The 8-bit formats store colors
+// encoded with `gamma`, either from linear floats or as given for bytes.
+texel_image make_texel_image(
+    const image4f& img, texel_format format, float gamma = 2.2f);
+texel_image make_texel_image(
+    const image4b& img, texel_format format, float gamma = 2.2f);
+image4f texel_to_float(const texel_image& img);
+// Bytes per texel of compact formats.
+int get_texel_size(texel_format format);
+// Decodes a compact texel to linear floats.
+vec4f lookup_texel(const texel_image& img, const vec2i& ij);
+
 // Apply exposure and filmic tone mapping
 image4f tonemap_image(
     const image4f& hdr, float exposure, float gamma, bool filmic);
@@ -2639,6 +2959,60 @@ inline vec4f byte_to_float(const vec4b& a) {
     return {a.x / 255.0f, a.y / 255.0f, a.z / 255.0f, a.w / 255.0f};
 }
 
+// Conversion between floats and the bits of half floats, rounding to nearest.
+inline uint16_t float_to_half(float a) {
+    auto bits = 0u;
+    memcpy(&bits, &a, sizeof(bits));
+    auto sign = (bits >> 16) & 0x8000u;
+    auto exp = (int)((bits >> 23) & 0xff) - 127 + 15;
+    auto mant = bits & 0x7fffffu;
+    if (exp >= 31) {
+        // overflow to infinity, keeping nans
+        if (((bits >> 23) & 0xff) == 0xff && mant)
+            return (uint16_t)(sign | 0x7e00u);
+        return (uint16_t)(sign | 0x7c00u);
+    }
+    if (exp <= 0) {
+        // denormals, or zero
+        if (exp < -10) return (uint16_t)sign;
+        mant |= 0x800000u;
+        auto shift = 14 - exp;
+        auto half = mant >> shift;
+        if ((mant >> (shift - 1)) & 1) half += 1;
+        return (uint16_t)(sign | half);
+    }
+    auto half = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    if (mant & 0x1000u) half += 1;
+    return (uint16_t)half;
+}
+inline float half_to_float(uint16_t a) {
+    auto sign = (uint32_t)(a & 0x8000u) << 16;
+    auto exp = (int)((a >> 10) & 0x1fu);
+    auto mant = (uint32_t)(a & 0x3ffu);
+    auto bits = 0u;
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else {
+            // normalize denormals
+            exp = 1;
+            while (!(mant & 0x400u)) {
+                mant <<= 1;
+                exp -= 1;
+            }
+            mant &= 0x3ffu;
+            bits = sign | ((uint32_t)(exp + 127 - 15) << 23) | (mant << 13);
+        }
+    } else if (exp == 31) {
+        bits = sign | 0x7f800000u | (mant << 13);
+    } else {
+        bits = sign | ((uint32_t)(exp + 127 - 15) << 23) | (mant << 13);
+    }
+    auto f = 0.0f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
 // Conversion between linear and gamma-encoded images.
 inline vec3f gamma_to_linear(const vec3f& srgb, float gamma = 2.2f) {
     return {pow(srgb.x, gamma), pow(srgb.y, gamma), pow(srgb.z, gamma)};
@@ -2787,6 +3161,7 @@ namespace ygl {
 
 // forward declaration
 struct bvh_tree;
+struct texture_cache;
 
 // Camera.
 struct camera {
@@ -2806,11 +3181,43 @@ struct texture {
     std::string name = "";     // name
     std::string path = "";     // file path
     image4f img = {};          // image
+    texel_image texels = {};   // compact image, used when img is empty
     bool clamp = false;        // clamp textures coordinates
     float scale = 1;           // scale for occ, normal, bumps
     float gamma = 2.2f;        // gamma correction for ldr textures in IO
     bool has_opacity = false;  // check whether alpha != 0
-    uint gl_txt = 0;           // unmanaged data for OpenGL viewer
+
+    // computed properties
+    std::vector<image4f> mips = {};                  // mip levels after img
+    std::vector<texel_image> texel_mips = {};        // mip levels after texels
+    std::shared_ptr<texture_cache> cache = nullptr;  // cache if not resident
+    uint gl_txt = 0;  // unmanaged data for OpenGL viewer
+};
+
+// Tile size of the texture cache.
+const int texture_tile_size = 64;
+
+// Tiled texture cache that pages textures in on demand within a memory
+// budget. Textures with an empty image and a cache are decoded with `load`
+// when first accessed, split into tiles for each mip level, and only the most
+// recently used tiles are kept resident. Access is thread safe. Since images
+// are decoded whole, budgets smaller than the working set cause reloads.
+struct texture_cache {
+    size_t budget = 256 * 1024 * 1024;  // memory budget in bytes
+    std::function<image4f(const std::shared_ptr<texture>&)> load = {};
+
+    // computed properties
+    struct entry {
+        std::shared_ptr<std::vector<vec4f>> pxl;  // tile texels
+        std::list<uint64_t>::iterator lru;        // position in lru list
+    };
+    std::mutex mutex;                             // access lock
+    std::unordered_map<uint64_t, entry> tiles;    // resident tiles
+    std::list<uint64_t> lru;                      // most recent first
+    std::unordered_map<const texture*, int> ids;  // texture ids
+    std::deque<std::vector<vec2i>> sizes;         // mip sizes per id
+    size_t memory = 0;                            // resident bytes
+    int loads = 0;                                // number of loads
 };
 
 // Material for surfaces, lines and triangles.
@@ -2868,6 +3275,7 @@ struct shape {
     // computed properties
     bbox3f bbox = invalid_bbox3f;             // boudning box
     std::vector<float> elem_cdf = {};         // element cdf for sampling
+    std::vector<alias_bin> elem_alias = {};   // element alias table
     std::shared_ptr<bvh_tree> bvh = nullptr;  // bvh for ray intersection
     uint gl_pos = 0, gl_norm = 0, gl_texcoord = 0, gl_color = 0, gl_tangsp = 0,
          gl_points = 0, gl_lines = 0,
@@ -2895,6 +3303,9 @@ struct subdiv {
     std::vector<vec3f> pos;       // positions
     std::vector<vec2f> texcoord;  // texcoord coordinates
     std::vector<vec4f> color;     // colors
+
+    // compute properties
+    bool dirty = true;  // tesselation needs to be updated
 };
 
 // Shape instance.
@@ -2907,6 +3318,7 @@ struct instance {
 
     // compute properties
     bbox3f bbox = invalid_bbox3f;  // boudning box
+    int light_id = -1;             // index in the scene lights or -1
 };
 
 // Envinonment map.
@@ -2917,7 +3329,9 @@ struct environment {
     std::shared_ptr<texture> ke_txt = {};  // emission texture
 
     // computed properties
-    std::vector<float> elem_cdf;  // element cdf for sampling
+    std::vector<alias_bin> row_alias = {};    // marginal alias table of rows
+    std::vector<alias_bin> texel_alias = {};  // conditional tables per row
+    float texel_sum = 0;                      // sum of the texel weights
 };
 
 // Node in a transform hierarchy.
@@ -2954,6 +3368,20 @@ struct animation {
     std::vector<std::shared_ptr<node>> targets;    // target nodes
 };
 
+// Light selection used by the path tracers. Lights and environments are
+// picked uniformly, proportionally to their estimated power, or with a light
+// tree that also accounts for the distance to the shading point.
+enum struct light_sampling_type { uniform, power, tree };
+
+// Light tree node. Leaves hold a single light, internal nodes two children.
+struct light_node {
+    bbox3f bbox = invalid_bbox3f;  // lights bounds
+    float power = 0;               // lights power
+    int parent = -1;               // parent node
+    int children[2] = {-1, -1};    // children nodes for internal nodes
+    int light = -1;                // light index for leaves
+};
+
 // Scene comprised an array of objects whose memory is owened by the scene.
 // All members are optional,Scene objects (camera, instances, environments)
 // have transforms defined internally. A scene can optionally contain a
@@ -2980,6 +3408,10 @@ struct scene {
     std::vector<std::shared_ptr<instance>> lights;
     bbox3f bbox = invalid_bbox3f;  // boudning box
     std::shared_ptr<bvh_tree> bvh = nullptr;
+    light_sampling_type light_sampling = light_sampling_type::uniform;
+    std::vector<float> light_cdf = {};        // lights then environments
+    std::vector<light_node> light_tree = {};  // light tree for lights
+    std::vector<int> light_leaves = {};       // light tree leaf per light
 };
 
 }  // namespace ygl
@@ -2992,6 +3424,13 @@ namespace ygl {
 // Print scene statistics.
 void print_stats(const std::shared_ptr<scene>& scn);
 
+// Memory used by the scene BVHs in bytes, returned as node memory, including
+// wide and compressed nodes, and precomputed leaf triangle memory.
+std::pair<uint64_t, uint64_t> get_bvh_memory(const std::shared_ptr<scene>& scn);
+// Memory saved by the compressed nodes of the scene BVHs in bytes, compared
+// to the binary nodes they replace.
+uint64_t get_bvh_compressed_savings(const std::shared_ptr<scene>& scn);
+
 // Merge scene into one another. Note that the objects are _moved_ from
 // merge_from to merged_into, so merge_from will be empty after this function.
 void merge_into(const std::shared_ptr<scene>& merge_into,
@@ -3018,23 +3457,50 @@ vec2f compute_animation_range(
 void udpate_bbox(const std::shared_ptr<shape>& shp);
 void update_bbox(const std::shared_ptr<scene>& scn, bool do_shapes = true);
 
-// Update lights.
+// Update lights. For non-uniform `sampling`, builds a cdf of the light and
+// environment powers, estimated from their emission, ignoring textures, and
+// area or scene bounds, and for `light_sampling_type::tree`, a light tree.
 void update_lights(const std::shared_ptr<scene>& scn, bool do_shapes = true,
-    bool do_environments = false);
+    bool do_environments = false,
+    light_sampling_type sampling = light_sampling_type::uniform);
+// Update texture mip levels, halving the image size at each level.
+void update_texture_mips(const std::shared_ptr<texture>& txt);
+void update_texture_mips(const std::shared_ptr<scene>& scn);
+// Converts texture images, and their mip levels, to compact texels. Picks
+// half floats for hdr images, a single channel for gray images without alpha,
+// and 8-bit rgba otherwise. Environment textures are kept in floats since
+// they are importance sampled.
+void compact_texture(const std::shared_ptr<texture>& txt);
+void compact_textures(const std::shared_ptr<scene>& scn);
 // Generate a distribution for sampling a shape uniformly based on area/length.
+// The cdf gives the shape area, while the alias table is used for sampling.
 void update_shape_cdf(const std::shared_ptr<shape>& shp);
 // Generate a distribution for sampling an environment texture uniformly
-// based on angle and texture intensity.
+// based on angle and texture intensity. Rows are sampled from a marginal
+// alias table, and texels from per-row conditional ones.
 void update_environment_cdf(std::shared_ptr<environment> env);
 
-// Updates/refits bvh.
-void update_bvh(const std::shared_ptr<shape>& shp, bool equalsize = false);
+// Updates/refits bvh with the given settings, which are stored on the
+// built trees.
+void update_bvh(
+    const std::shared_ptr<shape>& shp, const bvh_params& params = {});
 void update_bvh(const std::shared_ptr<scene>& scn, bool do_shapes = true,
-    bool equalsize = false);
+    const bvh_params& params = {});
 void refit_bvh(const std::shared_ptr<shape>& shp);
 void refit_bvh(const std::shared_ptr<scene>& scn, bool do_shapes = true);
-
-// Updates tesselation.
+// Updates the scene bvh for instances whose frame or shape bvh changed since
+// the last update, refitting only those. The instance tree is rebuilt if the
+// refits degrade its SAH cost past `rebuild_ratio` times the cost it had
+// when built. Rebuilds use the settings the tree was built with. Returns the
+// number of updated instances.
+int refit_bvh_instances(
+    const std::shared_ptr<scene>& scn, float rebuild_ratio = 1.5f);
+// Points the shape bvh to the shape data without copying it, as needed
+// when the bvh nodes are loaded instead of built.
+void update_bvh_views(const std::shared_ptr<shape>& shp);
+
+// Updates tesselation. Scene updates only tesselate dirty subdivs, all in
+// parallel, and clear their dirty flag.
 void update_tesselation(
     const std::shared_ptr<subdiv>& sbd, std::shared_ptr<shape> shp);
 void update_tesselation(const std::shared_ptr<scene>& scn);
@@ -3094,6 +3560,10 @@ struct scene_intersection {
 // Intersects a ray with the scene.
 scene_intersection intersect_ray(
     const std::shared_ptr<scene>& scn, const ray3f& ray, bool find_any = false);
+// Intersects `nrays` rays with the scene, writing one intersection per ray
+// to `isecs`. Coherent rays are traversed together in packets.
+void intersect_rays(const std::shared_ptr<scene>& scn, const ray3f* rays,
+    int nrays, scene_intersection* isecs, bool find_any = false);
 
 // Shape values interpolated using barycentric coordinates.
 vec3f eval_pos(const std::shared_ptr<shape>& shp, int ei, const vec2f& uv);
@@ -3132,8 +3602,14 @@ vec3f eval_direction(const std::shared_ptr<environment>& env, const vec2f& uv);
 // Evaluate the environment emission.
 vec3f eval_environment(const std::shared_ptr<environment>& env, vec3f i);
 
-// Evaluate a texture.
-vec4f eval_texture(const std::shared_ptr<texture>& txt, const vec2f& texcoord);
+// Evaluate a texture. If `footprint` is positive, it is the filter width
+// in texture coordinates used to pick and blend mip levels, if present.
+vec4f eval_texture(const std::shared_ptr<texture>& txt, const vec2f& texcoord,
+    float footprint = 0);
+// Texture coordinates footprint of a ray cone of `width` at an element,
+// from the ratio of its texture and world areas.
+float eval_texture_footprint(
+    const std::shared_ptr<instance>& ist, int ei, float width);
 
 // Set and evaluate camera parameters. Setters take zeros as default values.
 float eval_camera_fovy(const std::shared_ptr<camera>& cam);
@@ -3154,19 +3630,20 @@ ray3f eval_camera_ray(const std::shared_ptr<camera>& cam, const vec2i& ij,
     const vec2i& imsize, const vec2f& puv, const vec2f& luv);
 
 // Evaluates material parameters: emission, diffuse, specular, transmission,
-// roughness and opacity.
-vec3f eval_emission(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
-vec3f eval_diffuse(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
-vec3f eval_specular(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
-vec3f eval_transmission(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
-float eval_roughness(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
-float eval_opacity(
-    const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
+// roughness and opacity. Textures are filtered with `footprint`, computed
+// with `eval_texture_footprint()`.
+vec3f eval_emission(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint = 0);
+vec3f eval_diffuse(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint = 0);
+vec3f eval_specular(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint = 0);
+vec3f eval_transmission(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint = 0);
+float eval_roughness(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint = 0);
+float eval_opacity(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, float footprint = 0);
 
 // Material values packed into a convenience structure.
 struct bsdf {
@@ -3176,9 +3653,29 @@ struct bsdf {
     float rs = 1;          // roughness
     bool refract = false;  // whether to use refraction in transmission
 };
-bsdf eval_bsdf(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv);
+bsdf eval_bsdf(const std::shared_ptr<instance>& ist, int ei, const vec2f& uv,
+    float footprint = 0);
 bool is_delta_bsdf(const bsdf& f);
 
+// Geometry and material values at a shading point.
+struct shading_point {
+    vec3f p = zero3f;         // position
+    vec3f n = zero3f;         // shading normal
+    vec2f texcoord = zero2f;  // texture coordinates
+    vec3f ke = zero3f;        // emission
+    bsdf f = {};              // bsdf
+    float op = 1;             // opacity
+};
+// Evaluates a shading point facing `o`, interpolating vertex data once and
+// looking up each material texture once, filtered for a ray cone of `width`.
+// This matches the individual `eval_*()` functions.
+shading_point eval_shading_point(const std::shared_ptr<instance>& ist,
+    int ei, const vec2f& uv, const vec3f& o, float width = 0);
+// Evaluates the position, normal and emission of a shading point on a light,
+// skipping the bsdf and opacity.
+shading_point eval_light_point(const std::shared_ptr<instance>& ist, int ei,
+    const vec2f& uv, const vec3f& o);
+
 // Sample a shape based on a distribution.
 std::pair<int, vec2f> sample_shape(
     const std::shared_ptr<shape>& shp, float re, const vec2f& ruv);
@@ -3187,6 +3684,15 @@ std::pair<int, vec2f> sample_shape(
 vec2f sample_environment(
     const std::shared_ptr<environment>& env, const vec2f& ruv);
 
+// Picks a light for the shading point `p` using the scene light sampling.
+// Returns an index in the scene lights followed, if `environments` is set,
+// by the scene environments.
+int sample_light_index(const std::shared_ptr<scene>& scn, const vec3f& p,
+    float rl, bool environments = true);
+// Probability of picking a light index with `sample_light_index()`.
+float sample_light_index_pdf(const std::shared_ptr<scene>& scn,
+    const vec3f& p, int idx, bool environments = true);
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -3197,31 +3703,232 @@ namespace ygl {
 // Default trace seed
 const auto trace_default_seed = 961748941;
 
-// Trace evaluation function.
-using trace_func = std::function<vec3f(const std::shared_ptr<scene>& scn,
-    const ray3f& ray, rng_state& rng, int nbounces, bool* hit)>;
+// Instance of a render scene, with its shape and material given by index.
+struct render_instance {
+    frame3f frame = identity_frame3f;  // transform frame
+    int shape = -1;                    // shape index
+    int material = -1;                 // material index or -1
+    int light_id = -1;                 // index in the lights or -1
+};
+
+// Read-only render snapshot of a scene, made with `make_render_scene()`.
+// Elements are kept in contiguous arrays and refer to each other by index,
+// so rendering does not touch shared pointers. Instances are in scene order,
+// matching the bvh ids. Shape, material and texture data is not copied, so
+// the scene has to outlive the snapshot and not change while rendering.
+struct render_scene {
+    std::vector<const camera*> cameras = {};            // cameras
+    std::vector<const shape*> shapes = {};              // shapes
+    std::vector<const material*> materials = {};        // materials
+    std::vector<render_instance> instances = {};        // instances
+    std::vector<const environment*> environments = {};  // environments
+    std::vector<int> lights = {};                       // light instances
+    std::shared_ptr<bvh_tree> bvh = nullptr;            // scene bvh
+    light_sampling_type light_sampling = light_sampling_type::uniform;
+    std::vector<float> light_cdf = {};        // lights then environments
+    std::vector<light_node> light_tree = {};  // light tree for lights
+    std::vector<int> light_leaves = {};       // light tree leaf per light
+};
+
+// Makes a render snapshot of a scene whose bvh and lights are up to date.
+// Make it again after editing the scene.
+render_scene make_render_scene(const std::shared_ptr<scene>& scn);
+
+// Render scene intersection.
+struct render_intersection {
+    int iid = -1;       // instance index or -1 for no intersection
+    int ei = 0;         // shape element index
+    vec2f uv = zero2f;  // shape element coordinates
+    float dist = 0;     // ray distance
+};
+
+// Intersects a ray with a render scene.
+render_intersection intersect_ray(
+    const render_scene& scn, const ray3f& ray, bool find_any = false);
+// Intersects `nrays` rays with a render scene, writing one intersection per
+// ray to `isecs`. Coherent rays are traversed together in packets.
+void intersect_rays(const render_scene& scn, const ray3f* rays, int nrays,
+    render_intersection* isecs, bool find_any = false);
+
+// Trace evaluation function. The `spread` is the angle subtended by a
+// pixel for camera rays, used to filter textures by tracing ray cones.
+using trace_func = std::function<vec3f(const render_scene& scn,
+    const ray3f& ray, rng_state& rng, int nbounces, bool* hit, float spread)>;
+
+// Builtin trace functions. Renders given a trace type run sample loops
+// specialized for that tracer, that call it directly and may inline it,
+// while renders given a `trace_func` support custom tracers.
+enum struct trace_type {
+    path,               // `trace_path()`
+    path_nomis,         // `trace_path_nomis()`
+    path_naive,         // `trace_path_naive()`
+    direct,             // `trace_direct()`
+    direct_nomis,       // `trace_direct_nomis()`
+    environment,        // `trace_environment()`
+    eyelight,           // `trace_eyelight()`
+    debug_normal,       // `trace_debug_normal()`
+    debug_frontfacing,  // `trace_debug_frontfacing()`
+    debug_albedo,       // `trace_debug_albedo()`
+    debug_diffuse,      // `trace_debug_diffuse()`
+    debug_specular,     // `trace_debug_specular()`
+    debug_roughness,    // `trace_debug_roughness()`
+    debug_texcoord,     // `trace_debug_texcoord()`
+};
 
 // Progressively compute an image by calling trace_samples multiple times.
+// Unless `noparallel` is set, image tiles are rendered on a persistent pool
+// of `nthreads` threads, or all hardware threads if `nthreads` is 0.
+// The scene version renders from a snapshot made for the call.
+image4f trace_image(const render_scene& scn, int camid, int yresolution,
+    int nsamples, trace_func tracer, int nbounces = 8, float pixel_clamp = 100,
+    bool noparallel = false, int seed = trace_default_seed, int nthreads = 0);
 image4f trace_image(const std::shared_ptr<scene>& scn, int camid,
     int yresolution, int nsamples, trace_func tracer, int nbounces = 8,
     float pixel_clamp = 100, bool noparallel = false,
-    int seed = trace_default_seed);
+    int seed = trace_default_seed, int nthreads = 0);
+image4f trace_image(const render_scene& scn, int camid, int yresolution,
+    int nsamples, trace_type tracer, int nbounces = 8, float pixel_clamp = 100,
+    bool noparallel = false, int seed = trace_default_seed, int nthreads = 0);
+image4f trace_image(const std::shared_ptr<scene>& scn, int camid,
+    int yresolution, int nsamples, trace_type tracer, int nbounces = 8,
+    float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0);
 
 // Progressive trace state
 struct trace_state {
-    image4f img = {};           // computed image
-    image4f acc = {};           // accumulation buffer
-    image<rng_state> rng = {};  // random number generators
-    int sample = 0;             // next sample to render
+    image4f img = {};               // computed image
+    image4f acc = {};               // accumulation buffer
+    image4f acc2 = {};              // second moments for adaptive sampling
+    image<int> pixel_samples = {};  // samples per pixel when adaptive
+    image<rng_state> rng = {};      // random number generators
+    int sample = 0;                 // next sample to render
+    uint64_t samples_spent = 0;     // total number of samples rendered
+    image4f albedo = {};            // first-hit albedo aov
+    image4f normal = {};            // first-hit normal aov
+    image4f depth = {};             // first-hit distance aov
+    image4f emission = {};          // first-hit emission aov
+    image4f residual2 = {};         // second moments without the emission
 };
 
+// Minimum number of samples per pixel before adaptive sampling checks
+// whether a pixel converged.
+const int trace_adaptive_min_samples = 16;
+// Maximum number of samples per pixel with adaptive sampling, as a multiple
+// of the requested samples.
+const int trace_adaptive_max_ratio = 4;
+
 // Progressively compute an image by calling trace_samples multiple times.
 // Start with an empty state and then successively call this function to
-// render the next batch of samples.
+// render the next batch of samples. Threads are used as in `trace_image()`.
+// If `adaptive_threshold` is positive, pixels stop being sampled when the
+// relative standard error of their mean falls below it, and the budget of
+// `nsamples` per pixel is spent on the remaining ones, up to
+// `trace_adaptive_max_ratio` times `nsamples` each. Returns true when the
+// budget is spent or all pixels converged. If `aovs` is true, the first-hit
+// albedo, normal, distance and emission of the camera rays are averaged, in
+// the same pass, in the state aovs, with alpha set to the fraction of rays
+// that hit. Emission includes the environment seen by missed rays. The
+// second moments of the samples minus their first-hit emission are averaged
+// too, for denoising.
+// The scene version makes a snapshot for each batch, so prefer rendering
+// from a render scene.
+bool trace_samples(trace_state& st, const render_scene& scn, int camid,
+    int yresolution, int nsamples, trace_func tracer, int nbatch,
+    int nbounces = 8, float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0,
+    float adaptive_threshold = 0, bool aovs = false);
 bool trace_samples(trace_state& st, const std::shared_ptr<scene>& scn,
     int camid, int yresolution, int nsamples, trace_func tracer, int nbatch,
     int nbounces = 8, float pixel_clamp = 100, bool noparallel = false,
-    int seed = trace_default_seed);
+    int seed = trace_default_seed, int nthreads = 0,
+    float adaptive_threshold = 0, bool aovs = false);
+bool trace_samples(trace_state& st, const render_scene& scn, int camid,
+    int yresolution, int nsamples, trace_type tracer, int nbatch,
+    int nbounces = 8, float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0,
+    float adaptive_threshold = 0, bool aovs = false);
+bool trace_samples(trace_state& st, const std::shared_ptr<scene>& scn,
+    int camid, int yresolution, int nsamples, trace_type tracer, int nbatch,
+    int nbounces = 8, float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0,
+    float adaptive_threshold = 0, bool aovs = false);
+
+// Renders the next batch of samples like `trace_samples()` with
+// `trace_path()`, but as a wavefront. The paths of each image tile advance
+// one bounce at a time through queues of rays to extend, hits to shade and
+// light rays to test. Rays are intersected in packets and hits are sorted
+// by material and instance before shading, so that traversal and shading
+// stay coherent. Each path draws the same random numbers as in
+// `trace_path()`, so the images match up to ties in intersections.
+bool trace_samples_wavefront(trace_state& st, const render_scene& scn,
+    int camid, int yresolution, int nsamples, int nbatch, int nbounces = 8,
+    float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0);
+
+// Denoises a rendered image guided by its aovs, as computed by
+// `trace_samples()`, with an edge-avoiding a-trous wavelet filter. The
+// first-hit emission is removed and the rest divided by the albedo, then
+// filtered with `niterations` passes of a 5x5 kernel of increasing spacing,
+// weighted by the similarity of normal, depth and color, relative to the
+// standard deviation of their difference estimated from the lower per-pixel
+// `variance` of the image mean without the emission, which is filtered
+// along. The result is multiplied back by the albedo and the emission added
+// back. Larger sigmas blur more across the corresponding edges.
+image4f denoise_trace_image(const image4f& img, const image4f& variance,
+    const image4f& albedo, const image4f& normal, const image4f& depth,
+    const image4f& emission, int niterations = 5, float color_sigma = 1,
+    float normal_sigma = 0.1f, float depth_sigma = 0.1f);
+// Denoises the image of a state rendered with aovs as above, with the
+// variance of the pixel means estimated from the residual moments.
+image4f denoise_trace_image(const trace_state& st, int niterations = 5,
+    float color_sigma = 1, float normal_sigma = 0.1f,
+    float depth_sigma = 0.1f);
+
+// Pixels [region_min, region_max) and samples [sample_start, sample_end)
+// rendered into a raw accumulation.
+struct trace_accumulation_range {
+    vec2i region_min = {0, 0};  // first pixel
+    vec2i region_max = {0, 0};  // one past the last pixel
+    int sample_start = 0;       // first sample
+    int sample_end = 0;         // one past the last sample
+};
+
+// Raw accumulation of the samples of an image region, to split renders
+// over machines by region or sample range and merge them later.
+struct trace_accumulation {
+    vec2i imsize = {0, 0};    // full image size
+    vec2i offset = {0, 0};    // region offset in the full image
+    image4f acc = {};         // sum of samples, with the region size
+    image<int> count = {};    // number of samples per pixel
+    std::vector<trace_accumulation_range> ranges = {};  // rendered ranges
+};
+
+// Renders the samples [sample_start, sample_end) of the pixels in the
+// region [region_min, region_max) of the image. Each sample of each pixel
+// uses its own random sequence, derived from the seed, the pixel and the
+// sample index, so that merging renders of disjoint regions or sample
+// ranges gives the render of the whole image and all samples, up to float
+// rounding. These sequences differ from the per-pixel ones of
+// `trace_samples()`, so the result matches a `trace_image()` render only
+// statistically. Threads are used as in `trace_image()`.
+trace_accumulation trace_accumulate(const render_scene& scn, int camid,
+    int yresolution, const vec2i& region_min, const vec2i& region_max,
+    int sample_start, int sample_end, trace_func tracer, int nbounces = 8,
+    float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0);
+trace_accumulation trace_accumulate(const render_scene& scn, int camid,
+    int yresolution, const vec2i& region_min, const vec2i& region_max,
+    int sample_start, int sample_end, trace_type tracer, int nbounces = 8,
+    float pixel_clamp = 100, bool noparallel = false,
+    int seed = trace_default_seed, int nthreads = 0);
+// Adds the samples of `acc` to `merged`, which covers the full image after
+// the call. Throws if the image sizes do not match or if the same samples
+// of a pixel were already merged.
+void merge_trace_accumulation(
+    trace_accumulation& merged, const trace_accumulation& acc);
+// Full image with the average of the accumulated samples, zero where no
+// samples were accumulated.
+image4f resolve_trace_accumulation(const trace_accumulation& acc);
 
 // Asynchronous trace state
 struct trace_async_state {
@@ -3232,62 +3939,88 @@ struct trace_async_state {
     int sample = 0;                         // next sample to render
     bool stop_flag = false;                 // stop flag
     std::vector<std::thread> threads = {};  // rendering threads
+
+    // display tiles published since the last sync, guarded by the mutex
+    std::vector<int> dirty_tiles = {};   // dirty tile indices
+    std::vector<bool> dirty_flags = {};  // whether each tile is dirty
+    std::mutex display_mutex;            // guards display and dirty tiles
 };
 
-// Starts an anyncrhounous renderer.
+// Starts an anyncrhounous renderer. Samples are rendered one at a time
+// over image tiles, with threads used as in `trace_image()`, from a
+// snapshot of the scene made at start.
 void trace_async_start(trace_async_state& st, const std::shared_ptr<scene>& scn,
     int camid, int yresolution, int nsamples, trace_func tracer, float exposure,
     float gamma, bool filmic, int preview_ratio, int nbounces = 8,
-    float pixel_clamp = 100, int seed = trace_default_seed);
+    float pixel_clamp = 100, int seed = trace_default_seed, int nthreads = 0);
+void trace_async_start(trace_async_state& st, const std::shared_ptr<scene>& scn,
+    int camid, int yresolution, int nsamples, trace_type tracer,
+    float exposure, float gamma, bool filmic, int preview_ratio,
+    int nbounces = 8, float pixel_clamp = 100, int seed = trace_default_seed,
+    int nthreads = 0);
 // Stop the asynchronous renderer.
 void trace_async_stop(trace_async_state& st);
+// Copies the display tiles published since the last call to `display`,
+// resizing it if needed, and returns their regions as [min, max) pixel
+// bounds. Workers tonemap each tile once per sample and publish it whole,
+// so viewers can keep their own copy and upload only the changed regions.
+std::vector<std::pair<vec2i, vec2i>> trace_async_sync_display(
+    trace_async_state& st, image4f& display);
 
 // Trace function - path tracer.
-vec3f trace_path(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_path(const render_scene& scn, const ray3f& ray, rng_state& rng,
+    int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - path tracer without mis.
-vec3f trace_path_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_path_nomis(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - naive path tracer.
-vec3f trace_path_naive(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_path_naive(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - direct illumination.
-vec3f trace_direct(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_direct(const render_scene& scn, const ray3f& ray, rng_state& rng,
+    int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - direct illumination without mis.
-vec3f trace_direct_nomis(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_direct_nomis(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - pure environment illumination with no shadows.
-vec3f trace_environment(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_environment(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - eyelight rendering.
-vec3f trace_eyelight(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_eyelight(const render_scene& scn, const ray3f& ray, rng_state& rng,
+    int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - normal debug visualization.
-vec3f trace_debug_normal(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_debug_normal(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - faceforward debug visualization.
-vec3f trace_debug_frontfacing(const std::shared_ptr<scene>& scn,
-    const ray3f& ray, rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_debug_frontfacing(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - albedo debug visualization.
-vec3f trace_debug_albedo(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_debug_albedo(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - diffuse debug visualization.
-vec3f trace_debug_diffuse(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_debug_diffuse(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - specular debug visualization.
-vec3f trace_debug_specular(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_debug_specular(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - roughness debug visualization.
-vec3f trace_debug_roughness(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
+vec3f trace_debug_roughness(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
 // Trace function - texcoord debug visualization.
-vec3f trace_debug_texcoord(const std::shared_ptr<scene>& scn, const ray3f& ray,
-    rng_state& rng, int nbounces, bool* hit = nullptr);
-
-// Trace statistics for last run used for fine tuning implementation.
-// For now returns number of paths and number of rays.
-std::pair<uint64_t, uint64_t> get_trace_stats();
+vec3f trace_debug_texcoord(const render_scene& scn, const ray3f& ray,
+    rng_state& rng, int nbounces, bool* hit = nullptr, float spread = 0);
+
+// Trace statistics used for fine tuning implementation. Counters are kept
+// per thread and merged when the renderers finish each image tile.
+struct trace_stats {
+    uint64_t npaths = 0;        // camera paths
+    uint64_t nrays = 0;         // rays traced, including shadow rays
+    uint64_t nshadow_rays = 0;  // rays traced to test light visibility
+    uint64_t nbvh_nodes = 0;    // bvh nodes visited
+    uint64_t nbvh_prims = 0;    // primitives tested
+};
+// Trace statistics merged since the last reset.
+trace_stats get_trace_stats();
 void reset_trace_stats();
 
 }  // namespace ygl
@@ -3352,12 +4085,96 @@ inline std::string format_duration(int64_t duration) {
 inline std::string format_num(uint64_t num) {
     auto rem = num % 1000;
     auto div = num / 1000;
-    if (div > 0) return format_num(div) + "," + std::to_string(rem);
-    return std::to_string(rem);
+    if (div <= 0) return std::to_string(rem);
+    char buf[16];
+    sprintf(buf, ",%03d", (int)rem);
+    return format_num(div) + buf;
 }
 
 }  // namespace ygl
 
+// -----------------------------------------------------------------------------
+// CONCURRENCY UTILITIES
+// -----------------------------------------------------------------------------
+namespace ygl {
+
+// Whether the calling thread is a `parallel_for()` worker.
+inline bool& is_parallel_for_worker() {
+    static thread_local auto worker = false;
+    return worker;
+}
+
+// Runs `func(idx)` for all indices in [0, count) on `nthreads` threads,
+// or all hardware threads if `nthreads` is 0. Threads pull indices from a
+// shared counter, so the work is balanced even if the cost per index varies.
+// Nested calls run serially on the calling worker, so parallel kernels can
+// be called from parallel loops without oversubscribing the machine.
+template <typename Func>
+inline void parallel_for(int count, const Func& func, int nthreads = 0) {
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    nthreads = min(nthreads, count);
+    if (nthreads <= 1 || is_parallel_for_worker()) {
+        for (auto idx = 0; idx < count; idx++) func(idx);
+        return;
+    }
+    std::atomic<int> next_idx(0);
+    auto threads = std::vector<std::thread>();
+    for (auto tid = 0; tid < nthreads; tid++) {
+        threads.push_back(std::thread([&func, &next_idx, count]() {
+            is_parallel_for_worker() = true;
+            while (true) {
+                auto idx = next_idx.fetch_add(1);
+                if (idx >= count) break;
+                func(idx);
+            }
+        }));
+    }
+    for (auto& t : threads) t.join();
+}
+
+// Runs `func(j0, j1)` for blocks of rows [j0, j1) of an image of `size` in
+// parallel, with blocks large enough to amortize threading costs. Kernels
+// should loop over the contiguous pixels of the block rows.
+template <typename Func>
+inline void parallel_rows(const vec2i& size, const Func& func) {
+    auto rows = max(1, 16384 / max(size.x, 1));
+    auto nblocks = (size.y + rows - 1) / rows;
+    parallel_for(nblocks, [&func, size, rows](int block) {
+        func(block * rows, min(size.y, (block + 1) * rows));
+    });
+}
+
+// Pool of persistent worker threads that run parallel loops, so that
+// threads are not created on every call. Workers pull indices from a shared
+// counter, so tasks are balanced even if their cost varies. Jobs submitted
+// from different threads run one at a time.
+struct thread_pool {
+    std::vector<std::thread> threads = {};  // worker threads
+    std::mutex job_mutex;                   // serializes jobs
+    std::mutex mutex;                       // protects the job state
+    std::condition_variable job_cv;         // signals new jobs
+    std::condition_variable done_cv;        // signals job completion
+    const std::function<void(int)>* job = nullptr;  // current job
+    int job_count = 0;                              // job indices
+    std::atomic<int> job_next{0};                   // next job index
+    int job_working = 0;                            // workers in the job
+    uint64_t job_id = 0;                            // job counter
+    bool stop = false;                              // stop flag
+
+    ~thread_pool();
+};
+
+// Makes a thread pool with `nthreads` workers, or as many as the hardware
+// threads if `nthreads` is 0.
+std::shared_ptr<thread_pool> make_thread_pool(int nthreads = 0);
+
+// Runs `func(idx)` for all indices in [0, count) on the pool workers and
+// waits for completion. Must not be called from within a pool task.
+void parallel_for(const std::shared_ptr<thread_pool>& pool, int count,
+    const std::function<void(int)>& func);
+
+}  // namespace ygl
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR MATRICES
 // -----------------------------------------------------------------------------
@@ -64,8 +64,16 @@
 
 #include <array>
 #include <climits>
+#include <cstring>
 using namespace std::string_literals;
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "json.hpp"
 
 #ifndef _WIN32
@@ -193,6 +201,46 @@ void save_binary(const std::string& filename, const std::vector<byte>& data) {
     fs.close();
 }
 
+// Releases the mapped region
+file_view::~file_view() {
+#ifndef _WIN32
+    if (mapped) munmap(mapped, size);
+#endif
+}
+
+// Opens a file view, throwing on error.
+std::shared_ptr<file_view> load_file_view(const std::string& filename) {
+    auto view = std::make_shared<file_view>();
+#ifndef _WIN32
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("could not load " + filename);
+    struct stat st = {};
+    auto empty = fstat(fd, &st) == 0 && st.st_size == 0;
+    if (st.st_size > 0) {
+        auto mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            view->mapped = mapped;
+            view->data = (const char*)mapped;
+            view->size = st.st_size;
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    if (view->mapped || empty) return view;
+#endif
+    // fallback to reading the whole file
+    auto fs = std::ifstream(filename, std::ios::binary);
+    if (!fs) throw std::runtime_error("could not load " + filename);
+    fs.seekg(0, std::ios::end);
+    view->buffer.resize(fs.tellg());
+    fs.seekg(0);
+    fs.read(view->buffer.data(), view->buffer.size());
+    fs.close();
+    view->data = view->buffer.data();
+    view->size = view->buffer.size();
+    return view;
+}
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -417,6 +465,18 @@ image4f load_image(const std::string& filename) {
     return img;
 }
 
+// Loads an 8-bit image.
+image4b load_image4b(const std::string& filename) {
+    auto width = 0, height = 0, ncomp = 0;
+    auto pixels =
+        (vec4b*)stbi_load(filename.c_str(), &width, &height, &ncomp, 4);
+    if (!pixels) throw std::runtime_error("could not load image " + filename);
+    auto img = image4b{
+        {width, height}, std::vector<vec4b>(pixels, pixels + width * height)};
+    free(pixels);
+    return img;
+}
+
 // Saves an hdr image.
 void save_image(const std::string& filename, const image4f& img) {
     auto ext = get_extension(filename);
@@ -449,26 +509,160 @@ void save_image(const std::string& filename, const image4f& img) {
                 (float*)img.pxl.data()))
             throw std::runtime_error("could not save image " + filename);
     } else if (ext == "exr") {
-        if (!SaveEXR((float*)img.pxl.data(), img.size.x, img.size.y, 4,
-                filename.c_str()))
+        if (SaveEXR((float*)img.pxl.data(), img.size.x, img.size.y, 4,
+                filename.c_str()) < 0)
             throw std::runtime_error("could not save image " + filename);
     } else {
         throw std::runtime_error("unsupported image format " + ext);
     }
 }
 
+// Channels of raw accumulations, in the alphabetical order of EXR files.
+static const auto trace_accumulation_channels =
+    std::array<const char*, 5>{"A", "B", "G", "N", "R"};
+
+// Loads a raw render accumulation.
+trace_accumulation load_trace_accumulation(const std::string& filename) {
+    auto version = EXRVersion();
+    auto header = EXRHeader();
+    auto exr = EXRImage();
+    auto err = (const char*)nullptr;
+    InitEXRHeader(&header);
+    InitEXRImage(&exr);
+    if (ParseEXRVersionFromFile(&version, filename.c_str()) < 0 ||
+        ParseEXRHeaderFromFile(&header, &version, filename.c_str(), &err) < 0)
+        throw std::runtime_error("could not load accumulation " + filename);
+    for (auto c = 0; c < header.num_channels; c++)
+        header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+    if (LoadEXRImageFromFile(&exr, &header, filename.c_str(), &err) < 0) {
+        FreeEXRHeader(&header);
+        throw std::runtime_error("could not load accumulation " + filename);
+    }
+
+    // channels
+    auto channels = std::array<const float*, 5>{};
+    for (auto c = 0; c < header.num_channels; c++) {
+        for (auto k = 0; k < 5; k++) {
+            if (std::string(header.channels[c].name) ==
+                trace_accumulation_channels[k])
+                channels[k] = (const float*)exr.images[c];
+        }
+    }
+    auto acc = trace_accumulation();
+    acc.acc = image4f{{exr.width, exr.height}};
+    acc.count = image<int>{{exr.width, exr.height}};
+    acc.imsize = acc.acc.size;
+    auto samples = vec2i{-1, -1};
+    for (auto ai = 0; ai < header.num_custom_attributes; ai++) {
+        auto& a = header.custom_attributes[ai];
+        if (a.size != sizeof(vec2i)) continue;
+        if (std::string(a.name) == "yglImageSize")
+            memcpy(&acc.imsize, a.value, sizeof(vec2i));
+        if (std::string(a.name) == "yglRegionOffset")
+            memcpy(&acc.offset, a.value, sizeof(vec2i));
+        if (std::string(a.name) == "yglSampleRange")
+            memcpy(&samples, a.value, sizeof(vec2i));
+    }
+    acc.ranges = {{acc.offset, acc.offset + acc.acc.size, samples.x,
+        samples.y}};
+    auto missing = false;
+    for (auto channel : channels) missing = missing || !channel;
+    if (!missing) {
+        for (auto idx = 0; idx < acc.acc.pxl.size(); idx++) {
+            acc.acc.pxl[idx] = {channels[4][idx], channels[2][idx],
+                channels[1][idx], channels[0][idx]};
+            acc.count.pxl[idx] = (int)channels[3][idx];
+        }
+    }
+    FreeEXRImage(&exr);
+    FreeEXRHeader(&header);
+    if (missing)
+        throw std::runtime_error("missing accumulation channels " + filename);
+    if (samples.x < 0 || samples.y < samples.x)
+        throw std::runtime_error("missing accumulation samples " + filename);
+    return acc;
+}
+
+// Saves a raw render accumulation.
+void save_trace_accumulation(
+    const std::string& filename, const trace_accumulation& acc) {
+    if (acc.ranges.size() != 1)
+        throw std::runtime_error(
+            "only single renders can be saved as accumulations");
+    auto& range = acc.ranges.front();
+    auto npixels = acc.acc.pxl.size();
+    auto channels =
+        std::vector<std::vector<float>>(5, std::vector<float>(npixels));
+    for (auto idx = 0; idx < npixels; idx++) {
+        auto& p = acc.acc.pxl[idx];
+        channels[0][idx] = p.w;
+        channels[1][idx] = p.z;
+        channels[2][idx] = p.y;
+        channels[3][idx] = (float)acc.count.pxl[idx];
+        channels[4][idx] = p.x;
+    }
+    auto images = std::vector<unsigned char*>();
+    for (auto& channel : channels) images.push_back((byte*)channel.data());
+    auto infos = std::vector<EXRChannelInfo>(5);
+    auto pixel_types = std::vector<int>(5, TINYEXR_PIXELTYPE_FLOAT);
+    for (auto c = 0; c < 5; c++)
+        strcpy(infos[c].name, trace_accumulation_channels[c]);
+
+    auto header = EXRHeader();
+    auto exr = EXRImage();
+    InitEXRHeader(&header);
+    InitEXRImage(&exr);
+    exr.images = images.data();
+    exr.width = acc.acc.size.x;
+    exr.height = acc.acc.size.y;
+    exr.num_channels = 5;
+    header.num_channels = 5;
+    header.channels = infos.data();
+    header.pixel_types = pixel_types.data();
+    header.requested_pixel_types = pixel_types.data();
+    header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+    // region placement and samples
+    auto attributes = std::array<std::pair<const char*, vec2i>, 3>{
+        std::make_pair("yglImageSize", acc.imsize),
+        std::make_pair("yglRegionOffset", acc.offset),
+        std::make_pair("yglSampleRange",
+            vec2i{range.sample_start, range.sample_end})};
+    for (auto& attribute : attributes) {
+        auto& a = header.custom_attributes[header.num_custom_attributes++];
+        strcpy(a.name, attribute.first);
+        strcpy(a.type, "v2i");
+        a.value = (byte*)&attribute.second;
+        a.size = sizeof(vec2i);
+    }
+
+    auto err = (const char*)nullptr;
+    if (SaveEXRImageToFile(&exr, &header, filename.c_str(), &err) < 0)
+        throw std::runtime_error("could not save accumulation " + filename);
+}
+
 // Loads an hdr image.
 image4f load_image_from_memory(const byte* data, int data_size) {
-    stbi_ldr_to_hdr_gamma(1);
+    // 8-bit images are converted without stbi global gamma state, so that
+    // images can be decoded concurrently
     auto width = 0, height = 0, ncomp = 0;
-    auto pixels = (vec4f*)stbi_loadf_from_memory(
+    if (stbi_is_hdr_from_memory(data, data_size)) {
+        auto pixels = (vec4f*)stbi_loadf_from_memory(
+            data, data_size, &width, &height, &ncomp, 4);
+        if (!pixels)
+            throw std::runtime_error("could not decode image from memory");
+        auto img = image4f{{width, height},
+            std::vector<vec4f>(pixels, pixels + width * height)};
+        free(pixels);
+        return img;
+    }
+    auto pixels = (vec4b*)stbi_load_from_memory(
         data, data_size, &width, &height, &ncomp, 4);
-    stbi_ldr_to_hdr_gamma(2.2f);
     if (!pixels) throw std::runtime_error("could not decode image from memory");
-    auto img = image4f{
-        {width, height}, std::vector<vec4f>(pixels, pixels + width * height)};
-    delete pixels;
-    return img;
+    auto img = image4b{
+        {width, height}, std::vector<vec4b>(pixels, pixels + width * height)};
+    free(pixels);
+    return byte_to_float(img);
 }
 
 // Resize image.
@@ -480,10 +674,18 @@ image4f resize_image(const image4f& img, const vec2i& size) {
     if (!imsize.y)
         imsize.y = (int)round(img.size.y * (imsize.x / (float)img.size.x));
     auto res_img = image4f{imsize};
-    stbir_resize_float_generic((float*)img.pxl.data(), img.size.x, img.size.y,
-        sizeof(vec4f) * img.size.x, (float*)res_img.pxl.data(), imsize.x,
-        imsize.y, sizeof(vec4f) * imsize.x, 4, 3, 0, STBIR_EDGE_CLAMP,
-        STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, nullptr);
+    // resize blocks of output rows in parallel, each with the offset of its
+    // first row, so that they sample the input as a single resize would
+    auto scale = vec2f{
+        (float)imsize.x / img.size.x, (float)imsize.y / img.size.y};
+    parallel_rows(imsize, [&](int j0, int j1) {
+        stbir_resize_subpixel(img.pxl.data(), img.size.x, img.size.y,
+            sizeof(vec4f) * img.size.x, res_img.pxl.data() + j0 * imsize.x,
+            imsize.x, j1 - j0, sizeof(vec4f) * imsize.x, STBIR_TYPE_FLOAT, 4,
+            3, 0, STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT,
+            STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, nullptr, scale.x,
+            scale.y, 0, (float)j0);
+    });
     return res_img;
 }
 
@@ -503,10 +705,13 @@ std::shared_ptr<scene> load_scene(
         scn = load_json_scene(filename, load_textures, skip_missing);
     } else if (ext == "obj" || ext == "OBJ") {
         scn = load_obj_scene(filename, load_textures, skip_missing);
-    } else if (ext == "gltf" || ext == "GLTF") {
+    } else if (ext == "gltf" || ext == "GLTF" || ext == "glb" ||
+               ext == "GLB") {
         scn = load_gltf_scene(filename, load_textures, skip_missing);
     } else if (ext == "pbrt" || ext == "PBRT") {
         scn = load_pbrt_scene(filename, load_textures, skip_missing);
+    } else if (ext == "ybin" || ext == "YBIN") {
+        scn = load_binary_scene(filename, load_textures, skip_missing);
     } else {
         throw std::runtime_error("unsupported extension " + ext);
     }
@@ -532,11 +737,257 @@ void save_scene(const std::string& filename, const std::shared_ptr<scene>& scn,
         save_obj_scene(filename, scn, save_textures, skip_missing);
     } else if (ext == "gltf" || ext == "GLTF") {
         save_gltf_scene(filename, scn, save_textures, skip_missing);
+    } else if (ext == "ybin" || ext == "YBIN") {
+        save_binary_scene(filename, scn, save_textures, skip_missing);
     } else {
         throw std::runtime_error("unsupported extension " + ext);
     }
 }
 
+// Loads a texture image as floats, converting it to linear if needed.
+image4f load_texture_image(const std::string& filename, float gamma) {
+    auto img = load_image(filename);
+    if (!is_hdr_filename(filename) && gamma != 1)
+        img = gamma_to_linear(img, gamma);
+    return img;
+}
+
+// Estimates the memory needed to decode a texture, reading only the image
+// header if possible and guessing from the file size otherwise.
+size_t get_texture_load_memory(const std::string& filename) {
+    auto ext = get_extension(filename);
+    auto width = 0, height = 0, ncomp = 0;
+    if (ext != "exr" && ext != "pfm" &&
+        stbi_info(filename.c_str(), &width, &height, &ncomp))
+        return (size_t)width * (size_t)height * sizeof(vec4f) * 2;
+    auto fs = std::ifstream(filename, std::ios::binary | std::ios::ate);
+    if (!fs) return 0;
+    return (size_t)fs.tellg() * 8;
+}
+
+// Bounds the memory of the textures being decoded concurrently. Loads wait
+// until their estimated memory fits in the budget, but always proceed if
+// nothing else is in flight, so that images larger than the budget load.
+struct texture_load_budget {
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t max_memory = 0;
+    size_t memory = 0;
+    bool stop = false;
+
+    // Waits for `size` bytes, returning false if the loads were stopped.
+    bool acquire(size_t size) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this, size]() {
+            return stop || memory == 0 || memory + size <= max_memory;
+        });
+        if (stop) return false;
+        memory += size;
+        return true;
+    }
+    void release(size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            memory -= size;
+        }
+        cond.notify_all();
+    }
+};
+
+// Loads the scene textures that are not loaded.
+void load_scene_textures(const std::shared_ptr<scene>& scn,
+    const std::string& dirname, bool skip_missing, bool compact,
+    size_t max_memory) {
+    auto env_txts = std::unordered_set<std::shared_ptr<texture>>();
+    for (auto env : scn->environments) env_txts.insert(env->ke_txt);
+    auto txts = std::vector<std::shared_ptr<texture>>();
+    for (auto& txt : scn->textures) {
+        if (txt->path == "" || !txt->img.pxl.empty() ||
+            !txt->texels.data.empty())
+            continue;
+        txts.push_back(txt);
+    }
+
+    // decode concurrently, each task writing only its own texture
+    texture_load_budget budget;
+    budget.max_memory = max_memory;
+    auto error = std::exception_ptr();
+    std::mutex error_mutex;
+    parallel_for((int)txts.size(), [&](int idx) {
+        auto txt = txts[idx];
+        auto filename = normalize_path(dirname + "/" + txt->path);
+        auto memory = get_texture_load_memory(filename);
+        budget.acquire(memory);
+        try {
+            if (!compact || env_txts.count(txt)) {
+                txt->img = load_texture_image(filename, txt->gamma);
+            } else if (is_hdr_filename(filename)) {
+                txt->texels = make_texel_image(
+                    load_image(filename), texel_format::rgba16f, 1);
+            } else {
+                auto img = load_image4b(filename);
+                auto gray = true;
+                for (auto& p : img.pxl) {
+                    if (p.x != p.y || p.x != p.z || p.w != 255) {
+                        gray = false;
+                        break;
+                    }
+                }
+                txt->texels = make_texel_image(img,
+                    (gray) ? texel_format::r8 : texel_format::rgba8,
+                    txt->gamma);
+            }
+        } catch (const std::exception&) {
+            if (!skip_missing) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        }
+        budget.release(memory);
+    });
+    if (error) std::rethrow_exception(error);
+    if (compact) compact_textures(scn);
+}
+
+// Textures decoded in the background. Decoded images wait in `ready`, and
+// count against the memory budget, until they are moved into the scene.
+struct texture_stream {
+    std::thread loader;
+    texture_load_budget budget;
+    std::mutex mutex;
+    std::deque<std::tuple<std::shared_ptr<texture>, image4f, size_t>> ready;
+    std::exception_ptr error;
+    int pending = 0;
+
+    ~texture_stream() {
+        {
+            std::lock_guard<std::mutex> lock(budget.mutex);
+            budget.stop = true;
+        }
+        budget.cond.notify_all();
+        if (loader.joinable()) loader.join();
+    }
+};
+
+// Starts loading the scene textures in the background.
+std::shared_ptr<texture_stream> load_scene_textures_async(
+    const std::shared_ptr<scene>& scn, const std::string& dirname,
+    bool skip_missing, size_t max_memory, int nthreads) {
+    auto stream = std::make_shared<texture_stream>();
+    stream->budget.max_memory = max_memory;
+    auto env_txts = std::unordered_set<std::shared_ptr<texture>>();
+    for (auto env : scn->environments) env_txts.insert(env->ke_txt);
+    auto norm_txts = std::unordered_set<std::shared_ptr<texture>>();
+    for (auto mat : scn->materials) norm_txts.insert(mat->norm_txt);
+    auto txts = std::vector<std::shared_ptr<texture>>();
+    for (auto& txt : scn->textures) {
+        if (txt->path == "" || !txt->img.pxl.empty() ||
+            !txt->texels.data.empty())
+            continue;
+        auto filename = normalize_path(dirname + "/" + txt->path);
+        if (env_txts.count(txt)) {
+            try {
+                txt->img = load_texture_image(filename, txt->gamma);
+            } catch (const std::exception&) {
+                if (!skip_missing) throw;
+            }
+        } else {
+            // unloaded textures evaluate to white, so only normal maps need
+            // a placeholder to keep the geometric normals
+            if (norm_txts.count(txt))
+                txt->img = image4f{{1, 1}, {{0.5f, 0.5f, 1, 1}}};
+            txts.push_back(txt);
+        }
+    }
+    stream->pending = (int)txts.size();
+    auto ptr = stream.get();
+    stream->loader = std::thread([ptr, txts, dirname, skip_missing,
+                                     nthreads]() {
+        parallel_for((int)txts.size(),
+            [ptr, &txts, &dirname, skip_missing](int idx) {
+                auto txt = txts[idx];
+                auto filename = normalize_path(dirname + "/" + txt->path);
+                auto memory = get_texture_load_memory(filename);
+                if (!ptr->budget.acquire(memory)) return;
+                auto img = image4f();
+                try {
+                    img = load_texture_image(filename, txt->gamma);
+                } catch (const std::exception&) {
+                    std::lock_guard<std::mutex> lock(ptr->mutex);
+                    if (!skip_missing && !ptr->error)
+                        ptr->error = std::current_exception();
+                    img = txt->img;
+                }
+                std::lock_guard<std::mutex> lock(ptr->mutex);
+                ptr->ready.push_back(std::make_tuple(txt, img, memory));
+            },
+            nthreads);
+    });
+    return stream;
+}
+
+// Number of decoded textures waiting to be moved into the scene.
+int get_texture_stream_ready(const std::shared_ptr<texture_stream>& stream) {
+    if (!stream) return 0;
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    return (int)stream->ready.size();
+}
+
+// Checks whether all textures were moved into the scene.
+bool is_texture_stream_done(const std::shared_ptr<texture_stream>& stream) {
+    if (!stream) return true;
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    return stream->pending == 0;
+}
+
+// Moves the decoded textures into the scene.
+int update_texture_stream(const std::shared_ptr<texture_stream>& stream) {
+    if (!stream) return 0;
+    auto ready = decltype(stream->ready)();
+    auto error = std::exception_ptr();
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        std::swap(ready, stream->ready);
+        std::swap(error, stream->error);
+        stream->pending -= (int)ready.size();
+    }
+    for (auto& item : ready) {
+        std::get<0>(item)->img = std::move(std::get<1>(item));
+        stream->budget.release(std::get<2>(item));
+    }
+    if (error) std::rethrow_exception(error);
+    return (int)ready.size();
+}
+
+// Attaches a texture cache to the scene textures that are not loaded.
+std::shared_ptr<texture_cache> add_texture_cache(
+    const std::shared_ptr<scene>& scn, const std::string& dirname,
+    size_t budget, bool skip_missing) {
+    auto cache = std::make_shared<texture_cache>();
+    cache->budget = budget;
+    cache->load = [dirname, skip_missing](const std::shared_ptr<texture>& txt) {
+        auto filename = normalize_path(dirname + "/" + txt->path);
+        try {
+            return load_texture_image(filename, txt->gamma);
+        } catch (const std::exception&) {
+            if (skip_missing) return image4f{};
+            throw;
+        }
+    };
+    for (auto txt : scn->textures) {
+        if (txt->path == "" || !txt->img.pxl.empty() ||
+            !txt->texels.data.empty())
+            continue;
+        txt->cache = cache;
+    }
+    for (auto env : scn->environments) {
+        if (!env->ke_txt || !env->ke_txt->cache) continue;
+        env->ke_txt->img = cache->load(env->ke_txt);
+        env->ke_txt->cache = nullptr;
+    }
+    return cache;
+}
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -591,59 +1042,33 @@ std::string base64_encode(
     return ret;
 }
 
-// Decode from base64
-std::string base64_decode(std::string const& encoded_string) {
-    static const std::string base64_chars =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz"
-        "0123456789+/";
-
-    auto is_base64 = [](unsigned char c) -> bool {
-        return (isalnum(c) || (c == '+') || (c == '/'));
-    };
-
-    int in_len = (int)encoded_string.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    std::string ret;
-
-    while (in_len-- && (encoded_string[in_] != '=') &&
-           is_base64(encoded_string[in_])) {
-        char_array_4[i++] = encoded_string[in_];
-        in_++;
-        if (i == 4) {
-            for (i = 0; i < 4; i++)
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-            char_array_3[0] =
-                (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) +
-                              ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; (i < 3); i++) ret += char_array_3[i];
-            i = 0;
+// Decode from base64, stopping at padding or at the first invalid character.
+std::vector<byte> base64_decode(const char* encoded, size_t size) {
+    static const auto base64_table = []() {
+        auto base64_chars =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz"
+            "0123456789+/";
+        auto table = std::array<int, 256>();
+        table.fill(-1);
+        for (auto i = 0; i < 64; i++) table[(byte)base64_chars[i]] = i;
+        return table;
+    }();
+    auto data = std::vector<byte>();
+    data.reserve(size / 4 * 3 + 2);
+    auto bits = 0u, nbits = 0u;
+    for (auto i = (size_t)0; i < size; i++) {
+        auto val = base64_table[(byte)encoded[i]];
+        if (val < 0) break;
+        bits = (bits << 6) | (unsigned)val;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            data.push_back((byte)(bits >> nbits));
+            bits &= (1u << nbits) - 1;
         }
     }
-
-    if (i) {
-        for (j = i; j < 4; j++) char_array_4[j] = 0;
-
-        for (j = 0; j < 4; j++)
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
-
-        char_array_3[0] =
-            (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] =
-            ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-        for (j = 0; (j < i - 1); j++) ret += char_array_3[j];
-    }
-
-    return ret;
+    return data;
 }
 
 }  // namespace ygl
@@ -1533,18 +1958,7 @@ std::shared_ptr<scene> load_json_scene(
     if (!load_textures) return scn;
 
     // load images
-    for (auto& txt : scn->textures) {
-        if (txt->path == "" || !txt->img.pxl.empty()) continue;
-        auto filename = normalize_path(dirname + "/" + txt->path);
-        try {
-            txt->img = load_image(filename);
-            if (!is_hdr_filename(filename) && txt->gamma != 1)
-                txt->img = gamma_to_linear(txt->img, txt->gamma);
-        } catch (const std::exception&) {
-            if (skip_missing) continue;
-            throw;
-        }
-    }
+    load_scene_textures(scn, dirname, skip_missing);
 
     return scn;
 }
@@ -1605,6 +2019,460 @@ void save_json_scene(const std::string& filename,
 
 }  // namespace ygl
 
+// -----------------------------------------------------------------------------
+// BUILTIN BINARY FORMAT
+// -----------------------------------------------------------------------------
+namespace ygl {
+
+// Binary scene magic and version. The version is increased whenever the
+// layout changes, and files with a different version are rejected.
+const char binary_scene_magic[8] = {'y', 'g', 'l', 's', 'c', 'e', 'n', 'e'};
+const uint32_t binary_scene_version = 4;
+
+// Alignment of arrays in binary scenes, relative to the file start.
+const size_t binary_scene_align = 16;
+
+// Binary scene writer. Values are written in order, arrays are aligned.
+struct binary_scene_writer {
+    std::ofstream fs;                               // output stream
+    size_t offset = 0;                              // stream offset
+    std::unordered_map<const void*, int> ids = {};  // object indices
+};
+
+// Binary scene reader over a mapped file. Arrays are copied in bulk.
+struct binary_scene_reader {
+    std::shared_ptr<file_view> view = nullptr;  // input file
+    size_t offset = 0;                          // read offset
+};
+
+// Writes/reads raw bytes
+inline void serialize_binary_bytes(
+    binary_scene_writer& ar, void* data, size_t size) {
+    ar.fs.write((const char*)data, size);
+    ar.offset += size;
+}
+inline void serialize_binary_bytes(
+    binary_scene_reader& ar, void* data, size_t size) {
+    if (ar.view->size - ar.offset < size)
+        throw std::runtime_error("truncated binary scene");
+    if (data) memcpy(data, ar.view->data + ar.offset, size);
+    ar.offset += size;
+}
+
+// Pads/skips to the array alignment
+inline void serialize_binary_align(binary_scene_writer& ar) {
+    static const char zeros[binary_scene_align] = {};
+    auto pad = (binary_scene_align - ar.offset % binary_scene_align) %
+               binary_scene_align;
+    serialize_binary_bytes(ar, (void*)zeros, pad);
+}
+inline void serialize_binary_align(binary_scene_reader& ar) {
+    auto pad = (binary_scene_align - ar.offset % binary_scene_align) %
+               binary_scene_align;
+    serialize_binary_bytes(ar, nullptr, pad);
+}
+
+// Serialize plain values
+template <typename Archive, typename T>
+inline void serialize_binary(Archive& ar, T& val) {
+    static_assert(std::is_trivially_copyable<T>::value, "not plain data");
+    serialize_binary_bytes(ar, &val, sizeof(T));
+}
+
+// Serialize strings
+inline void serialize_binary(binary_scene_writer& ar, std::string& val) {
+    auto size = (uint64_t)val.size();
+    serialize_binary(ar, size);
+    serialize_binary_bytes(ar, (void*)val.data(), size);
+}
+inline void serialize_binary(binary_scene_reader& ar, std::string& val) {
+    auto size = (uint64_t)0;
+    serialize_binary(ar, size);
+    if (ar.view->size - ar.offset < size)
+        throw std::runtime_error("truncated binary scene");
+    val.assign(ar.view->data + ar.offset, size);
+    ar.offset += size;
+}
+
+// Serialize arrays, in bulk for plain data
+template <typename T>
+inline void serialize_binary_elems(
+    binary_scene_writer& ar, std::vector<T>& vals, std::true_type) {
+    serialize_binary_align(ar);
+    serialize_binary_bytes(ar, vals.data(), vals.size() * sizeof(T));
+}
+template <typename T>
+inline void serialize_binary_elems(
+    binary_scene_reader& ar, std::vector<T>& vals, std::true_type) {
+    serialize_binary_align(ar);
+    if ((ar.view->size - ar.offset) / sizeof(T) < vals.size())
+        throw std::runtime_error("truncated binary scene");
+    serialize_binary_bytes(ar, vals.data(), vals.size() * sizeof(T));
+}
+template <typename Archive, typename T>
+inline void serialize_binary_elems(
+    Archive& ar, std::vector<T>& vals, std::false_type) {
+    for (auto& val : vals) serialize_binary(ar, val);
+}
+template <typename T>
+inline void serialize_binary(binary_scene_writer& ar, std::vector<T>& vals) {
+    auto size = (uint64_t)vals.size();
+    serialize_binary(ar, size);
+    serialize_binary_elems(ar, vals, std::is_trivially_copyable<T>());
+}
+template <typename T>
+inline void serialize_binary(binary_scene_reader& ar, std::vector<T>& vals) {
+    auto size = (uint64_t)0;
+    serialize_binary(ar, size);
+    if (size > ar.view->size - ar.offset)
+        throw std::runtime_error("truncated binary scene");
+    vals.resize(size);
+    serialize_binary_elems(ar, vals, std::is_trivially_copyable<T>());
+}
+
+// Serialize images
+template <typename Archive, typename T>
+inline void serialize_binary(Archive& ar, image<T>& img) {
+    serialize_binary(ar, img.size);
+    serialize_binary(ar, img.pxl);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, texel_image& img) {
+    serialize_binary(ar, img.size);
+    serialize_binary(ar, img.format);
+    serialize_binary(ar, img.data);
+    serialize_binary(ar, img.lut);
+}
+
+// Serialize object references as indices in the scene arrays
+template <typename T>
+inline void serialize_binary_ref(binary_scene_writer& ar,
+    std::shared_ptr<T>& val, const std::vector<std::shared_ptr<T>>& vals) {
+    auto id = val ? ar.ids.at(val.get()) : -1;
+    serialize_binary(ar, id);
+}
+template <typename T>
+inline void serialize_binary_ref(binary_scene_reader& ar,
+    std::shared_ptr<T>& val, const std::vector<std::shared_ptr<T>>& vals) {
+    auto id = -1;
+    serialize_binary(ar, id);
+    if (id >= (int)vals.size() || id < -1)
+        throw std::runtime_error("bad reference in binary scene");
+    val = (id >= 0) ? vals[id] : nullptr;
+}
+template <typename Archive, typename T>
+inline void serialize_binary_ref(Archive& ar,
+    std::vector<std::shared_ptr<T>>& vals,
+    const std::vector<std::shared_ptr<T>>& objs) {
+    auto size = (uint64_t)vals.size();
+    serialize_binary(ar, size);
+    vals.resize(size);
+    for (auto& val : vals) serialize_binary_ref(ar, val, objs);
+}
+
+// Serialize BVH nodes. Views and instance BVHs are set after loading.
+template <typename Archive>
+inline void serialize_binary(Archive& ar, std::shared_ptr<bvh_tree>& bvh) {
+    auto has_bvh = (bool)bvh;
+    serialize_binary(ar, has_bvh);
+    if (!has_bvh) return;
+    if (!bvh) bvh = std::make_shared<bvh_tree>();
+    serialize_binary(ar, bvh->ist_frames);
+    serialize_binary(ar, bvh->ist_inv_frames);
+    serialize_binary(ar, bvh->nodes);
+    serialize_binary(ar, bvh->wide_nodes);
+    serialize_binary(ar, bvh->leaf_triangles);
+    serialize_binary(ar, bvh->compressed_nodes);
+    serialize_binary(ar, bvh->compressed_prims);
+    serialize_binary(ar, bvh->params);
+}
+
+// Serialize scene objects
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, camera& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.frame);
+    serialize_binary(ar, val.ortho);
+    serialize_binary(ar, val.imsize);
+    serialize_binary(ar, val.focal);
+    serialize_binary(ar, val.focus);
+    serialize_binary(ar, val.aperture);
+    serialize_binary(ar, val.near);
+    serialize_binary(ar, val.far);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, texture& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.path);
+    serialize_binary(ar, val.img);
+    serialize_binary(ar, val.texels);
+    serialize_binary(ar, val.clamp);
+    serialize_binary(ar, val.scale);
+    serialize_binary(ar, val.gamma);
+    serialize_binary(ar, val.has_opacity);
+    serialize_binary(ar, val.mips);
+    serialize_binary(ar, val.texel_mips);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, material& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.base_metallic);
+    serialize_binary(ar, val.gltf_textures);
+    serialize_binary(ar, val.double_sided);
+    serialize_binary(ar, val.ke);
+    serialize_binary(ar, val.kd);
+    serialize_binary(ar, val.ks);
+    serialize_binary(ar, val.kt);
+    serialize_binary(ar, val.rs);
+    serialize_binary(ar, val.op);
+    serialize_binary(ar, val.fresnel);
+    serialize_binary(ar, val.refract);
+    serialize_binary_ref(ar, val.ke_txt, scn.textures);
+    serialize_binary_ref(ar, val.kd_txt, scn.textures);
+    serialize_binary_ref(ar, val.ks_txt, scn.textures);
+    serialize_binary_ref(ar, val.kt_txt, scn.textures);
+    serialize_binary_ref(ar, val.rs_txt, scn.textures);
+    serialize_binary_ref(ar, val.op_txt, scn.textures);
+    serialize_binary_ref(ar, val.occ_txt, scn.textures);
+    serialize_binary_ref(ar, val.bump_txt, scn.textures);
+    serialize_binary_ref(ar, val.disp_txt, scn.textures);
+    serialize_binary_ref(ar, val.norm_txt, scn.textures);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, shape& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.path);
+    serialize_binary(ar, val.points);
+    serialize_binary(ar, val.lines);
+    serialize_binary(ar, val.triangles);
+    serialize_binary(ar, val.pos);
+    serialize_binary(ar, val.norm);
+    serialize_binary(ar, val.texcoord);
+    serialize_binary(ar, val.color);
+    serialize_binary(ar, val.radius);
+    serialize_binary(ar, val.tangsp);
+    serialize_binary(ar, val.bbox);
+    serialize_binary(ar, val.elem_cdf);
+    serialize_binary(ar, val.elem_alias);
+    serialize_binary(ar, val.bvh);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, subdiv& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.path);
+    serialize_binary(ar, val.level);
+    serialize_binary(ar, val.catmull_clark);
+    serialize_binary(ar, val.compute_normals);
+    serialize_binary(ar, val.quads_pos);
+    serialize_binary(ar, val.quads_texcoord);
+    serialize_binary(ar, val.quads_color);
+    serialize_binary(ar, val.crease_pos);
+    serialize_binary(ar, val.crease_texcoord);
+    serialize_binary(ar, val.pos);
+    serialize_binary(ar, val.texcoord);
+    serialize_binary(ar, val.color);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, instance& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.frame);
+    serialize_binary_ref(ar, val.shp, scn.shapes);
+    serialize_binary_ref(ar, val.mat, scn.materials);
+    serialize_binary_ref(ar, val.sbd, scn.subdivs);
+    serialize_binary(ar, val.bbox);
+    serialize_binary(ar, val.light_id);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, environment& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.frame);
+    serialize_binary(ar, val.ke);
+    serialize_binary_ref(ar, val.ke_txt, scn.textures);
+    serialize_binary(ar, val.row_alias);
+    serialize_binary(ar, val.texel_alias);
+    serialize_binary(ar, val.texel_sum);
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, node& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary_ref(ar, val.parent, scn.nodes);
+    serialize_binary(ar, val.frame);
+    serialize_binary(ar, val.translation);
+    serialize_binary(ar, val.rotation);
+    serialize_binary(ar, val.scale);
+    serialize_binary(ar, val.weights);
+    serialize_binary_ref(ar, val.cam, scn.cameras);
+    serialize_binary_ref(ar, val.ist, scn.instances);
+    serialize_binary_ref(ar, val.env, scn.environments);
+    auto children = std::vector<std::shared_ptr<node>>();
+    for (auto& child : val.children) children.push_back(child.lock());
+    serialize_binary_ref(ar, children, scn.nodes);
+    val.children.assign(children.begin(), children.end());
+}
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn, animation& val) {
+    serialize_binary(ar, val.name);
+    serialize_binary(ar, val.path);
+    serialize_binary(ar, val.group);
+    serialize_binary(ar, val.type);
+    serialize_binary(ar, val.times);
+    serialize_binary(ar, val.translation);
+    serialize_binary(ar, val.rotation);
+    serialize_binary(ar, val.scale);
+    serialize_binary(ar, val.weights);
+    serialize_binary_ref(ar, val.targets, scn.nodes);
+}
+
+// Serialize the scene objects of one type. Objects are created when
+// reading so that references can be resolved before they are read.
+template <typename Archive, typename T>
+inline void serialize_binary_objects(
+    Archive& ar, scene& scn, std::vector<std::shared_ptr<T>>& objs) {
+    for (auto& obj : objs) serialize_binary(ar, scn, *obj);
+}
+template <typename T>
+inline void serialize_binary_count(
+    binary_scene_writer& ar, std::vector<std::shared_ptr<T>>& objs) {
+    auto size = (uint64_t)objs.size();
+    serialize_binary(ar, size);
+    for (auto idx = 0; idx < objs.size(); idx++) ar.ids[objs[idx].get()] = idx;
+}
+template <typename T>
+inline void serialize_binary_count(
+    binary_scene_reader& ar, std::vector<std::shared_ptr<T>>& objs) {
+    auto size = (uint64_t)0;
+    serialize_binary(ar, size);
+    if (size > ar.view->size - ar.offset)
+        throw std::runtime_error("truncated binary scene");
+    objs.resize(size);
+    for (auto& obj : objs) obj = std::make_shared<T>();
+}
+
+// Serialize a scene with its header
+template <typename Archive>
+inline void serialize_binary(Archive& ar, scene& scn) {
+    // header
+    char magic[8];
+    memcpy(magic, binary_scene_magic, 8);
+    auto version = binary_scene_version;
+    auto endian = (uint32_t)0x01020304;
+    auto node_sizes = vec2i{(int)sizeof(bvh_node), (int)sizeof(bvh_wide_node)};
+    serialize_binary(ar, magic);
+    if (memcmp(magic, binary_scene_magic, 8))
+        throw std::runtime_error("not a binary scene");
+    serialize_binary(ar, version);
+    serialize_binary(ar, endian);
+    serialize_binary(ar, node_sizes);
+    if (version != binary_scene_version)
+        throw std::runtime_error("unsupported binary scene version");
+    if (endian != 0x01020304 ||
+        node_sizes !=
+            vec2i{(int)sizeof(bvh_node), (int)sizeof(bvh_wide_node)})
+        throw std::runtime_error("incompatible binary scene");
+
+    // objects
+    serialize_binary(ar, scn.name);
+    serialize_binary_count(ar, scn.cameras);
+    serialize_binary_count(ar, scn.textures);
+    serialize_binary_count(ar, scn.materials);
+    serialize_binary_count(ar, scn.shapes);
+    serialize_binary_count(ar, scn.subdivs);
+    serialize_binary_count(ar, scn.instances);
+    serialize_binary_count(ar, scn.environments);
+    serialize_binary_count(ar, scn.nodes);
+    serialize_binary_count(ar, scn.animations);
+    serialize_binary_objects(ar, scn, scn.cameras);
+    serialize_binary_objects(ar, scn, scn.textures);
+    serialize_binary_objects(ar, scn, scn.materials);
+    serialize_binary_objects(ar, scn, scn.shapes);
+    serialize_binary_objects(ar, scn, scn.subdivs);
+    serialize_binary_objects(ar, scn, scn.instances);
+    serialize_binary_objects(ar, scn, scn.environments);
+    serialize_binary_objects(ar, scn, scn.nodes);
+    serialize_binary_objects(ar, scn, scn.animations);
+
+    // computed properties
+    serialize_binary_ref(ar, scn.lights, scn.instances);
+    serialize_binary(ar, scn.bbox);
+    serialize_binary(ar, scn.bvh);
+    serialize_binary(ar, scn.light_sampling);
+    serialize_binary(ar, scn.light_cdf);
+    serialize_binary(ar, scn.light_tree);
+    serialize_binary(ar, scn.light_leaves);
+}
+
+// Load a scene in the builtin binary format.
+std::shared_ptr<scene> load_binary_scene(
+    const std::string& filename, bool load_textures, bool skip_missing) {
+    auto ar = binary_scene_reader();
+    ar.view = load_file_view(filename);
+    auto scn = std::make_shared<scene>();
+    serialize_binary(ar, *scn);
+
+    // point bvhs to the loaded data; prebuilt scenes are already tesselated
+    for (auto shp : scn->shapes) {
+        if (shp->bvh) update_bvh_views(shp);
+    }
+    if (scn->bvh) {
+        for (auto sbd : scn->subdivs) sbd->dirty = false;
+        if (scn->bvh->ist_frames.size() != scn->instances.size())
+            throw std::runtime_error("bad bvh in binary scene");
+        scn->bvh->ist_bvhs.resize(scn->instances.size());
+        for (auto i = 0; i < scn->instances.size(); i++) {
+            auto shp = scn->instances[i]->shp;
+            if (!shp || !shp->bvh)
+                throw std::runtime_error("bad bvh in binary scene");
+            scn->bvh->ist_bvhs[i] = shp->bvh;
+        }
+    }
+
+    // load textures that are not embedded; embedded ones are always loaded
+    if (load_textures)
+        load_scene_textures(scn, get_dirname(filename), skip_missing);
+
+    return scn;
+}
+
+// Save a scene in the builtin binary format.
+void save_binary_scene(const std::string& filename,
+    const std::shared_ptr<scene>& scn, bool save_textures, bool skip_missing) {
+    auto ar = binary_scene_writer();
+    ar.fs = std::ofstream(filename, std::ios::binary);
+    if (!ar.fs) throw std::runtime_error("could not save " + filename);
+    if (save_textures) {
+        serialize_binary(ar, *scn);
+    } else {
+        // serialize textures without images
+        auto images = std::vector<texture>();
+        for (auto txt : scn->textures) {
+            images.push_back(texture());
+            std::swap(images.back().img, txt->img);
+            std::swap(images.back().texels, txt->texels);
+            std::swap(images.back().mips, txt->mips);
+            std::swap(images.back().texel_mips, txt->texel_mips);
+        }
+        auto restore = [&]() {
+            for (auto idx = 0; idx < scn->textures.size(); idx++) {
+                auto txt = scn->textures[idx];
+                std::swap(images[idx].img, txt->img);
+                std::swap(images[idx].texels, txt->texels);
+                std::swap(images[idx].mips, txt->mips);
+                std::swap(images[idx].texel_mips, txt->texel_mips);
+            }
+        };
+        try {
+            serialize_binary(ar, *scn);
+        } catch (...) {
+            restore();
+            throw;
+        }
+        restore();
+    }
+    if (!ar.fs) throw std::runtime_error("could not save " + filename);
+}
+
+}  // namespace ygl
+
 // -----------------------------------------------------------------------------
 // OBJ CONVESION
 // -----------------------------------------------------------------------------
@@ -1647,45 +2515,485 @@ inline std::ostream& operator<<(std::ostream& os, const obj_vertex& v) {
     return os;
 }
 
-// Loads an OBJ
-std::shared_ptr<scene> load_obj_scene(const std::string& filename,
-    bool load_textures, bool skip_missing, bool split_shapes) {
-    auto scn = std::make_shared<scene>();
-
-    // parsing policies
-    auto flip_texcoord = true;
-    auto flip_tr = true;
-
-    // splitting policy
-    auto split_material = split_shapes;
-    auto split_group = split_shapes;
-    auto split_smoothing = split_shapes;
+// Skips whitespace in an OBJ line.
+inline void obj_skip_whitespace(const char*& s, const char* e) {
+    while (s < e && (*s == ' ' || *s == '\t' || *s == '\r')) s++;
+}
 
-    // open file
-    auto fs = std::ifstream(filename);
-    if (!fs) throw std::runtime_error("cannot open filename " + filename);
+// Parses an OBJ token into a fixed-size buffer, truncating long tokens.
+template <int N>
+inline bool obj_parse_value(const char*& s, const char* e, char (&val)[N]) {
+    obj_skip_whitespace(s, e);
+    auto len = 0;
+    while (s < e && *s != ' ' && *s != '\t' && *s != '\r') {
+        if (len < N - 1) val[len++] = *s;
+        s++;
+    }
+    val[len] = 0;
+    return len > 0;
+}
 
-    // current parsing values
-    auto matname = std::string();
-    auto oname = std::string();
-    auto gname = std::string();
-    auto smoothing = true;
-    auto ist = (std::shared_ptr<instance>)nullptr;
+// Parses an OBJ token.
+inline bool obj_parse_value(const char*& s, const char* e, std::string& val) {
+    obj_skip_whitespace(s, e);
+    auto start = s;
+    while (s < e && *s != ' ' && *s != '\t' && *s != '\r') s++;
+    val.assign(start, s);
+    return s > start;
+}
 
-    // vertices
-    auto pos = std::deque<vec3f>();
-    auto norm = std::deque<vec3f>();
-    auto texcoord = std::deque<vec2f>();
+// Parses an OBJ integer.
+inline bool obj_parse_value(const char*& s, const char* e, int& val) {
+    obj_skip_whitespace(s, e);
+    auto start = s;
+    auto neg = s < e && *s == '-';
+    if (s < e && (*s == '-' || *s == '+')) s++;
+    if (s == e || *s < '0' || *s > '9') {
+        s = start;
+        return false;
+    }
+    val = 0;
+    while (s < e && *s >= '0' && *s <= '9') val = val * 10 + (*s++ - '0');
+    if (neg) val = -val;
+    return true;
+}
 
-    // object maps
-    auto tmap = std::unordered_map<std::string, std::shared_ptr<texture>>();
-    auto mmap = std::unordered_map<std::string, std::shared_ptr<material>>();
+// Parses an OBJ boolean written as an integer.
+inline bool obj_parse_value(const char*& s, const char* e, bool& val) {
+    auto i = 0;
+    if (!obj_parse_value(s, e, i)) return false;
+    val = i;
+    return true;
+}
 
-    // vertex maps
-    auto name_map = std::unordered_map<std::string, int>();
-    auto vert_map = std::unordered_map<vec3i, int>();
-    auto pos_map = std::unordered_map<int, int>();
-    auto norm_map = std::unordered_map<int, int>();
+// Parses an OBJ float. The first 19 significant digits are accumulated
+// exactly and scaled once by an exact power of ten, so common inputs are
+// rounded as by strtod(). Falls back to strtod() for other spellings.
+inline bool obj_parse_value(const char*& s, const char* e, float& val) {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+        1e20, 1e21, 1e22};
+    obj_skip_whitespace(s, e);
+    auto start = s;
+    auto neg = s < e && *s == '-';
+    if (s < e && (*s == '-' || *s == '+')) s++;
+    auto mantissa = (uint64_t)0;
+    auto ndigits = 0, exponent = 0;
+    auto valid = false;
+    while (s < e && *s >= '0' && *s <= '9') {
+        if (ndigits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa) ndigits++;
+        } else {
+            exponent++;
+        }
+        s++;
+        valid = true;
+    }
+    if (s < e && *s == '.') {
+        s++;
+        while (s < e && *s >= '0' && *s <= '9') {
+            if (ndigits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa) ndigits++;
+                exponent--;
+            }
+            s++;
+            valid = true;
+        }
+    }
+    if (!valid) {
+        // inf, nan and hex floats
+        char buf[64];
+        s = start;
+        if (!obj_parse_value(s, e, buf)) return false;
+        auto end = (char*)nullptr;
+        auto dval = strtod(buf, &end);
+        if (end == buf) {
+            s = start;
+            return false;
+        }
+        s = start + (end - buf);
+        val = (float)dval;
+        return true;
+    }
+    if (s < e && (*s == 'e' || *s == 'E')) {
+        auto es = s + 1;
+        auto exp_neg = es < e && *es == '-';
+        if (es < e && (*es == '-' || *es == '+')) es++;
+        if (es < e && *es >= '0' && *es <= '9') {
+            auto exp_val = 0;
+            while (es < e && *es >= '0' && *es <= '9') {
+                if (exp_val < 10000) exp_val = exp_val * 10 + (*es - '0');
+                es++;
+            }
+            exponent += exp_neg ? -exp_val : exp_val;
+            s = es;
+        }
+    }
+    auto dval = (double)mantissa;
+    if (exponent < 0 && exponent >= -22) {
+        dval /= pow10[-exponent];
+    } else if (exponent > 0 && exponent <= 22) {
+        dval *= pow10[exponent];
+    } else if (exponent) {
+        dval *= std::pow(10.0, (double)exponent);
+    }
+    val = (float)(neg ? -dval : dval);
+    return true;
+}
+
+// Parses OBJ vectors and frames.
+template <typename T, int N>
+inline bool obj_parse_value(const char*& s, const char* e, vec<T, N>& val) {
+    for (auto i = 0; i < N; i++)
+        if (!obj_parse_value(s, e, (&val.x)[i])) return false;
+    return true;
+}
+template <typename T>
+inline bool obj_parse_value(const char*& s, const char* e, frame<T, 3>& val) {
+    for (auto i = 0; i < 12; i++)
+        if (!obj_parse_value(s, e, (&val.x.x)[i])) return false;
+    return true;
+}
+
+// Parses an OBJ vertex as in `operator>>`.
+inline bool obj_parse_value(const char*& s, const char* e, obj_vertex& val) {
+    val = {0, 0, 0};
+    if (!obj_parse_value(s, e, val.pos)) return false;
+    if (s < e && *s == '/') {
+        s++;
+        if (s < e && *s == '/') {
+            s++;
+            obj_parse_value(s, e, val.norm);
+        } else {
+            obj_parse_value(s, e, val.texcoord);
+            if (s < e && *s == '/') {
+                s++;
+                obj_parse_value(s, e, val.norm);
+            }
+        }
+    }
+    return true;
+}
+
+// Checks if an OBJ line starts with the command `cmd`.
+inline bool obj_is_command(const char* s, const char* e, const char* cmd) {
+    while (*cmd && s < e && *s == *cmd) {
+        s++;
+        cmd++;
+    }
+    return !*cmd && (s == e || *s == ' ' || *s == '\t' || *s == '\r');
+}
+
+// Gets the next line in [s, e), with comments removed, and advances `s`
+// to the following line.
+inline void obj_next_line(
+    const char*& s, const char* e, const char*& ls, const char*& le) {
+    auto nl = (const char*)memchr(s, '\n', e - s);
+    ls = s;
+    le = nl ? nl : e;
+    s = nl ? nl + 1 : e;
+    auto comment = (const char*)memchr(ls, '#', le - ls);
+    if (comment) le = comment;
+}
+
+// OBJ element or command. Elements ('f', 'l', 'p') refer to vertices in the
+// parsed vertex list; other commands are kept as line ranges to be parsed
+// in order by the loaders.
+struct obj_command {
+    char elem = 0;                // element type or 0 for commands
+    int vert_start = 0;           // first vertex in the chunk
+    int vert_num = 0;             // number of vertices
+    const char* start = nullptr;  // command line start
+    const char* end = nullptr;    // command line end
+    vec3i vert_size = {0, 0, 0};  // chunk vertex counts at this line
+};
+
+// OBJ file chunk parsed independently of the others.
+struct obj_chunk {
+    std::vector<vec3f> pos;             // positions
+    std::vector<vec3f> norm;            // normals
+    std::vector<vec2f> texcoord;        // texcoords
+    std::vector<vec3i> verts;           // element vertices
+    std::vector<obj_command> commands;  // elements and commands
+};
+
+// Parsed OBJ vertex data with element vertices resolved to 0-based
+// indices, or -1 if missing. Commands are stored per chunk in file order.
+struct obj_data {
+    std::vector<vec3f> pos;         // positions
+    std::vector<vec3f> norm;        // normals
+    std::vector<vec2f> texcoord;    // texcoords
+    std::vector<obj_chunk> chunks;  // chunks in file order
+};
+
+// Parses a range of OBJ lines.
+inline void parse_obj_chunk(
+    const char* s, const char* e, obj_chunk& chunk, bool flip_texcoord) {
+    while (s < e) {
+        auto ls = s, le = s;
+        obj_next_line(s, e, ls, le);
+        obj_skip_whitespace(ls, le);
+        if (ls == le) continue;
+        if (obj_is_command(ls, le, "v")) {
+            ls += 1;
+            chunk.pos.push_back(zero3f);
+            obj_parse_value(ls, le, chunk.pos.back());
+        } else if (obj_is_command(ls, le, "vn")) {
+            ls += 2;
+            chunk.norm.push_back(zero3f);
+            obj_parse_value(ls, le, chunk.norm.back());
+        } else if (obj_is_command(ls, le, "vt")) {
+            ls += 2;
+            chunk.texcoord.push_back(zero2f);
+            obj_parse_value(ls, le, chunk.texcoord.back());
+            if (flip_texcoord)
+                chunk.texcoord.back().y = 1 - chunk.texcoord.back().y;
+        } else if (obj_is_command(ls, le, "f") ||
+                   obj_is_command(ls, le, "l") ||
+                   obj_is_command(ls, le, "p")) {
+            auto cmd = obj_command();
+            cmd.elem = ls[0];
+            cmd.vert_start = (int)chunk.verts.size();
+            cmd.vert_size = {(int)chunk.pos.size(),
+                (int)chunk.texcoord.size(), (int)chunk.norm.size()};
+            ls += 1;
+            auto vert = obj_vertex();
+            while (obj_parse_value(ls, le, vert) && vert.pos)
+                chunk.verts.push_back({vert.pos, vert.texcoord, vert.norm});
+            cmd.vert_num = (int)chunk.verts.size() - cmd.vert_start;
+            chunk.commands.push_back(cmd);
+        } else {
+            auto cmd = obj_command();
+            cmd.start = ls;
+            cmd.end = le;
+            chunk.commands.push_back(cmd);
+        }
+    }
+}
+
+// Parses an OBJ buffer. The buffer is split into chunks at line boundaries
+// that are parsed in parallel. Vertex indices are then resolved against the
+// vertex counts of the preceding chunks and the vertex data concatenated.
+inline void parse_obj_data(const char* data, size_t size, obj_data& obj,
+    bool flip_texcoord, size_t chunk_size = 1 << 22) {
+    // split into chunks
+    auto bounds = std::vector<const char*>{data};
+    while (bounds.back() < data + size) {
+        auto s = bounds.back();
+        if ((size_t)(data + size - s) <= chunk_size) {
+            bounds.push_back(data + size);
+        } else {
+            auto nl = (const char*)memchr(
+                s + chunk_size, '\n', data + size - s - chunk_size);
+            bounds.push_back(nl ? nl + 1 : data + size);
+        }
+    }
+    auto nchunks = (int)bounds.size() - 1;
+    obj.chunks.resize(nchunks);
+
+    // parse chunks
+    parallel_for(nchunks, [&obj, &bounds, flip_texcoord](int idx) {
+        parse_obj_chunk(
+            bounds[idx], bounds[idx + 1], obj.chunks[idx], flip_texcoord);
+    });
+
+    // compute vertex offsets
+    auto offsets = std::vector<vec3i>(nchunks + 1, {0, 0, 0});
+    for (auto idx = 0; idx < nchunks; idx++) {
+        auto& chunk = obj.chunks[idx];
+        offsets[idx + 1] = offsets[idx] + vec3i{(int)chunk.pos.size(),
+                                              (int)chunk.texcoord.size(),
+                                              (int)chunk.norm.size()};
+    }
+    obj.pos.resize(offsets.back().x);
+    obj.texcoord.resize(offsets.back().y);
+    obj.norm.resize(offsets.back().z);
+
+    // resolve indices and concatenate vertices
+    parallel_for(nchunks, [&obj, &offsets](int idx) {
+        auto& chunk = obj.chunks[idx];
+        auto offset = offsets[idx];
+        for (auto& cmd : chunk.commands) {
+            if (!cmd.elem) continue;
+            auto size = offset + cmd.vert_size;
+            for (auto i = 0; i < cmd.vert_num; i++) {
+                auto& vert = chunk.verts[cmd.vert_start + i];
+                for (auto c = 0; c < 3; c++) {
+                    auto& v = (&vert.x)[c];
+                    v = (v < 0) ? (&size.x)[c] + v : (v ? v - 1 : -1);
+                }
+            }
+        }
+        std::copy(chunk.pos.begin(), chunk.pos.end(),
+            obj.pos.begin() + offset.x);
+        std::copy(chunk.texcoord.begin(), chunk.texcoord.end(),
+            obj.texcoord.begin() + offset.y);
+        std::copy(chunk.norm.begin(), chunk.norm.end(),
+            obj.norm.begin() + offset.z);
+        chunk.pos = {};
+        chunk.texcoord = {};
+        chunk.norm = {};
+    });
+}
+
+// Loads OBJ materials from an MTL file, adding them to the scene and maps.
+void load_obj_materials(const std::string& filename,
+    const std::shared_ptr<scene>& scn,
+    std::unordered_map<std::string, std::shared_ptr<texture>>& tmap,
+    std::unordered_map<std::string, std::shared_ptr<material>>& mmap,
+    bool flip_tr) {
+    // open file
+    auto view = load_file_view(filename);
+
+    // Parse texture options and name
+    auto add_texture = [&scn, &tmap](
+                           const char*& s, const char* e, bool srgb) {
+        // get tokens
+        auto tokens = std::vector<std::string>();
+        auto v = ""s;
+        while (obj_parse_value(s, e, v)) tokens.push_back(v);
+        if (tokens.empty()) return (std::shared_ptr<texture>)nullptr;
+
+        // texture name
+        auto path = normalize_path(tokens.back());
+        if (tmap.find(path) != tmap.end()) { return tmap.at(path); }
+
+        // create texture
+        auto txt = std::make_shared<texture>();
+        txt->name = path;
+        txt->path = path;
+        txt->gamma = (srgb && !is_hdr_filename(path)) ? 2.2f : 1.0f;
+        scn->textures.push_back(txt);
+        tmap[path] = txt;
+
+        // texture options
+        for (auto i = 0; i < tokens.size(); i++) {
+            if (tokens[i] == "-clamp") txt->clamp = true;
+            // TODO: bump scale
+        }
+
+        return txt;
+    };
+
+    // add a material preemptively to avoid crashes
+    scn->materials.push_back(std::make_shared<material>());
+    auto mat = scn->materials.back();
+
+    // read the file line by line
+    auto s = view->data, e = view->data + view->size;
+    while (s < e) {
+        auto ss = s, se = s;
+        obj_next_line(s, e, ss, se);
+
+        // get command
+        char cmd[32];
+        if (!obj_parse_value(ss, se, cmd)) continue;
+
+        // possible token values
+        if (!strcmp(cmd, "newmtl")) {
+            mat = std::make_shared<material>();
+            obj_parse_value(ss, se, mat->name);
+            scn->materials.push_back(mat);
+            mmap[mat->name] = mat;
+        } else if (!strcmp(cmd, "illum")) {
+            // TODO: something with illum
+        } else if (!strcmp(cmd, "Ke")) {
+            obj_parse_value(ss, se, mat->ke);
+        } else if (!strcmp(cmd, "Kd")) {
+            obj_parse_value(ss, se, mat->kd);
+        } else if (!strcmp(cmd, "Ks")) {
+            obj_parse_value(ss, se, mat->ks);
+        } else if (!strcmp(cmd, "Kt")) {
+            obj_parse_value(ss, se, mat->kt);
+        } else if (!strcmp(cmd, "Tf")) {
+            mat->kt = {-1, -1, -1};
+            obj_parse_value(ss, se, mat->kt);
+            if (mat->kt.y < 0) mat->kt = {mat->kt.x, mat->kt.x, mat->kt.x};
+            if (flip_tr) mat->kt = vec3f{1, 1, 1} - mat->kt;
+        } else if (!strcmp(cmd, "Tr")) {
+            auto tr = vec3f{-1, -1, -1};
+            obj_parse_value(ss, se, tr);
+            if (tr.y < 0) tr = {tr.x, tr.x, tr.x};
+            mat->op = (tr.x + tr.y + tr.z) / 3;
+            if (flip_tr) mat->op = 1 - mat->op;
+        } else if (!strcmp(cmd, "Ns")) {
+            auto ns = 0.0f;
+            obj_parse_value(ss, se, ns);
+            mat->rs = pow(2 / (ns + 2), 1 / 4.0f);
+            if (mat->rs < 0.01f) mat->rs = 0;
+            if (mat->rs > 0.99f) mat->rs = 1;
+        } else if (!strcmp(cmd, "d")) {
+            obj_parse_value(ss, se, mat->op);
+        } else if (!strcmp(cmd, "Pr") || !strcmp(cmd, "rs")) {
+            obj_parse_value(ss, se, mat->rs);
+        } else if (!strcmp(cmd, "map_Ke")) {
+            mat->ke_txt = add_texture(ss, se, true);
+        } else if (!strcmp(cmd, "map_Kd")) {
+            mat->kd_txt = add_texture(ss, se, true);
+        } else if (!strcmp(cmd, "map_Ks")) {
+            mat->ks_txt = add_texture(ss, se, true);
+        } else if (!strcmp(cmd, "map_Tr")) {
+            mat->kt_txt = add_texture(ss, se, true);
+        } else if (!strcmp(cmd, "map_d") || !strcmp(cmd, "map_Tr")) {
+            mat->op_txt = add_texture(ss, se, false);
+        } else if (!strcmp(cmd, "map_Pr") || !strcmp(cmd, "map_rs")) {
+            mat->rs_txt = add_texture(ss, se, false);
+        } else if (!strcmp(cmd, "map_occ") || !strcmp(cmd, "occ")) {
+            mat->occ_txt = add_texture(ss, se, false);
+        } else if (!strcmp(cmd, "map_bump") || !strcmp(cmd, "bump")) {
+            mat->bump_txt = add_texture(ss, se, false);
+        } else if (!strcmp(cmd, "map_disp") || !strcmp(cmd, "disp")) {
+            mat->disp_txt = add_texture(ss, se, false);
+        } else if (!strcmp(cmd, "map_norm") || !strcmp(cmd, "norm")) {
+            mat->norm_txt = add_texture(ss, se, false);
+        }
+    }
+
+    // remove first fake material
+    if (scn->materials.front()->name == "")
+        scn->materials.erase(scn->materials.begin());
+}
+
+// Loads an OBJ
+std::shared_ptr<scene> load_obj_scene(const std::string& filename,
+    bool load_textures, bool skip_missing, bool split_shapes) {
+    auto scn = std::make_shared<scene>();
+
+    // parsing policies
+    auto flip_texcoord = true;
+    auto flip_tr = true;
+
+    // splitting policy
+    auto split_material = split_shapes;
+    auto split_group = split_shapes;
+    auto split_smoothing = split_shapes;
+
+    // open and parse file
+    auto view = load_file_view(filename);
+    auto obj = obj_data();
+    parse_obj_data(view->data, view->size, obj, flip_texcoord);
+    auto& pos = obj.pos;
+    auto& norm = obj.norm;
+    auto& texcoord = obj.texcoord;
+
+    // current parsing values
+    auto matname = std::string();
+    auto oname = std::string();
+    auto gname = std::string();
+    auto smoothing = true;
+    auto ist = (std::shared_ptr<instance>)nullptr;
+
+    // object maps
+    auto tmap = std::unordered_map<std::string, std::shared_ptr<texture>>();
+    auto mmap = std::unordered_map<std::string, std::shared_ptr<material>>();
+
+    // vertex maps
+    auto name_map = std::unordered_map<std::string, int>();
+    auto vert_map = std::unordered_map<vec3i, int>();
+    auto pos_map = std::unordered_map<int, int>();
+    auto norm_map = std::unordered_map<int, int>();
     auto texcoord_map = std::unordered_map<int, int>();
 
     // add object if needed
@@ -1734,58 +3042,16 @@ std::shared_ptr<scene> load_obj_scene(const std::string& filename,
     // current objet
     ist = add_instance(scn, "", "", "", true);
 
-    // read the file line by line
-    std::string line;
-    while (std::getline(fs, line)) {
-        // remove comments
-        if (line.find("#") != line.npos) line = line.substr(0, line.find("#"));
-
-        // prepare to parse
-        auto ss = std::stringstream(line);
-
-        // get command
-        auto cmd = ""s;
-        ss >> cmd;
-        if (cmd == "") continue;
-
-        // possible token values
-        if (cmd == "v") {
-            pos.push_back(zero3f);
-            ss >> pos.back();
-        } else if (cmd == "vn") {
-            norm.push_back({});
-            ss >> norm.back();
-        } else if (cmd == "vt") {
-            texcoord.push_back({});
-            ss >> texcoord.back();
-            if (flip_texcoord) texcoord.back().y = 1 - texcoord.back().y;
-        } else if (cmd == "f" || cmd == "l" || cmd == "p") {
-            auto num = 0;
-            vec3i verts[128];
-            int vids[128];
-            auto vert_size =
-                vec3i{(int)pos.size(), (int)texcoord.size(), (int)norm.size()};
-            // elem.material = (int)oobj->materials.size() - 1;
-            while (true) {
-                auto vert = obj_vertex();
-                ss >> vert;
-                if (!vert.pos) break;
-                verts[num] = {-1, -1, -1};
-                if (vert.pos)
-                    verts[num].x = (vert.pos < 0) ? (vert_size.x + vert.pos) :
-                                                    (vert.pos - 1);
-                if (vert.texcoord)
-                    verts[num].y = (vert.texcoord < 0) ?
-                                       (vert_size.y + vert.texcoord) :
-                                       (vert.texcoord - 1);
-                if (vert.norm)
-                    verts[num].z = (vert.norm < 0) ? (vert_size.z + vert.norm) :
-                                                     (vert.norm - 1);
-                num++;
-            }
-            if (ist->sbd) {
+    // process elements and commands in file order
+    auto vids = std::vector<int>();
+    for (auto& chunk : obj.chunks) {
+        for (auto& elem : chunk.commands) {
+            if (elem.elem) {
+                auto verts = chunk.verts.data() + elem.vert_start;
+                auto num = elem.vert_num;
                 // TODO: subdivs
-            } else if (ist->shp) {
+                if (ist->sbd || !ist->shp) continue;
+                vids.resize(num);
                 for (auto i = 0; i < num; i++) {
                     auto it = vert_map.find(verts[i]);
                     if (it == vert_map.end()) {
@@ -1803,195 +3069,89 @@ std::shared_ptr<scene> load_obj_scene(const std::string& filename,
                         vids[i] = it->second;
                     }
                 }
-                if (cmd == "f") {
+                if (elem.elem == 'f') {
                     for (auto i = 2; i < num; i++)
                         ist->shp->triangles.push_back(
                             {vids[0], vids[i - 1], vids[i]});
                 }
-                if (cmd == "l") {
+                if (elem.elem == 'l') {
                     for (auto i = 1; i < num; i++)
                         ist->shp->lines.push_back({vids[i - 1], vids[i]});
                 }
-                if (cmd == "p") {
+                if (elem.elem == 'p') {
                     for (auto i = 0; i < num; i++)
                         ist->shp->points.push_back(vids[i]);
                 }
+                continue;
             }
-        } else if (cmd == "o") {
-            ss >> oname;
-            gname = "";
-            matname = "";
-            smoothing = true;
-            ist = add_instance(scn, oname, matname, gname, smoothing);
-        } else if (cmd == "usemtl") {
-            ss >> matname;
-            if (split_material) {
-                ist = add_instance(scn, oname, matname, gname, smoothing);
-            } else {
-                if (matname != "") ist->mat = mmap.at(matname);
-            }
-        } else if (cmd == "g") {
-            ss >> gname;
-            if (split_group) {
-                ist = add_instance(scn, oname, matname, gname, smoothing);
-            }
-        } else if (cmd == "s") {
-            auto name = ""s;
-            ss >> name;
-            smoothing = (name == "on");
-            if (split_smoothing) {
+
+            // get command
+            auto ss = elem.start, se = elem.end;
+            auto cmd = ""s;
+            obj_parse_value(ss, se, cmd);
+
+            // possible token values
+            if (cmd == "o") {
+                obj_parse_value(ss, se, oname);
+                gname = "";
+                matname = "";
+                smoothing = true;
                 ist = add_instance(scn, oname, matname, gname, smoothing);
-            }
-        } else if (cmd == "mtllib") {
-            auto mtlname = ""s;
-            ss >> mtlname;
-            auto mtlpath = get_dirname(filename) + "/" + mtlname;
-            // open file
-            auto fs = std::ifstream(mtlpath);
-            if (!fs)
-                throw std::runtime_error("cannot open filename " + mtlpath);
-
-            // Parse texture options and name
-            auto add_texture = [scn, &tmap](std::stringstream& ss, bool srgb) {
-                // get tokens
-                auto tokens = std::vector<std::string>();
-                while (true) {
-                    auto v = ""s;
-                    ss >> v;
-                    if (v == "") break;
-                    tokens.push_back(v);
+            } else if (cmd == "usemtl") {
+                obj_parse_value(ss, se, matname);
+                if (split_material) {
+                    ist = add_instance(scn, oname, matname, gname, smoothing);
+                } else {
+                    if (matname != "") ist->mat = mmap.at(matname);
                 }
-                if (tokens.empty()) return (std::shared_ptr<texture>)nullptr;
-
-                // texture name
-                auto path = normalize_path(tokens.back());
-                if (tmap.find(path) != tmap.end()) { return tmap.at(path); }
-
-                // create texture
-                auto txt = std::make_shared<texture>();
-                txt->name = path;
-                txt->path = path;
-                txt->gamma = (srgb && !is_hdr_filename(path)) ? 2.2f : 1.0f;
-                scn->textures.push_back(txt);
-                tmap[path] = txt;
-
-                // texture options
-                for (auto i = 0; i < tokens.size(); i++) {
-                    if (tokens[i] == "-clamp") txt->clamp = true;
-                    // TODO: bump scale
+            } else if (cmd == "g") {
+                obj_parse_value(ss, se, gname);
+                if (split_group) {
+                    ist = add_instance(scn, oname, matname, gname, smoothing);
                 }
-
-                return txt;
-            };
-
-            // add a material preemptively to avoid crashes
-            scn->materials.push_back(std::make_shared<material>());
-            auto mat = scn->materials.back();
-
-            // read the file line by line
-            std::string line;
-            while (std::getline(fs, line)) {
-                // remove comment
-                if (line.find("#") != line.npos)
-                    line = line.substr(0, line.find("#"));
-
-                // prepare to parse
-                auto ss = std::stringstream(line);
-
-                // get command
-                auto cmd = ""s;
-                ss >> cmd;
-                if (cmd == "") continue;
-
-                // possible token values
-                if (cmd == "newmtl") {
-                    mat = std::make_shared<material>();
-                    ss >> mat->name;
-                    scn->materials.push_back(mat);
-                    mmap[mat->name] = mat;
-                } else if (cmd == "illum") {
-                    // TODO: something with illum
-                } else if (cmd == "Ke") {
-                    ss >> mat->ke;
-                } else if (cmd == "Kd") {
-                    ss >> mat->kd;
-                } else if (cmd == "Ks") {
-                    ss >> mat->ks;
-                } else if (cmd == "Kt") {
-                    ss >> mat->kt;
-                } else if (cmd == "Tf") {
-                    mat->kt = {-1, -1, -1};
-                    ss >> mat->kt;
-                    if (mat->kt.y < 0)
-                        mat->kt = {mat->kt.x, mat->kt.x, mat->kt.x};
-                    if (flip_tr) mat->kt = vec3f{1, 1, 1} - mat->kt;
-                } else if (cmd == "Tr") {
-                    auto tr = vec3f{-1, -1, -1};
-                    ss >> tr;
-                    if (tr.y < 0) tr = {tr.x, tr.x, tr.x};
-                    mat->op = (tr.x + tr.y + tr.z) / 3;
-                    if (flip_tr) mat->op = 1 - mat->op;
-                } else if (cmd == "Ns") {
-                    auto ns = 0.0f;
-                    ss >> ns;
-                    mat->rs = pow(2 / (ns + 2), 1 / 4.0f);
-                    if (mat->rs < 0.01f) mat->rs = 0;
-                    if (mat->rs > 0.99f) mat->rs = 1;
-                } else if (cmd == "d") {
-                    ss >> mat->op;
-                } else if (cmd == "Pr" || cmd == "rs") {
-                    ss >> mat->rs;
-                } else if (cmd == "map_Ke") {
-                    mat->ke_txt = add_texture(ss, true);
-                } else if (cmd == "map_Kd") {
-                    mat->kd_txt = add_texture(ss, true);
-                } else if (cmd == "map_Ks") {
-                    mat->ks_txt = add_texture(ss, true);
-                } else if (cmd == "map_Tr") {
-                    mat->kt_txt = add_texture(ss, true);
-                } else if (cmd == "map_d" || cmd == "map_Tr") {
-                    mat->op_txt = add_texture(ss, false);
-                } else if (cmd == "map_Pr" || cmd == "map_rs") {
-                    mat->rs_txt = add_texture(ss, false);
-                } else if (cmd == "map_occ" || cmd == "occ") {
-                    mat->occ_txt = add_texture(ss, false);
-                } else if (cmd == "map_bump" || cmd == "bump") {
-                    mat->bump_txt = add_texture(ss, false);
-                } else if (cmd == "map_disp" || cmd == "disp") {
-                    mat->disp_txt = add_texture(ss, false);
-                } else if (cmd == "map_norm" || cmd == "norm") {
-                    mat->norm_txt = add_texture(ss, false);
+            } else if (cmd == "s") {
+                auto name = ""s;
+                obj_parse_value(ss, se, name);
+                smoothing = (name == "on");
+                if (split_smoothing) {
+                    ist = add_instance(scn, oname, matname, gname, smoothing);
                 }
-            }
-
-            // remove first fake material
-            if (scn->materials.front()->name == "")
-                scn->materials.erase(scn->materials.begin());
-
-            // clone
-            fs.close();
-        } else if (cmd == "c") {
-            auto cam = std::make_shared<camera>();
-            ss >> cam->name >> cam->ortho >> cam->imsize >> cam->focal >>
-                cam->focus >> cam->aperture >> cam->frame;
-            scn->cameras.push_back(cam);
-        } else if (cmd == "e") {
-            auto ke_txt = ""s;
-            auto env = std::make_shared<environment>();
-            ss >> env->name >> env->ke >> ke_txt >> env->frame;
-            if (ke_txt != "\"\"") {
-                if (tmap.find(ke_txt) == tmap.end()) {
-                    auto txt = std::make_shared<texture>();
-                    txt->name = ke_txt;
-                    txt->path = ke_txt;
-                    tmap[ke_txt] = txt;
-                    scn->textures.push_back(txt);
+            } else if (cmd == "mtllib") {
+                auto mtlname = ""s;
+                obj_parse_value(ss, se, mtlname);
+                auto mtlpath = get_dirname(filename) + "/" + mtlname;
+                load_obj_materials(mtlpath, scn, tmap, mmap, flip_tr);
+            } else if (cmd == "c") {
+                auto cam = std::make_shared<camera>();
+                obj_parse_value(ss, se, cam->name);
+                obj_parse_value(ss, se, cam->ortho);
+                obj_parse_value(ss, se, cam->imsize);
+                obj_parse_value(ss, se, cam->focal);
+                obj_parse_value(ss, se, cam->focus);
+                obj_parse_value(ss, se, cam->aperture);
+                obj_parse_value(ss, se, cam->frame);
+                scn->cameras.push_back(cam);
+            } else if (cmd == "e") {
+                auto ke_txt = ""s;
+                auto env = std::make_shared<environment>();
+                obj_parse_value(ss, se, env->name);
+                obj_parse_value(ss, se, env->ke);
+                obj_parse_value(ss, se, ke_txt);
+                obj_parse_value(ss, se, env->frame);
+                if (ke_txt != "\"\"") {
+                    if (tmap.find(ke_txt) == tmap.end()) {
+                        auto txt = std::make_shared<texture>();
+                        txt->name = ke_txt;
+                        txt->path = ke_txt;
+                        tmap[ke_txt] = txt;
+                        scn->textures.push_back(txt);
+                    }
+                    env->ke_txt = tmap.at(ke_txt);
                 }
-                env->ke_txt = tmap.at(ke_txt);
+                scn->environments.push_back(env);
+            } else {
+                // unused
             }
-            scn->environments.push_back(env);
-        } else {
-            // unused
         }
     }
 
@@ -2011,9 +3171,6 @@ std::shared_ptr<scene> load_obj_scene(const std::string& filename,
         idx--;
     }
 
-    // close file
-    fs.close();
-
     // updates
     update_bbox(scn);
 
@@ -2025,18 +3182,7 @@ std::shared_ptr<scene> load_obj_scene(const std::string& filename,
     if (!load_textures) return scn;
 
     // load images
-    auto dirname = get_dirname(filename);
-    for (auto& txt : scn->textures) {
-        auto filename = normalize_path(dirname + "/" + txt->path);
-        try {
-            txt->img = load_image(filename);
-            if (!is_hdr_filename(filename) && txt->gamma != 1)
-                txt->img = gamma_to_linear(txt->img, txt->gamma);
-        } catch (std::exception&) {
-            if (skip_missing) continue;
-            throw;
-        }
-    }
+    load_scene_textures(scn, get_dirname(filename), skip_missing);
 
     // assign opacity texture if needed
     auto has_opacity = std::unordered_map<std::shared_ptr<texture>, bool>();
@@ -2248,37 +3394,199 @@ static bool startswith(const std::string& str, const std::string& substr) {
     return true;
 }
 
+// Data of a glTF buffer, mapped from its file or from the GLB binary chunk,
+// or decoded from a data uri.
+struct gltf_buffer {
+    std::shared_ptr<file_view> view = nullptr;
+    std::vector<byte> decoded = {};
+    const byte* data = nullptr;
+    size_t size = 0;
+};
+
+// Elements of a glTF accessor in its buffer.
+struct gltf_accessor {
+    const byte* data = nullptr;
+    int count = 0;
+    int ncomp = 0;
+    int ctype = 5126;
+    int csize = 4;
+    int stride = 0;
+    bool normalized = false;
+};
+
+// Gets an accessor, checking that its elements are in the buffer.
+gltf_accessor get_gltf_accessor(
+    const json& gltf, const std::vector<gltf_buffer>& buffers, int aid) {
+    auto& gacc = gltf.at("accessors").at(aid);
+    auto& gview = gltf.at("bufferViews").at(gacc.value("bufferView", -1));
+    auto& buffer = buffers.at(gview.value("buffer", -1));
+    auto acc = gltf_accessor();
+    acc.count = gacc.value("count", -1);
+    acc.ctype = gacc.value("componentType", 5123);
+    acc.normalized = gacc.value("normalized", false);
+    auto type = gacc.value("type", ""s);
+    if (type == "SCALAR") acc.ncomp = 1;
+    if (type == "VEC2") acc.ncomp = 2;
+    if (type == "VEC3") acc.ncomp = 3;
+    if (type == "VEC4") acc.ncomp = 4;
+    acc.csize = 1;
+    if (acc.ctype == 5122 || acc.ctype == 5123) acc.csize = 2;
+    if (acc.ctype == 5124 || acc.ctype == 5125 || acc.ctype == 5126)
+        acc.csize = 4;
+    acc.stride = gview.value("byteStride", 0);
+    if (!acc.stride) acc.stride = acc.csize * acc.ncomp;
+    auto offset = (size_t)gacc.value("byteOffset", 0) +
+                  (size_t)gview.value("byteOffset", 0);
+    if (acc.count < 0 ||
+        (acc.count && offset + (size_t)(acc.count - 1) * acc.stride +
+                              acc.csize * acc.ncomp >
+                          buffer.size))
+        throw std::runtime_error("accessor out of buffer bounds");
+    acc.data = buffer.data + offset;
+    return acc;
+}
+
+// Reads an accessor component, normalizing integers if needed.
+template <typename T>
+inline T read_gltf_component(const gltf_accessor& acc, const byte* d) {
+    auto read = [d](auto val) {
+        memcpy(&val, d, sizeof(val));
+        return val;
+    };
+    auto val = 0.0;
+    switch (acc.ctype) {
+        case 5120: {  // char
+            val = read((int8_t)0);
+            if (acc.normalized) val = std::max(val / SCHAR_MAX, -1.0);
+        } break;
+        case 5121: {  // byte
+            val = read((uint8_t)0);
+            if (acc.normalized) val /= UCHAR_MAX;
+        } break;
+        case 5122: {  // short
+            val = read((int16_t)0);
+            if (acc.normalized) val = std::max(val / SHRT_MAX, -1.0);
+        } break;
+        case 5123: {  // unsigned short
+            val = read((uint16_t)0);
+            if (acc.normalized) val /= USHRT_MAX;
+        } break;
+        case 5124: {  // int
+            val = read((int32_t)0);
+        } break;
+        case 5125: {  // unsigned int
+            val = read((uint32_t)0);
+        } break;
+        case 5126: {  // float
+            val = read(0.0f);
+        } break;
+        default: throw std::runtime_error("unknown component type");
+    }
+    return (T)val;
+}
+
+// Reads the accessor elements as `N` values of type `T`, with missing
+// components set to 0, or 1 for the fourth. Elements are copied in bulk
+// when the layouts match, which is the common case for floats and indices.
+template <int N, typename T>
+void read_gltf_values(const gltf_accessor& acc, T* vals) {
+    auto same_type = (std::is_same<T, float>::value && acc.ctype == 5126) ||
+                     (std::is_same<T, int>::value &&
+                         (acc.ctype == 5124 || acc.ctype == 5125));
+    if (same_type && acc.ncomp == N) {
+        if (acc.stride == sizeof(T) * N) {
+            memcpy(vals, acc.data, sizeof(T) * N * acc.count);
+        } else {
+            for (auto i = 0; i < acc.count; i++)
+                memcpy(vals + i * N, acc.data + (size_t)i * acc.stride,
+                    sizeof(T) * N);
+        }
+        return;
+    }
+    for (auto i = 0; i < acc.count; i++) {
+        auto d = acc.data + (size_t)i * acc.stride;
+        for (auto c = 0; c < N; c++) {
+            vals[i * N + c] =
+                (c < acc.ncomp) ?
+                    read_gltf_component<T>(acc, d + c * acc.csize) :
+                    (T)((c == 3) ? 1 : 0);
+        }
+    }
+}
+
+// Reads the accessor elements into a vector.
+template <typename T, int N>
+void read_gltf_accessor(
+    const gltf_accessor& acc, std::vector<vec<T, N>>& vals) {
+    vals.resize(acc.count);
+    read_gltf_values<N>(acc, (T*)vals.data());
+}
+template <typename T>
+void read_gltf_accessor(const gltf_accessor& acc, std::vector<T>& vals) {
+    vals.resize(acc.count);
+    read_gltf_values<1>(acc, vals.data());
+}
+
 // Load a scene
 std::shared_ptr<scene> load_gltf_scene(
     const std::string& filename, bool load_textures, bool skip_missing) {
-    auto gltf = load_json(filename);
+    // map the file, reading the json and binary chunks of GLB files
+    auto view = load_file_view(filename);
+    auto gltf = json();
+    auto glb_data = (const byte*)nullptr;
+    auto glb_size = (size_t)0;
+    if (view->size >= 12 && !memcmp(view->data, "glTF", 4)) {
+        auto read_uint = [&view](size_t offset) {
+            auto val = (uint32_t)0;
+            if (offset + 4 > view->size)
+                throw std::runtime_error("truncated glb file");
+            memcpy(&val, view->data + offset, 4);
+            return val;
+        };
+        if (read_uint(4) != 2)
+            throw std::runtime_error("unsupported glb version");
+        auto offset = (size_t)12;
+        while (offset + 8 <= view->size) {
+            auto length = (size_t)read_uint(offset);
+            auto type = read_uint(offset + 4);
+            auto chunk = view->data + offset + 8;
+            if (offset + 8 + length > view->size)
+                throw std::runtime_error("truncated glb file");
+            if (type == 0x4E4F534A) gltf = json::parse(chunk, chunk + length);
+            if (type == 0x004E4942 && !glb_data) {
+                glb_data = (const byte*)chunk;
+                glb_size = length;
+            }
+            offset += 8 + ((length + 3) & ~(size_t)3);
+        }
+        if (gltf.is_null()) throw std::runtime_error("missing glb json");
+    } else {
+        gltf = json::parse(view->data, view->data + view->size);
+    }
     auto scn = std::make_shared<scene>();
 
     // prepare parsing
     auto dirname = get_dirname(filename);
 
-    // convert textures
-    if (gltf.count("images")) {
-        for (auto iid = 0; iid < gltf.at("images").size(); iid++) {
-            auto& gimg = gltf.at("images").at(iid);
-            auto txt = std::make_shared<texture>();
-            txt->name = gimg.value("name", ""s);
-            txt->path = (startswith(gimg.value("uri", ""s), "data:")) ?
-                            std::string("[glTF-inline].png") :
-                            gimg.value("uri", ""s);
-            scn->textures.push_back(txt);
-        }
-    }
-
-    // load buffers
-    auto bmap = std::vector<std::vector<byte>>();
+    // load buffers, mapping files and decoding data uris in place
+    auto buffers = std::vector<gltf_buffer>();
     if (gltf.count("buffers")) {
-        bmap.resize(gltf.at("buffers").size());
+        buffers.resize(gltf.at("buffers").size());
         for (auto bid = 0; bid < gltf.at("buffers").size(); bid++) {
             auto& gbuf = gltf.at("buffers").at(bid);
-            auto& data = bmap.at(bid);
+            auto& buffer = buffers.at(bid);
             auto uri = gbuf.value("uri", ""s);
-            if (uri == "") continue;
+            auto size = (size_t)gbuf.value("byteLength", -1);
+            if (uri == "") {
+                // the first buffer of a GLB file is its binary chunk
+                if (bid || !glb_data) continue;
+                if (glb_size < size)
+                    throw std::runtime_error("mismatched buffer size");
+                buffer.view = view;
+                buffer.data = glb_data;
+                buffer.size = size;
+                continue;
+            }
             if (startswith(uri, "data:")) {
                 // assume it is base64 and find ','
                 auto pos = uri.find(',');
@@ -2286,24 +3594,64 @@ std::shared_ptr<scene> load_gltf_scene(
                     throw std::runtime_error("could not decode base64 data");
                 }
                 // decode
-                auto data_char = base64_decode(uri.substr(pos + 1));
-                data = std::vector<unsigned char>(
-                    (unsigned char*)data_char.c_str(),
-                    (unsigned char*)data_char.c_str() + data_char.length());
+                buffer.decoded = base64_decode(
+                    uri.data() + pos + 1, uri.size() - pos - 1);
+                buffer.data = buffer.decoded.data();
+                buffer.size = buffer.decoded.size();
             } else {
-                data = load_binary(normalize_path(dirname + "/" + uri));
-                if (data.empty()) {
+                auto filename = normalize_path(dirname + "/" + uri);
+                try {
+                    buffer.view = load_file_view(filename);
+                } catch (const std::exception&) {
                     throw std::runtime_error(
-                        "could not load binary file " +
-                        normalize_path(dirname + "/" + uri));
+                        "could not load binary file " + filename);
                 }
+                buffer.data = (const byte*)buffer.view->data;
+                buffer.size = buffer.view->size;
             }
-            if (gbuf.value("byteLength", -1) != data.size()) {
+            if (size != buffer.size) {
                 throw std::runtime_error("mismatched buffer size");
             }
         }
     }
 
+    // convert textures, keeping the encoded data of embedded images
+    auto embedded = std::vector<std::pair<const byte*, size_t>>();
+    auto embedded_data = std::vector<std::vector<byte>>();
+    if (gltf.count("images")) {
+        embedded.resize(gltf.at("images").size(), {nullptr, 0});
+        embedded_data.resize(gltf.at("images").size());
+        for (auto iid = 0; iid < gltf.at("images").size(); iid++) {
+            auto& gimg = gltf.at("images").at(iid);
+            auto txt = std::make_shared<texture>();
+            txt->name = gimg.value("name", ""s);
+            auto uri = gimg.value("uri", ""s);
+            if (startswith(uri, "data:")) {
+                txt->path = "[glTF-inline].png";
+                auto pos = uri.find(',');
+                if (pos != uri.npos) {
+                    embedded_data[iid] = base64_decode(
+                        uri.data() + pos + 1, uri.size() - pos - 1);
+                    embedded[iid] = {
+                        embedded_data[iid].data(), embedded_data[iid].size()};
+                }
+            } else if (uri == "" && gimg.count("bufferView")) {
+                txt->path = "[glTF-inline].png";
+                auto& gview =
+                    gltf.at("bufferViews").at(gimg.value("bufferView", -1));
+                auto& buffer = buffers.at(gview.value("buffer", -1));
+                auto offset = (size_t)gview.value("byteOffset", 0);
+                auto length = (size_t)gview.value("byteLength", 0);
+                if (offset + length > buffer.size)
+                    throw std::runtime_error("image out of buffer bounds");
+                embedded[iid] = {buffer.data + offset, length};
+            } else {
+                txt->path = uri;
+            }
+            scn->textures.push_back(txt);
+        }
+    }
+
     // add a texture
     auto add_texture = [scn, &gltf](const json& ginfo, bool srgb) {
         if (!gltf.count("images") || !gltf.count("textures"))
@@ -2379,61 +3727,6 @@ std::shared_ptr<scene> load_gltf_scene(
         }
     }
 
-    // get values from accessors
-    auto accessor_values =
-        [&gltf, &bmap](const json& gacc,
-            bool normalize = false) -> std::vector<std::array<double, 4>> {
-        auto gview = gltf.at("bufferViews").at(gacc.value("bufferView", -1));
-        auto data = bmap.at(gview.value("buffer", -1)).data();
-        auto offset =
-            gacc.value("byteOffset", 0) + gview.value("byteOffset", 0);
-        auto stride = gview.value("byteStride", 0);
-        auto compTypeNum = gacc.value("componentType", 5123);
-        auto count = gacc.value("count", -1);
-        auto type = gacc.value("type", ""s);
-        auto ncomp = 0;
-        if (type == "SCALAR") ncomp = 1;
-        if (type == "VEC2") ncomp = 2;
-        if (type == "VEC3") ncomp = 3;
-        if (type == "VEC4") ncomp = 4;
-        auto compSize = 1;
-        if (compTypeNum == 5122 || compTypeNum == 5123) { compSize = 2; }
-        if (compTypeNum == 5124 || compTypeNum == 5125 || compTypeNum == 5126) {
-            compSize = 4;
-        }
-        if (!stride) stride = compSize * ncomp;
-        auto vals =
-            std::vector<std::array<double, 4>>(count, {{0.0, 0.0, 0.0, 1.0}});
-        for (auto i = 0; i < count; i++) {
-            auto d = data + offset + i * stride;
-            for (auto c = 0; c < ncomp; c++) {
-                if (compTypeNum == 5120) {  // char
-                    vals[i][c] = (double)(*(char*)d);
-                    if (normalize) vals[i][c] /= SCHAR_MAX;
-                } else if (compTypeNum == 5121) {  // byte
-                    vals[i][c] = (double)(*(byte*)d);
-                    if (normalize) vals[i][c] /= UCHAR_MAX;
-                } else if (compTypeNum == 5122) {  // short
-                    vals[i][c] = (double)(*(short*)d);
-                    if (normalize) vals[i][c] /= SHRT_MAX;
-                } else if (compTypeNum == 5123) {  // unsigned short
-                    vals[i][c] = (double)(*(unsigned short*)d);
-                    if (normalize) vals[i][c] /= USHRT_MAX;
-                } else if (compTypeNum == 5124) {  // int
-                    vals[i][c] = (double)(*(int*)d);
-                    if (normalize) vals[i][c] /= INT_MAX;
-                } else if (compTypeNum == 5125) {  // unsigned int
-                    vals[i][c] = (double)(*(unsigned int*)d);
-                    if (normalize) vals[i][c] /= UINT_MAX;
-                } else if (compTypeNum == 5126) {  // float
-                    vals[i][c] = (*(float*)d);
-                }
-                d += compSize;
-            }
-        }
-        return vals;
-    };
-
     // convert meshes
     auto meshes = std::vector<std::vector<
         std::pair<std::shared_ptr<shape>, std::shared_ptr<material>>>>();
@@ -2451,42 +3744,22 @@ std::shared_ptr<scene> load_gltf_scene(
                 for (json::iterator gattr_it = gprim.at("attributes").begin();
                      gattr_it != gprim.at("attributes").end(); ++gattr_it) {
                     auto semantic = gattr_it.key();
-                    auto& gacc =
-                        gltf.at("accessors").at(gattr_it.value().get<int>());
-                    auto vals = accessor_values(gacc);
+                    auto acc = get_gltf_accessor(
+                        gltf, buffers, gattr_it.value().get<int>());
                     if (semantic == "POSITION") {
-                        shp->pos.reserve(vals.size());
-                        for (auto i = 0; i < vals.size(); i++)
-                            shp->pos.push_back({(float)vals[i][0],
-                                (float)vals[i][1], (float)vals[i][2]});
+                        read_gltf_accessor(acc, shp->pos);
                     } else if (semantic == "NORMAL") {
-                        shp->norm.reserve(vals.size());
-                        for (auto i = 0; i < vals.size(); i++)
-                            shp->norm.push_back({(float)vals[i][0],
-                                (float)vals[i][1], (float)vals[i][2]});
+                        read_gltf_accessor(acc, shp->norm);
                     } else if (semantic == "TEXCOORD" ||
                                semantic == "TEXCOORD_0") {
-                        shp->texcoord.reserve(vals.size());
-                        for (auto i = 0; i < vals.size(); i++)
-                            shp->texcoord.push_back(
-                                {(float)vals[i][0], (float)vals[i][1]});
+                        read_gltf_accessor(acc, shp->texcoord);
                     } else if (semantic == "COLOR" || semantic == "COLOR_0") {
-                        shp->color.reserve(vals.size());
-                        for (auto i = 0; i < vals.size(); i++)
-                            shp->color.push_back(
-                                {(float)vals[i][0], (float)vals[i][1],
-                                    (float)vals[i][2], (float)vals[i][3]});
+                        read_gltf_accessor(acc, shp->color);
                     } else if (semantic == "TANGENT") {
-                        shp->tangsp.reserve(vals.size());
-                        for (auto i = 0; i < vals.size(); i++)
-                            shp->tangsp.push_back(
-                                {(float)vals[i][0], (float)vals[i][1],
-                                    (float)vals[i][2], (float)vals[i][3]});
+                        read_gltf_accessor(acc, shp->tangsp);
                         for (auto& t : shp->tangsp) t.w = -t.w;
                     } else if (semantic == "RADIUS") {
-                        shp->radius.reserve(vals.size());
-                        for (auto i = 0; i < vals.size(); i++)
-                            shp->radius.push_back((float)vals[i][0]);
+                        read_gltf_accessor(acc, shp->radius);
                     } else {
                         // ignore
                     }
@@ -2533,50 +3806,44 @@ std::shared_ptr<scene> load_gltf_scene(
                         throw std::runtime_error("unknown primitive type");
                     }
                 } else {
-                    auto indices = accessor_values(
-                        gltf.at("accessors").at(gprim.value("indices", -1)),
-                        false);
+                    auto acc = get_gltf_accessor(
+                        gltf, buffers, gprim.value("indices", -1));
+                    auto indices = std::vector<int>();
+                    if (mode != 4 && mode != 1)
+                        read_gltf_accessor(acc, indices);
                     if (mode == 4) {
-                        // triangles
-                        shp->triangles.reserve(indices.size());
-                        for (auto i = 0; i < indices.size() / 3; i++)
-                            shp->triangles.push_back(
-                                {(int)indices[i * 3 + 0][0],
-                                    (int)indices[i * 3 + 1][0],
-                                    (int)indices[i * 3 + 2][0]});
+                        // triangles, read in place
+                        acc.count -= acc.count % 3;
+                        shp->triangles.resize(acc.count / 3);
+                        read_gltf_values<1>(acc, &shp->triangles.data()->x);
                     } else if (mode == 6) {
                         // triangle fan
                         shp->triangles.reserve(indices.size() - 2);
                         for (auto i = 2; i < indices.size(); i++)
-                            shp->triangles.push_back({(int)indices[0][0],
-                                (int)indices[i - 1][0], (int)indices[i][0]});
+                            shp->triangles.push_back(
+                                {indices[0], indices[i - 1], indices[i]});
                     } else if (mode == 5) {
                         // triangle strip
                         shp->triangles.reserve(indices.size() - 2);
                         for (auto i = 2; i < indices.size(); i++)
-                            shp->triangles.push_back({(int)indices[i - 2][0],
-                                (int)indices[i - 1][0], (int)indices[i][0]});
+                            shp->triangles.push_back(
+                                {indices[i - 2], indices[i - 1], indices[i]});
                     } else if (mode == 1) {
-                        // lines
-                        shp->lines.reserve(indices.size() / 2);
-                        for (auto i = 0; i < indices.size() / 2; i++)
-                            shp->lines.push_back({(int)indices[i * 2 + 0][0],
-                                (int)indices[i * 2 + 1][0]});
+                        // lines, read in place
+                        acc.count -= acc.count % 2;
+                        shp->lines.resize(acc.count / 2);
+                        read_gltf_values<1>(acc, &shp->lines.data()->x);
                     } else if (mode == 2) {
                         // line loop
                         shp->lines.reserve(indices.size());
                         for (auto i = 1; i < indices.size(); i++)
-                            shp->lines.push_back(
-                                {(int)indices[i - 1][0], (int)indices[i][0]});
-                        shp->lines.back() = {
-                            (int)indices[indices.size() - 1][0],
-                            (int)indices[0][0]};
+                            shp->lines.push_back({indices[i - 1], indices[i]});
+                        shp->lines.back() = {indices.back(), indices[0]};
                     } else if (mode == 3) {
                         // line strip
                         shp->lines.reserve(indices.size() - 1);
                         for (auto i = 1; i < indices.size(); i++)
-                            shp->lines.push_back(
-                                {(int)indices[i - 1][0], (int)indices[i][0]});
+                            shp->lines.push_back({indices[i - 1], indices[i]});
                     } else if (mode == -1 || mode == 0) {
                         // points
                         std::cout << "points not supported\n";
@@ -2697,42 +3964,25 @@ std::shared_ptr<scene> load_gltf_scene(
                                                       "anim") +
                                 std::to_string(aid++);
                     anm->group = ganm.value("name", ""s);
-                    auto input_view = accessor_values(
-                        gltf.at("accessors").at(gsampler.value("input", -1)));
-                    anm->times.resize(input_view.size());
-                    for (auto i = 0; i < input_view.size(); i++)
-                        anm->times[i] = input_view[i][0];
+                    read_gltf_accessor(get_gltf_accessor(gltf, buffers,
+                                           gsampler.value("input", -1)),
+                        anm->times);
                     auto type = gsampler.value("interpolation", "LINEAR");
                     if (type == "LINEAR") anm->type = animation_type::linear;
                     if (type == "STEP") anm->type = animation_type::step;
                     if (type == "CUBICSPLINE")
                         anm->type = animation_type::bezier;
-                    auto output_view = accessor_values(
-                        gltf.at("accessors").at(gsampler.value("output", -1)));
+                    auto output_acc = get_gltf_accessor(
+                        gltf, buffers, gsampler.value("output", -1));
                     switch (path) {
                         case 0: {  // translation
-                            anm->translation.reserve(output_view.size());
-                            for (auto i = 0; i < output_view.size(); i++)
-                                anm->translation.push_back(
-                                    {(float)output_view[i][0],
-                                        (float)output_view[i][1],
-                                        (float)output_view[i][2]});
+                            read_gltf_accessor(output_acc, anm->translation);
                         } break;
                         case 1: {  // rotation
-                            anm->rotation.reserve(output_view.size());
-                            for (auto i = 0; i < output_view.size(); i++)
-                                anm->rotation.push_back(
-                                    {(float)output_view[i][0],
-                                        (float)output_view[i][1],
-                                        (float)output_view[i][2],
-                                        (float)output_view[i][3]});
+                            read_gltf_accessor(output_acc, anm->rotation);
                         } break;
                         case 2: {  // scale
-                            anm->scale.reserve(output_view.size());
-                            for (auto i = 0; i < output_view.size(); i++)
-                                anm->scale.push_back({(float)output_view[i][0],
-                                    (float)output_view[i][1],
-                                    (float)output_view[i][2]});
+                            read_gltf_accessor(output_acc, anm->scale);
                         } break;
                         case 3: {  // weights
                             std::cout << "weights not supported for now\n";
@@ -2793,18 +4043,24 @@ std::shared_ptr<scene> load_gltf_scene(
     // skip textures if needed
     if (!load_textures) return scn;
 
-    // load images
-    for (auto& txt : scn->textures) {
-        auto filename = normalize_path(dirname + "/" + txt->path);
+    // load images, decoding embedded ones from memory
+    auto error = std::exception_ptr();
+    std::mutex error_mutex;
+    parallel_for((int)embedded.size(), [&](int iid) {
+        if (!embedded[iid].first) return;
+        auto txt = scn->textures[iid];
         try {
-            txt->img = load_image(filename);
-            if (!is_hdr_filename(filename) && txt->gamma != 1)
+            txt->img = load_image_from_memory(
+                embedded[iid].first, (int)embedded[iid].second);
+            if (txt->gamma != 1)
                 txt->img = gamma_to_linear(txt->img, txt->gamma);
         } catch (const std::exception&) {
-            if (skip_missing) continue;
-            throw;
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!skip_missing && !error) error = std::current_exception();
         }
-    }
+    });
+    if (error) std::rethrow_exception(error);
+    load_scene_textures(scn, dirname, skip_missing);
 
     // assign opacity texture if needed
     auto has_opacity = std::unordered_map<std::shared_ptr<texture>, bool>();
@@ -3041,7 +4297,8 @@ void save_gltf_scene(const std::string& filename,
                 throw std::runtime_error("could not open file " + filename);
             fs.write((char*)shp->pos.data(), 3 * 4 * shp->pos.size());
             fs.write((char*)shp->norm.data(), 3 * 4 * shp->norm.size());
-            fs.write((char*)shp->texcoord.data(), 2 * 4 * shp->pos.size());
+            fs.write(
+                (char*)shp->texcoord.data(), 2 * 4 * shp->texcoord.size());
             fs.write((char*)shp->color.data(), 4 * 4 * shp->color.size());
             fs.write((char*)shp->radius.data(), 1 * 4 * shp->radius.size());
             fs.write((char*)shp->lines.data(), 2 * 4 * shp->lines.size());
@@ -3080,156 +4337,197 @@ void save_gltf_scene(const std::string& filename,
 // -----------------------------------------------------------------------------
 namespace ygl {
 
-// convert pbrt to json
-json pbrt_to_json(const std::string& filename) {
-    auto split = [](const std::string& str) {
-        auto ret = std::vector<std::string>();
-        if (str.empty()) return ret;
-        auto lpos = (size_t)0;
-        while (lpos != str.npos) {
-            auto pos = str.find_first_of(" \t\n\r", lpos);
-            if (pos != str.npos) {
-                if (pos > lpos) ret.push_back(str.substr(lpos, pos - lpos));
-                lpos = pos + 1;
-            } else {
-                if (lpos < str.size()) ret.push_back(str.substr(lpos));
-                lpos = pos;
-            }
-        }
-        return ret;
-    };
+// File read by the pbrt tokenizer, with the cursor in its mapped data.
+struct pbrt_file {
+    std::shared_ptr<file_view> view = nullptr;
+    const char* s = nullptr;
+    const char* e = nullptr;
+};
 
-    auto is_cmd = [](const std::vector<std::string>& tokens, int i) -> bool {
-        auto& tok = tokens.at(i);
-        return !(tok[0] == '[' || tok[0] == ']' || tok[0] == '\"' ||
-                 tok[0] == '-' || tok[0] == '+' || tok[0] == '.' ||
-                 std::isdigit(tok[0]));
-    };
-    auto is_number = [](const std::vector<std::string>& tokens, int i) -> bool {
-        auto& tok = tokens.at(i);
-        return tok[0] == '-' || tok[0] == '+' || tok[0] == '.' ||
-               std::isdigit(tok[0]);
-    };
-    auto parse_string = [](const std::vector<std::string>& tokens,
-                            int& i) -> std::string {
-        if (tokens[i][0] != '"') throw std::runtime_error("string expected");
-        auto tok = tokens[i++];
-        tok = tok.substr(1, tok.size() - 2);
-        if (tok.find('|') != tok.npos) tok = tok.substr(tok.find('|') + 1);
-        return tok;
-    };
-    auto parse_param = [&](const std::vector<std::string>& tokens, int& i,
-                           json& js) -> void {
-        auto list = false, first = true;
-        while (i < tokens.size()) {
-            if (is_cmd(tokens, i)) {
-                break;
-            } else if (tokens[i][0] == '[') {
-                list = true;
-                i++;
-            } else if (tokens[i][0] == ']') {
-                list = false;
-                i++;
-                break;
-            } else if (tokens[i][0] == '"') {
-                if (!first && !list) break;
-                js.push_back(tokens[i].substr(1, tokens[i].size() - 2));
-                i++;
-                if (!list) break;
+// Streaming tokenizer for pbrt files. Files are mapped and tokens are read
+// in place, with included files stacked on top of the including ones.
+struct pbrt_tokenizer {
+    std::vector<pbrt_file> files = {};
+};
+
+// Parameter of a pbrt command, with its values as numbers or strings.
+struct pbrt_param {
+    std::string type = "";
+    std::string name = "";
+    std::vector<float> values = {};
+    std::vector<std::string> strings = {};
+};
+
+// Opens a pbrt file, reading it before the rest of the current one.
+void open_pbrt_file(pbrt_tokenizer& tok, const std::string& filename) {
+    auto view = load_file_view(filename);
+    tok.files.push_back({view, view->data, view->data + view->size});
+}
+
+// Skips whitespace and comments, closing the files that are done. Returns
+// the next character, or 0 at the end of the input.
+inline char skip_pbrt_whitespace(pbrt_tokenizer& tok) {
+    while (!tok.files.empty()) {
+        auto& f = tok.files.back();
+        while (f.s < f.e) {
+            if (*f.s == '#') {
+                while (f.s < f.e && *f.s != '\n') f.s++;
+            } else if (std::isspace((unsigned char)*f.s)) {
+                f.s++;
             } else {
-                if (!first && !list) throw std::runtime_error("bad params");
-                js.push_back(atof(tokens[i].c_str()));
-                i++;
-                if (!list) break;
+                return *f.s;
             }
         }
-    };
-    auto parse_param_list = [&](const std::vector<std::string>& tokens, int& i,
-                                json& js) -> void {
-        while (i < tokens.size()) {
-            if (is_cmd(tokens, i)) break;
-            auto name = parse_string(tokens, i);
-            js[name] = json::array();
-            parse_param(tokens, i, js.at(name));
-            if (js.at(name).size() == 1) { js.at(name) = js.at(name).at(0); }
-        }
-    };
-    auto parse_param_numbers = [&](const std::vector<std::string>& tokens,
-                                   int& i, json& js) -> void {
-        js["values"] = json::array();
-        if (tokens[i][0] == '[') i++;
-        while (is_number(tokens, i)) {
-            js.at("values").push_back((float)atof(tokens[i++].c_str()));
+        tok.files.pop_back();
+    }
+    return 0;
+}
+
+// Checks whether a character starts a number.
+inline bool is_pbrt_number(char c) {
+    return c == '-' || c == '+' || c == '.' || std::isdigit((unsigned char)c);
+}
+
+// Reads a command name.
+std::string read_pbrt_command(pbrt_tokenizer& tok) {
+    if (!std::isalpha((unsigned char)skip_pbrt_whitespace(tok)))
+        throw std::runtime_error("command expected");
+    auto& f = tok.files.back();
+    auto start = f.s;
+    while (f.s < f.e && std::isalnum((unsigned char)*f.s)) f.s++;
+    return std::string(start, f.s);
+}
+
+// Reads a quoted string.
+std::string read_pbrt_string(pbrt_tokenizer& tok) {
+    if (skip_pbrt_whitespace(tok) != '"')
+        throw std::runtime_error("string expected");
+    auto& f = tok.files.back();
+    auto start = ++f.s;
+    while (f.s < f.e && *f.s != '"') f.s++;
+    if (f.s == f.e) throw std::runtime_error("unterminated string");
+    return std::string(start, f.s++);
+}
+
+// Reads a number.
+inline float read_pbrt_number(pbrt_tokenizer& tok) {
+    if (!is_pbrt_number(skip_pbrt_whitespace(tok)))
+        throw std::runtime_error("number expected");
+    auto& f = tok.files.back();
+    auto val = 0.0f;
+    if (!obj_parse_value(f.s, f.e, val))
+        throw std::runtime_error("bad number");
+    return val;
+}
+
+// Reads the values of a command or parameter, calling `number(val)` for
+// numbers and `string(str)` for strings. Values are either enclosed in
+// brackets, or a single parameter value, or all numbers following a command.
+template <typename NumberFunc, typename StringFunc>
+void read_pbrt_values(pbrt_tokenizer& tok, bool single,
+    const NumberFunc& number, const StringFunc& string) {
+    auto list = skip_pbrt_whitespace(tok) == '[';
+    if (list) tok.files.back().s++;
+    while (true) {
+        auto c = skip_pbrt_whitespace(tok);
+        if (is_pbrt_number(c)) {
+            number(read_pbrt_number(tok));
+        } else if (c == '"') {
+            string(read_pbrt_string(tok));
+        } else {
+            break;
         }
-        if (tokens[i][0] == ']') i++;
-    };
+        if (!list && single) break;
+    }
+    if (list) {
+        if (skip_pbrt_whitespace(tok) != ']')
+            throw std::runtime_error("] expected");
+        tok.files.back().s++;
+    }
+}
 
-    auto f = fopen(filename.c_str(), "rt");
-    if (!f) throw std::runtime_error("cannot open filename " + filename);
-    auto pbrt = std::string();
-    char buf[4096];
-    while (fgets(buf, 4096, f)) {
-        auto line = std::string(buf);
-        if (line.find('#') == line.npos)
-            pbrt += line + "\n";
-        else
-            pbrt += line.substr(0, line.find('#')) + "\n";
+// Reads the numbers following a command.
+std::vector<float> read_pbrt_numbers(pbrt_tokenizer& tok) {
+    auto vals = std::vector<float>();
+    read_pbrt_values(tok, false, [&vals](float val) { vals.push_back(val); },
+        [](const std::string&) {
+            throw std::runtime_error("number expected");
+        });
+    return vals;
+}
+
+// Reads parameter values directly into an array of `N` components, as done
+// for the large arrays of shapes.
+template <typename T, int N>
+void read_pbrt_array(pbrt_tokenizer& tok, std::vector<vec<T, N>>& vals) {
+    auto elem = vec<T, N>();
+    auto count = 0;
+    read_pbrt_values(tok, true,
+        [&vals, &elem, &count](float val) {
+            (&elem.x)[count++] =
+                (std::is_integral<T>::value) ? (T)std::round(val) : (T)val;
+            if (count == N) {
+                vals.push_back(elem);
+                count = 0;
+            }
+        },
+        [](const std::string&) {
+            throw std::runtime_error("number expected");
+        });
+    if (count) {
+        std::cout << "cannot handle vector<vec" << N << ">\n";
+        vals.clear();
     }
-    fclose(f);
-    auto re = std::regex("\"(\\w+)\\s+(\\w+)\"");
-    pbrt = std::regex_replace(pbrt, re, "\"$1|$2\"");
-    pbrt = std::regex_replace(pbrt, std::regex("\\["), " [ ");
-    pbrt = std::regex_replace(pbrt, std::regex("\\]"), " ] ");
-    auto tokens = split(pbrt);
-    auto js = json::array();
-    auto i = 0;
-    while (i < tokens.size()) {
-        if (!is_cmd(tokens, i)) throw std::runtime_error("command expected");
-        auto& tok = tokens[i++];
-        auto jcmd = json::object();
-        jcmd["cmd"] = tok;
-        if (tok == "Transform" || tok == "LookAt" || tok == "Scale" ||
-            tok == "Rotate" || tok == "Translate" || tok == "ConcatTransform") {
-            parse_param_numbers(tokens, i, jcmd);
-        } else if (tok == "Integrator" || tok == "Sampler" ||
-                   tok == "PixelFilter" || tok == "Film" || tok == "Camera" ||
-                   tok == "Shape" || tok == "AreaLightSource" ||
-                   tok == "LightSource") {
-            jcmd["type"] = parse_string(tokens, i);
-            parse_param_list(tokens, i, jcmd);
-        } else if (tok == "Texture") {
-            jcmd["name"] = parse_string(tokens, i);
-            jcmd["value_type"] = parse_string(tokens, i);
-            jcmd["type"] = parse_string(tokens, i);
-            parse_param_list(tokens, i, jcmd);
-        } else if (tok == "MakeNamedMaterial") {
-            jcmd["name"] = parse_string(tokens, i);
-            parse_param_list(tokens, i, jcmd);
-        } else if (tok == "Material") {
-            jcmd["type"] = parse_string(tokens, i);
-            parse_param_list(tokens, i, jcmd);
-        } else if (tok == "NamedMaterial" || tok == "ObjectBegin" ||
-                   tok == "ObjectInstance") {
-            jcmd["name"] = parse_string(tokens, i);
-        } else if (tok == "WorldBegin" || tok == "AttributeBegin" ||
-                   tok == "TransformBegin" || tok == "WorldEnd" ||
-                   tok == "AttributeEnd" || tok == "TransformEnd" ||
-                   tok == "ObjectEnd" || tok == "ReverseOrientation") {
+}
+
+// Reads the parameter list of a command. Parameters can be read directly
+// by `array(param)`, that returns true if it consumes the values.
+template <typename ArrayFunc>
+void read_pbrt_params(pbrt_tokenizer& tok, std::vector<pbrt_param>& params,
+    const ArrayFunc& array) {
+    while (skip_pbrt_whitespace(tok) == '"') {
+        auto decl = read_pbrt_string(tok);
+        auto param = pbrt_param();
+        auto pos = decl.find_first_of(" \t");
+        if (pos != decl.npos) {
+            param.type = decl.substr(0, pos);
+            param.name = decl.substr(decl.find_first_not_of(" \t", pos));
         } else {
-            throw std::runtime_error("unsupported command " + tok);
+            param.name = decl;
         }
-        js.push_back(jcmd);
+        if (array(param)) continue;
+        read_pbrt_values(tok, true,
+            [&param](float val) { param.values.push_back(val); },
+            [&param](const std::string& str) { param.strings.push_back(str); });
+        params.push_back(param);
     }
-    // auto fstr = std::fstream(filename + ".json");
-    // fstr << js;
-    return js;
+}
+void read_pbrt_params(pbrt_tokenizer& tok, std::vector<pbrt_param>& params) {
+    read_pbrt_params(tok, params, [](const pbrt_param&) { return false; });
+}
+
+// Finds a parameter by name, returning nullptr if missing.
+const pbrt_param* find_pbrt_param(
+    const std::vector<pbrt_param>& params, const std::string& name) {
+    for (auto& param : params)
+        if (param.name == name) return &param;
+    return nullptr;
+}
+
+// Gets a parameter by name, throwing if missing.
+const pbrt_param& get_pbrt_param(
+    const std::vector<pbrt_param>& params, const std::string& name) {
+    auto param = find_pbrt_param(params, name);
+    if (!param) throw std::runtime_error("missing parameter " + name);
+    return *param;
 }
 
 // load pbrt scenes
 std::shared_ptr<scene> load_pbrt_scene(
     const std::string& filename, bool load_textures, bool skip_missing) {
-    auto js = pbrt_to_json(filename);
     auto dirname = get_dirname(filename);
+    auto tok = pbrt_tokenizer();
+    open_pbrt_file(tok, filename);
 
     struct stack_item {
         frame3f frame = identity_frame3f;
@@ -3247,142 +4545,107 @@ std::shared_ptr<scene> load_pbrt_scene(
     auto mat_map = std::map<std::string, std::shared_ptr<material>>();
     auto mid = 0;
 
-    auto get_vec3f = [](const json& js) -> vec3f {
-        if (js.is_number())
-            return {js.get<float>(), js.get<float>(), js.get<float>()};
-        if (js.is_array() && js.size() == 1)
-            return {js.at(0).get<float>(), js.at(0).get<float>(),
-                js.at(0).get<float>()};
-        if (js.is_array() && js.size() == 3)
-            return {js.at(0).get<float>(), js.at(1).get<float>(),
-                js.at(2).get<float>()};
+    auto get_vec3f = [](const std::vector<float>& vals) -> vec3f {
+        if (vals.size() == 1) return {vals[0], vals[0], vals[0]};
+        if (vals.size() == 3) return {vals[0], vals[1], vals[2]};
         std::cout << "cannot handle vec3f\n";
         return zero3f;
     };
 
-    auto get_vec4f = [](const json& js) -> vec4f {
-        if (js.is_number())
-            return {js.get<float>(), js.get<float>(), js.get<float>(),
-                js.get<float>()};
-        if (js.is_array() && js.size() == 4)
-            return {js.at(0).get<float>(), js.at(1).get<float>(),
-                js.at(2).get<float>(), js.at(3).get<float>()};
+    auto get_vec4f = [](const std::vector<float>& vals) -> vec4f {
+        if (vals.size() == 1) return {vals[0], vals[0], vals[0], vals[0]};
+        if (vals.size() == 4) return {vals[0], vals[1], vals[2], vals[3]};
         std::cout << "cannot handle vec4f\n";
         return zero4f;
     };
 
-    auto get_mat4f = [](const json& js) -> mat4f {
-        if (!js.is_array() || js.size() != 16) {
+    auto get_mat4f = [](const std::vector<float>& vals) -> mat4f {
+        if (vals.size() != 16) {
             std::cout << "cannot handle vec4f\n";
             return identity_mat4f;
         }
         auto m = identity_mat4f;
-        for (auto i = 0; i < 16; i++) (&m.x.x)[i] = js.at(i).get<float>();
+        for (auto i = 0; i < 16; i++) (&m.x.x)[i] = vals[i];
         return m;
     };
 
-    auto get_mat3f = [](const json& js) -> mat3f {
-        if (!js.is_array() || js.size() != 9) {
+    auto get_mat3f = [](const std::vector<float>& vals) -> mat3f {
+        if (vals.size() != 9) {
             std::cout << "cannot handle mat3f\n";
             return identity_mat3f;
         }
         auto m = identity_mat3f;
-        for (auto i = 0; i < 9; i++) (&m.x.x)[i] = js.at(i).get<float>();
+        for (auto i = 0; i < 9; i++) (&m.x.x)[i] = vals[i];
         return m;
     };
 
-    auto get_vector_vec3i = [](const json& js) -> std::vector<vec3i> {
-        if (!js.is_array() || js.size() % 3) {
-            std::cout << "cannot handle vector<vec3f>";
-            return {};
-        }
-        auto vals = std::vector<vec3i>(js.size() / 3);
-        for (auto i = 0; i < vals.size(); i++) {
-            vals[i].x = (int)std::round(js.at(i * 3 + 0).get<float>());
-            vals[i].y = (int)std::round(js.at(i * 3 + 1).get<float>());
-            vals[i].z = (int)std::round(js.at(i * 3 + 2).get<float>());
-        }
-        return vals;
-    };
-
-    auto get_vector_vec3f = [](const json& js) -> std::vector<vec3f> {
-        if (!js.is_array() || js.size() % 3) {
-            std::cout << "cannot handle vector<vec3f>\n";
-            return {};
-        }
-        auto vals = std::vector<vec3f>(js.size() / 3);
-        for (auto i = 0; i < vals.size(); i++) {
-            vals[i].x = js.at(i * 3 + 0).get<float>();
-            vals[i].y = js.at(i * 3 + 1).get<float>();
-            vals[i].z = js.at(i * 3 + 2).get<float>();
-        }
-        return vals;
+    auto get_float = [](const std::vector<pbrt_param>& params,
+                         const std::string& name) -> float {
+        return get_pbrt_param(params, name).values.at(0);
     };
 
-    auto get_vector_vec2f = [](const json& js) -> std::vector<vec2f> {
-        if (!js.is_array() || js.size() % 2) {
-            std::cout << "cannot handle vector<vec3f>\n";
-            return {};
-        }
-        auto vals = std::vector<vec2f>(js.size() / 2);
-        for (auto i = 0; i < vals.size(); i++) {
-            vals[i].x = js.at(i * 2 + 0).get<float>();
-            vals[i].y = js.at(i * 2 + 1).get<float>();
-        }
-        return vals;
+    auto get_string = [](const std::vector<pbrt_param>& params,
+                          const std::string& name) -> std::string {
+        return get_pbrt_param(params, name).strings.at(0);
     };
 
     auto get_scaled_texture =
-        [&txt_map, &get_vec3f](
-            const json& js) -> std::pair<vec3f, std::shared_ptr<texture>> {
-        if (js.is_string())
-            return {{1, 1, 1}, txt_map.at(js.get<std::string>())};
-        return {get_vec3f(js), nullptr};
+        [&txt_map, &get_vec3f](const std::vector<pbrt_param>& params,
+            const std::string& name)
+        -> std::pair<vec3f, std::shared_ptr<texture>> {
+        auto& param = get_pbrt_param(params, name);
+        if (!param.strings.empty())
+            return {{1, 1, 1}, txt_map.at(param.strings.at(0))};
+        return {get_vec3f(param.values), nullptr};
     };
 
     auto use_hierarchy = false;
     std::map<std::string, std::vector<std::shared_ptr<instance>>> objects;
-    for (auto& jcmd : js) {
-        auto cmd = jcmd.at("cmd").get<std::string>();
-        if (cmd == "ObjectInstance") {
-            use_hierarchy = true;
-            break;
-        }
-    }
 
     auto lid = 0, sid = 0, cid = 0;
     auto cur_object = ""s;
-    for (auto& jcmd : js) {
-        auto cmd = jcmd.at("cmd").get<std::string>();
-        if (cmd == "Integrator" || cmd == "Sampler" || cmd == "PixelFilter") {
+    while (skip_pbrt_whitespace(tok)) {
+        auto cmd = read_pbrt_command(tok);
+        auto params = std::vector<pbrt_param>();
+        if (cmd == "Include") {
+            open_pbrt_file(
+                tok, normalize_path(dirname + "/" + read_pbrt_string(tok)));
+        } else if (cmd == "Integrator" || cmd == "Sampler" ||
+                   cmd == "PixelFilter") {
+            read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
         } else if (cmd == "Transform") {
-            auto m = get_mat4f(jcmd.at("values"));
+            auto m = get_mat4f(read_pbrt_numbers(tok));
             stack.back().frame = mat_to_frame(m);
         } else if (cmd == "ConcatTransform") {
-            auto m = get_mat4f(jcmd.at("values"));
+            auto m = get_mat4f(read_pbrt_numbers(tok));
             stack.back().frame = stack.back().frame * mat_to_frame(m);
         } else if (cmd == "Scale") {
-            auto v = get_vec3f(jcmd.at("values"));
+            auto v = get_vec3f(read_pbrt_numbers(tok));
             stack.back().frame = stack.back().frame * scaling_frame(v);
         } else if (cmd == "Translate") {
-            auto v = get_vec3f(jcmd.at("values"));
+            auto v = get_vec3f(read_pbrt_numbers(tok));
             stack.back().frame = stack.back().frame * translation_frame(v);
         } else if (cmd == "Rotate") {
-            auto v = get_vec4f(jcmd.at("values"));
+            auto v = get_vec4f(read_pbrt_numbers(tok));
             stack.back().frame =
                 stack.back().frame *
                 rotation_frame(vec3f{v.y, v.z, v.w}, v.x * pi / 180);
         } else if (cmd == "LookAt") {
-            auto m = get_mat3f(jcmd.at("values"));
+            auto m = get_mat3f(read_pbrt_numbers(tok));
             stack.back().frame =
                 stack.back().frame * inverse(lookat_frame(m.x, m.y, m.z, true));
             stack.back().focus = length(m.x - m.y);
         } else if (cmd == "ReverseOrientation") {
             stack.back().reverse = !stack.back().reverse;
         } else if (cmd == "Film") {
-            stack.back().aspect = jcmd.at("xresolution").get<float>() /
-                                  jcmd.at("yresolution").get<float>();
+            read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
+            stack.back().aspect = get_float(params, "xresolution") /
+                                  get_float(params, "yresolution");
         } else if (cmd == "Camera") {
+            auto type = read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
             auto cam = std::make_shared<camera>();
             cam->name = "cam" + std::to_string(cid++);
             cam->frame = inverse(stack.back().frame);
@@ -3390,17 +4653,19 @@ std::shared_ptr<scene> load_pbrt_scene(
             cam->focus = stack.back().focus;
             auto aspect = stack.back().aspect;
             auto fovy = 1.0f;
-            auto type = jcmd.at("type").get<std::string>();
             if (type == "perspective") {
-                fovy = jcmd.at("fov").get<float>() * pi / 180;
+                fovy = get_float(params, "fov") * pi / 180;
             } else {
                 std::cout << type << " camera not supported\n";
             }
             ygl::set_camera_fovy(cam, fovy, aspect);
             scn->cameras.push_back(cam);
         } else if (cmd == "Texture") {
+            auto name = read_pbrt_string(tok);
+            read_pbrt_string(tok);
+            auto type = read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
             auto found = false;
-            auto name = jcmd.at("name").get<std::string>();
             for (auto& txt : scn->textures) {
                 if (txt->name == name) {
                     found = true;
@@ -3410,11 +4675,10 @@ std::shared_ptr<scene> load_pbrt_scene(
             if (!found) {
                 auto txt = std::make_shared<texture>();
                 scn->textures.push_back(txt);
-                txt->name = jcmd.at("name").get<std::string>();
+                txt->name = name;
                 txt_map[txt->name] = txt;
-                auto type = jcmd.at("type").get<std::string>();
                 if (type == "imagemap") {
-                    txt->path = jcmd.at("filename").get<std::string>();
+                    txt->path = get_string(params, "filename");
                     if (ygl::get_extension(txt->path) == "pfm")
                         txt->path = ygl::replace_extension(txt->path, ".hdr");
                 } else {
@@ -3422,9 +4686,10 @@ std::shared_ptr<scene> load_pbrt_scene(
                 }
             }
         } else if (cmd == "MakeNamedMaterial" || cmd == "Material") {
+            auto name = read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
             auto found = false;
             if (cmd == "MakeNamedMaterial") {
-                auto name = jcmd.at("name").get<std::string>();
                 for (auto mat : scn->materials) {
                     if (mat->name == name) {
                         found = true;
@@ -3435,74 +4700,74 @@ std::shared_ptr<scene> load_pbrt_scene(
             if (!found) {
                 auto mat = std::make_shared<material>();
                 scn->materials.push_back(mat);
+                auto type = "uber"s;
                 if (cmd == "Material") {
                     mat->name = "unnamed_mat" + std::to_string(mid++);
                     stack.back().mat = mat;
+                    type = name;
                 } else {
-                    mat->name = jcmd.at("name").get<std::string>();
+                    mat->name = name;
                     mat_map[mat->name] = mat;
+                    if (find_pbrt_param(params, "type"))
+                        type = get_string(params, "type");
                 }
-                auto type = "uber"s;
-                if (jcmd.count("type"))
-                    type = jcmd.at("type").get<std::string>();
                 if (type == "uber") {
-                    if (jcmd.count("Kd"))
+                    if (find_pbrt_param(params, "Kd"))
                         std::tie(mat->kd, mat->kd_txt) =
-                            get_scaled_texture(jcmd.at("Kd"));
-                    if (jcmd.count("Ks"))
+                            get_scaled_texture(params, "Kd");
+                    if (find_pbrt_param(params, "Ks"))
                         std::tie(mat->ks, mat->ks_txt) =
-                            get_scaled_texture(jcmd.at("Ks"));
-                    if (jcmd.count("Kt"))
+                            get_scaled_texture(params, "Ks");
+                    if (find_pbrt_param(params, "Kt"))
                         std::tie(mat->kt, mat->kt_txt) =
-                            get_scaled_texture(jcmd.at("Kt"));
-                    if (jcmd.count("opacity")) {
+                            get_scaled_texture(params, "Kt");
+                    if (find_pbrt_param(params, "opacity")) {
                         auto op = vec3f{0, 0, 0};
                         auto op_txt = std::shared_ptr<texture>();
                         std::tie(op, op_txt) =
-                            get_scaled_texture(jcmd.at("opacity"));
+                            get_scaled_texture(params, "opacity");
                         mat->op = (op.x + op.y + op.z) / 3;
                         mat->op_txt = op_txt;
                     }
                     mat->rs = 0;
                 } else if (type == "matte") {
                     mat->kd = {1, 1, 1};
-                    if (jcmd.count("Kd"))
+                    if (find_pbrt_param(params, "Kd"))
                         std::tie(mat->kd, mat->kd_txt) =
-                            get_scaled_texture(jcmd.at("Kd"));
+                            get_scaled_texture(params, "Kd");
                     mat->rs = 1;
                 } else if (type == "mirror") {
                     mat->kd = {0, 0, 0};
                     mat->ks = {1, 1, 1};
                     mat->rs = 0;
                 } else if (type == "metal") {
-                    auto eta = get_vec3f(jcmd.at("eta"));
-                    auto k = get_vec3f(jcmd.at("k"));
+                    auto eta = get_vec3f(get_pbrt_param(params, "eta").values);
+                    auto k = get_vec3f(get_pbrt_param(params, "k").values);
                     mat->ks = fresnel_metal(1, eta, k);
                     mat->rs = 0;
                 } else if (type == "substrate") {
-                    if (jcmd.count("Kd"))
+                    if (find_pbrt_param(params, "Kd"))
                         std::tie(mat->kd, mat->kd_txt) =
-                            get_scaled_texture(jcmd.at("Kd"));
+                            get_scaled_texture(params, "Kd");
                     mat->ks = {0.04, 0.04, 0.04};
-                    if (jcmd.count("Ks"))
+                    if (find_pbrt_param(params, "Ks"))
                         std::tie(mat->ks, mat->ks_txt) =
-                            get_scaled_texture(jcmd.at("Ks"));
+                            get_scaled_texture(params, "Ks");
                     mat->rs = 0;
                 } else if (type == "glass") {
                     mat->ks = {0.04, 0.04, 0.04};
                     mat->kt = {1, 1, 1};
-                    if (jcmd.count("Ks"))
+                    if (find_pbrt_param(params, "Ks"))
                         std::tie(mat->ks, mat->ks_txt) =
-                            get_scaled_texture(jcmd.at("Ks"));
-                    if (jcmd.count("Kt"))
+                            get_scaled_texture(params, "Ks");
+                    if (find_pbrt_param(params, "Kt"))
                         std::tie(mat->kt, mat->kt_txt) =
-                            get_scaled_texture(jcmd.at("Kt"));
+                            get_scaled_texture(params, "Kt");
                     mat->rs = 0;
                 } else if (type == "mix") {
                     std::cout << "mix material not properly supported\n";
-                    if (jcmd.count("namedmaterial1")) {
-                        auto mat1 =
-                            jcmd.at("namedmaterial1").get<std::string>();
+                    if (find_pbrt_param(params, "namedmaterial1")) {
+                        auto mat1 = get_string(params, "namedmaterial1");
                         auto saved_name = mat->name;
                         *mat = *mat_map.at(mat1);
                         mat->name = saved_name;
@@ -3513,19 +4778,15 @@ std::shared_ptr<scene> load_pbrt_scene(
                     mat->kd = {1, 0, 0};
                     std::cout << type << " material not supported\n";
                 }
-                if (jcmd.count("uroughness")) {
-                    auto remap = js.count("remaproughness") &&
-                                 js.at("remaproughness").get<bool>();
-                    if (jcmd.count("uroughness"))
-                        mat->rs = jcmd.at("uroughness").get<float>();
+                auto remap = find_pbrt_param(params, "remaproughness") &&
+                             get_string(params, "remaproughness") == "true";
+                if (find_pbrt_param(params, "uroughness")) {
+                    mat->rs = get_float(params, "uroughness");
                     // if (!remap) mat->rs = mat->rs * mat->rs;
                     if (remap) std::cout << "remap roughness not supported\n";
                 }
-                if (jcmd.count("roughness")) {
-                    auto remap = js.count("remaproughness") &&
-                                 js.at("remaproughness").get<bool>();
-                    if (jcmd.count("roughness"))
-                        mat->rs = jcmd.at("roughness").get<float>();
+                if (find_pbrt_param(params, "roughness")) {
+                    mat->rs = get_float(params, "roughness");
                     // if (!remap) mat->rs = mat->rs * mat->rs;
                     if (remap) std::cout << "remap roughness not supported\n";
                 }
@@ -3535,7 +4796,7 @@ std::shared_ptr<scene> load_pbrt_scene(
                 }
             }
         } else if (cmd == "NamedMaterial") {
-            stack.back().mat = mat_map.at(jcmd.at("name").get<std::string>());
+            stack.back().mat = mat_map.at(read_pbrt_string(tok));
             if (stack.back().light_mat) {
                 auto mat = std::make_shared<material>(*stack.back().mat);
                 mat->name += "_" + std::to_string(lid++);
@@ -3546,9 +4807,25 @@ std::shared_ptr<scene> load_pbrt_scene(
             }
         } else if (cmd == "Shape") {
             auto shp = std::make_shared<shape>();
-            auto type = jcmd.at("type").get<std::string>();
+            auto type = read_pbrt_string(tok);
+            // mesh arrays are parsed directly into the shape
+            read_pbrt_params(tok, params, [&](const pbrt_param& param) {
+                if (type != "trianglemesh") return false;
+                if (param.name == "indices") {
+                    read_pbrt_array(tok, shp->triangles);
+                } else if (param.name == "P") {
+                    read_pbrt_array(tok, shp->pos);
+                } else if (param.name == "N") {
+                    read_pbrt_array(tok, shp->norm);
+                } else if (param.name == "uv") {
+                    read_pbrt_array(tok, shp->texcoord);
+                } else {
+                    return false;
+                }
+                return true;
+            });
             if (type == "plymesh") {
-                auto filename = jcmd.at("filename").get<std::string>();
+                auto filename = get_string(params, "filename");
                 shp->name = get_filename(filename);
                 shp->path = filename;
                 load_ply_mesh(dirname + "/" + filename, shp->points, shp->lines,
@@ -3557,18 +4834,12 @@ std::shared_ptr<scene> load_pbrt_scene(
             } else if (type == "trianglemesh") {
                 shp->name = "mesh" + std::to_string(sid++);
                 shp->path = "models/" + shp->name + ".ply";
-                if (jcmd.count("indices"))
-                    shp->triangles = get_vector_vec3i(jcmd.at("indices"));
-                if (jcmd.count("P")) shp->pos = get_vector_vec3f(jcmd.at("P"));
-                if (jcmd.count("N")) shp->norm = get_vector_vec3f(jcmd.at("N"));
-                if (jcmd.count("uv"))
-                    shp->texcoord = get_vector_vec2f(jcmd.at("uv"));
             } else if (type == "sphere") {
                 shp->name = "sphere" + std::to_string(sid++);
                 shp->path = "models/" + shp->name + ".ply";
                 auto radius = 1.0f;
-                if (jcmd.count("radius"))
-                    radius = jcmd.at("radius").get<float>();
+                if (find_pbrt_param(params, "radius"))
+                    radius = get_float(params, "radius");
                 auto sshp = make_sphere({64, 32}, 2 * radius, {1, 1}, true);
                 shp->pos = sshp.pos;
                 shp->norm = sshp.norm;
@@ -3578,8 +4849,8 @@ std::shared_ptr<scene> load_pbrt_scene(
                 shp->name = "disk" + std::to_string(sid++);
                 shp->path = "models/" + shp->name + ".ply";
                 auto radius = 1.0f;
-                if (jcmd.count("radius"))
-                    radius = jcmd.at("radius").get<float>();
+                if (find_pbrt_param(params, "radius"))
+                    radius = get_float(params, "radius");
                 auto sshp = make_disk({32, 16}, 2 * radius, {1, 1}, true);
                 shp->pos = sshp.pos;
                 shp->norm = sshp.norm;
@@ -3608,8 +4879,9 @@ std::shared_ptr<scene> load_pbrt_scene(
                 scn->instances.push_back(ist);
             }
         } else if (cmd == "ObjectInstance") {
+            use_hierarchy = true;
             static auto instances = std::map<std::string, int>();
-            auto name = jcmd.at("name").get<std::string>();
+            auto name = read_pbrt_string(tok);
             auto& object = objects.at(name);
             for (auto shp : object) {
                 instances[shp->name] += 1;
@@ -3621,16 +4893,18 @@ std::shared_ptr<scene> load_pbrt_scene(
                 scn->instances.push_back(ist);
             }
         } else if (cmd == "AreaLightSource") {
-            auto type = jcmd.at("type").get<std::string>();
+            auto type = read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
             if (type == "diffuse") {
                 auto lmat = std::make_shared<material>();
-                lmat->ke = get_vec3f(jcmd.at("L"));
+                lmat->ke = get_vec3f(get_pbrt_param(params, "L").values);
                 stack.back().light_mat = lmat;
             } else {
                 std::cout << type << " area light not supported\n";
             }
         } else if (cmd == "LightSource") {
-            auto type = jcmd.at("type").get<std::string>();
+            auto type = read_pbrt_string(tok);
+            read_pbrt_params(tok, params);
             if (type == "infinite") {
                 auto env = std::make_shared<environment>();
                 env->name = "env" + std::to_string(lid++);
@@ -3639,10 +4913,12 @@ std::shared_ptr<scene> load_pbrt_scene(
                 env->frame = stack.back().frame * frame3f{{0, 0, 1}, {0, 1, 0},
                                                       {1, 0, 0}, {0, 0, 0}};
                 env->ke = {1, 1, 1};
-                if (jcmd.count("scale")) env->ke *= get_vec3f(jcmd.at("scale"));
-                if (jcmd.count("mapname")) {
+                if (find_pbrt_param(params, "scale"))
+                    env->ke *=
+                        get_vec3f(get_pbrt_param(params, "scale").values);
+                if (find_pbrt_param(params, "mapname")) {
                     auto txt = std::make_shared<texture>();
-                    txt->path = jcmd.at("mapname").get<std::string>();
+                    txt->path = get_string(params, "mapname");
                     txt->name = env->name;
                     scn->textures.push_back(txt);
                     env->ke_txt = txt;
@@ -3653,8 +4929,10 @@ std::shared_ptr<scene> load_pbrt_scene(
                 auto shp = std::make_shared<shape>();
                 shp->name = "distant" + std::to_string(lid++);
                 auto from = vec3f{0, 0, 0}, to = vec3f{0, 0, 0};
-                if (jcmd.count("from")) from = get_vec3f(jcmd.at("from"));
-                if (jcmd.count("to")) to = get_vec3f(jcmd.at("to"));
+                if (find_pbrt_param(params, "from"))
+                    from = get_vec3f(get_pbrt_param(params, "from").values);
+                if (find_pbrt_param(params, "to"))
+                    to = get_vec3f(get_pbrt_param(params, "to").values);
                 auto dir = normalize(from - to);
                 auto size = distant_dist * sin(5 * pi / 180);
                 auto sshp = make_quad({1, 1}, {size, size}, {1, 1}, true);
@@ -3666,8 +4944,11 @@ std::shared_ptr<scene> load_pbrt_scene(
                 auto mat = std::make_shared<material>();
                 mat->name = shp->name;
                 mat->ke = {1, 1, 1};
-                if (jcmd.count("L")) mat->ke *= get_vec3f(jcmd.at("L"));
-                if (jcmd.count("scale")) mat->ke *= get_vec3f(jcmd.at("scale"));
+                if (find_pbrt_param(params, "L"))
+                    mat->ke *= get_vec3f(get_pbrt_param(params, "L").values);
+                if (find_pbrt_param(params, "scale"))
+                    mat->ke *=
+                        get_vec3f(get_pbrt_param(params, "scale").values);
                 mat->ke *= (distant_dist * distant_dist) / (size * size);
                 scn->materials.push_back(mat);
                 auto ist = std::make_shared<instance>();
@@ -3687,7 +4968,7 @@ std::shared_ptr<scene> load_pbrt_scene(
         } else if (cmd == "AttributeBegin") {
             stack.push_back(stack.back());
         } else if (cmd == "ObjectBegin") {
-            auto name = jcmd.at("name").get<std::string>();
+            auto name = read_pbrt_string(tok);
             cur_object = name;
             objects[name] = {};
         } else if (cmd == "ObjectEnd") {
@@ -3698,7 +4979,7 @@ std::shared_ptr<scene> load_pbrt_scene(
                    cmd == "TransformEnd") {
             stack.pop_back();
         } else {
-            std::cout << cmd << " command not supported\n";
+            throw std::runtime_error("unsupported command " + cmd);
         }
     }
     if (use_hierarchy) {
@@ -3726,18 +5007,7 @@ std::shared_ptr<scene> load_pbrt_scene(
     if (!load_textures) return scn;
 
     // load images
-    for (auto& txt : scn->textures) {
-        if (txt->path == "" || !txt->img.pxl.empty()) continue;
-        auto filename = normalize_path(dirname + "/" + txt->path);
-        try {
-            txt->img = load_image(filename);
-            if (!is_hdr_filename(filename) && txt->gamma != 1)
-                txt->img = gamma_to_linear(txt->img, txt->gamma);
-        } catch (const std::exception&) {
-            if (skip_missing) continue;
-            throw;
-        }
-    }
+    load_scene_textures(scn, dirname, skip_missing);
 
     return scn;
 }
@@ -3798,198 +5068,340 @@ void save_mesh(const std::string& filename, const std::vector<int>& points,
 
 #if 1
 
-// Load ply mesh
-void load_ply_mesh(const std::string& filename, std::vector<int>& points,
-    std::vector<vec2i>& lines, std::vector<vec3i>& triangles,
-    std::vector<vec3f>& pos, std::vector<vec3f>& norm,
-    std::vector<vec2f>& texcoord, std::vector<vec4f>& color,
-    std::vector<float>& radius) {
-    // clear data
-    pos.clear();
-    norm.clear();
-    texcoord.clear();
-    color.clear();
-    radius.clear();
-    points.clear();
-    lines.clear();
-    triangles.clear();
+// PLY scalar types
+enum struct ply_type { i8, u8, i16, u16, i32, u32, f32, f64 };
 
-    // ply header parsed
-    enum property_type { uchar_type, int_type, float_type, int_list_type };
-    struct property {
-        std::string name = "";
-        property_type type = float_type;
-        std::vector<float> scalars;
-        std::vector<std::array<int, 8>> lists;
-    };
-    struct element {
-        std::string name = "";
-        int count = 0;
-        std::vector<property> props;
-    };
+// PLY property, either a scalar or a list of scalars
+struct ply_property {
+    std::string name = "";               // property name
+    ply_type type = ply_type::f32;       // scalar or list element type
+    bool list = false;                   // whether this is a list
+    ply_type count_type = ply_type::u8;  // list count type
+};
 
-    auto fs = std::ifstream(filename);
-    if (!fs) throw std::runtime_error("could not open file " + filename);
+// PLY element
+struct ply_element {
+    std::string name = "";            // element name
+    int count = 0;                    // number of elements
+    std::vector<ply_property> props;  // properties
+};
+
+// Parses a PLY type name.
+inline ply_type get_ply_type(const std::string& name) {
+    if (name == "char" || name == "int8") return ply_type::i8;
+    if (name == "uchar" || name == "uint8") return ply_type::u8;
+    if (name == "short" || name == "int16") return ply_type::i16;
+    if (name == "ushort" || name == "uint16") return ply_type::u16;
+    if (name == "int" || name == "int32") return ply_type::i32;
+    if (name == "uint" || name == "uint32") return ply_type::u32;
+    if (name == "float" || name == "float32") return ply_type::f32;
+    if (name == "double" || name == "float64") return ply_type::f64;
+    throw std::runtime_error("unsupported ply type " + name);
+}
+
+// Size in bytes of a PLY type.
+inline int get_ply_type_size(ply_type type) {
+    static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[(int)type];
+}
+
+// Reads a binary PLY scalar, swapping bytes if needed, and advances `s`.
+template <typename T>
+inline T read_ply_binary(const char*& s, bool swap) {
+    auto val = T();
+    if (swap) {
+        auto dst = (char*)&val;
+        for (auto i = 0; i < (int)sizeof(T); i++)
+            dst[i] = s[sizeof(T) - 1 - i];
+    } else {
+        memcpy(&val, s, sizeof(T));
+    }
+    s += sizeof(T);
+    return val;
+}
+inline double read_ply_binary(const char*& s, ply_type type, bool swap) {
+    switch (type) {
+        case ply_type::i8: return read_ply_binary<int8_t>(s, swap);
+        case ply_type::u8: return read_ply_binary<uint8_t>(s, swap);
+        case ply_type::i16: return read_ply_binary<int16_t>(s, swap);
+        case ply_type::u16: return read_ply_binary<uint16_t>(s, swap);
+        case ply_type::i32: return read_ply_binary<int32_t>(s, swap);
+        case ply_type::u32: return read_ply_binary<uint32_t>(s, swap);
+        case ply_type::f32: return read_ply_binary<float>(s, swap);
+        case ply_type::f64: return read_ply_binary<double>(s, swap);
+    }
+    return 0;
+}
+
+// Reads an ascii PLY scalar with the OBJ token parsers.
+inline double read_ply_ascii(const char*& s, const char* e, ply_type type) {
+    if (type == ply_type::f32 || type == ply_type::f64) {
+        auto val = 0.0f;
+        if (!obj_parse_value(s, e, val))
+            throw std::runtime_error("error reading ply");
+        return val;
+    } else {
+        auto val = 0;
+        if (!obj_parse_value(s, e, val))
+            throw std::runtime_error("error reading ply");
+        return val;
+    }
+}
+
+// Parse ply mesh into empty arrays
+static void parse_ply_mesh(const std::string& filename,
+    std::vector<int>& points, std::vector<vec2i>& lines,
+    std::vector<vec3i>& triangles, std::vector<vec3f>& pos,
+    std::vector<vec3f>& norm, std::vector<vec2f>& texcoord,
+    std::vector<vec4f>& color, std::vector<float>& radius) {
+    // open file
+    auto view = load_file_view(filename);
+    auto s = view->data, e = view->data + view->size;
 
     // parse header
-    auto ascii = false;
-    auto elems = std::vector<element>();
-    std::string line;
-    while (std::getline(fs, line)) {
-        auto ss = std::stringstream(line);
+    auto ascii = false, swap = false;
+    auto elems = std::vector<ply_element>();
+    auto header_done = false;
+    while (s < e && !header_done) {
+        auto ls = s;
+        auto nl = (const char*)memchr(s, '\n', e - s);
+        auto le = nl ? nl : e;
+        s = nl ? nl + 1 : e;
         auto cmd = ""s;
-        ss >> cmd;
-        if (cmd == "") continue;
+        if (!obj_parse_value(ls, le, cmd)) continue;
         if (cmd == "ply") {
-        } else if (cmd == "comment") {
+        } else if (cmd == "comment" || cmd == "obj_info") {
         } else if (cmd == "format") {
             auto fmt = ""s;
-            ss >> fmt;
-            if (fmt != "ascii" && fmt != "binary_little_endian")
+            obj_parse_value(ls, le, fmt);
+            if (fmt != "ascii" && fmt != "binary_little_endian" &&
+                fmt != "binary_big_endian")
                 throw std::runtime_error("format not supported");
             ascii = fmt == "ascii";
+            swap = fmt == "binary_big_endian";
         } else if (cmd == "element") {
-            auto elem = element();
-            ss >> elem.name;
-            ss >> elem.count;
+            auto elem = ply_element();
+            obj_parse_value(ls, le, elem.name);
+            obj_parse_value(ls, le, elem.count);
             elems.push_back(elem);
         } else if (cmd == "property") {
-            auto prop = property();
+            if (elems.empty()) throw std::runtime_error("bad ply header");
+            auto prop = ply_property();
             auto type = ""s;
-            ss >> type;
+            obj_parse_value(ls, le, type);
             if (type == "list") {
                 auto count_type = ""s, elem_type = ""s;
-                ss >> count_type;
-                ss >> elem_type;
-                if (count_type != "uchar" && count_type != "uint8")
-                    throw std::runtime_error("unsupported ply list type");
-                if (elem_type != "int")
+                obj_parse_value(ls, le, count_type);
+                obj_parse_value(ls, le, elem_type);
+                prop.list = true;
+                prop.count_type = get_ply_type(count_type);
+                prop.type = get_ply_type(elem_type);
+                if (prop.count_type == ply_type::f32 ||
+                    prop.count_type == ply_type::f64 ||
+                    prop.type == ply_type::f32 || prop.type == ply_type::f64)
                     throw std::runtime_error("unsupported ply list type");
-                prop.type = int_list_type;
-            } else if (type == "float") {
-                prop.type = float_type;
-            } else if (type == "uchar" || type == "uint8") {
-                prop.type = uchar_type;
-            } else if (type == "int") {
-                prop.type = int_type;
             } else {
-                throw std::runtime_error("unsupported ply type");
+                prop.type = get_ply_type(type);
             }
-            ss >> prop.name;
-            prop.scalars.resize(elems.back().count);
-            if (prop.type == int_list_type)
-                prop.lists.resize(elems.back().count);
+            obj_parse_value(ls, le, prop.name);
             elems.back().props.push_back(prop);
         } else if (cmd == "end_header") {
-            break;
+            header_done = true;
         } else {
             throw std::runtime_error("command not supported " + cmd);
         }
     }
+    if (!header_done) throw std::runtime_error("error reading ply");
+    auto nverts = 0;
+    for (auto& elem : elems)
+        if (elem.name == "vertex") nverts = elem.count;
+
+    // vertex property destinations as float arrays with stride and offset
+    struct ply_dest {
+        float* data = nullptr;
+        int stride = 0;
+        int offset = 0;
+        float scale = 1;
+    };
+    auto get_dest = [&](const ply_element& elem, const ply_property& prop) {
+        auto dest = ply_dest();
+        if (elem.name != "vertex" || prop.list) return dest;
+        auto count = elem.count;
+        auto set_dest = [&dest, count](auto& vert, const auto& def,
+                            int stride, int offset) {
+            if (vert.size() != count) vert.resize(count, def);
+            dest = {(float*)vert.data(), stride, offset, 1};
+        };
+        if (prop.name == "x") set_dest(pos, zero3f, 3, 0);
+        if (prop.name == "y") set_dest(pos, zero3f, 3, 1);
+        if (prop.name == "z") set_dest(pos, zero3f, 3, 2);
+        if (prop.name == "nx") set_dest(norm, zero3f, 3, 0);
+        if (prop.name == "ny") set_dest(norm, zero3f, 3, 1);
+        if (prop.name == "nz") set_dest(norm, zero3f, 3, 2);
+        if (prop.name == "u") set_dest(texcoord, zero2f, 2, 0);
+        if (prop.name == "v") set_dest(texcoord, zero2f, 2, 1);
+        if (prop.name == "red") set_dest(color, vec4f{0, 0, 0, 1}, 4, 0);
+        if (prop.name == "green") set_dest(color, vec4f{0, 0, 0, 1}, 4, 1);
+        if (prop.name == "blue") set_dest(color, vec4f{0, 0, 0, 1}, 4, 2);
+        if (prop.name == "alpha") set_dest(color, vec4f{0, 0, 0, 1}, 4, 3);
+        if (prop.name == "radius") set_dest(radius, 0.0f, 1, 0);
+        if (prop.type == ply_type::u8) dest.scale = 1 / 255.0f;
+        return dest;
+    };
+
+    // adds a list as polygon or polyline
+    auto add_list = [&](const ply_element& elem, const ply_property& prop,
+                        const std::vector<int>& list) {
+        if (prop.name != "vertex_indices" && prop.name != "vertex_index")
+            return;
+        for (auto vid : list)
+            if (vid < 0 || vid >= nverts)
+                throw std::runtime_error("bad ply vertex index");
+        if (elem.name == "face") {
+            for (auto i = 2; i < (int)list.size(); i++)
+                triangles.push_back({list[0], list[i - 1], list[i]});
+        } else if (elem.name == "line") {
+            for (auto i = 1; i < (int)list.size(); i++)
+                lines.push_back({list[i - 1], list[i]});
+        }
+    };
 
     // parse content
+    auto list = std::vector<int>();
     for (auto& elem : elems) {
-        for (auto vid = 0; vid < elem.count; vid++) {
-            auto ss = std::stringstream();
-            if (ascii) {
-                if (!std::getline(fs, line))
-                    throw std::runtime_error("error reading ply");
-                ss = std::stringstream(line);
+        auto dests = std::vector<ply_dest>();
+        for (auto& prop : elem.props) dests.push_back(get_dest(elem, prop));
+        auto has_lists = false;
+        auto stride = 0;
+        for (auto& prop : elem.props) {
+            has_lists = has_lists || prop.list;
+            stride += get_ply_type_size(prop.type);
+        }
+        if (ascii) {
+            for (auto idx = 0; idx < elem.count; idx++) {
+                if (s >= e) throw std::runtime_error("error reading ply");
+                auto ls = s;
+                auto nl = (const char*)memchr(s, '\n', e - s);
+                auto le = nl ? nl : e;
+                s = nl ? nl + 1 : e;
+                for (auto pid = 0; pid < elem.props.size(); pid++) {
+                    auto& prop = elem.props[pid];
+                    auto& dest = dests[pid];
+                    if (prop.list) {
+                        auto num = (int)read_ply_ascii(ls, le, prop.count_type);
+                        list.resize(num);
+                        for (auto i = 0; i < num; i++)
+                            list[i] = (int)read_ply_ascii(ls, le, prop.type);
+                        add_list(elem, prop, list);
+                    } else {
+                        auto val = read_ply_ascii(ls, le, prop.type);
+                        if (dest.data)
+                            dest.data[idx * dest.stride + dest.offset] =
+                                (float)val * dest.scale;
+                    }
+                }
             }
+        } else if (!has_lists) {
+            // fixed size elements are copied property by property with
+            // strided copies, or with a single copy if the layouts match
+            if ((size_t)(e - s) < (size_t)elem.count * stride)
+                throw std::runtime_error("error reading ply");
+            auto prop_offset = 0;
             for (auto pid = 0; pid < elem.props.size(); pid++) {
                 auto& prop = elem.props[pid];
-                if (prop.type == float_type) {
-                    auto v = 0.0f;
-                    if (ascii)
-                        ss >> v;
-                    else
-                        fs.read((char*)&v, 4);
-                    prop.scalars[vid] = v;
-                } else if (prop.type == int_type) {
-                    auto v = 0;
-                    if (ascii)
-                        ss >> v;
-                    else
-                        fs.read((char*)&v, 4);
-                    prop.scalars[vid] = v;
-                } else if (prop.type == uchar_type) {
-                    auto vc = (unsigned char)0;
-                    if (ascii) {
-                        auto v = 0;
-                        ss >> v;
-                        vc = (unsigned char)v;
-                    } else
-                        fs.read((char*)&vc, 1);
-                    prop.scalars[vid] = vc / 255.0f;
-                } else if (prop.type == int_list_type) {
-                    auto vc = (unsigned char)0;
-                    if (ascii) {
-                        auto v = 0;
-                        ss >> v;
-                        vc = (unsigned char)v;
-                    } else
-                        fs.read((char*)&vc, 1);
-                    prop.scalars[vid] = vc;
-                    for (auto i = 0; i < (int)prop.scalars[vid]; i++)
-                        if (ascii)
-                            ss >> prop.lists[vid][i];
-                        else
-                            fs.read((char*)&prop.lists[vid][i], 4);
+                auto& dest = dests[pid];
+                auto src = s + prop_offset;
+                prop_offset += get_ply_type_size(prop.type);
+                if (!dest.data) continue;
+                if (prop.type == ply_type::f32 && !swap) {
+                    // copy runs of consecutive float components at once
+                    auto ncomp = 1;
+                    while (pid + ncomp < elem.props.size() &&
+                           elem.props[pid + ncomp].type == ply_type::f32 &&
+                           dests[pid + ncomp].data == dest.data &&
+                           dests[pid + ncomp].offset == dest.offset + ncomp)
+                        ncomp++;
+                    auto dst = dest.data + dest.offset;
+                    if (ncomp * 4 == stride && ncomp == dest.stride) {
+                        memcpy(dst, src, (size_t)elem.count * stride);
+                    } else {
+                        for (auto idx = 0; idx < elem.count; idx++)
+                            memcpy(dst + (size_t)idx * dest.stride,
+                                src + (size_t)idx * stride, ncomp * 4);
+                    }
+                    prop_offset += (ncomp - 1) * 4;
+                    pid += ncomp - 1;
                 } else {
-                    throw std::runtime_error("unsupported ply type");
+                    for (auto idx = 0; idx < elem.count; idx++) {
+                        auto vs = src + (size_t)idx * stride;
+                        dest.data[(size_t)idx * dest.stride + dest.offset] =
+                            (float)read_ply_binary(vs, prop.type, swap) *
+                            dest.scale;
+                    }
                 }
             }
-        }
-    }
-
-    // copy vertex data
-    for (auto& elem : elems) {
-        if (elem.name != "vertex") continue;
-        auto count = elem.count;
-        for (auto& prop : elem.props) {
-            auto vals = prop.scalars.data();
-            auto copy_floats = [vals, count](auto& vert, const auto& def,
-                                   int stride, int offset) {
-                if (vert.size() != count) vert.resize(count, def);
-                auto dst = (float*)vert.data();
-                for (auto i = 0; i < count; i++)
-                    dst[i * stride + offset] = vals[i];
-            };
-            if (prop.name == "x") copy_floats(pos, zero3f, 3, 0);
-            if (prop.name == "y") copy_floats(pos, zero3f, 3, 1);
-            if (prop.name == "z") copy_floats(pos, zero3f, 3, 2);
-            if (prop.name == "nx") copy_floats(norm, zero3f, 3, 0);
-            if (prop.name == "ny") copy_floats(norm, zero3f, 3, 1);
-            if (prop.name == "nz") copy_floats(norm, zero3f, 3, 2);
-            if (prop.name == "u") copy_floats(texcoord, zero2f, 2, 0);
-            if (prop.name == "v") copy_floats(texcoord, zero2f, 2, 1);
-            if (prop.name == "red") copy_floats(color, vec4f{0, 0, 0, 1}, 4, 0);
-            if (prop.name == "green")
-                copy_floats(color, vec4f{0, 0, 0, 1}, 4, 1);
-            if (prop.name == "blue")
-                copy_floats(color, vec4f{0, 0, 0, 1}, 4, 2);
-            if (prop.name == "alpha")
-                copy_floats(color, vec4f{0, 0, 0, 1}, 4, 3);
-            if (prop.name == "radius") copy_floats(radius, 0.0f, 1, 0);
-        }
-    }
-
-    // copy triangle data
-    for (auto& elem : elems) {
-        if (elem.name != "face") continue;
-        auto count = elem.count;
-        for (auto& prop : elem.props) {
-            if (prop.name == "vertex_indices") {
-                for (auto fid = 0; fid < count; fid++) {
-                    auto& list = prop.lists[fid];
-                    for (auto i = 2; i < (int)prop.scalars[fid]; i++)
-                        triangles.push_back({list[0], list[i - 1], list[i]});
+            s += (size_t)elem.count * stride;
+        } else {
+            for (auto idx = 0; idx < elem.count; idx++) {
+                for (auto pid = 0; pid < elem.props.size(); pid++) {
+                    auto& prop = elem.props[pid];
+                    auto& dest = dests[pid];
+                    auto size = get_ply_type_size(
+                        prop.list ? prop.count_type : prop.type);
+                    if (e - s < size)
+                        throw std::runtime_error("error reading ply");
+                    if (!prop.list) {
+                        auto val = read_ply_binary(s, prop.type, swap);
+                        if (dest.data)
+                            dest.data[(size_t)idx * dest.stride + dest.offset] =
+                                (float)val * dest.scale;
+                        continue;
+                    }
+                    auto num = (int)read_ply_binary(s, prop.count_type, swap);
+                    auto elem_size = get_ply_type_size(prop.type);
+                    if ((size_t)(e - s) < (size_t)num * elem_size)
+                        throw std::runtime_error("error reading ply");
+                    list.resize(num);
+                    if (!swap && (prop.type == ply_type::i32 ||
+                                     prop.type == ply_type::u32)) {
+                        memcpy(list.data(), s, (size_t)num * 4);
+                        s += (size_t)num * 4;
+                    } else {
+                        for (auto i = 0; i < num; i++)
+                            list[i] = (int)read_ply_binary(s, prop.type, swap);
+                    }
+                    add_list(elem, prop, list);
                 }
             }
         }
     }
+}
 
-    fs.close();
+// Load ply mesh. Data is parsed into local arrays and swapped in only on
+// success, so that errors leave no partial mesh.
+void load_ply_mesh(const std::string& filename, std::vector<int>& points,
+    std::vector<vec2i>& lines, std::vector<vec3i>& triangles,
+    std::vector<vec3f>& pos, std::vector<vec3f>& norm,
+    std::vector<vec2f>& texcoord, std::vector<vec4f>& color,
+    std::vector<float>& radius) {
+    auto ply_points = std::vector<int>();
+    auto ply_lines = std::vector<vec2i>();
+    auto ply_triangles = std::vector<vec3i>();
+    auto ply_pos = std::vector<vec3f>();
+    auto ply_norm = std::vector<vec3f>();
+    auto ply_texcoord = std::vector<vec2f>();
+    auto ply_color = std::vector<vec4f>();
+    auto ply_radius = std::vector<float>();
+    parse_ply_mesh(filename, ply_points, ply_lines, ply_triangles, ply_pos,
+        ply_norm, ply_texcoord, ply_color, ply_radius);
+    std::swap(points, ply_points);
+    std::swap(lines, ply_lines);
+    std::swap(triangles, ply_triangles);
+    std::swap(pos, ply_pos);
+    std::swap(norm, ply_norm);
+    std::swap(texcoord, ply_texcoord);
+    std::swap(color, ply_color);
+    std::swap(radius, ply_radius);
 }
 
 #else
@@ -4149,7 +5561,17 @@ void save_ply_mesh(const std::string& filename, const std::vector<int>& points,
     const std::vector<vec3f>& pos, const std::vector<vec3f>& norm,
     const std::vector<vec2f>& texcoord, const std::vector<vec4f>& color,
     const std::vector<float>& radius, bool ascii) {
-    auto fs = std::ofstream(filename);
+    // vertex data is written per position, so all of it has to match
+    auto check_size = [&pos](auto& vert) {
+        if (!vert.empty() && vert.size() != pos.size())
+            throw std::runtime_error("vertex data size mismatch");
+    };
+    check_size(norm);
+    check_size(texcoord);
+    check_size(color);
+    check_size(radius);
+
+    auto fs = std::ofstream(filename, std::ios::binary);
     if (!fs) throw std::runtime_error("cannot save file " + filename);
 
     // header
@@ -4195,26 +5617,41 @@ void save_ply_mesh(const std::string& filename, const std::vector<int>& points,
             fs << "3 " << triangles[i] << "\n";
         for (auto i = 0; i < lines.size(); i++) fs << "2 " << lines[i] << "\n";
     } else {
-        // write vertex data
-        for (auto i = 0; i < pos.size(); i++) {
-            if (!pos.empty()) fs.write((char*)&pos[i], 4 * 3);
-            if (!norm.empty()) fs.write((char*)&norm[i], 4 * 3);
-            if (!texcoord.empty()) fs.write((char*)&texcoord[i], 4 * 2);
-            if (!color.empty()) fs.write((char*)&color[i], 4 * 4);
-            if (!radius.empty()) fs.write((char*)&radius[i], 4 * 1);
-        }
-
-        // write face data
-        for (auto i = 0; i < triangles.size(); i++) {
-            auto n = (byte)3;
-            fs.write((char*)&n, 1);
-            fs.write((char*)&triangles[i], 4 * 3);
-        }
-        for (auto i = 0; i < lines.size(); i++) {
-            auto n = (byte)3;
-            fs.write((char*)&n, 1);
-            fs.write((char*)&lines[i], 4 * 2);
-        }
+        // interleave vertex data with strided copies and write it at once
+        auto stride = (pos.empty() ? 0 : 4 * 3) + (norm.empty() ? 0 : 4 * 3) +
+                      (texcoord.empty() ? 0 : 4 * 2) +
+                      (color.empty() ? 0 : 4 * 4) +
+                      (radius.empty() ? 0 : 4 * 1);
+        auto buf = std::vector<byte>((size_t)pos.size() * stride);
+        auto offset = 0;
+        auto copy_vertex_data = [&buf, &offset, stride](auto& vert, int size) {
+            if (vert.empty()) return;
+            auto src = (const byte*)vert.data();
+            for (auto i = (size_t)0; i < vert.size(); i++)
+                memcpy(buf.data() + i * stride + offset, src + i * size, size);
+            offset += size;
+        };
+        copy_vertex_data(pos, 4 * 3);
+        copy_vertex_data(norm, 4 * 3);
+        copy_vertex_data(texcoord, 4 * 2);
+        copy_vertex_data(color, 4 * 4);
+        copy_vertex_data(radius, 4 * 1);
+        fs.write((char*)buf.data(), buf.size());
+
+        // write face data, prefixing each element with its vertex count
+        auto copy_elem_data = [&buf](auto& elems, int num) {
+            auto size = 1 + 4 * num;
+            buf.resize((size_t)elems.size() * size);
+            auto src = (const byte*)elems.data();
+            for (auto i = (size_t)0; i < elems.size(); i++) {
+                buf[i * size] = (byte)num;
+                memcpy(buf.data() + i * size + 1, src + i * 4 * num, 4 * num);
+            }
+        };
+        copy_elem_data(triangles, 3);
+        fs.write((char*)buf.data(), buf.size());
+        copy_elem_data(lines, 2);
+        fs.write((char*)buf.data(), buf.size());
     }
 
     // done
@@ -4226,14 +5663,12 @@ void load_obj_mesh(const std::string& filename, std::vector<int>& points,
     std::vector<vec2i>& lines, std::vector<vec3i>& triangles,
     std::vector<vec3f>& pos, std::vector<vec3f>& norm,
     std::vector<vec2f>& texcoord, bool flip_texcoord) {
-    // open file
-    auto fs = std::ifstream(filename);
-    if (!fs) throw std::runtime_error("cannot open filename " + filename);
-
-    auto opos = std::deque<vec3f>();
-    auto onorm = std::deque<vec3f>();
-    auto otexcoord = std::deque<vec2f>();
+    // open and parse file
+    auto view = load_file_view(filename);
+    auto obj = obj_data();
+    parse_obj_data(view->data, view->size, obj, flip_texcoord);
 
+    points.clear();
     pos.clear();
     norm.clear();
     texcoord.clear();
@@ -4243,85 +5678,42 @@ void load_obj_mesh(const std::string& filename, std::vector<int>& points,
     // vertex maps
     auto vert_map = std::unordered_map<vec3i, int>();
 
-    // read the file line by line
-    std::string line;
-    while (std::getline(fs, line)) {
-        // remove comment
-        if (line.find("#") != line.npos) line = line.substr(0, line.find("#"));
-
-        // prepare to parse
-        auto ss = std::stringstream(line);
-
-        // get command
-        auto cmd = ""s;
-        ss >> cmd;
-        if (cmd == "") continue;
-
-        // possible token values
-        if (cmd == "v") {
-            opos.push_back({});
-            ss >> opos.back();
-        } else if (cmd == "vn") {
-            onorm.push_back({});
-            ss >> onorm.back();
-        } else if (cmd == "vt") {
-            otexcoord.push_back({});
-            ss >> otexcoord.back();
-            if (flip_texcoord) otexcoord.back().y = 1 - otexcoord.back().y;
-        } else if (cmd == "f" || cmd == "l" || cmd == "p") {
-            auto num = 0;
-            vec3i verts[128];
-            int vids[128];
-            auto vert_size =
-                vec3i{(int)pos.size(), (int)texcoord.size(), (int)norm.size()};
-            // elem.material = (int)oobj->materials.size() - 1;
-            while (true) {
-                auto vert = obj_vertex();
-                ss >> vert;
-                if (!vert.pos) break;
-                verts[num] = {-1, -1, -1};
-                if (vert.pos)
-                    verts[num].x = (vert.pos < 0) ? (vert_size.x + vert.pos) :
-                                                    (vert.pos - 1);
-                if (vert.texcoord)
-                    verts[num].y = (vert.texcoord < 0) ?
-                                       (vert_size.y + vert.texcoord) :
-                                       (vert.texcoord - 1);
-                if (vert.norm)
-                    verts[num].z = (vert.norm < 0) ? (vert_size.z + vert.norm) :
-                                                     (vert.norm - 1);
-                num++;
-            }
+    // process elements in file order
+    auto vids = std::vector<int>();
+    for (auto& chunk : obj.chunks) {
+        for (auto& elem : chunk.commands) {
+            if (!elem.elem) continue;
+            auto verts = chunk.verts.data() + elem.vert_start;
+            auto num = elem.vert_num;
+            vids.resize(num);
             for (auto i = 0; i < num; i++) {
                 auto it = vert_map.find(verts[i]);
                 if (it == vert_map.end()) {
                     auto nverts = (int)pos.size();
                     vert_map.insert(it, {verts[i], nverts});
                     vids[i] = nverts;
-                    if (verts[i].x >= 0) pos.push_back(opos.at(verts[i].x));
+                    if (verts[i].x >= 0) pos.push_back(obj.pos.at(verts[i].x));
                     if (verts[i].y >= 0)
-                        texcoord.push_back(otexcoord.at(verts[i].y));
-                    if (verts[i].z >= 0) norm.push_back(onorm.at(verts[i].z));
+                        texcoord.push_back(obj.texcoord.at(verts[i].y));
+                    if (verts[i].z >= 0)
+                        norm.push_back(obj.norm.at(verts[i].z));
                 } else {
                     vids[i] = it->second;
                 }
             }
-            if (cmd == "f") {
+            if (elem.elem == 'f') {
                 for (auto i = 2; i < num; i++)
                     triangles.push_back({vids[0], vids[i - 1], vids[i]});
             }
-            if (cmd == "l") {
+            if (elem.elem == 'l') {
                 for (auto i = 1; i < num; i++)
                     lines.push_back({vids[i - 1], vids[i]});
             }
-            if (cmd == "p") {
+            if (elem.elem == 'p') {
                 for (auto i = 0; i < num; i++) points.push_back(vids[i]);
             }
         }
     }
-
-    // close file
-    fs.close();
 }
 
 // Load ply mesh
@@ -10,9 +10,11 @@
 //
 // 1. manipulate paths withe path utilities
 // 2. load and save text files with `load_text()` and `save_text()`
-// 3. load and save binary files with `load_binary()` and `save_binary()`
+// 3. load and save binary files with `load_binary()` and `save_binary()`,
+//    or map large files for reading with `load_file_view()`
 // 4. load and save images with `load_image()` and `save_image()`
 // 5. load a scene with `load_json_scene()` and save it with `save_json_scene()`
+//    or cache a processed scene with `save_binary_scene()`
 // 6. load and save OBJs with `load_obj_scene()` and `save_obj_scene()`
 // 7. load and save glTFs with `load_gltf_scene()` and `save_gltf_scene()`
 // 6. if desired, the function `load_scene()` and `save_scene()` will either
@@ -83,6 +85,23 @@ std::vector<byte> load_binary(const std::string& filename);
 // Save a binary file
 void save_binary(const std::string& filename, const std::vector<byte>& data);
 
+// Read-only view of the contents of a file. The file is memory-mapped where
+// supported and read into memory otherwise. Data is not null terminated.
+struct file_view {
+    const char* data = nullptr;     // file contents
+    size_t size = 0;                // file size in bytes
+    void* mapped = nullptr;         // mapped region, if any
+    std::vector<char> buffer = {};  // file contents if not mapped
+
+    file_view() {}
+    file_view(const file_view&) = delete;
+    file_view& operator=(const file_view&) = delete;
+    ~file_view();
+};
+
+// Opens a file view, throwing on error.
+std::shared_ptr<file_view> load_file_view(const std::string& filename);
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -95,9 +114,18 @@ bool is_hdr_filename(const std::string& filename);
 
 // Loads/saves a 4 channel image.
 image4f load_image(const std::string& filename);
+// Loads an 8-bit 4 channel image without conversion.
+image4b load_image4b(const std::string& filename);
 void save_image(const std::string& filename, const image4f& img);
 image4f load_image_from_memory(const byte* data, int data_size);
 
+// Loads/saves raw render accumulations as EXR, with the sample sums in
+// RGBA, the sample counts in N, and the region placement and sample range
+// as attributes. Only accumulations of a single render can be saved.
+trace_accumulation load_trace_accumulation(const std::string& filename);
+void save_trace_accumulation(
+    const std::string& filename, const trace_accumulation& acc);
+
 }  // namespace ygl
 
 // -----------------------------------------------------------------------------
@@ -111,6 +139,45 @@ std::shared_ptr<scene> load_scene(const std::string& filename,
 void save_scene(const std::string& filename, const std::shared_ptr<scene>& scn,
     bool save_textures = true, bool skip_missing = true);
 
+// Loads the scene textures that are not loaded from `dirname`. If `compact`
+// is set, 8-bit images are kept as 8-bit texels, gray ones in a single
+// channel, and hdr images as half floats. Environment textures are loaded
+// as floats since they are importance sampled. Procedural textures are
+// converted with `compact_textures()`. Images are decoded concurrently,
+// with at most about `max_memory` bytes of decode buffers in flight.
+void load_scene_textures(const std::shared_ptr<scene>& scn,
+    const std::string& dirname, bool skip_missing = true,
+    bool compact = false, size_t max_memory = 1024 * 1024 * 1024);
+
+// Textures loaded in the background by `load_scene_textures_async()`.
+struct texture_stream;
+
+// Starts loading the scene textures that are not loaded from `dirname` on
+// `nthreads` background threads, so that rendering can start before
+// textures are decoded. Unloaded textures evaluate to white, and normal
+// maps get a flat placeholder. Decoded images are moved into the scene by
+// `update_texture_stream()`, which should be called when the scene is not
+// rendered, and count against `max_memory` until then. Environment
+// textures are loaded before returning since they are importance sampled.
+std::shared_ptr<texture_stream> load_scene_textures_async(
+    const std::shared_ptr<scene>& scn, const std::string& dirname,
+    bool skip_missing = true, size_t max_memory = 1024 * 1024 * 1024,
+    int nthreads = 2);
+// Number of decoded textures waiting for `update_texture_stream()`.
+int get_texture_stream_ready(const std::shared_ptr<texture_stream>& stream);
+// Checks whether all textures were moved into the scene.
+bool is_texture_stream_done(const std::shared_ptr<texture_stream>& stream);
+// Moves the decoded textures into the scene, returning their number.
+// Rethrows load errors if `skip_missing` was not set.
+int update_texture_stream(const std::shared_ptr<texture_stream>& stream);
+
+// Attaches a texture cache with a memory `budget` in bytes to the scene
+// textures that are not loaded, paging them in from `dirname` on demand.
+// Environment textures are loaded instead since they are importance sampled.
+std::shared_ptr<texture_cache> add_texture_cache(
+    const std::shared_ptr<scene>& scn, const std::string& dirname,
+    size_t budget, bool skip_missing = true);
+
 // Load/save a scene in the builtin JSON format.
 std::shared_ptr<scene> load_json_scene(const std::string& filename,
     bool load_textures = true, bool skip_missing = true);
@@ -118,6 +185,20 @@ void save_json_scene(const std::string& filename,
     const std::shared_ptr<scene>& scn, bool save_textures = true,
     bool skip_missing = true);
 
+// Load/save a scene in the builtin binary format, used as a cache to skip
+// scene processing. Besides the scene data, it stores tesselated shapes,
+// texture images and mips, light data and BVH nodes, so that a scene
+// processed before saving is ready for rendering after loading, with arrays
+// copied in bulk from the mapped file. Texture images are embedded if
+// `save_textures` is set, and otherwise loaded from their paths if
+// `load_textures` is set. Files are tied to the format version and
+// platform layout and rejected otherwise.
+std::shared_ptr<scene> load_binary_scene(const std::string& filename,
+    bool load_textures = true, bool skip_missing = true);
+void save_binary_scene(const std::string& filename,
+    const std::shared_ptr<scene>& scn, bool save_textures = true,
+    bool skip_missing = true);
+
 // Load/save a scene from/to OBJ.
 std::shared_ptr<scene> load_obj_scene(const std::string& filename,
     bool load_textures = true, bool skip_missing = true,
@@ -126,7 +207,10 @@ void save_obj_scene(const std::string& filename,
     const std::shared_ptr<scene>& scn, bool save_textures = true,
     bool skip_missing = true);
 
-// Load/save a scene from/to glTF.
+// Load/save a scene from/to glTF. Loading also supports binary GLB files.
+// Buffer files are mapped and accessors copied in bulk when their layout
+// matches the shape data, and images embedded in buffers or data uris are
+// decoded from memory.
 std::shared_ptr<scene> load_gltf_scene(const std::string& filename,
     bool load_textures = true, bool skip_missing = true);
 void save_gltf_scene(const std::string& filename,
@@ -135,7 +219,9 @@ void save_gltf_scene(const std::string& filename,
 
 // Load/save a scene from/to pbrt. This is not robust at all and only
 // works on scene that have been previously adapted since the two renderers
-// are too different to match.
+// are too different to match. Files are tokenized in place from mapped
+// memory, following Include directives, and mesh arrays are parsed directly
+// into the shapes.
 std::shared_ptr<scene> load_pbrt_scene(const std::string& filename,
     bool load_textures = true, bool skip_missing = true);
 void save_pbrt_scene(const std::string& filename,
@@ -161,7 +247,9 @@ void save_mesh(const std::string& filename, const std::vector<int>& points,
     const std::vector<vec2f>& texcoord, const std::vector<vec4f>& color,
     const std::vector<float>& radius, bool ascii = false);
 
-// Load/Save a ply mesh
+// Load/Save a ply mesh. Loading leaves the arrays unchanged on errors,
+// including out-of-range vertex indices. Saving throws if vertex data sizes
+// do not match the positions.
 void load_ply_mesh(const std::string& filename, std::vector<int>& points,
     std::vector<vec2i>& lines, std::vector<vec3i>& triangles,
     std::vector<vec3f>& pos, std::vector<vec3f>& norm,